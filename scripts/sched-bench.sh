@@ -0,0 +1,36 @@
+#!/usr/bin/env bash
+#
+# Compares per-gate (GATE) and level-synchronous (LEVEL) evaluation scheduling.
+# Obfuscates the circuit once and evaluates its test inputs with each scheduler
+# and thread count, printing the average evaluation time as CSV.
+#
+# usage: sched-bench.sh circuit [scheme] [mmap] [nthreads...]
+#
+
+set -e
+
+scriptdir=$(dirname "$(readlink -f "${BASH_SOURCE[0]}")")
+prog=$(readlink -f "$scriptdir/../mio.sh")
+
+circuit=${1:?usage: $0 circuit [scheme] [mmap] [nthreads...]}
+scheme=${2:-LZ}
+mmap=${3:-DUMMY}
+shift $(( $# < 3 ? $# : 3 ))
+threads=${*:-1 2 4 8}
+
+inputs=$(mktemp)
+trap 'rm -f "$inputs"' EXIT
+grep '^:test' "$circuit" | awk '{print $2}' > "$inputs"
+
+$prog obf obfuscate --mmap "$mmap" --scheme "$scheme" "$circuit" > /dev/null
+
+echo "scheduler,nthreads,evaluate avg (s)"
+for nthreads in $threads; do
+    for sched in GATE LEVEL; do
+        avg=$($prog obf evaluate --batch --verbose --sched $sched \
+                    --nthreads "$nthreads" --mmap "$mmap" --scheme "$scheme" \
+                    "$circuit" "$inputs" 2>&1 >/dev/null \
+                  | grep 'evaluate avg' | awk '{print $NF}' | tr -d 's')
+        echo "$sched,$nthreads,$avg"
+    done
+done
@@ -31,6 +31,52 @@ obf_test_sigma () {
     $prog obf test --smart --sigma --symlen 16 --mmap $2 --scheme $3 $1
 }
 
+obf_test_incremental () {
+    echo ""
+    echo "***"
+    echo "***"
+    echo "*** OBF INCREMENTAL $1 $2 $3"
+    echo "***"
+    echo "***"
+    echo ""
+    grep '^:test' "$1" | awk '{ print $2 }' > "$1.inputs"
+    $prog obf obfuscate --smart --mmap $2 --scheme $3 $1
+    $prog obf evaluate --smart --mmap $2 --scheme $3 --batch $1 "$1.inputs" > "$1.full"
+    $prog obf evaluate --smart --mmap $2 --scheme $3 --batch --incremental $1 "$1.inputs" > "$1.incr"
+    diff "$1.full" "$1.incr"
+    rm -f "$1.inputs" "$1.full" "$1.incr"
+}
+
+obf_test_resume () {
+    echo ""
+    echo "***"
+    echo "***"
+    echo "*** OBF RESUME $1 $2 $3"
+    echo "***"
+    echo "***"
+    echo ""
+    local obf="$1.obf"
+    rm -f "$obf" "$obf.journal"
+    # Cap the file size to kill the run partway through, leaving its journal
+    ( ulimit -f 2; $prog obf obfuscate --smart --mmap $2 --scheme $3 --resume $1 ) || true
+    if [ ! -f "$obf.journal" ]; then
+        echo "finished before it could be interrupted"
+        return
+    fi
+    cp "$obf.journal" "$obf.journal.first"
+    # Interrupt it again further on, then finish
+    ( ulimit -f 4; $prog obf obfuscate --smart --mmap $2 --scheme $3 --resume $1 ) || true
+    if [ -f "$obf.journal" ]; then
+        $prog obf obfuscate --smart --mmap $2 --scheme $3 --resume $1
+    fi
+    mv "$obf" "$obf.first"
+    # Resuming from the first checkpoint alone must give the same bytes
+    mv "$obf.journal.first" "$obf.journal"
+    $prog obf obfuscate --smart --mmap $2 --scheme $3 --resume $1
+    cmp "$obf" "$obf.first"
+    rm -f "$obf.first"
+}
+
 mife_test () {
     echo ""
     echo "***"
@@ -64,6 +110,8 @@ done
 for circuit in $circuits/*.acirc; do
     obf_test "$circuit" DUMMY LZ
     obf_test "$circuit" DUMMY MIFE
+    obf_test_incremental "$circuit" DUMMY LZ
+    obf_test_resume "$circuit" DUMMY LZ
 done
 
 for circuit in $circuits/sigma/*.acirc; do
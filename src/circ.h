@@ -1,8 +1,18 @@
 #pragma once
 
+#include "sched.h"
+
 #include <acirc.h>
 #include <gmp.h>
 
 int
-circ_eval(acirc *circ, const mpz_t *xs, const mpz_t *ys, const mpz_t modulus,
-          mpz_t *cache, size_t nthreads);
+circ_eval(const sched_t *sched, const mpz_t *xs, const mpz_t *ys,
+          const mpz_t modulus, mpz_t *cache, size_t nthreads);
+
+/* Per-gate-type counters, indexed by acirc_operation */
+#define CIRC_NOPS (OP_SET + 1)
+
+void
+circ_count(size_t *counts, acirc_operation op, size_t n);
+void
+circ_counts_print(const char *name, const size_t *counts);
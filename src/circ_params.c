@@ -12,6 +12,12 @@ circ_params_init(circ_params_t *cp, size_t n, acirc *circ)
     cp->circ = circ;
     cp->ds = my_calloc(n, sizeof cp->ds[0]);
     cp->qs = my_calloc(n, sizeof cp->ds[0]);
+    if ((cp->sched = sched_new(circ)) == NULL) {
+        free(cp->ds);
+        free(cp->qs);
+        cp->ds = cp->qs = NULL;
+        return ERR;
+    }
     return OK;
 }
 
@@ -22,6 +28,22 @@ circ_params_clear(circ_params_t *cp)
         free(cp->ds);
     if (cp->qs)
         free(cp->qs);
+    sched_free(cp->sched);
+}
+
+int
+circ_params_prune(circ_params_t *cp, const size_t *outputs, size_t n)
+{
+    sched_t *sched;
+
+    if ((sched = sched_prune(cp->sched, outputs, n)) == NULL)
+        return ERR;
+    if (g_verbose)
+        fprintf(stderr, "output cone:     %lu of %lu gates\n", sched->nsched,
+                cp->sched->nsched);
+    sched_free(cp->sched);
+    cp->sched = sched;
+    return OK;
 }
 
 int
@@ -67,12 +89,15 @@ circ_params_fread(circ_params_t *const cp, acirc *circ, FILE *fp)
             goto error;
     }
     cp->circ = circ;
+    if ((cp->sched = sched_new(circ)) == NULL)
+        goto error;
     return OK;
 error:
     if (cp->ds)
         free(cp->ds);
     if (cp->qs)
         free(cp->qs);
+    cp->ds = cp->qs = NULL;
     fprintf(stderr, "error: reading circuit parameters failed\n");
     return ERR;
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "sched.h"
+
 #include <acirc.h>
 #include <stddef.h>
 
@@ -10,12 +12,16 @@ typedef struct circ_params_t {
     size_t *ds;                 /* number of bits in each input string */
     size_t *qs;                 /* number of symbols associated with input string */
     acirc *circ;
+    sched_t *sched;             /* shared by every evaluation of circ */
 } circ_params_t;
 
 int
 circ_params_init(circ_params_t *cp, size_t n, acirc *circ);
 void
 circ_params_clear(circ_params_t *cp);
+/* Restricts evaluation to the cones of outputs[0..n) */
+int
+circ_params_prune(circ_params_t *cp, const size_t *outputs, size_t n);
 int
 circ_params_fwrite(const circ_params_t *const cp, FILE *fp);
 int
@@ -0,0 +1,105 @@
+#include "depgraph.h"
+#include "util.h"
+
+#include <stdlib.h>
+
+/* Number of gate arguments, inputs and constants refer to neither */
+static int
+_arity(const acirc *c, acircref ref)
+{
+    switch (c->gates.gates[ref].op) {
+    case OP_INPUT: case OP_CONST:
+        return 0;
+    case OP_SET:
+        return 1;
+    case OP_ADD: case OP_SUB: case OP_MUL:
+        return 2;
+    default:
+        abort();
+    }
+}
+
+depgraph *
+depgraph_new(const acirc *c)
+{
+    const size_t nrefs = acirc_nrefs(c);
+    depgraph *g;
+    size_t *next;
+
+    g = my_calloc(1, sizeof g[0]);
+    g->nrefs = nrefs;
+    g->offsets = my_calloc(nrefs + 1, sizeof g->offsets[0]);
+    g->nargs = my_calloc(nrefs, sizeof g->nargs[0]);
+
+    /* First pass: count the edges of each gate */
+    for (size_t ref = 0; ref < nrefs; ++ref) {
+        g->nargs[ref] = _arity(c, ref);
+        g->offsets[ref + 1] += g->nargs[ref];
+        for (int i = 0; i < g->nargs[ref]; ++i)
+            g->offsets[c->gates.gates[ref].args[i] + 1]++;
+    }
+    for (size_t ref = 0; ref < nrefs; ++ref)
+        g->offsets[ref + 1] += g->offsets[ref];
+
+    /* Second pass: fill in arguments, then consumers */
+    g->edges = my_calloc(g->offsets[nrefs], sizeof g->edges[0]);
+    next = my_calloc(nrefs, sizeof next[0]);
+    for (size_t ref = 0; ref < nrefs; ++ref)
+        next[ref] = g->offsets[ref] + g->nargs[ref];
+    for (size_t ref = 0; ref < nrefs; ++ref) {
+        for (int i = 0; i < g->nargs[ref]; ++i) {
+            const acircref arg = c->gates.gates[ref].args[i];
+            g->edges[g->offsets[ref] + i] = arg;
+            g->edges[next[arg]++] = ref;
+        }
+    }
+    free(next);
+    return g;
+}
+
+depgraph *
+depgraph_restrict(const depgraph *g, const bool *keep)
+{
+    depgraph *r;
+
+    r = my_calloc(1, sizeof r[0]);
+    r->nrefs = g->nrefs;
+    r->offsets = my_calloc(g->nrefs + 1, sizeof r->offsets[0]);
+    r->nargs = my_calloc(g->nrefs, sizeof r->nargs[0]);
+    for (size_t ref = 0; ref < g->nrefs; ++ref) {
+        const acircref *succs = depgraph_succs(g, ref);
+        size_t n = 0;
+        if (keep[ref]) {
+            r->nargs[ref] = g->nargs[ref];
+            n = g->nargs[ref];
+            for (size_t i = 0; i < depgraph_nsuccs(g, ref); ++i)
+                n += keep[succs[i]];
+        }
+        r->offsets[ref + 1] = r->offsets[ref] + n;
+    }
+    /* Copy arguments and the consumers that were kept, in the same order */
+    r->edges = my_calloc(r->offsets[g->nrefs], sizeof r->edges[0]);
+    for (size_t ref = 0; ref < g->nrefs; ++ref) {
+        const acircref *succs = depgraph_succs(g, ref);
+        size_t next = r->offsets[ref];
+        if (!keep[ref])
+            continue;
+        for (int i = 0; i < g->nargs[ref]; ++i)
+            r->edges[next++] = depgraph_args(g, ref)[i];
+        for (size_t i = 0; i < depgraph_nsuccs(g, ref); ++i)
+            if (keep[succs[i]])
+                r->edges[next++] = succs[i];
+    }
+    return r;
+}
+
+void
+depgraph_free(depgraph *g)
+{
+    if (g == NULL)
+        return;
+    free(g->offsets);
+    free(g->nargs);
+    free(g->edges);
+    free(g);
+}
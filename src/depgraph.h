@@ -0,0 +1,30 @@
+#pragma once
+
+/*
+ * Gate dependency graph in compressed sparse row form.  The edges of gate
+ * `ref` are edges[offsets[ref] .. offsets[ref + 1]): first its nargs[ref]
+ * arguments, then every gate that consumes it, in increasing ref order.
+ */
+
+#include <acirc.h>
+#include <stdbool.h>
+
+typedef struct {
+    size_t nrefs;
+    size_t *offsets;            /* [nrefs + 1], offsets into edges */
+    int *nargs;                 /* [nrefs], number of incoming edges */
+    acircref *edges;            /* [offsets[nrefs]] */
+} depgraph;
+
+depgraph *
+depgraph_new(const acirc *c);
+/* Subgraph of the gates with keep[ref] set, which must include their arguments */
+depgraph *
+depgraph_restrict(const depgraph *g, const bool *keep);
+void
+depgraph_free(depgraph *g);
+
+#define depgraph_args(g, ref) (&(g)->edges[(g)->offsets[ref]])
+#define depgraph_succs(g, ref) (&(g)->edges[(g)->offsets[ref] + (g)->nargs[ref]])
+#define depgraph_nsuccs(g, ref) \
+    ((g)->offsets[(ref) + 1] - (g)->offsets[ref] - (g)->nargs[ref])
@@ -0,0 +1,505 @@
+#include "estimate.h"
+#include "util.h"
+
+#include <string.h>
+#include <mmap/mmap_dummy.h>
+
+/* Each operation is repeated for at least this long, and this many times */
+#define CALIBRATE_SECONDS 0.2
+#define CALIBRATE_REPS 3
+
+static struct {
+    estimate_ops ops;
+    size_t live, sks, pps;      /* currently alive */
+    size_t bytes;               /* bytes the dummy mmap wrote this phase */
+    double start;               /* of this phase */
+    mmap_params_t params;       /* as asked for by the dry run */
+} g_est;
+
+static mmap_pp_vtable _pp_vt;
+static mmap_sk_vtable _sk_vt;
+static mmap_enc_vtable _enc_vt;
+static const mmap_vtable _counting_vtable = {
+    .pp = &_pp_vt,
+    .sk = &_sk_vt,
+    .enc = &_enc_vt,
+};
+
+static void
+_alive(size_t *live, size_t *peak)
+{
+    const size_t n = __sync_add_and_fetch(live, 1);
+    size_t cur;
+    while ((cur = *peak) < n)
+        __sync_bool_compare_and_swap(peak, cur, n);
+}
+
+static void
+_written(FILE *fp, long start)
+{
+    const long end = ftell(fp);
+    if (start >= 0 && end >= start)
+        __sync_fetch_and_add(&g_est.bytes, end - start);
+}
+
+static void
+_pp_clear(mmap_pp *pp)
+{
+    dummy_vtable.pp->clear(pp);
+    __sync_fetch_and_sub(&g_est.pps, 1);
+}
+
+static int
+_pp_fread(mmap_pp *pp, FILE *fp)
+{
+    _alive(&g_est.pps, &g_est.ops.peak_pps);
+    return dummy_vtable.pp->fread(pp, fp);
+}
+
+static int
+_pp_fwrite(const mmap_pp *pp, FILE *fp)
+{
+    const long start = ftell(fp);
+    const int ret = dummy_vtable.pp->fwrite(pp, fp);
+    __sync_fetch_and_add(&g_est.ops.pp_fwrite, 1);
+    _written(fp, start);
+    return ret;
+}
+
+static int
+_sk_init(mmap_sk *sk, size_t lambda, size_t kappa, size_t nzs, int *pows,
+         size_t nslots, size_t ncores, aes_randstate_t rng, bool verbose)
+{
+    free(g_est.params.pows);
+    g_est.params.kappa = kappa;
+    g_est.params.nzs = nzs;
+    g_est.params.nslots = nslots;
+    g_est.params.pows = my_calloc(nzs, sizeof g_est.params.pows[0]);
+    memcpy(g_est.params.pows, pows, nzs * sizeof pows[0]);
+    __sync_fetch_and_add(&g_est.ops.sk_init, 1);
+    _alive(&g_est.sks, &g_est.ops.peak_sks);
+    return dummy_vtable.sk->init(sk, lambda, kappa, nzs, pows, nslots, ncores,
+                                 rng, verbose);
+}
+
+static void
+_sk_clear(mmap_sk *sk)
+{
+    dummy_vtable.sk->clear(sk);
+    __sync_fetch_and_sub(&g_est.sks, 1);
+}
+
+static int
+_sk_fread(mmap_sk *sk, FILE *fp)
+{
+    _alive(&g_est.sks, &g_est.ops.peak_sks);
+    return dummy_vtable.sk->fread(sk, fp);
+}
+
+static int
+_sk_fwrite(const mmap_sk *sk, FILE *fp)
+{
+    const long start = ftell(fp);
+    const int ret = dummy_vtable.sk->fwrite(sk, fp);
+    __sync_fetch_and_add(&g_est.ops.sk_fwrite, 1);
+    _written(fp, start);
+    return ret;
+}
+
+static mmap_pp *
+_sk_pp(const mmap_sk *sk)
+{
+    _alive(&g_est.pps, &g_est.ops.peak_pps);
+    return dummy_vtable.sk->pp(sk);
+}
+
+static int
+_enc_init(mmap_enc *enc, const mmap_pp *pp)
+{
+    _alive(&g_est.live, &g_est.ops.peak);
+    return dummy_vtable.enc->init(enc, pp);
+}
+
+static void
+_enc_clear(mmap_enc *enc)
+{
+    dummy_vtable.enc->clear(enc);
+    __sync_fetch_and_sub(&g_est.live, 1);
+}
+
+static int
+_enc_fread(mmap_enc *enc, FILE *fp)
+{
+    _alive(&g_est.live, &g_est.ops.peak);
+    __sync_fetch_and_add(&g_est.ops.fread, 1);
+    return dummy_vtable.enc->fread(enc, fp);
+}
+
+static int
+_enc_fwrite(const mmap_enc *enc, FILE *fp)
+{
+    const long start = ftell(fp);
+    const int ret = dummy_vtable.enc->fwrite(enc, fp);
+    __sync_fetch_and_add(&g_est.ops.fwrite, 1);
+    _written(fp, start);
+    return ret;
+}
+
+static int
+_enc_add(mmap_enc *rop, const mmap_pp *pp, const mmap_enc *x, const mmap_enc *y)
+{
+    __sync_fetch_and_add(&g_est.ops.add, 1);
+    return dummy_vtable.enc->add(rop, pp, x, y);
+}
+
+static int
+_enc_sub(mmap_enc *rop, const mmap_pp *pp, const mmap_enc *x, const mmap_enc *y)
+{
+    __sync_fetch_and_add(&g_est.ops.add, 1);
+    return dummy_vtable.enc->sub(rop, pp, x, y);
+}
+
+static int
+_enc_mul(mmap_enc *rop, const mmap_pp *pp, const mmap_enc *x, const mmap_enc *y)
+{
+    __sync_fetch_and_add(&g_est.ops.mul, 1);
+    return dummy_vtable.enc->mul(rop, pp, x, y);
+}
+
+static int
+_enc_is_zero(const mmap_enc *enc, const mmap_pp *pp)
+{
+    __sync_fetch_and_add(&g_est.ops.is_zero, 1);
+    return dummy_vtable.enc->is_zero(enc, pp);
+}
+
+static int
+_enc_encode(mmap_enc *enc, const mmap_sk *sk, size_t n, const fmpz_t *xs,
+            int *pows)
+{
+    __sync_fetch_and_add(&g_est.ops.encode, 1);
+    return dummy_vtable.enc->encode(enc, sk, n, xs, pows);
+}
+
+const mmap_vtable *
+estimate_begin(void)
+{
+    memset(&g_est, '\0', sizeof g_est);
+    _pp_vt = *dummy_vtable.pp;
+    _pp_vt.clear = _pp_clear;
+    _pp_vt.fread = _pp_fread;
+    _pp_vt.fwrite = _pp_fwrite;
+    _sk_vt = *dummy_vtable.sk;
+    _sk_vt.init = _sk_init;
+    _sk_vt.clear = _sk_clear;
+    _sk_vt.fread = _sk_fread;
+    _sk_vt.fwrite = _sk_fwrite;
+    _sk_vt.pp = _sk_pp;
+    _enc_vt = *dummy_vtable.enc;
+    _enc_vt.init = _enc_init;
+    _enc_vt.clear = _enc_clear;
+    _enc_vt.fread = _enc_fread;
+    _enc_vt.fwrite = _enc_fwrite;
+    _enc_vt.add = _enc_add;
+    _enc_vt.sub = _enc_sub;
+    _enc_vt.mul = _enc_mul;
+    _enc_vt.is_zero = _enc_is_zero;
+    _enc_vt.encode = _enc_encode;
+    g_est.start = current_time();
+    return &_counting_vtable;
+}
+
+void
+estimate_phase(estimate_ops *ops, size_t written)
+{
+    const double now = current_time();
+
+    *ops = g_est.ops;
+    ops->other_bytes = written > g_est.bytes ? written - g_est.bytes : 0;
+    ops->seconds = now - g_est.start;
+    memset(&g_est.ops, '\0', sizeof g_est.ops);
+    g_est.ops.peak = g_est.live;
+    g_est.ops.peak_sks = g_est.sks;
+    g_est.ops.peak_pps = g_est.pps;
+    g_est.bytes = 0;
+    g_est.start = now;
+}
+
+void
+estimate_end(void)
+{
+    free(g_est.params.pows);
+    memset(&g_est, '\0', sizeof g_est);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// calibration
+
+typedef struct {
+    const mmap_vtable *mmap;
+    mmap_sk *sk;
+    mmap_pp *pp;
+    mmap_enc *x, *y, *rop, *top;
+    size_t nslots;
+    fmpz_t *xs;
+    int *unit;
+    FILE *fp;
+} calib;
+
+static mmap_enc *
+_calib_enc(calib *c)
+{
+    mmap_enc *enc = my_calloc(1, c->mmap->enc->size);
+    c->mmap->enc->init(enc, c->pp);
+    return enc;
+}
+
+static void
+_calib_enc_free(calib *c, mmap_enc *enc)
+{
+    if (enc == NULL)
+        return;
+    c->mmap->enc->clear(enc);
+    free(enc);
+}
+
+static void
+_calib_encode(calib *c)
+{
+    c->mmap->enc->encode(c->rop, c->sk, c->nslots, (const fmpz_t *) c->xs, c->unit);
+}
+
+static void
+_calib_mul(calib *c)
+{
+    c->mmap->enc->mul(c->rop, c->pp, c->x, c->y);
+}
+
+static void
+_calib_add(calib *c)
+{
+    c->mmap->enc->add(c->rop, c->pp, c->x, c->y);
+}
+
+static void
+_calib_is_zero(calib *c)
+{
+    (void) c->mmap->enc->is_zero(c->top, c->pp);
+}
+
+static void
+_calib_fwrite(calib *c)
+{
+    c->mmap->enc->fwrite(c->x, c->fp);
+}
+
+static void
+_calib_fread(calib *c)
+{
+    mmap_enc *enc = my_calloc(1, c->mmap->enc->size);
+    c->mmap->enc->fread(enc, c->fp);
+    _calib_enc_free(c, enc);
+}
+
+/* Seconds per call of f, running it at least CALIBRATE_REPS times and for
+ * CALIBRATE_SECONDS, or exactly *reps times if that is nonzero */
+static double
+_time(void (*f)(calib *), calib *c, size_t *reps)
+{
+    const double start = current_time();
+    double end;
+    size_t n = 0;
+
+    do {
+        f(c);
+        n++;
+        end = current_time();
+    } while (*reps ? n < *reps
+                   : n < CALIBRATE_REPS || end - start < CALIBRATE_SECONDS);
+    *reps = n;
+    return (end - start) / n;
+}
+
+static size_t
+_pp_bytes(calib *c)
+{
+    rewind(c->fp);
+    c->mmap->pp->fwrite(c->pp, c->fp);
+    return ftell(c->fp);
+}
+
+static size_t
+_sk_bytes(calib *c)
+{
+    rewind(c->fp);
+    c->mmap->sk->fwrite(c->sk, c->fp);
+    return ftell(c->fp);
+}
+
+int
+estimate_calibrate(const mmap_vtable *mmap, size_t secparam, size_t nthreads,
+                   aes_randstate_t rng, estimate_costs *costs)
+{
+    const mmap_params_t *const params = &g_est.params;
+    calib c;
+    double start, end;
+    size_t reps;
+    int ret = ERR;
+
+    if (params->pows == NULL) {
+        fprintf(stderr, "error: the dry run made no secret parameters\n");
+        return ERR;
+    }
+    memset(&c, '\0', sizeof c);
+    memset(costs, '\0', sizeof costs[0]);
+    costs->kappa = params->kappa;
+    costs->nzs = params->nzs;
+    c.mmap = mmap;
+    if ((c.fp = tmpfile()) == NULL) {
+        fprintf(stderr, "error: unable to create temporary file\n");
+        return ERR;
+    }
+    if (g_verbose)
+        fprintf(stderr, "Calibrating at λ = %lu, κ = %lu, %lu Zs...\n",
+                secparam, params->kappa, params->nzs);
+
+    start = current_time();
+    c.sk = my_calloc(1, mmap->sk->size);
+    if (mmap->sk->init(c.sk, secparam, params->kappa, params->nzs, params->pows,
+                       params->nslots, nthreads, rng, g_verbose)) {
+        fprintf(stderr, "error: generating secret parameters failed\n");
+        free(c.sk);
+        c.sk = NULL;
+        goto cleanup;
+    }
+    end = current_time();
+    costs->sk_init = end - start;
+    c.pp = mmap->sk->pp(c.sk);
+    c.nslots = costs->nslots = mmap->sk->nslots(c.sk);
+
+    c.xs = my_calloc(c.nslots, sizeof c.xs[0]);
+    for (size_t i = 0; i < c.nslots; ++i) {
+        fmpz_init(c.xs[i]);
+        fmpz_set_ui(c.xs[i], 1);
+    }
+    /* Encodings mostly sit at a handful of Zs, so price encode at one */
+    c.unit = my_calloc(params->nzs, sizeof c.unit[0]);
+    if (params->nzs)
+        c.unit[0] = 1;
+    c.x = _calib_enc(&c);
+    c.y = _calib_enc(&c);
+    c.rop = _calib_enc(&c);
+    c.top = _calib_enc(&c);
+    mmap->enc->encode(c.x, c.sk, c.nslots, (const fmpz_t *) c.xs, c.unit);
+    mmap->enc->encode(c.y, c.sk, c.nslots, (const fmpz_t *) c.xs, c.unit);
+    mmap->enc->encode(c.top, c.sk, c.nslots, (const fmpz_t *) c.xs, params->pows);
+
+    reps = 0;
+    costs->encode = _time(_calib_encode, &c, &reps);
+    reps = 0;
+    costs->mul = _time(_calib_mul, &c, &reps);
+    reps = 0;
+    costs->add = _time(_calib_add, &c, &reps);
+    reps = 0;
+    costs->is_zero = _time(_calib_is_zero, &c, &reps);
+    reps = 0;
+    rewind(c.fp);
+    costs->fwrite = _time(_calib_fwrite, &c, &reps);
+    costs->enc_bytes = ftell(c.fp) / reps;
+    rewind(c.fp);
+    costs->fread = _time(_calib_fread, &c, &reps);
+
+    costs->pp_bytes = _pp_bytes(&c);
+    costs->sk_bytes = _sk_bytes(&c);
+    if (g_verbose)
+        fprintf(stderr, "calibrate:       %.2fs\n", current_time() - start);
+    ret = OK;
+cleanup:
+    _calib_enc_free(&c, c.x);
+    _calib_enc_free(&c, c.y);
+    _calib_enc_free(&c, c.rop);
+    _calib_enc_free(&c, c.top);
+    if (c.xs) {
+        for (size_t i = 0; i < c.nslots; ++i)
+            fmpz_clear(c.xs[i]);
+        free(c.xs);
+    }
+    free(c.unit);
+    if (c.pp) {
+        mmap->pp->clear(c.pp);
+        free(c.pp);
+    }
+    if (c.sk) {
+        mmap->sk->clear(c.sk);
+        free(c.sk);
+    }
+    fclose(c.fp);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// predictions
+
+static void
+_fprint_phase(FILE *fp, const char *name, const estimate_costs *costs,
+              const estimate_ops *ops, size_t nthreads)
+{
+    const double per_byte = costs->enc_bytes ? costs->fwrite / costs->enc_bytes : 0;
+    const size_t written = ops->fwrite * costs->enc_bytes
+        + ops->sk_fwrite * costs->sk_bytes + ops->pp_fwrite * costs->pp_bytes
+        + ops->other_bytes;
+    const size_t peak = ops->peak * costs->enc_bytes
+        + ops->peak_sks * costs->sk_bytes + ops->peak_pps * costs->pp_bytes;
+    const double seconds = ops->seconds + ops->sk_init * costs->sk_init
+        + (ops->encode * costs->encode + ops->mul * costs->mul
+           + ops->add * costs->add + ops->is_zero * costs->is_zero
+           + ops->fread * costs->fread) / (nthreads ? nthreads : 1)
+        + ops->fwrite * costs->fwrite
+        + (written - ops->fwrite * costs->enc_bytes) * per_byte;
+
+    fprintf(fp, "  \"%s\": {\n", name);
+    fprintf(fp, "    \"sk_init\": %lu,\n", ops->sk_init);
+    fprintf(fp, "    \"encode\": %lu,\n", ops->encode);
+    fprintf(fp, "    \"mul\": %lu,\n", ops->mul);
+    fprintf(fp, "    \"add\": %lu,\n", ops->add);
+    fprintf(fp, "    \"is_zero\": %lu,\n", ops->is_zero);
+    fprintf(fp, "    \"fwrite\": %lu,\n", ops->fwrite);
+    fprintf(fp, "    \"fread\": %lu,\n", ops->fread);
+    fprintf(fp, "    \"peak_encodings\": %lu,\n", ops->peak);
+    fprintf(fp, "    \"dry_run_seconds\": %.6g,\n", ops->seconds);
+    fprintf(fp, "    \"seconds\": %.6g,\n", seconds);
+    fprintf(fp, "    \"peak_bytes\": %lu,\n", peak);
+    fprintf(fp, "    \"written_bytes\": %lu\n", written);
+    fprintf(fp, "  }");
+}
+
+void
+estimate_fprint(FILE *fp, const char *scheme, size_t secparam, size_t nthreads,
+                const estimate_costs *costs, const char *const *names,
+                const estimate_ops *ops, size_t nphases)
+{
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"scheme\": \"%s\",\n", scheme);
+    fprintf(fp, "  \"secparam\": %lu,\n", secparam);
+    fprintf(fp, "  \"kappa\": %lu,\n", costs->kappa);
+    fprintf(fp, "  \"nzs\": %lu,\n", costs->nzs);
+    fprintf(fp, "  \"nslots\": %lu,\n", costs->nslots);
+    fprintf(fp, "  \"nthreads\": %lu,\n", nthreads);
+    fprintf(fp, "  \"calibration\": {\n");
+    fprintf(fp, "    \"sk_init\": %.6g,\n", costs->sk_init);
+    fprintf(fp, "    \"encode\": %.6g,\n", costs->encode);
+    fprintf(fp, "    \"mul\": %.6g,\n", costs->mul);
+    fprintf(fp, "    \"add\": %.6g,\n", costs->add);
+    fprintf(fp, "    \"is_zero\": %.6g,\n", costs->is_zero);
+    fprintf(fp, "    \"fwrite\": %.6g,\n", costs->fwrite);
+    fprintf(fp, "    \"fread\": %.6g,\n", costs->fread);
+    fprintf(fp, "    \"encoding_bytes\": %lu,\n", costs->enc_bytes);
+    fprintf(fp, "    \"pp_bytes\": %lu,\n", costs->pp_bytes);
+    fprintf(fp, "    \"sk_bytes\": %lu\n", costs->sk_bytes);
+    fprintf(fp, "  }");
+    for (size_t i = 0; i < nphases; ++i) {
+        fprintf(fp, ",\n");
+        _fprint_phase(fp, names[i], costs, &ops[i], nthreads);
+    }
+    fprintf(fp, "\n}\n");
+}
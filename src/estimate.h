@@ -0,0 +1,54 @@
+#pragma once
+
+/*
+ * Pre-flight cost estimates.  A dry run of the scheme on a counting dummy
+ * mmap gives the exact number of mmap operations of each phase (obfuscate,
+ * evaluate, ...) and how many encodings it keeps alive at once.  A short
+ * microbenchmark of the target mmap, at the λ, κ, nzs and nslots the dry run
+ * asked for, then prices each operation.  A phase's time is the dry run's
+ * own (the scheme's bookkeeping) plus its priced operations, assuming these
+ * spread evenly over the threads, except writing, which is serial.
+ *
+ * The counting mmap keeps global counts, so only one estimate may run at once.
+ */
+
+#include "mmap.h"
+
+typedef struct {
+    size_t sk_init;             /* secret parameters generated */
+    size_t encode, mul, add, is_zero;
+    size_t fwrite, fread;       /* encodings written and read */
+    size_t sk_fwrite, pp_fwrite;
+    size_t peak;                /* most encodings alive at once */
+    size_t peak_sks, peak_pps;  /* most secret/public parameters alive at once */
+    size_t other_bytes;         /* bytes written besides the mmap's own */
+    double seconds;             /* wall time of the dry run */
+} estimate_ops;
+
+typedef struct {
+    size_t kappa, nzs, nslots;
+    double sk_init;             /* seconds, at the given number of threads */
+    double encode, mul, add, is_zero, fwrite, fread; /* seconds per operation */
+    size_t enc_bytes, pp_bytes, sk_bytes;
+} estimate_costs;
+
+/* Starts counting, returning the counting mmap to dry-run with */
+const mmap_vtable *
+estimate_begin(void);
+/* Counts since the previous phase; written is the number of bytes the phase
+ * wrote in total, to tell the scheme's own data from the mmap's */
+void
+estimate_phase(estimate_ops *ops, size_t written);
+/* Benchmarks mmap with the parameters of the dry run */
+int
+estimate_calibrate(const mmap_vtable *mmap, size_t secparam, size_t nthreads,
+                   aes_randstate_t rng, estimate_costs *costs);
+void
+estimate_end(void);
+
+/* Prints the calibration and the predicted time, peak memory and bytes
+ * written of each phase as JSON */
+void
+estimate_fprint(FILE *fp, const char *scheme, size_t secparam, size_t nthreads,
+                const estimate_costs *costs, const char *const *names,
+                const estimate_ops *ops, size_t nphases);
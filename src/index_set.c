@@ -4,23 +4,70 @@
 #include <assert.h>
 #include <string.h>
 
+/* The kernels below work on IX_LANES entries at a time using GCC vector
+ * extensions, which lower to whatever SIMD the target has, with a scalar
+ * loop for the tail */
+typedef int ix_vec __attribute__((vector_size(16)));
+#define IX_LANES (sizeof(ix_vec) / sizeof(int))
+
+static inline ix_vec
+_load(const int *p)
+{
+    ix_vec v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static inline void
+_store(int *p, ix_vec v)
+{
+    memcpy(p, &v, sizeof v);
+}
+
+static inline bool
+_any(ix_vec v)
+{
+    for (size_t i = 0; i < IX_LANES; ++i)
+        if (v[i])
+            return true;
+    return false;
+}
+
 index_set *
 index_set_new(size_t nzs)
 {
-    index_set *ix = my_calloc(1, sizeof ix[0]);
+    /* One allocation, with pows right after the (aligned) header */
+    const size_t hdr = (sizeof(index_set) + sizeof(ix_vec) - 1)
+        / sizeof(ix_vec) * sizeof(ix_vec);
+    index_set *ix = my_calloc(1, hdr + nzs * sizeof ix->pows[0]);
     ix->nzs = nzs;
-    ix->pows = my_calloc(ix->nzs, sizeof ix->pows[0]);
+    ix->pows = (int *) ((char *) ix + hdr);
     return ix;
 }
 
 void
 index_set_free(index_set *ix)
 {
-    if (ix) {
-        if (ix->pows)
-            free(ix->pows);
-        free(ix);
-    }
+    free(ix);
+}
+
+index_set *
+index_set_init(index_set_buf *buf, size_t nzs)
+{
+    buf->ix.nzs = nzs;
+    if (nzs <= INDEX_SET_INLINE)
+        buf->ix.pows = buf->buf;
+    else
+        buf->ix.pows = my_calloc(nzs, sizeof buf->ix.pows[0]);
+    return &buf->ix;
+}
+
+void
+index_set_release(index_set_buf *buf)
+{
+    if (buf->ix.pows != buf->buf)
+        free(buf->ix.pows);
+    buf->ix.pows = NULL;
 }
 
 void
@@ -42,14 +89,20 @@ index_set_print(const index_set *ix)
 void
 index_set_add(index_set *rop, const index_set *x, const index_set *y)
 {
-    array_add(rop->pows, x->pows, y->pows, rop->nzs);
+    const size_t n = rop->nzs;
+    size_t i = 0;
+
+    for (; i + IX_LANES <= n; i += IX_LANES)
+        _store(&rop->pows[i], _load(&x->pows[i]) + _load(&y->pows[i]));
+    for (; i < n; ++i)
+        rop->pows[i] = x->pows[i] + y->pows[i];
 }
 
 void
 index_set_set(index_set *rop, const index_set *x)
 {
-    for (size_t i = 0; i < x->nzs; i++)
-        rop->pows[i] = x->pows[i];
+    if (rop != x)
+        memcpy(rop->pows, x->pows, x->nzs * sizeof rop->pows[0]);
 }
 
 index_set *
@@ -65,7 +118,59 @@ index_set_copy(const index_set *x)
 bool
 index_set_eq(const index_set *x, const index_set *y)
 {
-    return array_eq(x->pows, y->pows, x->nzs);
+    const size_t n = x->nzs;
+    size_t i = 0;
+
+    if (x->pows == y->pows)
+        return true;
+    for (; i + IX_LANES <= n; i += IX_LANES)
+        if (_any(_load(&x->pows[i]) != _load(&y->pows[i])))
+            return false;
+    for (; i < n; ++i)
+        if (x->pows[i] != y->pows[i])
+            return false;
+    return true;
+}
+
+void
+index_set_max(index_set *rop, const index_set *x, const index_set *y)
+{
+    const size_t n = x->nzs;
+    size_t i = 0;
+
+    for (; i + IX_LANES <= n; i += IX_LANES) {
+        const ix_vec a = _load(&x->pows[i]), b = _load(&y->pows[i]);
+        const ix_vec gt = a > b;
+        _store(&rop->pows[i], (a & gt) | (b & ~gt));
+    }
+    for (; i < n; ++i)
+        rop->pows[i] = x->pows[i] > y->pows[i] ? x->pows[i] : y->pows[i];
+}
+
+int
+index_set_sub(index_set *rop, const index_set *x, const index_set *y)
+{
+    const size_t n = x->nzs;
+    ix_vec neg = { 0 };
+    bool negative = false;
+    size_t i = 0;
+
+    for (; i + IX_LANES <= n; i += IX_LANES) {
+        const ix_vec d = _load(&x->pows[i]) - _load(&y->pows[i]);
+        neg |= d;
+        _store(&rop->pows[i], d);
+    }
+    for (; i < n; ++i) {
+        rop->pows[i] = x->pows[i] - y->pows[i];
+        negative |= rop->pows[i] < 0;
+    }
+    if (negative || _any(neg < 0)) {
+        fprintf(stderr, "error: negative difference in index set\n");
+        index_set_print(x);
+        index_set_print(y);
+        return ERR;
+    }
+    return OK;
 }
 
 index_set *
@@ -74,9 +179,7 @@ index_set_union(const index_set *x, const index_set *y)
     index_set *rop;
     if ((rop = index_set_new(x->nzs)) == NULL)
         return NULL;
-    for (size_t i = 0; i < x->nzs; i++) {
-        rop->pows[i] = x->pows[i] > y->pows[i] ? x->pows[i] : y->pows[i];
-    }
+    index_set_max(rop, x, y);
     return rop;
 }
 
@@ -86,35 +189,28 @@ index_set_difference(const index_set *x, const index_set *y)
     index_set *rop;
     if ((rop = index_set_new(x->nzs)) == NULL)
         return NULL;
-    for (size_t i = 0; i < x->nzs; i++) {
-        if (x->pows[i] < y->pows[i]) {
-            fprintf(stderr, "error: negative difference in index set\n");
-            index_set_print(x);
-            index_set_print(y);
-            goto error;
-        }
-        rop->pows[i] = x->pows[i] - y->pows[i];
+    if (index_set_sub(rop, x, y) == ERR) {
+        index_set_free(rop);
+        return NULL;
     }
     return rop;
-error:
-    free(rop);
-    return NULL;
 }
 
 index_set *
 index_set_fread(FILE *fp)
 {
-    index_set *ix = my_calloc(1, sizeof ix[0]);
-    if (ulong_fread(&ix->nzs, fp) == ERR)
-        goto error;
-    ix->pows = my_calloc(ix->nzs, sizeof ix->pows[0]);
+    index_set *ix;
+    size_t nzs;
+    if (ulong_fread(&nzs, fp) == ERR)
+        return NULL;
+    ix = index_set_new(nzs);
     for (size_t i = 0; i < ix->nzs; i++) {
         if (int_fread(&ix->pows[i], fp) == ERR)
             goto error;
     }
     return ix;
 error:
-    free(ix);
+    index_set_free(ix);
     return NULL;
 }
 
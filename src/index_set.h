@@ -9,10 +9,24 @@ typedef struct {
     size_t nzs;
 } index_set;
 
+/* Index sets with at most this many entries fit in an index_set_buf */
+#define INDEX_SET_INLINE 64
+
+/* Scratch index set for the evaluation hot path, usually on the stack: pows
+ * points into buf, and only spills to the heap when nzs > INDEX_SET_INLINE */
+typedef struct {
+    index_set ix;
+    int buf[INDEX_SET_INLINE] __attribute__((aligned(16)));
+} index_set_buf;
+
 index_set *
 index_set_new(size_t nzs);
 void
 index_set_free(index_set *ix);
+index_set *
+index_set_init(index_set_buf *buf, size_t nzs);
+void
+index_set_release(index_set_buf *buf);
 void
 index_set_clear(index_set *ix);
 void
@@ -25,6 +39,12 @@ index_set *
 index_set_copy(const index_set *x);
 bool
 index_set_eq(const index_set *x, const index_set *y);
+/* rop = max(x, y) entrywise */
+void
+index_set_max(index_set *rop, const index_set *x, const index_set *y);
+/* rop = x - y, or ERR if some entry would be negative */
+int
+index_set_sub(index_set *rop, const index_set *x, const index_set *y);
 index_set *
 index_set_union(const index_set *x, const index_set *y);
 index_set *
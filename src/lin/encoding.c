@@ -5,6 +5,7 @@
 
 #include <assert.h>
 
+/* lvl is interned, so encodings at the same level share it */
 struct encoding_info {
     level *lvl;
     size_t nslots;
@@ -23,13 +24,22 @@ encoding_equal_z(const encoding *x, const encoding *y)
     return level_eq_z(info(x)->lvl, info(y)->lvl);
 }
 
+/* Takes over the reference to lvl */
+static void
+_encoding_set_level(encoding *rop, level *lvl)
+{
+    level *const old = info(rop)->lvl;
+    info(rop)->lvl = lvl;
+    level_release(old);
+}
+
 static int
 _encoding_new(const pp_vtable *vt, encoding *enc, const public_params *pp)
 {
     const obf_params_t *op = vt->params(pp);
+    const circ_params_t *cp = &op->cp;
     info(enc) = my_calloc(1, sizeof info(enc)[0]);
-    info(enc)->lvl = level_new(&op->cp);
-    info(enc)->nslots = info(enc)->lvl->c + 3;
+    info(enc)->nslots = cp->n - (cp->circ->consts.n ? 1 : 0) + 3;
     return OK;
 }
 
@@ -37,17 +47,23 @@ static void
 _encoding_free(encoding *enc)
 {
     if (info(enc)) {
-        if (info(enc)->lvl)
-            level_free(info(enc)->lvl);
+        level_release(info(enc)->lvl);
         free(info(enc));
     }
 }
 
+static void
+_encoding_reset(encoding *enc)
+{
+    _encoding_set_level(enc, NULL);
+}
+
 static int
 _encoding_print(const encoding *enc)
 {
     fprintf(stderr, "Encoding: ");
-    level_fprint(stderr, info(enc)->lvl);
+    if (info(enc)->lvl)
+        level_fprint(stderr, info(enc)->lvl);
     return OK;
 }
 
@@ -56,8 +72,8 @@ _encode(encoding *rop, const void *set)
 {
     int *pows;
     const level *lvl = (const level *const) set;
-    level_set(info(rop)->lvl, lvl);
-    pows = my_calloc((lvl->q+1) * (lvl->c+2) + lvl->gamma, sizeof(int));
+    _encoding_set_level(rop, level_intern(lvl));
+    pows = my_calloc(lvl->n, sizeof(int));
     level_flatten(pows, lvl);
     return pows;
 }
@@ -66,7 +82,7 @@ static int
 _encoding_set(encoding *rop, const encoding *x)
 {
     info(rop)->nslots = info(x)->nslots;
-    level_set(info(rop)->lvl, info(x)->lvl);
+    _encoding_set_level(rop, level_ref(info(x)->lvl));
     return OK;
 }
 
@@ -76,7 +92,7 @@ _encoding_mul(const pp_vtable *vt, encoding *rop,
               const public_params *pp)
 {
     (void) vt; (void) pp;
-    level_add(info(rop)->lvl, info(x)->lvl, info(y)->lvl);
+    _encoding_set_level(rop, level_intern_add(info(x)->lvl, info(y)->lvl));
     return OK;
 }
 
@@ -94,7 +110,7 @@ _encoding_add(const pp_vtable *vt, encoding *rop,
         level_fprint(stderr, y->info->lvl);
         return ERR;
     }
-    level_set(info(rop)->lvl, info(x)->lvl);
+    _encoding_set_level(rop, level_ref(info(x)->lvl));
     return OK;
 }
 
@@ -112,7 +128,7 @@ _encoding_sub(const pp_vtable *vt, encoding *rop,
         level_fprint(stderr, info(x)->lvl);
         return ERR;
     }
-    level_set(info(rop)->lvl, info(x)->lvl);
+    _encoding_set_level(rop, level_ref(info(x)->lvl));
     return OK;
 }
 
@@ -134,9 +150,16 @@ _encoding_is_zero(const pp_vtable *vt, const encoding *x,
 static int
 _encoding_fread(encoding *x, FILE *fp)
 {
+    level *lvl;
+
     info(x) = calloc(1, sizeof info(x)[0]);
-    info(x)->lvl = calloc(1, sizeof info(x)->lvl[0]);
-    level_fread(info(x)->lvl, fp);
+    if ((lvl = level_fread(fp)) == NULL) {
+        free(info(x));
+        return ERR;
+    }
+    info(x)->lvl = level_intern(lvl);
+    info(x)->nslots = lvl->c + 3;
+    level_free(lvl);
     return OK;
 }
 
@@ -158,6 +181,7 @@ static encoding_vtable _encoding_vtable =
     .mmap = NULL,
     .new = _encoding_new,
     .free = _encoding_free,
+    .reset = _encoding_reset,
     .print = _encoding_print,
     .encode = _encode,
     .set = _encoding_set,
@@ -3,10 +3,61 @@
 
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+/* Interned levels, chained by hash and split into shards by hash so that
+ * threads evaluating different gates rarely contend.  The links and counts
+ * of a shard are protected by its lock.  References are counted without it,
+ * except for dropping the last one, which unlinks the level. */
+#define SHARD_BITS 6
+typedef struct {
+    pthread_mutex_t lock;
+    level **buckets;
+    size_t nbuckets;
+    size_t count;
+} shard_t;
+static shard_t table[1 << SHARD_BITS] = {
+    [0 ... (1 << SHARD_BITS) - 1] = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 }
+};
+
+static level *
+_level_alloc(size_t q, size_t c, size_t gamma)
+{
+    const size_t n = (q + 1) * (c + 2) + gamma;
+    level *lvl;
+    size_t *data;
+
+    lvl = my_calloc(1, sizeof lvl[0] + (q + 1) * sizeof lvl->mat[0]
+                    + n * sizeof data[0]);
+    lvl->q = q;
+    lvl->c = c;
+    lvl->gamma = gamma;
+    lvl->n = n;
+    lvl->mat = (size_t **) (lvl + 1);
+    data = (size_t *) (lvl->mat + q + 1);
+    for (size_t i = 0; i < q + 1; ++i)
+        lvl->mat[i] = data + i * (c + 2);
+    lvl->vec = data + (q + 1) * (c + 2);
+    return lvl;
+}
+
+static inline size_t *
+_data(const level *lvl)
+{
+    return lvl->mat[0];
+}
+
+/* Index of mat[q][c+1] in the data */
+static inline size_t
+_degree_index(const level *lvl)
+{
+    return lvl->q * (lvl->c + 2) + lvl->c + 1;
+}
 
 level *
 level_new(const circ_params_t *cp)
@@ -14,27 +65,200 @@ level_new(const circ_params_t *cp)
     const size_t has_consts = cp->circ->consts.n ? 1 : 0;
     const size_t ninputs = cp->n - has_consts;
     const size_t q = array_max(cp->qs, ninputs);
-    level *lvl = calloc(1, sizeof lvl[0]);
-    lvl->q = q;
-    lvl->c = ninputs;
-    lvl->gamma = cp->m;
-    lvl->mat = my_calloc(lvl->q + 1, sizeof lvl->mat[0]);
-    for (size_t i = 0; i < lvl->q + 1; ++i)
-        lvl->mat[i] = my_calloc(lvl->c + 2, sizeof lvl->mat[i][0]);
-    lvl->vec = my_calloc(cp->m, sizeof lvl->vec[0]);
-    return lvl;
+    return _level_alloc(q, ninputs, cp->m);
 }
 
 void
 level_free(level *lvl)
 {
-    for (size_t i = 0; i < lvl->q + 1; ++i)
-        free(lvl->mat[i]);
-    free(lvl->mat);
-    free(lvl->vec);
     free(lvl);
 }
 
+/* Weight of entry i in the hash.  The hash is linear in the entries, so the
+ * hash of a sum of levels is the sum of their hashes. */
+static inline size_t
+_weight(size_t i)
+{
+    size_t z = i + 0x9e3779b97f4a7c15;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+static size_t
+_hash(const level *lvl)
+{
+    const size_t *const data = _data(lvl);
+    size_t h = 0;
+
+    if (lvl->interned)
+        return lvl->hash;
+    for (size_t i = 0; i < lvl->n; ++i)
+        h += data[i] * _weight(i);
+    return h;
+}
+
+/* The low bits of a linear hash are poor, so mix them in before bucketing */
+static inline size_t
+_mix(size_t hash)
+{
+    hash = (hash ^ (hash >> 33)) * 0xff51afd7ed558ccd;
+    return hash ^ (hash >> 33);
+}
+
+static inline size_t
+_bucket(size_t hash, size_t nbuckets)
+{
+    return _mix(hash) % nbuckets;
+}
+
+/* Taken from the top bits, which _bucket only uses in huge shards */
+static inline shard_t *
+_shard(size_t hash)
+{
+    return &table[_mix(hash) >> (64 - SHARD_BITS)];
+}
+
+static bool
+_matches(const level *lvl, size_t hash, const level *shape, const size_t *x,
+         const size_t *y)
+{
+    const size_t *const data = _data(lvl);
+    size_t diff = 0;
+
+    if (lvl->hash != hash || lvl->q != shape->q || lvl->c != shape->c
+        || lvl->gamma != shape->gamma)
+        return false;
+    if (y == NULL)
+        return memcmp(data, x, lvl->n * sizeof data[0]) == 0;
+    for (size_t i = 0; i < lvl->n; ++i)
+        diff |= data[i] ^ (x[i] + y[i]);
+    return diff == 0;
+}
+
+static void
+_grow_locked(shard_t *shard)
+{
+    const size_t nbuckets = shard->nbuckets ? 2 * shard->nbuckets : 16;
+    level **buckets = my_calloc(nbuckets, sizeof buckets[0]);
+
+    for (size_t b = 0; b < shard->nbuckets; ++b) {
+        level *lvl = shard->buckets[b];
+        while (lvl) {
+            level *const next = lvl->next;
+            lvl->next = buckets[_bucket(lvl->hash, nbuckets)];
+            buckets[_bucket(lvl->hash, nbuckets)] = lvl;
+            lvl = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->nbuckets = nbuckets;
+}
+
+/* Finds or adds the interned level with the entries of x + y, taking a
+ * reference to it */
+static level *
+_intern_locked(shard_t *shard, size_t hash, const level *shape,
+               const size_t *x, const size_t *y)
+{
+    level *lvl;
+    size_t d;
+
+    if (shard->nbuckets) {
+        for (lvl = shard->buckets[_bucket(hash, shard->nbuckets)]; lvl; lvl = lvl->next) {
+            if (_matches(lvl, hash, shape, x, y)) {
+                __sync_fetch_and_add(&lvl->refs, 1);
+                return lvl;
+            }
+        }
+    }
+    if (shard->count >= shard->nbuckets)
+        _grow_locked(shard);
+    lvl = _level_alloc(shape->q, shape->c, shape->gamma);
+    if (y == NULL) {
+        memcpy(_data(lvl), x, lvl->n * sizeof x[0]);
+    } else {
+        for (size_t i = 0; i < lvl->n; ++i)
+            _data(lvl)[i] = x[i] + y[i];
+    }
+    lvl->interned = true;
+    lvl->refs = 1;
+    lvl->hash = hash;
+    lvl->next = shard->buckets[_bucket(hash, shard->nbuckets)];
+    shard->buckets[_bucket(hash, shard->nbuckets)] = lvl;
+    shard->count++;
+    d = _degree_index(lvl);
+    lvl->zhash = hash - _data(lvl)[d] * _weight(d);
+    return lvl;
+}
+
+level *
+level_intern(const level *lvl)
+{
+    const size_t hash = _hash(lvl);
+    shard_t *const shard = _shard(hash);
+    level *rop;
+
+    pthread_mutex_lock(&shard->lock);
+    rop = _intern_locked(shard, hash, lvl, _data(lvl), NULL);
+    pthread_mutex_unlock(&shard->lock);
+    return rop;
+}
+
+level *
+level_intern_add(const level *x, const level *y)
+{
+    const size_t hash = _hash(x) + _hash(y);
+    shard_t *const shard = _shard(hash);
+    level *rop;
+
+    pthread_mutex_lock(&shard->lock);
+    rop = _intern_locked(shard, hash, x, _data(x), _data(y));
+    pthread_mutex_unlock(&shard->lock);
+    return rop;
+}
+
+level *
+level_ref(level *lvl)
+{
+    assert(lvl->interned);
+    __sync_fetch_and_add(&lvl->refs, 1);
+    return lvl;
+}
+
+void
+level_release(level *lvl)
+{
+    shard_t *shard;
+    size_t refs;
+    level **p;
+
+    if (lvl == NULL)
+        return;
+    /* Only the last reference needs the lock, since interning may find the
+     * level and take a new one until it is unlinked */
+    while ((refs = __sync_fetch_and_add(&lvl->refs, 0)) > 1) {
+        if (__sync_bool_compare_and_swap(&lvl->refs, refs, refs - 1))
+            return;
+    }
+    shard = _shard(lvl->hash);
+    pthread_mutex_lock(&shard->lock);
+    if (__sync_sub_and_fetch(&lvl->refs, 1) == 0) {
+        p = &shard->buckets[_bucket(lvl->hash, shard->nbuckets)];
+        while (*p != lvl)
+            p = &(*p)->next;
+        *p = lvl->next;
+        free(lvl);
+        if (--shard->count == 0) {
+            free(shard->buckets);
+            shard->buckets = NULL;
+            shard->nbuckets = 0;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
 void
 level_fprint(FILE *fp, const level *lvl)
 {
@@ -62,57 +286,35 @@ level_fprint(FILE *fp, const level *lvl)
 void
 level_set(level *rop, const level *lvl)
 {
-    for (size_t i = 0; i < lvl->q+1; i++) {
-        for (size_t j = 0; j < lvl->c+2; j++) {
-            rop->mat[i][j] = lvl->mat[i][j];
-        }
-    }
-    for (size_t i = 0; i < lvl->gamma; i++) {
-        rop->vec[i] = lvl->vec[i];
-    }
+    memcpy(_data(rop), _data(lvl), lvl->n * sizeof _data(rop)[0]);
 }
 
 void
 level_add(level *rop, const level *x, const level *y)
 {
-    for (size_t i = 0; i < rop->q+1; i++) {
-        for (size_t j = 0; j < rop->c+2; j++) {
-            rop->mat[i][j] = x->mat[i][j] + y->mat[i][j];
-        }
-    }
-    for (size_t i = 0; i < rop->gamma; i++) {
-        rop->vec[i] = x->vec[i] + y->vec[i];
-    }
+    size_t *const r = _data(rop);
+    const size_t *const xs = _data(x), *const ys = _data(y);
+    for (size_t i = 0; i < rop->n; i++)
+        r[i] = xs[i] + ys[i];
 }
 
 void
 level_mul_ui(level *rop, const level *op, int x)
 {
-    for (size_t i = 0; i < rop->q+1; i++) {
-        for (size_t j = 0; j < rop->c+2; j++) {
-            rop->mat[i][j] = op->mat[i][j] * x;
-        }
-    }
-    for (size_t i = 0; i < rop->gamma; i++) {
-        rop->vec[i] = op->vec[i] * x;
-    }
+    size_t *const r = _data(rop);
+    const size_t *const ops = _data(op);
+    for (size_t i = 0; i < rop->n; i++)
+        r[i] = ops[i] * x;
 }
 
 int
 level_flatten(int *pows, const level *lvl)
 {
-    int z = 0;
-    for (size_t i = 0; i < lvl->q+1; i++) {
-        for (size_t j = 0; j < lvl->c+2; j++) {
-            if ((int) lvl->mat[i][j] < 0)
-                return ERR;
-            pows[z++] = (int) lvl->mat[i][j];
-        }
-    }
-    for (size_t i = 0; i < lvl->gamma; i++) {
-        if ((int) lvl->vec[i] < 0)
+    const size_t *const data = _data(lvl);
+    for (size_t i = 0; i < lvl->n; i++) {
+        if ((int) data[i] < 0)
             return ERR;
-        pows[z++] = (int) lvl->vec[i];
+        pows[i] = (int) data[i];
     }
     return OK;
 }
@@ -120,32 +322,25 @@ level_flatten(int *pows, const level *lvl)
 bool
 level_eq(const level *x, const level *y)
 {
-    for (size_t i = 0; i < x->q+1; i++) {
-        for (size_t j = 0; j < x->c+2; j++) {
-            if (x->mat[i][j] != y->mat[i][j])
-                return false;
-        }
-    }
-    for (size_t i = 0; i < x->gamma; i++) {
-        if (x->vec[i] != y->vec[i])
-            return false;
-    }
-    return true;
+    if (x == y)
+        return true;
+    if (x->interned && y->interned)
+        return false;
+    return memcmp(_data(x), _data(y), x->n * sizeof _data(x)[0]) == 0;
 }
 
 bool
-level_eq_z(level *x, level *y)
-{
-    for (size_t i = 0; i < x->q+1; i++) {
-        for (size_t j = 0; j < x->c+2; j++) {
-            if (i == x->q && j == x->c+1)
-                continue;
-            if (x->mat[i][j] != y->mat[i][j])
-                return false;
-        }
-    }
-    for (size_t i = 0; i < x->gamma; i++) {
-        if (x->vec[i] != y->vec[i])
+level_eq_z(const level *x, const level *y)
+{
+    const size_t mask = _degree_index(x);
+    const size_t *const xs = _data(x), *const ys = _data(y);
+
+    if (x == y)
+        return true;
+    if (x->interned && y->interned && x->zhash != y->zhash)
+        return false;
+    for (size_t i = 0; i < x->n; i++) {
+        if (i != mask && xs[i] != ys[i])
             return false;
     }
     return true;
@@ -255,21 +450,21 @@ level_fwrite(const level *lvl, FILE *fp)
     }
 }
 
-void
-level_fread(level *lvl, FILE *fp)
+level *
+level_fread(FILE *fp)
 {
-    ulong_fread(&lvl->q, fp);
-    ulong_fread(&lvl->c, fp);
-    ulong_fread(&lvl->gamma, fp);
-    lvl->mat = my_calloc(lvl->q + 1, sizeof lvl->mat[0]);
-    for (size_t i = 0; i < lvl->q+1; i++) {
-        lvl->mat[i] = my_calloc(lvl->c+3, sizeof lvl->mat[i][0]);
-        for (size_t j = 0; j < lvl->c+2; j++) {
-            ulong_fread(&lvl->mat[i][j], fp);
+    size_t q, c, gamma;
+    level *lvl;
+
+    if (ulong_fread(&q, fp) == ERR || ulong_fread(&c, fp) == ERR
+        || ulong_fread(&gamma, fp) == ERR)
+        return NULL;
+    lvl = _level_alloc(q, c, gamma);
+    for (size_t i = 0; i < lvl->n; i++) {
+        if (ulong_fread(&_data(lvl)[i], fp) == ERR) {
+            level_free(lvl);
+            return NULL;
         }
     }
-    lvl->vec = my_calloc(lvl->gamma, sizeof lvl->vec[0]);
-    for (size_t i = 0; i < lvl->gamma; i++) {
-        ulong_fread(&lvl->vec[i], fp);
-    }
+    return lvl;
 }
@@ -3,18 +3,44 @@
 #include "obf_params.h"
 #include "mmap.h"
 
-typedef struct {
+/*
+ * A level is one allocation holding the header, the row pointers of mat and
+ * the entries themselves, with vec right after the last row.
+ *
+ * Levels handed out by level_intern are immutable and shared between all
+ * encodings at that level, so comparing two interned levels is a pointer
+ * comparison.  The others are scratch levels for building them.
+ */
+typedef struct level {
     size_t q;                   /* # symbols in alphabet */
     size_t c;                   /* # symbols in input */
     size_t gamma;
-    size_t **mat;
-    size_t *vec;
+    size_t **mat;               /* [q + 1][c + 2] */
+    size_t *vec;                /* [gamma] */
+    size_t n;                   /* # entries in mat and vec */
+    /* Only used for interned levels */
+    bool interned;
+    size_t refs;
+    size_t hash;
+    size_t zhash;               /* hash ignoring mat[q][c+1] */
+    struct level *next;
 } level;
 
 level *
 level_new(const circ_params_t *cp);
 void
 level_free(level *lvl);
+/* Returns the interned level equal to lvl, taking a reference to it */
+level *
+level_intern(const level *lvl);
+/* Like level_intern on x + y, without building the sum unless it is new */
+level *
+level_intern_add(const level *x, const level *y);
+/* Takes another reference to an interned level */
+level *
+level_ref(level *lvl);
+void
+level_release(level *lvl);
 void
 level_fprint(FILE *fp, const level *lvl);
 void
@@ -27,8 +53,9 @@ int
 level_flatten(int *pows, const level *lvl);
 bool
 level_eq(const level *x, const level *y);
+/* Equality ignoring mat[q][c+1], the degree */
 bool
-level_eq_z(level *x, level *y);
+level_eq_z(const level *x, const level *y);
 level *
 level_create_vstar(const circ_params_t *cp);
 level *
@@ -45,5 +72,5 @@ level *
 level_create_vzt(const circ_params_t *cp, size_t M, size_t D);
 void
 level_fwrite(const level *lvl, FILE *fp);
-void
-level_fread(level *lvl, FILE *fp);
+level *
+level_fread(FILE *fp);
@@ -1,7 +1,10 @@
 #include "obfuscator.h"
 #include "encoding.h"
 #include "level.h"
-#include "reflist.h"
+#include "obf_index.h"
+#include "prodtree.h"
+#include "raise.h"
+#include "sched.h"
 #include "vtables.h"
 #include "util.h"
 
@@ -10,9 +13,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
 #include <threadpool.h>
 
+
 struct obfuscation {
     const mmap_vtable *mmap;
     const pp_vtable *pp_vt;
@@ -21,7 +24,6 @@ struct obfuscation {
     const obf_params_t *op;
     secret_params *sp;
     public_params *pp;
-    aes_randstate_t rng;
     encoding *Zstar;
     encoding ***Rks;        // k \in [c], s \in \Sigma
     encoding ****Zksj;      // k \in [c], s \in \Sigma, j \in [\ell]
@@ -33,21 +35,17 @@ struct obfuscation {
     encoding **Zhato;       // o \in \Gamma
     encoding **Rbaro;       // o \in \Gamma
     encoding **Zbaro;       // o \in \Gamma
+    obf_index *index;       // NULL unless lazily loading from disk
 };
 
 typedef struct work_args {
     const mmap_vtable *mmap;
-    acircref ref;
     const acirc *c;
     const int *inputs;
     const obfuscation *obf;
     bool *mine;
-    int *ready;
     void *cache;
-    ref_list *deps;
-    threadpool *pool;
-    size_t *kappas;
-    int *rop;
+    raise_eval *zstars;
 } work_args;
 
 static void
@@ -314,6 +312,7 @@ _free(obfuscation *obf)
     }
     free(obf->Rbaro);
     free(obf->Zbaro);
+    obf_index_free(obf->index);
     free(obf);
 }
 
@@ -368,6 +367,124 @@ _alloc(const mmap_vtable *mmap, const obf_params_t *op)
     return obf;
 }
 
+/* Values shared by every encoding job */
+typedef struct {
+    const obfuscation *obf;
+    mpz_t *moduli;
+    mpz_t *ykj;                 // [ninputs * d]
+    mpz_t *ykjc;                // [nconsts]
+    mpz_t *whatk;               // [ninputs * (ninputs + 3)]
+    mpz_t *what;                // [ninputs + 3]
+    mpz_t *tmp;                 // what times each whatk
+    mpz_t *ybars;               // [noutputs]
+    pthread_mutex_t count_lock;
+    size_t count;
+    size_t total;
+} obf_shared;
+
+/* Jobs are coarse enough that seeding each one's generator is negligible */
+typedef enum {
+    JOB_ZSTAR,                  // Zstar
+    JOB_KS,                     // Rks, Zksj, and Rhatkso and Zhatkso for all o
+    JOB_C,                      // Rc and Zcj
+    JOB_O,                      // Rhato, Zhato, Rbaro and Zbaro
+} job_e;
+
+typedef struct {
+    obf_shared *sh;
+    job_e job;
+    size_t k, s, o;
+    aes_randstate_t rng;
+} obf_args;
+
+static void
+_progress(obf_shared *sh, size_t n)
+{
+    if (g_verbose) {
+        pthread_mutex_lock(&sh->count_lock);
+        sh->count += n;
+        print_progress(sh->count, sh->total);
+        pthread_mutex_unlock(&sh->count_lock);
+    }
+}
+
+static void
+obf_worker(void *vargs)
+{
+    obf_args *const args = vargs;
+    obf_shared *const sh = args->sh;
+    const obfuscation *const obf = sh->obf;
+    const obf_params_t *const op = obf->op;
+    const circ_params_t *const cp = &op->cp;
+    const encoding_vtable *const vt = obf->enc_vt;
+    const size_t ninputs = cp->n - (cp->circ->consts.n ? 1 : 0);
+    const size_t d = array_max(cp->ds, ninputs);
+    const size_t k = args->k, s = args->s;
+    mpz_t rs[ninputs + 3];
+
+    mpz_vect_init(rs, ninputs + 3);
+    switch (args->job) {
+    case JOB_ZSTAR:
+        encode_Zstar(vt, cp, obf->Zstar, obf->sp, args->rng, sh->moduli);
+        break;
+    case JOB_KS:
+        mpz_vect_urandomms(rs, sh->moduli, ninputs + 3, args->rng);
+        encode_Rks(vt, cp, obf->Rks[k][s], obf->sp, rs, k, s);
+        for (size_t j = 0; j < d; j++)
+            encode_Zksj(vt, cp, obf->Zksj[k][s][j], obf->sp, op->sigma,
+                        args->rng, rs, sh->ykj[k * d + j], k, s, j, sh->moduli);
+        _progress(sh, 1 + d);
+        for (size_t o = 0; o < cp->m; o++) {
+            mpz_vect_urandomms(rs, sh->moduli, ninputs + 3, args->rng);
+            encode_Rhatkso(vt, cp, obf->Rhatkso[k][s][o], obf->sp, rs, k, s, o,
+                           op->types);
+            encode_Zhatkso(vt, cp, obf->Zhatkso[k][s][o], obf->sp, rs,
+                           &sh->whatk[k * (ninputs + 3)], k, s, o, sh->moduli,
+                           op->types);
+            _progress(sh, 2);
+        }
+        break;
+    case JOB_C:
+        mpz_vect_urandomms(rs, sh->moduli, ninputs + 3, args->rng);
+        encode_Rc(vt, cp, obf->Rc, obf->sp, rs);
+        for (size_t j = 0; j < cp->circ->consts.n; j++)
+            encode_Zcj(vt, cp, obf->Zcj[j], obf->sp, args->rng, rs,
+                       sh->ykjc[j], cp->circ->consts.buf[j], sh->moduli);
+        _progress(sh, 1 + cp->circ->consts.n);
+        break;
+    case JOB_O: {
+        const size_t o = args->o;
+        mpz_vect_urandomms(rs, sh->moduli, ninputs + 3, args->rng);
+        encode_Rhato(vt, cp, obf->Rhato[o], obf->sp, rs, o, op->M, op->types);
+        encode_Zhato(vt, cp, obf->Zhato[o], obf->sp, rs, sh->what, o,
+                     sh->moduli, op->M, op->types);
+        mpz_vect_urandomms(rs, sh->moduli, ninputs + 3, args->rng);
+        encode_Rbaro(vt, cp, obf->Rbaro[o], obf->sp, rs, o);
+        encode_Zbaro(vt, cp, obf->Zbaro[o], obf->sp, sh->ybars[o], rs,
+                     sh->tmp, o, sh->moduli, op->D);
+        _progress(sh, 4);
+        break;
+    }
+    }
+    mpz_vect_clear(rs, ninputs + 3);
+    aes_randclear(args->rng);
+    free(args);
+}
+
+static void
+__encode(threadpool *pool, obf_shared *sh, job_e job, size_t k, size_t s,
+         size_t o, aes_randstate_t rng)
+{
+    obf_args *args = my_calloc(1, sizeof args[0]);
+    args->sh = sh;
+    args->job = job;
+    args->k = k;
+    args->s = s;
+    args->o = o;
+    randstate_split(args->rng, rng);
+    threadpool_add_job(pool, obf_worker, args);
+}
+
 static obfuscation *
 _obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
            size_t *kappa, size_t nthreads, aes_randstate_t rng)
@@ -435,155 +552,159 @@ _obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
     mpz_t *moduli =
         mpz_vect_create_of_fmpz(obf->mmap->sk->plaintext_fields(obf->sp->sk),
                                 obf->mmap->sk->nslots(obf->sp->sk));
+    obf_shared sh;
+    threadpool *pool = threadpool_create(nthreads);
+
+    sh.obf = obf;
+    sh.moduli = moduli;
+    sh.count = 0;
+    sh.total = obf_params_num_encodings(op);
+    pthread_mutex_init(&sh.count_lock, NULL);
 
-    mpz_t ykj[ninputs][d];
+    sh.ykj = mpz_vect_new(ninputs * d);
     for (size_t k = 0; k < ninputs; k++) {
         for (size_t j = 0; j < d; j++) {
-            mpz_init(ykj[k][j]);
-            mpz_urandomm_aes(ykj[k][j], obf->rng, moduli[0]);
+            mpz_urandomm_aes(sh.ykj[k * d + j], rng, moduli[0]);
         }
     }
-    mpz_t ykjc[nconsts];
+    sh.ykjc = mpz_vect_new(nconsts);
     for (size_t j = 0; j < nconsts; j++) {
-        mpz_init(ykjc[j]);
-        mpz_urandomm_aes(ykjc[j], obf->rng, moduli[0]);
+        mpz_urandomm_aes(sh.ykjc[j], rng, moduli[0]);
     }
 
-    mpz_t whatk[ninputs][ninputs + 3];
+    sh.whatk = mpz_vect_new(ninputs * (ninputs + 3));
     for (size_t k = 0; k < ninputs; k++) {
-        mpz_vect_init(whatk[k], ninputs + 3);
-        mpz_vect_urandomms(whatk[k], moduli, ninputs + 3, obf->rng);
-        mpz_set_ui(whatk[k][k + 2], 0);
+        mpz_t *const whatk = &sh.whatk[k * (ninputs + 3)];
+        mpz_vect_urandomms(whatk, moduli, ninputs + 3, rng);
+        mpz_set_ui(whatk[k + 2], 0);
     }
-    mpz_t what[ninputs + 3];
-    mpz_vect_init(what, ninputs + 3);
-    mpz_vect_urandomms(what, moduli, ninputs + 3, obf->rng);
-    mpz_set_ui(what[ninputs + 2], 0);
-
-    mpz_t rs[ninputs + 3];
-    mpz_vect_init(rs, ninputs + 3);
-
-    encode_Zstar(obf->enc_vt, cp, obf->Zstar, obf->sp, obf->rng, moduli);
-
-    size_t count = 0;
-    const size_t total = obf_params_num_encodings(op);
-
-    if (g_verbose)
-        print_progress(count, total);
+    sh.what = mpz_vect_new(ninputs + 3);
+    mpz_vect_urandomms(sh.what, moduli, ninputs + 3, rng);
+    mpz_set_ui(sh.what[ninputs + 2], 0);
 
+    sh.tmp = mpz_vect_new(ninputs + 3);
+    mpz_vect_set(sh.tmp, sh.what, ninputs + 3);
     for (size_t k = 0; k < ninputs; k++) {
-        for (size_t s = 0; s < q; s++) {
-            mpz_vect_urandomms(rs, moduli, ninputs + 3, obf->rng);
-            encode_Rks(obf->enc_vt, cp, obf->Rks[k][s], obf->sp, rs, k, s);
-            if (g_verbose)
-                print_progress(++count, total);
-            for (size_t j = 0; j < d; j++) {
-                encode_Zksj(obf->enc_vt, cp, obf->Zksj[k][s][j], obf->sp, op->sigma,
-                            obf->rng, rs, ykj[k][j], k, s, j, moduli);
-                if (g_verbose)
-                    print_progress(++count, total);
-            }
-        }
-    }
-
-    mpz_vect_urandomms(rs, moduli, ninputs + 3, obf->rng);
-    encode_Rc(obf->enc_vt, cp, obf->Rc, obf->sp, rs);
-    if (g_verbose)
-        print_progress(++count, total);
-    for (size_t j = 0; j < nconsts; j++) {
-        encode_Zcj(obf->enc_vt, cp, obf->Zcj[j], obf->sp, obf->rng, rs,
-                   ykjc[j], c->consts.buf[j], moduli);
-        if (g_verbose)
-            print_progress(++count, total);
-    }
-
-    for (size_t o = 0; o < noutputs; o++) {
-        for (size_t k = 0; k < ninputs; k++) {
-            for (size_t s = 0; s < q; s++) {
-                mpz_vect_urandomms(rs, moduli, ninputs + 3, obf->rng);
-                encode_Rhatkso(obf->enc_vt, cp, obf->Rhatkso[k][s][o],
-                               obf->sp, rs, k, s, o, op->types);
-                if (g_verbose)
-                    print_progress(++count, total);
-                encode_Zhatkso(obf->enc_vt, cp, obf->Zhatkso[k][s][o],
-                               obf->sp, rs, whatk[k], k, s, o, moduli,
-                               op->types);
-                if (g_verbose)
-                    print_progress(++count, total);
-            }
-        }
-    }
-
-    for (size_t o = 0; o < noutputs; o++) {
-        mpz_vect_urandomms(rs, moduli, ninputs + 3, obf->rng);
-        encode_Rhato(obf->enc_vt, cp, obf->Rhato[o], obf->sp, rs, o, op->M,
-                     op->types);
-        if (g_verbose)
-            print_progress(++count, total);
-        encode_Zhato(obf->enc_vt, cp, obf->Zhato[o], obf->sp, rs, what, o,
-                     moduli, op->M, op->types);
-        if (g_verbose)
-            print_progress(++count, total);
+        mpz_vect_mul_mod(sh.tmp, sh.tmp, &sh.whatk[k * (ninputs + 3)], moduli,
+                         ninputs + 3);
     }
 
+    sh.ybars = mpz_vect_new(noutputs);
     {
-        mpz_t ybars[noutputs];
         mpz_t xs[c->ninputs];
-        mpz_t tmp[ninputs + 3];
         bool known[acirc_nrefs(c)];
         mpz_t cache[acirc_nrefs(c)];
 
         memset(known, 0, sizeof known);
-        mpz_vect_init(tmp, ninputs + 3);
-        mpz_vect_set(tmp, what, ninputs + 3);
-        for (size_t k = 0; k < ninputs; k++) {
-            mpz_vect_mul_mod(tmp, tmp, whatk[k], moduli, ninputs + 3);
-        }
-
         for (size_t k = 0; k < ninputs; k++) {
             for (size_t j = 0; j < d; j++) {
                 const sym_id sym = {k, j};
                 const size_t id = op->rchunker(sym, c->ninputs, ninputs);
-                mpz_init_set(xs[id], ykj[k][j]);
+                mpz_init_set(xs[id], sh.ykj[k * d + j]);
             }
         }
         for (size_t o = 0; o < noutputs; o++) {
-            acirc_eval_mpz_mod_memo(c, c->outputs.buf[o], xs, ykjc, moduli[0],
+            acirc_eval_mpz_mod_memo(c, c->outputs.buf[o], xs, sh.ykjc, moduli[0],
                                     known, cache);
-            mpz_init_set(ybars[o], cache[c->outputs.buf[o]]);
-            mpz_vect_urandomms(rs, moduli, ninputs + 3, obf->rng);
-            encode_Rbaro(obf->enc_vt, cp, obf->Rbaro[o], obf->sp, rs, o);
-            if (g_verbose)
-                print_progress(++count, total);
-            encode_Zbaro(obf->enc_vt, cp, obf->Zbaro[o], obf->sp, ybars[o], rs,
-                         tmp, o, moduli, op->D);
-            if (g_verbose)
-                print_progress(++count, total);
+            mpz_set(sh.ybars[o], cache[c->outputs.buf[o]]);
         }
-        mpz_vect_clear(ybars, noutputs);
         mpz_vect_clear(xs, c->ninputs);
-        mpz_vect_clear(tmp, ninputs + 3);
         for (size_t i = 0; i < acirc_nrefs(c); ++i) {
             if (known[i])
                 mpz_clear(cache[i]);
         }
     }
 
-    mpz_vect_clear(rs, ninputs + 3);
-    for (size_t k = 0; k < ninputs; k++) {
-        for (size_t j = 0; j < d; j++)
-            mpz_clear(ykj[k][j]);
-    }
-    mpz_vect_clear(ykjc, nconsts);
-    for (size_t k = 0; k < ninputs; k++) {
-        mpz_vect_clear(whatk[k], ninputs + 3);
-    }
-    mpz_vect_clear(what, ninputs + 3);
+    if (g_verbose)
+        print_progress(sh.count, sh.total);
+
+    /* Each job draws from its own generator, seeded from rng in a fixed
+     * order, so the obfuscation does not depend on the number of threads */
+    __encode(pool, &sh, JOB_ZSTAR, 0, 0, 0, rng);
+    for (size_t k = 0; k < ninputs; k++)
+        for (size_t s = 0; s < q; s++)
+            __encode(pool, &sh, JOB_KS, k, s, 0, rng);
+    __encode(pool, &sh, JOB_C, 0, 0, 0, rng);
+    for (size_t o = 0; o < noutputs; o++)
+        __encode(pool, &sh, JOB_O, 0, 0, o, rng);
+
+    threadpool_destroy(pool);
+    pthread_mutex_destroy(&sh.count_lock);
+
+    mpz_vect_free(sh.ybars, noutputs);
+    mpz_vect_free(sh.tmp, ninputs + 3);
+    mpz_vect_free(sh.what, ninputs + 3);
+    mpz_vect_free(sh.whatk, ninputs * (ninputs + 3));
+    mpz_vect_free(sh.ykjc, nconsts);
+    mpz_vect_free(sh.ykj, ninputs * d);
     mpz_vect_free(moduli, obf->mmap->sk->nslots(obf->sp->sk));
 
     return obf;
 }
 
+/* Each (k, s) symbol slice is stored contiguously so it can be loaded lazily */
+static void
+_fwrite_slice(const obfuscation *obf, size_t k, size_t s, FILE *fp)
+{
+    const circ_params_t *cp = &obf->op->cp;
+    const size_t ninputs = cp->n - (cp->circ->consts.n ? 1 : 0);
+    const size_t d = array_max(cp->ds, ninputs);
+
+    encoding_fwrite(obf->enc_vt, obf->Rks[k][s], fp);
+    for (size_t j = 0; j < d; j++)
+        encoding_fwrite(obf->enc_vt, obf->Zksj[k][s][j], fp);
+    for (size_t o = 0; o < cp->m; o++) {
+        encoding_fwrite(obf->enc_vt, obf->Rhatkso[k][s][o], fp);
+        encoding_fwrite(obf->enc_vt, obf->Zhatkso[k][s][o], fp);
+    }
+}
+
+static void
+_clear_slice(const obfuscation *obf, size_t k, size_t s)
+{
+    const circ_params_t *cp = &obf->op->cp;
+    const size_t ninputs = cp->n - (cp->circ->consts.n ? 1 : 0);
+    const size_t d = array_max(cp->ds, ninputs);
+
+    encoding_free(obf->enc_vt, obf->Rks[k][s]);
+    obf->Rks[k][s] = NULL;
+    for (size_t j = 0; j < d; j++) {
+        encoding_free(obf->enc_vt, obf->Zksj[k][s][j]);
+        obf->Zksj[k][s][j] = NULL;
+    }
+    for (size_t o = 0; o < cp->m; o++) {
+        encoding_free(obf->enc_vt, obf->Rhatkso[k][s][o]);
+        encoding_free(obf->enc_vt, obf->Zhatkso[k][s][o]);
+        obf->Rhatkso[k][s][o] = obf->Zhatkso[k][s][o] = NULL;
+    }
+}
+
+static int
+_fread_slice(const obfuscation *obf, size_t k, size_t s, FILE *fp)
+{
+    const circ_params_t *cp = &obf->op->cp;
+    const size_t ninputs = cp->n - (cp->circ->consts.n ? 1 : 0);
+    const size_t d = array_max(cp->ds, ninputs);
+
+    if ((obf->Rks[k][s] = encoding_fread(obf->enc_vt, fp)) == NULL)
+        goto error;
+    for (size_t j = 0; j < d; j++)
+        if ((obf->Zksj[k][s][j] = encoding_fread(obf->enc_vt, fp)) == NULL)
+            goto error;
+    for (size_t o = 0; o < cp->m; o++) {
+        if ((obf->Rhatkso[k][s][o] = encoding_fread(obf->enc_vt, fp)) == NULL)
+            goto error;
+        if ((obf->Zhatkso[k][s][o] = encoding_fread(obf->enc_vt, fp)) == NULL)
+            goto error;
+    }
+    return OK;
+error:
+    fprintf(stderr, "error: reading encodings of input %lu, symbol %lu failed\n",
+            k, s);
+    _clear_slice(obf, k, s);
+    return ERR;
+}
+
 static int
 _fwrite(const obfuscation *obf, FILE *fp)
 {
@@ -593,34 +714,17 @@ _fwrite(const obfuscation *obf, FILE *fp)
     const size_t ninputs = cp->n - has_consts;
     const size_t noutputs = cp->m;
     const size_t q = array_max(cp->qs, ninputs);
-    const size_t d = array_max(cp->ds, ninputs);
+    obf_index *index;
+    int ret;
 
+    if ((index = obf_index_fwrite_begin(ninputs * q, fp)) == NULL)
+        return ERR;
     public_params_fwrite(obf->pp_vt, obf->pp, fp);
     encoding_fwrite(obf->enc_vt, obf->Zstar, fp);
-    for (size_t k = 0; k < ninputs; k++) {
-        for (size_t s = 0; s < q; s++) {
-            encoding_fwrite(obf->enc_vt, obf->Rks[k][s], fp);
-        }
-    }
-    for (size_t k = 0; k < ninputs; k++) {
-        for (size_t s = 0; s < q; s++) {
-            for (size_t j = 0; j < d; j++) {
-                encoding_fwrite(obf->enc_vt, obf->Zksj[k][s][j], fp);
-            }
-        }
-    }
     encoding_fwrite(obf->enc_vt, obf->Rc, fp);
     for (size_t j = 0; j < nconsts; j++) {
         encoding_fwrite(obf->enc_vt, obf->Zcj[j], fp);
     }
-    for (size_t k = 0; k < ninputs; k++) {
-        for (size_t s = 0; s < q; s++) {
-            for (size_t o = 0; o < noutputs; o++) {
-                encoding_fwrite(obf->enc_vt, obf->Rhatkso[k][s][o], fp);
-                encoding_fwrite(obf->enc_vt, obf->Zhatkso[k][s][o], fp);
-            }
-        }
-    }
     for (size_t o = 0; o < noutputs; o++) {
         encoding_fwrite(obf->enc_vt, obf->Rhato[o], fp);
         encoding_fwrite(obf->enc_vt, obf->Zhato[o], fp);
@@ -629,13 +733,54 @@ _fwrite(const obfuscation *obf, FILE *fp)
         encoding_fwrite(obf->enc_vt, obf->Rbaro[o], fp);
         encoding_fwrite(obf->enc_vt, obf->Zbaro[o], fp);
     }
-    return OK;
+    for (size_t k = 0; k < ninputs; k++) {
+        for (size_t s = 0; s < q; s++) {
+            obf_index_mark(index, k * q + s, fp);
+            _fwrite_slice(obf, k, s, fp);
+        }
+    }
+    ret = obf_index_fwrite_end(index, fp);
+    obf_index_free(index);
+    return ret;
+}
+
+static int
+_load_slice(size_t slice, FILE *fp, const void *vargs)
+{
+    const obfuscation *const obf = vargs;
+    const circ_params_t *cp = &obf->op->cp;
+    const size_t q = array_max(cp->qs, cp->n - (cp->circ->consts.n ? 1 : 0));
+
+    return _fread_slice(obf, slice / q, slice % q, fp);
+}
+
+/* Materializes the encodings for the chosen symbol of each input */
+static int
+_load_inputs(const obfuscation *obf, const int *syms, size_t ninputs,
+             size_t nthreads)
+{
+    const circ_params_t *cp = &obf->op->cp;
+    const size_t q = array_max(cp->qs, ninputs);
+    size_t slices[ninputs];
+
+    if (obf->index == NULL)
+        return OK;
+    for (size_t k = 0; k < ninputs; k++)
+        slices[k] = k * q + syms[k];
+    return obf_index_load_many(obf->index, slices, ninputs, _load_slice, obf,
+                               nthreads);
 }
 
 static obfuscation *
-_fread(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp)
+_fread(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp,
+       const eval_ctx *ctx)
 {
     obfuscation *obf;
+    bool legacy;
+
+    /* The bulk of the encodings are loaded lazily, in parallel, by
+     * _load_inputs */
+    (void) ctx;
 
     if ((obf = _alloc(mmap, op)) == NULL)
         return NULL;
@@ -648,36 +793,59 @@ _fread(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp)
     const size_t q = array_max(cp->qs, ninputs);
     const size_t d = array_max(cp->ds, ninputs);
 
-    obf->pp = public_params_fread(obf->pp_vt, op, fp);
-    obf->Zstar = encoding_fread(obf->enc_vt, fp);
-    for (size_t k = 0; k < ninputs; k++)
-        for (size_t s = 0; s < q; s++)
-            obf->Rks[k][s] = encoding_fread(obf->enc_vt, fp);
-    for (size_t k = 0; k < ninputs; k++)
-        for (size_t s = 0; s < q; s++)
-            for (size_t j = 0; j < d; j++)
-                obf->Zksj[k][s][j] = encoding_fread(obf->enc_vt, fp);
-    obf->Rc = encoding_fread(obf->enc_vt, fp);
+    obf->index = obf_index_fread(ninputs * q, fp, &legacy);
+    if (obf->index == NULL && !legacy)
+        goto error;
+    if ((obf->pp = public_params_fread(obf->pp_vt, op, fp)) == NULL)
+        goto error;
+    if ((obf->Zstar = encoding_fread(obf->enc_vt, fp)) == NULL)
+        goto error;
+    if (legacy) {
+        for (size_t k = 0; k < ninputs; k++)
+            for (size_t s = 0; s < q; s++)
+                if ((obf->Rks[k][s] = encoding_fread(obf->enc_vt, fp)) == NULL)
+                    goto error;
+        for (size_t k = 0; k < ninputs; k++)
+            for (size_t s = 0; s < q; s++)
+                for (size_t j = 0; j < d; j++)
+                    if ((obf->Zksj[k][s][j] = encoding_fread(obf->enc_vt, fp)) == NULL)
+                        goto error;
+    }
+    if ((obf->Rc = encoding_fread(obf->enc_vt, fp)) == NULL)
+        goto error;
     for (size_t j = 0; j < nconsts; j++)
-        obf->Zcj[j] = encoding_fread(obf->enc_vt, fp);
-    for (size_t k = 0; k < ninputs; k++) {
-        for (size_t s = 0; s < q; s++) {
-            for (size_t o = 0; o < noutputs; o++) {
-                obf->Rhatkso[k][s][o] = encoding_fread(obf->enc_vt, fp);
-                obf->Zhatkso[k][s][o] = encoding_fread(obf->enc_vt, fp);
+        if ((obf->Zcj[j] = encoding_fread(obf->enc_vt, fp)) == NULL)
+            goto error;
+    if (legacy) {
+        for (size_t k = 0; k < ninputs; k++) {
+            for (size_t s = 0; s < q; s++) {
+                for (size_t o = 0; o < noutputs; o++) {
+                    if ((obf->Rhatkso[k][s][o] = encoding_fread(obf->enc_vt, fp)) == NULL)
+                        goto error;
+                    if ((obf->Zhatkso[k][s][o] = encoding_fread(obf->enc_vt, fp)) == NULL)
+                        goto error;
+                }
             }
         }
     }
     for (size_t o = 0; o < noutputs; o++) {
-        obf->Rhato[o] = encoding_fread(obf->enc_vt, fp);
-        obf->Zhato[o] = encoding_fread(obf->enc_vt, fp);
+        if ((obf->Rhato[o] = encoding_fread(obf->enc_vt, fp)) == NULL)
+            goto error;
+        if ((obf->Zhato[o] = encoding_fread(obf->enc_vt, fp)) == NULL)
+            goto error;
     }
     for (size_t o = 0; o < noutputs; o++) {
-        obf->Rbaro[o] = encoding_fread(obf->enc_vt, fp);
-        obf->Zbaro[o] = encoding_fread(obf->enc_vt, fp);
+        if ((obf->Rbaro[o] = encoding_fread(obf->enc_vt, fp)) == NULL)
+            goto error;
+        if ((obf->Zbaro[o] = encoding_fread(obf->enc_vt, fp)) == NULL)
+            goto error;
     }
 
     return obf;
+error:
+    fprintf(stderr, "error: reading obfuscation failed\n");
+    _free(obf);
+    return NULL;
 }
 
 typedef struct {
@@ -704,21 +872,32 @@ wire_init(const encoding_vtable *vt, const pp_vtable *pp_vt,
     rop->my_z = init_z;
 }
 
+static size_t
+level_degree(const circ_params_t *cp, const level *lvl)
+{
+    const size_t ninputs = cp->n - (cp->circ->consts.n ? 1 : 0);
+    const size_t nsymbols = array_max(cp->qs, ninputs);
+    return lvl->mat[nsymbols][ninputs + 1];
+}
+
+static size_t
+wire_degree(const encoding_vtable *vt, const pp_vtable *pp_vt,
+            const public_params *pp, const encoding *z)
+{
+    const obf_params_t *op = pp_vt->params(pp);
+    return level_degree(&op->cp, vt->mmap_set(z));
+}
+
 static void
 wire_init_from_encodings(const encoding_vtable *vt, const pp_vtable *pp_vt,
                          wire *rop, const public_params *pp,
                          encoding *r, encoding *z)
 {
-    const obf_params_t *op = pp_vt->params(pp);
-    const circ_params_t *cp = &op->cp;
-    const size_t ninputs = cp->n - (cp->circ->consts.n ? 1 : 0);
-    const size_t nsymbols = array_max(cp->qs, ninputs);
-    const level *lvl = vt->mmap_set(z);
     rop->r = r;
     rop->z = z;
     rop->my_r = false;
     rop->my_z = false;
-    rop->d = lvl->mat[nsymbols][ninputs + 1];
+    rop->d = wire_degree(vt, pp_vt, pp, z);
 }
 
 static void
@@ -759,18 +938,57 @@ wire_mul(const encoding_vtable *vt, const pp_vtable *pp_vt,
 }
 
 
+/* Per-evaluation table of the powers of Zstar that adding wires of different
+ * degrees multiplies by, as a raise table with a single symbol whose powers
+ * are Zstar^{2^p}, squared up to the top degree D */
+static raise_table *
+zstar_table_new(const obfuscation *obf)
+{
+    const size_t D = obf->op->D ? obf->op->D : 1;
+    size_t npowers = 1;
+    encoding **powers;
+    raise_table *t;
+
+    while (((size_t) 1 << npowers) <= D)
+        npowers++;
+    powers = my_calloc(npowers, sizeof powers[0]);
+    powers[0] = obf->Zstar;     /* not ours */
+    for (size_t p = 1; p < npowers; ++p) {
+        powers[p] = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
+        encoding_mul(obf->enc_vt, obf->pp_vt, powers[p], powers[p - 1],
+                     powers[p - 1], obf->pp);
+    }
+    t = raise_table_new(obf->enc_vt, obf->pp_vt, obf->pp, 1, npowers, D + 1);
+    raise_table_set(t, 0, powers, D);
+    return t;
+}
+
+static void
+zstar_table_free(raise_table *t)
+{
+    encoding **powers;
+
+    if (t == NULL)
+        return;
+    powers = t->syms[0].powers;
+    for (size_t p = 1; p < t->npowers; ++p)
+        encoding_free(t->enc_vt, powers[p]);
+    free(powers);
+    raise_table_free(t);
+}
+
 static int
 wire_add(const encoding_vtable *vt, const pp_vtable *pp_vt,
          wire *rop, const wire *x, const wire *y,
-         const obfuscation *obf, const public_params *pp)
+         raise_eval *zstars, const public_params *pp)
 {
     int ret = ERR;
     if (x->d > y->d) {
-        if (wire_add(vt, pp_vt, rop, y, x, obf, pp) == ERR)
+        if (wire_add(vt, pp_vt, rop, y, x, zstars, pp) == ERR)
             return ERR;
         ret = OK;
     } else {
-        encoding *zstar, *tmp;
+        encoding *tmp;
         size_t d = y->d - x->d;
 
         if (encoding_mul(vt, pp_vt, rop->r, x->r, y->r, pp) == ERR)
@@ -778,24 +996,10 @@ wire_add(const encoding_vtable *vt, const pp_vtable *pp_vt,
 
         tmp = encoding_new(vt, pp_vt, pp);
 
-        if (d > 1) {
-            /* Compute Zstar^d */
-            zstar = encoding_new(vt, pp_vt, pp);
-            if (encoding_mul(vt, pp_vt, zstar, obf->Zstar, obf->Zstar, pp) == ERR)
-                goto cleanup;
-            for (size_t j = 2; j < d; j++) {
-                if (encoding_mul(vt, pp_vt, zstar, zstar, obf->Zstar, pp) == ERR)
-                    goto cleanup;
-            }
-        } else {
-            zstar = obf->Zstar;
-        }
-
         if (encoding_mul(vt, pp_vt, rop->z, x->z, y->r, pp) == ERR)
             goto cleanup;
-        if (d > 0)
-            if (encoding_mul(vt, pp_vt, rop->z, rop->z, zstar, pp) == ERR)
-                goto cleanup;
+        if (raise_eval_raise(zstars, rop->z, 0, d) == ERR)
+            goto cleanup;
         if (encoding_mul(vt, pp_vt, tmp, y->z, x->r, pp) == ERR)
             goto cleanup;
         if (encoding_add(vt, pp_vt, rop->z, rop->z, tmp, pp) == ERR)
@@ -805,9 +1009,6 @@ wire_add(const encoding_vtable *vt, const pp_vtable *pp_vt,
 
         ret = OK;
     cleanup:
-        if (d > 1) {
-            encoding_free(vt, zstar);
-        }
         encoding_free(vt, tmp);
     }
     return ret;
@@ -816,31 +1017,19 @@ wire_add(const encoding_vtable *vt, const pp_vtable *pp_vt,
 static int
 wire_sub(const encoding_vtable *vt, const pp_vtable *pp_vt,
          wire *rop, const wire *x, const wire *y,
-         const obfuscation *obf, const public_params *pp)
+         raise_eval *zstars, const public_params *pp)
 {
     size_t d = abs((int) y->d - (int) x->d);
-    encoding *zstar, *tmp;
+    encoding *tmp;
     int ret = ERR;
 
-    if (d > 1) {
-        zstar = encoding_new(vt, pp_vt, pp);
-        if (encoding_mul(vt, pp_vt, zstar, obf->Zstar, obf->Zstar, pp) == ERR)
-            goto cleanup;
-        for (size_t j = 2; j < d; j++)
-            if (encoding_mul(vt, pp_vt, zstar, zstar, obf->Zstar, pp) == ERR)
-                goto cleanup;
-    } else {
-        zstar = obf->Zstar;
-    }
-
     tmp = encoding_new(vt, pp_vt, pp);
 
     if (x->d <= y->d) {
         if (encoding_mul(vt, pp_vt, rop->z, x->z, y->r, pp) == ERR)
             goto cleanup;
-        if (d > 0)
-            if (encoding_mul(vt, pp_vt, rop->z, rop->z, zstar, pp) == ERR)
-                goto cleanup;
+        if (raise_eval_raise(zstars, rop->z, 0, d) == ERR)
+            goto cleanup;
         if (encoding_mul(vt, pp_vt, tmp, y->z, x->r, pp) == ERR)
             goto cleanup;
         if (encoding_sub(vt, pp_vt, rop->z, rop->z, tmp, pp) == ERR)
@@ -851,9 +1040,8 @@ wire_sub(const encoding_vtable *vt, const pp_vtable *pp_vt,
             goto cleanup;
         if (encoding_mul(vt, pp_vt, tmp, y->z, x->r, pp) == ERR)
             goto cleanup;
-        if (d > 0)
-            if (encoding_mul(vt, pp_vt, tmp, tmp, zstar, pp) == ERR)
-                goto cleanup;
+        if (raise_eval_raise(zstars, tmp, 0, d) == ERR)
+            goto cleanup;
         if (encoding_sub(vt, pp_vt, rop->z, rop->z, tmp, pp) == ERR)
             goto cleanup;
         rop->d = x->d;
@@ -863,8 +1051,6 @@ wire_sub(const encoding_vtable *vt, const pp_vtable *pp_vt,
 
     ret = OK;
 cleanup:
-    if (d > 1)
-        encoding_free(vt, zstar);
     encoding_free(vt, tmp);
     return ret;
 }
@@ -872,36 +1058,26 @@ cleanup:
 static int
 wire_constrained_add(const encoding_vtable *vt, const pp_vtable *pp_vt,
                      wire *rop, const wire *x, const wire *y,
-                     const obfuscation *obf, const public_params *pp)
+                     raise_eval *zstars, const public_params *pp)
 {
     if (x->d > y->d) {
-        if (wire_constrained_add(vt, pp_vt, rop, y, x, obf, pp) == ERR)
+        if (wire_constrained_add(vt, pp_vt, rop, y, x, zstars, pp) == ERR)
             return ERR;
         return OK;
     } else {
         size_t d = y->d - x->d;
-        encoding *zstar;
-
-        if (d > 1) {
-            zstar = encoding_new(vt, pp_vt, pp);
-            encoding_mul(vt, pp_vt, zstar, obf->Zstar, obf->Zstar, pp);
-            for (size_t j = 2; j < d; j++)
-                encoding_mul(vt, pp_vt, zstar, zstar, obf->Zstar, pp);
-        } else {
-            zstar = obf->Zstar;
-        }
 
         if (d > 0) {
-            encoding_mul(vt, pp_vt, rop->z, x->z, zstar, pp);
+            encoding_set(vt, rop->z, x->z);
+            if (raise_eval_raise(zstars, rop->z, 0, d) == ERR)
+                return ERR;
             encoding_add(vt, pp_vt, rop->z, rop->z, y->z, pp);
         } else {
             encoding_add(vt, pp_vt, rop->z, x->z, y->z, pp);
         }
-        rop->r = x->r;
+        /* Copy r rather than alias x's, so x can be released early */
+        encoding_set(vt, rop->r, x->r);
         rop->d = y->d;
-
-        if (d > 1)
-            encoding_free(vt, zstar);
     }
     return OK;
 }
@@ -909,22 +1085,15 @@ wire_constrained_add(const encoding_vtable *vt, const pp_vtable *pp_vt,
 static int
 wire_constrained_sub(const encoding_vtable *vt, const pp_vtable *pp_vt,
                      wire *rop, const wire *x, const wire *y,
-                     const obfuscation *obf, const public_params *pp)
+                     raise_eval *zstars, const public_params *pp)
 {
     size_t d = abs((int) y->d - (int) x->d);
-    encoding *zstar;
-    if (d > 1) {
-        zstar = encoding_new(vt, pp_vt, pp);
-        encoding_mul(vt, pp_vt, zstar, obf->Zstar, obf->Zstar, pp);
-        for (size_t j = 2; j < d; j++)
-            encoding_mul(vt, pp_vt, zstar, zstar, obf->Zstar, pp);
-    } else {
-        zstar = obf->Zstar;
-    }
 
     if (x->d <= y->d) {
         if (d > 0) {
-            encoding_mul(vt, pp_vt, rop->z, x->z, zstar, pp);
+            encoding_set(vt, rop->z, x->z);
+            if (raise_eval_raise(zstars, rop->z, 0, d) == ERR)
+                return ERR;
             encoding_sub(vt, pp_vt, rop->z, rop->z, y->z, pp);
         } else {
             encoding_sub(vt, pp_vt, rop->z, x->z, y->z, pp);
@@ -934,15 +1103,16 @@ wire_constrained_sub(const encoding_vtable *vt, const pp_vtable *pp_vt,
         // x->d > y->d && d > 0
         encoding *tmp;
         tmp = encoding_new(vt, pp_vt, pp);
-        encoding_mul(vt, pp_vt, tmp, y->z, zstar, pp);
-        encoding_sub(vt, pp_vt, rop->z, rop->z, tmp, pp);
+        encoding_set(vt, tmp, y->z);
+        if (raise_eval_raise(zstars, tmp, 0, d) == ERR) {
+            encoding_free(vt, tmp);
+            return ERR;
+        }
+        encoding_sub(vt, pp_vt, rop->z, x->z, tmp, pp);
         encoding_free(vt, tmp);
         rop->d = x->d;
     }
-    rop->r = x->r;
-
-    if (d > 1)
-        encoding_free(vt, zstar);
+    encoding_set(vt, rop->r, x->r);
     return OK;
 }
 
@@ -956,21 +1126,15 @@ wire_type_eq(const wire *x, const wire *y)
     return true;
 }
 
-static void
-eval_worker(void *vargs)
+static int
+eval_gate(acircref ref, void *vargs)
 {
     work_args *const wargs = vargs;
-    const acircref ref = wargs->ref;
     const acirc *const c = wargs->c;
     const int *const inputs = wargs->inputs;
     const obfuscation *const obf = wargs->obf;
     bool *const mine = wargs->mine;
-    int *const ready = wargs->ready;
     wire **cache = wargs->cache;
-    ref_list *const deps = wargs->deps;
-    threadpool *const pool = wargs->pool;
-    size_t *const kappas = wargs->kappas;
-    int *const rop = wargs->rop;
 
     const public_params *const pp = obf->pp;
     int ret = OK;
@@ -980,7 +1144,6 @@ eval_worker(void *vargs)
 
     const circ_params_t *cp = &obf->op->cp;
     const size_t ninputs = cp->n - (cp->circ->consts.n ? 1 : 0);
-    const size_t noutputs = cp->m;
 
     wire *const w = my_calloc(1, sizeof w[0]);
     mine[ref] = true;
@@ -1013,21 +1176,21 @@ eval_worker(void *vargs)
             if (wire_mul(obf->enc_vt, obf->pp_vt, w, x, y, pp) == ERR)
                 ret = ERR;
         } else if (wire_type_eq(x, y)) {
-            wire_init(obf->enc_vt, obf->pp_vt, w, pp, false, true);
+            wire_init(obf->enc_vt, obf->pp_vt, w, pp, true, true);
             if (op == OP_ADD) {
-                if (wire_constrained_add(obf->enc_vt, obf->pp_vt, w, x, y, obf, pp) == ERR)
+                if (wire_constrained_add(obf->enc_vt, obf->pp_vt, w, x, y, wargs->zstars, pp) == ERR)
                     ret = ERR;
             } else if (op == OP_SUB) {
-                if (wire_constrained_sub(obf->enc_vt, obf->pp_vt, w, x, y, obf, pp) == ERR)
+                if (wire_constrained_sub(obf->enc_vt, obf->pp_vt, w, x, y, wargs->zstars, pp) == ERR)
                     ret = ERR;
             }
         } else {
             wire_init(obf->enc_vt, obf->pp_vt, w, pp, true, true);
             if (op == OP_ADD) {
-                if (wire_add(obf->enc_vt, obf->pp_vt, w, x, y, obf, pp) == ERR)
+                if (wire_add(obf->enc_vt, obf->pp_vt, w, x, y, wargs->zstars, pp) == ERR)
                     ret = ERR;
             } else if (op == OP_SUB) {
-                if (wire_sub(obf->enc_vt, obf->pp_vt, w, x, y, obf, pp) == ERR)
+                if (wire_sub(obf->enc_vt, obf->pp_vt, w, x, y, wargs->zstars, pp) == ERR)
                     ret = ERR;
             }
         }
@@ -1039,67 +1202,103 @@ eval_worker(void *vargs)
     }
 
     assert(ret == OK);
+    return OK;
+}
 
-    ref_list_node *node = &deps->refs[ref];
-    for (size_t i = 0; i < node->cur; ++i) {
-        const int num = __sync_add_and_fetch(&ready[node->refs[i]], 1);
-        if (num == 2) {
-            work_args *newargs = my_calloc(1, sizeof newargs[0]);
-            memcpy(newargs, wargs, sizeof newargs[0]);
-            newargs->ref = node->refs[i];
-            threadpool_add_job(pool, eval_worker, newargs);
-        }
-    }
+/* Trees for the R and Z parts of output o's consistency checks, the product
+ * of \hat R_{k,s_k,o} (resp. \hat Z) over the inputs and \hat R_o.  These only
+ * depend on the input, so can be computed alongside the circuit. */
+static void
+output_trees(const obfuscation *obf, const int *inputs, size_t o,
+             prodtree **rprod, prodtree **zprod)
+{
+    const circ_params_t *cp = &obf->op->cp;
+    const size_t ninputs = cp->n - (cp->circ->consts.n ? 1 : 0);
 
-    free(wargs);
-    
-    ssize_t output = -1;
-    for (size_t i = 0; i < noutputs; i++) {
-        if (ref == c->outputs.buf[i]) {
-            output = i;
-            break;
-        }
+    *rprod = prodtree_new(obf->enc_vt, obf->pp_vt, obf->pp, ninputs + 1);
+    *zprod = prodtree_new(obf->enc_vt, obf->pp_vt, obf->pp, ninputs + 1);
+    for (size_t k = 0; k < ninputs; k++) {
+        prodtree_set(*rprod, k, obf->Rhatkso[k][inputs[k]][o]);
+        prodtree_set(*zprod, k, obf->Zhatkso[k][inputs[k]][o]);
     }
+    prodtree_set(*rprod, ninputs, obf->Rhato[o]);
+    prodtree_set(*zprod, ninputs, obf->Zhato[o]);
+}
 
-    if (output != -1) {
-        wire tmp[1], outwire[1];
-        wire_copy(obf->enc_vt, obf->pp_vt, outwire, cache[ref], pp);
+static void
+zero_test(const obfuscation *obf, raise_eval *zstars, const wire *res,
+          const prodtree *rprod, const prodtree *zprod, size_t o, int *rop,
+          size_t *kappa)
+{
+    const public_params *const pp = obf->pp;
+    wire tmp[1], outwire[1];
+
+    // input and output consistency
+    wire_init(obf->enc_vt, obf->pp_vt, outwire, pp, true, true);
+    encoding_mul(obf->enc_vt, obf->pp_vt, outwire->r, res->r,
+                 prodtree_root(rprod), pp);
+    encoding_mul(obf->enc_vt, obf->pp_vt, outwire->z, res->z,
+                 prodtree_root(zprod), pp);
+    outwire->d = res->d + wire_degree(obf->enc_vt, obf->pp_vt, pp,
+                                      prodtree_root(zprod));
+
+    // authentication
+    wire_init_from_encodings(obf->enc_vt, obf->pp_vt, tmp, pp,
+                             obf->Rbaro[o], obf->Zbaro[o]);
+    wire_sub(obf->enc_vt, obf->pp_vt, outwire, outwire, tmp, zstars, pp);
+
+    *rop = encoding_is_zero(obf->enc_vt, obf->pp_vt, outwire->z, pp);
+    if (*rop == ERR) {
+        fprintf(stderr, "error: iszero check failed\n");
+        *rop = 1;
+    }
+    if (kappa)
+        *kappa = encoding_get_degree(obf->enc_vt, outwire->z);
 
-        // input consistency
-        for (size_t k = 0; k < ninputs; k++) {
-            wire_init_from_encodings(obf->enc_vt, obf->pp_vt, tmp, pp,
-                                     obf->Rhatkso[k][inputs[k]][output],
-                                     obf->Zhatkso[k][inputs[k]][output]);
-            wire_mul(obf->enc_vt, obf->pp_vt, outwire, outwire, tmp, pp);
-        }
+    wire_clear(obf->enc_vt, tmp);
+    wire_clear(obf->enc_vt, outwire);
+}
 
-        // output consistency
-        wire_init_from_encodings(obf->enc_vt, obf->pp_vt, tmp, pp,
-                                 obf->Rhato[output], obf->Zhato[output]);
-        wire_mul(obf->enc_vt, obf->pp_vt, outwire, outwire, tmp, pp);
+typedef struct {
+    const obfuscation *obf;
+    raise_eval *zstars;
+    const wire *res;
+    const prodtree *rprod;
+    const prodtree *zprod;
+    size_t o;
+    int *rop;
+    size_t *kappa;
+} zero_test_args;
 
-        // authentication
-        wire_init_from_encodings(obf->enc_vt, obf->pp_vt, tmp, pp,
-                                 obf->Rbaro[output], obf->Zbaro[output]);
-        wire_sub(obf->enc_vt, obf->pp_vt, outwire, outwire, tmp, obf, pp);
+static void
+zero_test_worker(void *vargs)
+{
+    zero_test_args *const args = vargs;
+    zero_test(args->obf, args->zstars, args->res, args->rprod, args->zprod,
+              args->o, args->rop, args->kappa);
+    free(args);
+}
 
-        rop[output] = encoding_is_zero(obf->enc_vt, obf->pp_vt, outwire->z, pp);
-        if (rop[output] == ERR) {
-            fprintf(stderr, "error: iszero check failed\n");
-            rop[output] = 1;
-        }
-        if (kappas)
-            kappas[output] = encoding_get_degree(obf->enc_vt, outwire->z);
+static void
+release_gate(acircref ref, void *vargs)
+{
+    work_args *const wargs = vargs;
+    wire **cache = wargs->cache;
 
-        wire_clear(obf->enc_vt, tmp);
-        wire_clear(obf->enc_vt, outwire);
+    /* Outputs are zero-tested once the circuit is done */
+    if (wargs->obf->op->cp.sched->output[ref] != -1)
+        return;
+    if (wargs->mine[ref]) {
+        wire_clear(wargs->obf->enc_vt, cache[ref]);
+        free(cache[ref]);
+        cache[ref] = NULL;
+        wargs->mine[ref] = false;
     }
 }
 
-
 static int
 _evaluate(const obfuscation *obf, int *outputs, size_t noutputs,
-          const int *inputs, size_t ninputs, size_t nthreads,
+          const int *inputs, size_t ninputs, const eval_ctx *ctx,
           size_t *kappa, size_t *max_npowers)
 {
     (void) max_npowers;
@@ -1119,35 +1318,72 @@ _evaluate(const obfuscation *obf, int *outputs, size_t noutputs,
 
     wire **cache = my_calloc(acirc_nrefs(c), sizeof cache[0]);
     bool *mine = my_calloc(acirc_nrefs(c), sizeof mine[0]);
-    int *ready = my_calloc(acirc_nrefs(c), sizeof ready[0]);
     size_t *kappas = my_calloc(noutputs, sizeof kappas[0]);
     int *input_syms = get_input_syms(inputs, c->ninputs, obf->op->rchunker,
                                      cp->n - has_consts, ell, q, obf->op->sigma);
-    ref_list *deps = ref_list_new(c);
-    threadpool *pool = threadpool_create(nthreads);
+    prodtree **rprods = my_calloc(noutputs, sizeof rprods[0]);
+    prodtree **zprods = my_calloc(noutputs, sizeof zprods[0]);
+    raise_table *zstars = NULL;
+    raise_eval zeval;
+    sched_jobs jobs;
+    work_args args;
+    int ret = ERR;
+
+    sched_jobs_init(&jobs, ctx);
+    if (input_syms == NULL || cp->sched == NULL)
+        goto finish;
+    if (_load_inputs(obf, input_syms, cp->n - has_consts, ctx->nthreads) == ERR)
+        goto finish;
 
-    for (size_t ref = 0; ref < acirc_nrefs(c); ref++) {
-        acirc_operation op = c->gates.gates[ref].op;
-        if (!(op == OP_INPUT || op == OP_CONST))
-            continue;
-        work_args *args = calloc(1, sizeof args[0]);
-        args->mmap   = obf->mmap;
-        args->ref    = ref;
-        args->c      = c;
-        args->inputs = input_syms;
-        args->obf    = obf;
-        args->mine   = mine;
-        args->ready  = ready;
-        args->cache  = cache;
-        args->deps   = deps;
-        args->pool   = pool;
-        args->rop    = outputs;
-        args->kappas = kappas;
-        threadpool_add_job(pool, eval_worker, args);
+    /* Start on the consistency products, which don't need the circuit */
+    for (size_t o = 0; o < noutputs; o++) {
+        if (cp->sched->output[c->outputs.buf[o]] == -1)
+            continue;           /* pruned from the schedule */
+        output_trees(obf, input_syms, o, &rprods[o], &zprods[o]);
+        if (jobs.pool) {
+            prodtree_update_async(rprods[o], &jobs);
+            prodtree_update_async(zprods[o], &jobs);
+        }
     }
 
-    threadpool_destroy(pool);
+    args.mmap   = obf->mmap;
+    args.c      = c;
+    args.inputs = input_syms;
+    args.obf    = obf;
+    args.mine   = mine;
+    args.cache  = cache;
+    zstars = zstar_table_new(obf);
+    raise_eval_init(&zeval, zstars);
+    args.zstars = &zeval;
+    ret = sched_run_ctx(cp->sched, eval_gate, release_gate, &args, ctx);
+    if (jobs.pool) {
+        sched_jobs_wait(&jobs);
+    } else {
+        for (size_t o = 0; o < noutputs; o++) {
+            if (rprods[o] == NULL)
+                continue;
+            prodtree_update(rprods[o]);
+            prodtree_update(zprods[o]);
+        }
+    }
+    for (size_t o = 0; o < noutputs; o++) {
+        zero_test_args *zargs;
+        if (ret != OK || cache[c->outputs.buf[o]] == NULL)
+            continue;           /* pruned from the schedule */
+        zargs = my_calloc(1, sizeof zargs[0]);
+        zargs->obf = obf;
+        zargs->zstars = &zeval;
+        zargs->res = cache[c->outputs.buf[o]];
+        zargs->rprod = rprods[o];
+        zargs->zprod = zprods[o];
+        zargs->o = o;
+        zargs->rop = &outputs[o];
+        zargs->kappa = &kappas[o];
+        sched_jobs_add(&jobs, zero_test_worker, zargs);
+    }
 
+finish:
+    sched_jobs_clear(&jobs);
     if (kappa) {
         unsigned int maxkappa = 0;
         for (size_t i = 0; i < noutputs; i++) {
@@ -1163,20 +1399,339 @@ _evaluate(const obfuscation *obf, int *outputs, size_t noutputs,
             free(cache[i]);
         }
     }
-    ref_list_free(deps, c);
+    for (size_t o = 0; o < noutputs; o++) {
+        prodtree_free(rprods[o]);
+        prodtree_free(zprods[o]);
+    }
+    free(rprods);
+    free(zprods);
+    zstar_table_free(zstars);
     free(cache);
     free(mine);
-    free(ready);
     free(kappas);
     free(input_syms);
 
+    return ret;
+}
+
+/* What evaluation knows of an encoding without computing it: its (interned)
+ * level and the degree the mmap would report */
+typedef struct {
+    level *lvl;
+    size_t deg;
+} sym_enc;
+
+typedef struct {
+    sym_enc r;
+    sym_enc z;
+    size_t d;
+} sym_wire;
+
+/* Takes over the reference to lvl */
+static void
+sym_set(sym_enc *rop, level *lvl, size_t deg)
+{
+    if (rop->lvl)
+        level_release(rop->lvl);
+    rop->lvl = lvl;
+    rop->deg = deg;
+}
+
+/* Interns a scratch level as a fresh encoding's, freeing it */
+static void
+sym_encode(sym_enc *rop, level *lvl)
+{
+    sym_set(rop, level_intern(lvl), 1);
+    level_free(lvl);
+}
+
+static void
+sym_mul(sym_enc *rop, const sym_enc *x, const sym_enc *y)
+{
+    sym_set(rop, level_intern_add(x->lvl, y->lvl), x->deg + y->deg);
+}
+
+/* Sums and differences keep x's level */
+static void
+sym_add(sym_enc *rop, const sym_enc *x, const sym_enc *y)
+{
+    sym_set(rop, level_ref(x->lvl), x->deg > y->deg ? x->deg : y->deg);
+}
+
+static void
+sym_mul_zstar(sym_enc *rop, const sym_enc *zstar, size_t d)
+{
+    for (size_t j = 0; j < d; j++)
+        sym_mul(rop, rop, zstar);
+}
+
+static void
+sym_wire_clear(sym_wire *w)
+{
+    sym_set(&w->r, NULL, 0);
+    sym_set(&w->z, NULL, 0);
+}
+
+/* The sym_wire_* functions follow their wire_* counterparts, into a fresh rop */
+static void
+sym_wire_mul(sym_wire *rop, const sym_wire *x, const sym_wire *y)
+{
+    sym_mul(&rop->r, &x->r, &y->r);
+    sym_mul(&rop->z, &x->z, &y->z);
+    rop->d = x->d + y->d;
+}
+
+static void
+sym_wire_add(sym_wire *rop, const sym_wire *x, const sym_wire *y,
+             const sym_enc *zstar)
+{
+    sym_enc tmp = { NULL, 0 };
+
+    if (x->d > y->d) {
+        sym_wire_add(rop, y, x, zstar);
+        return;
+    }
+    sym_mul(&rop->r, &x->r, &y->r);
+    sym_mul(&rop->z, &x->z, &y->r);
+    sym_mul_zstar(&rop->z, zstar, y->d - x->d);
+    sym_mul(&tmp, &y->z, &x->r);
+    sym_add(&rop->z, &rop->z, &tmp);
+    rop->d = y->d;
+    sym_set(&tmp, NULL, 0);
+}
+
+static void
+sym_wire_sub(sym_wire *rop, const sym_wire *x, const sym_wire *y,
+             const sym_enc *zstar)
+{
+    sym_enc tmp = { NULL, 0 };
+
+    sym_mul(&rop->z, &x->z, &y->r);
+    sym_mul(&tmp, &y->z, &x->r);
+    if (x->d <= y->d) {
+        sym_mul_zstar(&rop->z, zstar, y->d - x->d);
+        rop->d = y->d;
+    } else {
+        sym_mul_zstar(&tmp, zstar, x->d - y->d);
+        rop->d = x->d;
+    }
+    sym_add(&rop->z, &rop->z, &tmp);
+    sym_mul(&rop->r, &x->r, &y->r);
+    sym_set(&tmp, NULL, 0);
+}
+
+static void
+sym_wire_constrained_add(sym_wire *rop, const sym_wire *x, const sym_wire *y,
+                         const sym_enc *zstar)
+{
+    if (x->d > y->d) {
+        sym_wire_constrained_add(rop, y, x, zstar);
+        return;
+    }
+    sym_set(&rop->z, level_ref(x->z.lvl), x->z.deg);
+    sym_mul_zstar(&rop->z, zstar, y->d - x->d);
+    sym_add(&rop->z, &rop->z, &y->z);
+    sym_set(&rop->r, level_ref(x->r.lvl), x->r.deg);
+    rop->d = y->d;
+}
+
+static void
+sym_wire_constrained_sub(sym_wire *rop, const sym_wire *x, const sym_wire *y,
+                         const sym_enc *zstar)
+{
+    if (x->d <= y->d) {
+        sym_set(&rop->z, level_ref(x->z.lvl), x->z.deg);
+        sym_mul_zstar(&rop->z, zstar, y->d - x->d);
+        sym_add(&rop->z, &rop->z, &y->z);
+        rop->d = y->d;
+    } else {
+        sym_enc tmp = { NULL, 0 };
+        sym_set(&tmp, level_ref(y->z.lvl), y->z.deg);
+        sym_mul_zstar(&tmp, zstar, x->d - y->d);
+        sym_add(&rop->z, &x->z, &tmp);
+        sym_set(&tmp, NULL, 0);
+        rop->d = x->d;
+    }
+    sym_set(&rop->r, level_ref(x->r.lvl), x->r.deg);
+}
+
+static bool
+sym_wire_type_eq(const sym_wire *x, const sym_wire *y)
+{
+    return level_eq(x->r.lvl, y->r.lvl) && level_eq_z(x->z.lvl, y->z.lvl);
+}
+
+/* Sets w to the wire of an encoding pair at levels r and r + extra */
+static void
+sym_wire_encode(const circ_params_t *cp, sym_wire *w, level *r, const level *extra)
+{
+    level *const z = level_new(cp);
+
+    level_add(z, r, extra);
+    sym_encode(&w->r, r);
+    sym_encode(&w->z, z);
+    w->d = level_degree(cp, w->z.lvl);
+}
+
+typedef struct {
+    const obf_params_t *op;
+    const level *vstar;
+    sym_enc zstar;
+    sym_wire *wires;            // [nrefs]
+} kappa_args;
+
+static int
+kappa_gate(acircref ref, void *vargs)
+{
+    kappa_args *const kargs = vargs;
+    const obf_params_t *const op = kargs->op;
+    const circ_params_t *cp = &op->cp;
+    const acirc *const c = cp->circ;
+    const size_t ninputs = cp->n - (c->consts.n ? 1 : 0);
+    const acirc_operation gop = c->gates.gates[ref].op;
+    const acircref *const args = c->gates.gates[ref].args;
+    sym_wire *const w = &kargs->wires[ref];
+
+    switch (gop) {
+    case OP_INPUT: {
+        /* Every symbol's encodings have the same shape, so take s = 0 */
+        const sym_id sym = op->chunker(args[0], c->ninputs, ninputs);
+        sym_wire_encode(cp, w, level_create_vks(cp, sym.sym_number, 0),
+                        kargs->vstar);
+        break;
+    }
+    case OP_CONST:
+        sym_wire_encode(cp, w, level_create_vc(cp), kargs->vstar);
+        break;
+    case OP_ADD: case OP_SUB: case OP_MUL: {
+        const sym_wire *const x = &kargs->wires[args[0]];
+        const sym_wire *const y = &kargs->wires[args[1]];
+
+        if (gop == OP_MUL)
+            sym_wire_mul(w, x, y);
+        else if (sym_wire_type_eq(x, y) && gop == OP_ADD)
+            sym_wire_constrained_add(w, x, y, &kargs->zstar);
+        else if (sym_wire_type_eq(x, y))
+            sym_wire_constrained_sub(w, x, y, &kargs->zstar);
+        else if (gop == OP_ADD)
+            sym_wire_add(w, x, y, &kargs->zstar);
+        else
+            sym_wire_sub(w, x, y, &kargs->zstar);
+        break;
+    }
+    default:
+        fprintf(stderr, "fatal: op not supported\n");
+        abort();
+    }
     return OK;
 }
 
+static void
+kappa_release(acircref ref, void *vargs)
+{
+    kappa_args *const kargs = vargs;
+
+    if (kargs->op->cp.sched->output[ref] != -1)
+        return;
+    sym_wire_clear(&kargs->wires[ref]);
+}
+
+/* Mirrors zero_test on the wire res of output o */
+static size_t
+kappa_zero_test(const kappa_args *kargs, const sym_wire *res, size_t o)
+{
+    const obf_params_t *const op = kargs->op;
+    const circ_params_t *cp = &op->cp;
+    const size_t ninputs = cp->n - (cp->circ->consts.n ? 1 : 0);
+    level *const rprod = level_create_vhato(cp, o, op->M, op->types);
+    level *const zprod = level_new(cp);
+    sym_wire out = { { NULL, 0 }, { NULL, 0 }, 0 };
+    sym_wire prod = { { NULL, 0 }, { NULL, 0 }, 0 };
+    sym_wire tmp = { { NULL, 0 }, { NULL, 0 }, 0 };
+    sym_wire rop = { { NULL, 0 }, { NULL, 0 }, 0 };
+    size_t kappa;
+
+    /* \hat R_o and \hat Z_o times \hat R_{k,0,o} and \hat Z_{k,0,o} */
+    level_add(zprod, rprod, kargs->vstar);
+    for (size_t k = 0; k < ninputs; k++) {
+        level *const vhatkso = level_create_vhatkso(cp, k, 0, o, op->types);
+        level_add(rprod, rprod, vhatkso);
+        level_add(zprod, zprod, vhatkso);
+        level_add(zprod, zprod, kargs->vstar);
+        level_free(vhatkso);
+    }
+    sym_encode(&prod.r, rprod);
+    sym_encode(&prod.z, zprod);
+    prod.r.deg = prod.z.deg = ninputs + 1;
+
+    sym_mul(&out.r, &res->r, &prod.r);
+    sym_mul(&out.z, &res->z, &prod.z);
+    out.d = res->d + level_degree(cp, prod.z.lvl);
+    {
+        level *const vbaro = level_create_vbaro(cp, o);
+        level *const extra = level_new(cp);
+        level_mul_ui(extra, kargs->vstar, op->D);
+        sym_wire_encode(cp, &tmp, vbaro, extra);
+        level_free(extra);
+    }
+    sym_wire_sub(&rop, &out, &tmp, &kargs->zstar);
+    kappa = rop.z.deg;
+
+    sym_wire_clear(&out);
+    sym_wire_clear(&prod);
+    sym_wire_clear(&tmp);
+    sym_wire_clear(&rop);
+    return kappa;
+}
+
+static int
+_kappa(const obf_params_t *op, size_t *kappa, size_t *npowers)
+{
+    const circ_params_t *cp = &op->cp;
+    const acirc *const c = cp->circ;
+    level *const vstar = level_create_vstar(cp);
+    size_t maxkappa = 0;
+    kappa_args args;
+    int ret = ERR;
+
+    args.op = op;
+    args.vstar = vstar;
+    args.zstar.lvl = NULL;
+    sym_encode(&args.zstar, level_create_vstar(cp));
+    args.wires = my_calloc(acirc_nrefs(c), sizeof args.wires[0]);
+    if (cp->sched == NULL)
+        goto cleanup;
+    if (sched_run(cp->sched, kappa_gate, kappa_release, &args, 1) == ERR)
+        goto cleanup;
+    for (size_t o = 0; o < cp->m; o++) {
+        const acircref ref = c->outputs.buf[o];
+        size_t k;
+
+        if (cp->sched->output[ref] == -1)
+            continue;           /* pruned from the schedule */
+        if ((k = kappa_zero_test(&args, &args.wires[ref], o)) > maxkappa)
+            maxkappa = k;
+    }
+    if (kappa)
+        *kappa = maxkappa;
+    /* There are no powers to raise by */
+    if (npowers)
+        *npowers = 0;
+    ret = OK;
+cleanup:
+    for (size_t i = 0; i < acirc_nrefs(c); i++)
+        sym_wire_clear(&args.wires[i]);
+    free(args.wires);
+    sym_set(&args.zstar, NULL, 0);
+    level_free(vstar);
+    return ret;
+}
+
 obfuscator_vtable lin_obfuscator_vtable = {
     .free = _free,
     .obfuscate = _obfuscate,
     .evaluate = _evaluate,
     .fwrite = _fwrite,
     .fread = _fread,
+    .kappa = _kappa,
 };
@@ -7,7 +7,6 @@
 struct pp_info {
     const obf_params_t *op;
     level *toplevel;
-    bool my_toplevel;
 };
 #define info(x) (x)->info
 
@@ -15,8 +14,7 @@ static int
 _pp_init(const sp_vtable *vt, public_params *pp, const secret_params *sp)
 {
     pp->info = calloc(1, sizeof pp->info[0]);
-    pp->info->toplevel = vt->toplevel(sp);
-    pp->info->my_toplevel = false;
+    pp->info->toplevel = level_intern(vt->toplevel(sp));
     pp->info->op = vt->params(sp);
     return OK;
 }
@@ -31,10 +29,13 @@ _pp_fwrite(const public_params *pp, FILE *fp)
 static int
 _pp_fread(public_params *pp, const obf_params_t *op, FILE *fp)
 {
+    level *toplevel;
+
     (void) fp;
     pp->info = calloc(1, sizeof pp->info[0]);
-    pp->info->toplevel = level_create_vzt(&op->cp, op->M, op->D);
-    pp->info->my_toplevel = true;
+    toplevel = level_create_vzt(&op->cp, op->M, op->D);
+    pp->info->toplevel = level_intern(toplevel);
+    level_free(toplevel);
     pp->info->op = op;
     return OK;
 }
@@ -42,8 +43,7 @@ _pp_fread(public_params *pp, const obf_params_t *op, FILE *fp)
 static void
 _pp_clear(public_params *pp)
 {
-    if (pp->info->my_toplevel)
-        level_free(pp->info->toplevel);
+    level_release(pp->info->toplevel);
     free(pp->info);
 }
 
@@ -18,10 +18,13 @@ _sp_init(secret_params *sp, mmap_params_t *mp, const obf_params_t *op,
     const size_t ninputs = cp->n - (cp->c ? 1 : 0);
     const size_t noutputs = cp->m;
     const size_t q = array_max(cp->qs, ninputs);
+    level *toplevel;
     size_t t;
 
     spinfo(sp) = my_calloc(1, sizeof spinfo(sp)[0]);
-    spinfo(sp)->toplevel = level_create_vzt(cp, op->M, op->D);
+    toplevel = level_create_vzt(cp, op->M, op->D);
+    spinfo(sp)->toplevel = level_intern(toplevel);
+    level_free(toplevel);
     spinfo(sp)->cp = cp;
 
     t = 0;
@@ -43,7 +46,7 @@ _sp_init(secret_params *sp, mmap_params_t *mp, const obf_params_t *op,
     return OK;
 error:
     free(mp->pows);
-    level_free(spinfo(sp)->toplevel);
+    level_release(spinfo(sp)->toplevel);
     free(spinfo(sp));
     return ERR;
 }
@@ -51,8 +54,7 @@ error:
 static void
 _sp_clear(secret_params *sp)
 {
-    if (spinfo(sp)->toplevel)
-        level_free(spinfo(sp)->toplevel);
+    level_release(spinfo(sp)->toplevel);
     if (spinfo(sp))
         free(spinfo(sp));
 }
@@ -23,7 +23,7 @@ ix_y_set(index_set *ix, const circ_params_t *cp, int pow)
         ix->pows[0] = pow;
 }
 static inline int
-ix_y_get(index_set *ix, const circ_params_t *cp)
+ix_y_get(const index_set *ix, const circ_params_t *cp)
 {
     if (cp->circ->consts.n)
         return ix->pows[0];
@@ -37,7 +37,7 @@ ix_s_set(index_set *ix, const circ_params_t *cp, size_t k, size_t s, int pow)
     ix->pows[has_consts + cp->qs[k] * k + s] = pow;
 }
 static inline int
-ix_s_get(index_set *ix, const circ_params_t *cp, size_t k, size_t s)
+ix_s_get(const index_set *ix, const circ_params_t *cp, size_t k, size_t s)
 {
     const size_t has_consts = cp->circ->consts.n ? 1 : 0;
     return ix->pows[has_consts + cp->qs[k] * k + s];
@@ -1,10 +1,17 @@
 #include "obfuscator.h"
+#include "circ.h"
+#include "obf_index.h"
+#include "obf_journal.h"
 #include "obf_params.h"
+#include "obf_stream.h"
+#include "prodtree.h"
+#include "raise.h"
 #include "vtables.h"
-#include "reflist.h"
+#include "sched.h"
 #include "util.h"
 
 #include <assert.h>
+#include <stdint.h>
 #include <string.h>
 #include <threadpool.h>
 
@@ -23,29 +30,33 @@ typedef struct obfuscation {
     encoding **yhat;            // [m]
     encoding **vhat;            // [npowers]
     encoding **Chatstar;        // [γ]
+    size_t *slices;             // [c + 1], first slice of each input, then the total
+    obf_index *index;           // NULL unless lazily loading from disk
+    raise_table *raise;         // shared by every evaluation, NULL unless read from disk
 } obfuscation;
 
 typedef struct work_args {
     const mmap_vtable *mmap;
-    acircref ref;
     const acirc *c;
     const int *inputs;
     const obfuscation *obf;
+    raise_eval *raise;
     bool *mine;
-    int *ready;
     void *cache;
-    ref_list *deps;
-    threadpool *pool;
     unsigned int *kappas;
     int *rop;
+    obf_state *state;           // NULL unless evaluating incrementally
+    size_t allocs[CIRC_NOPS];
 } work_args;
 
 typedef struct obf_args {
-    const encoding_vtable *vt;
-    encoding *enc;
+    const obfuscation *obf;
+    encoding *enc;              // NULL when streaming
+    obf_stream *stream;
+    obf_journal *journal;       // NULL unless checkpointing
+    size_t seq;
     mpz_t inps[2];
     index_set *ix;
-    const secret_params *sp;
     pthread_mutex_t *count_lock;
     size_t *count;
     size_t total;
@@ -54,8 +65,23 @@ typedef struct obf_args {
 static void obf_worker(void *wargs)
 {
     obf_args *const args = wargs;
-
-    encode(args->vt, args->enc, args->inps, 2, args->ix, args->sp);
+    const obfuscation *const obf = args->obf;
+
+    if (args->stream) {
+        encoding *enc = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
+        /* Once the journal fails the obfuscation is abandoned, and what is
+         * left only has to be handed to the stream so that it can finish */
+        if (args->journal == NULL || !obf_journal_failed(args->journal)) {
+            encode(obf->enc_vt, enc, args->inps, 2, args->ix, obf->sp);
+            if (args->journal
+                && obf_journal_fwrite(args->journal, obf->enc_vt, args->seq, enc) == ERR)
+                fprintf(stderr, "error: checkpointing encoding %lu failed, aborting\n",
+                        args->seq);
+        }
+        obf_stream_put(args->stream, args->seq, enc);
+    } else {
+        encode(obf->enc_vt, args->enc, args->inps, 2, args->ix, obf->sp);
+    }
     if (g_verbose) {
         pthread_mutex_lock(args->count_lock);
         print_progress(++*args->count, args->total);
@@ -67,18 +93,42 @@ static void obf_worker(void *wargs)
 }
 
 static void
-__encode(threadpool *pool, const encoding_vtable *vt, encoding *enc, mpz_t inps[2],
-         index_set *ix, const secret_params *sp, pthread_mutex_t *count_lock,
-         size_t *count, size_t total)
+__encode(threadpool *pool, const obfuscation *obf, obf_stream *stream,
+         obf_journal *journal, encoding *enc, mpz_t inps[2], index_set *ix,
+         pthread_mutex_t *count_lock, size_t *count, size_t total)
 {
     obf_args *args = my_calloc(1, sizeof args[0]);
-    args->vt = vt;
+    args->obf = obf;
     args->enc = enc;
+    args->stream = stream;
+    args->journal = journal;
+    if (journal && obf_journal_failed(journal)) {
+        /* Abandoned, see obf_worker */
+        index_set_free(ix);
+        free(args);
+        return;
+    }
+    if (stream)
+        args->seq = obf_stream_reserve(stream);
+    if (journal && obf_journal_done(journal, args->seq)) {
+        /* Finished by an earlier run */
+        encoding *old = obf_journal_fread(journal, obf->enc_vt, args->seq);
+        if (old == NULL)
+            old = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
+        obf_stream_put(stream, args->seq, old);
+        if (g_verbose) {
+            pthread_mutex_lock(count_lock);
+            print_progress(++*count, total);
+            pthread_mutex_unlock(count_lock);
+        }
+        index_set_free(ix);
+        free(args);
+        return;
+    }
     mpz_vect_init(args->inps, 2);
     mpz_set(args->inps[0], inps[0]);
     mpz_set(args->inps[1], inps[1]);
     args->ix = ix;
-    args->sp = sp;
     args->count_lock = count_lock;
     args->count = count;
     args->total = total;
@@ -121,6 +171,9 @@ _alloc(const mmap_vtable *mmap, const obf_params_t *op)
     obf->yhat = my_calloc(nconsts, sizeof obf->yhat[0]);
     obf->vhat = my_calloc(op->npowers, sizeof obf->vhat[0]);
     obf->Chatstar = my_calloc(noutputs, sizeof obf->Chatstar[0]);
+    obf->slices = my_calloc(ninputs + 1, sizeof obf->slices[0]);
+    for (size_t k = 0; k < ninputs; k++)
+        obf->slices[k + 1] = obf->slices[k] + cp->qs[k];
 
     return obf;
 }
@@ -138,6 +191,7 @@ _free(obfuscation *obf)
     const size_t ninputs = cp->n - has_consts;
     const size_t noutputs = cp->m;
 
+    raise_table_free(obf->raise);
     for (size_t k = 0; k < ninputs; k++) {
         for (size_t s = 0; s < cp->qs[k]; s++) {
             for (size_t j = 0; j < cp->ds[k]; j++)
@@ -171,20 +225,138 @@ _free(obfuscation *obf)
     for (size_t i = 0; i < noutputs; i++)
         encoding_free(obf->enc_vt, obf->Chatstar[i]);
     free(obf->Chatstar);
+    free(obf->slices);
 
     if (obf->pp)
         public_params_free(obf->pp_vt, obf->pp);
     if (obf->sp)
         secret_params_free(obf->sp_vt, obf->sp);
+    obf_index_free(obf->index);
 
     free(obf);
 }
 
+/* Each (k, s) symbol slice is stored contiguously so it can be loaded lazily */
+static size_t
+_nslices(const obfuscation *obf, size_t ninputs)
+{
+    return obf->slices[ninputs];
+}
+
+static size_t
+_slice(const obfuscation *obf, size_t k, size_t s)
+{
+    return obf->slices[k] + s;
+}
+
+/* The input whose slices include slice */
+static size_t
+_slice_input(const obfuscation *obf, size_t slice, size_t ninputs)
+{
+    size_t lo = 0, hi = ninputs;
+
+    while (hi - lo > 1) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (obf->slices[mid] <= slice)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Writes x to the journal, or reads it back when resuming */
+static int
+_journal_mpz(obf_journal *journal, mpz_t x)
+{
+    FILE *const fp = obf_journal_fp(journal);
+
+    if (obf_journal_resuming(journal))
+        return mpz_fread((mpz_t *) x, fp);
+    return mpz_fwrite(x, fp);
+}
+
+/* Degrees of each output in the constants and in each input, which fix the
+ * index sets of \hat z and \hat C* */
+typedef struct {
+    unsigned long *const_deg;   // [γ]
+    unsigned long const_deg_max;
+    unsigned long *var_deg;     // [c][γ]
+    unsigned long *var_deg_max; // [c]
+} out_degrees;
+
+static out_degrees *
+_out_degrees_new(const circ_params_t *cp)
+{
+    const acirc *const circ = cp->circ;
+    const size_t ninputs = cp->n - (circ->consts.n ? 1 : 0);
+    const size_t noutputs = cp->m;
+    out_degrees *degs = my_calloc(1, sizeof degs[0]);
+    acirc_memo *memo;
+
+    degs->const_deg = my_calloc(noutputs, sizeof degs->const_deg[0]);
+    degs->var_deg = my_calloc(ninputs * noutputs, sizeof degs->var_deg[0]);
+    degs->var_deg_max = my_calloc(ninputs, sizeof degs->var_deg_max[0]);
+
+    memo = acirc_memo_new(circ);
+    for (size_t o = 0; o < noutputs; o++) {
+        degs->const_deg[o] = acirc_const_degree(circ, circ->outputs.buf[o], memo);
+        if (degs->const_deg[o] > degs->const_deg_max)
+            degs->const_deg_max = degs->const_deg[o];
+    }
+    acirc_memo_free(memo, circ);
+
+    memo = acirc_memo_new(circ);
+    for (size_t k = 0; k < ninputs; k++) {
+        for (size_t o = 0; o < noutputs; o++) {
+            unsigned long *const deg = &degs->var_deg[k * noutputs + o];
+            *deg = acirc_var_degree(circ, circ->outputs.buf[o], k, memo);
+            if (*deg > degs->var_deg_max[k])
+                degs->var_deg_max[k] = *deg;
+        }
+    }
+    acirc_memo_free(memo, circ);
+    return degs;
+}
+
+static void
+_out_degrees_free(out_degrees *degs)
+{
+    free(degs->const_deg);
+    free(degs->var_deg);
+    free(degs->var_deg_max);
+    free(degs);
+}
+
+/* Sets ix to the index set of \\hat z_{k,s,o} */
+static void
+_zhat_ix(index_set *ix, const circ_params_t *cp, const out_degrees *degs,
+         size_t k, size_t s, size_t o)
+{
+    const unsigned long max = degs->var_deg_max[k];
+
+    index_set_clear(ix);
+    if (k == 0)
+        ix_y_set(ix, cp, degs->const_deg_max - degs->const_deg[o]);
+    for (size_t r = 0; r < cp->qs[k]; r++)
+        ix_s_set(ix, cp, k, r, r == s ? max - degs->var_deg[k * cp->m + o] : max);
+    ix_z_set(ix, cp, k, 1);
+    ix_w_set(ix, cp, k, 1);
+}
+
+/* Encodings are produced in the order _fwrite lays them out, so that when fp is
+ * given they can be streamed to disk and freed as soon as they are written.
+ * With a journal, the secret parameters, the random scalars and each finished
+ * encoding are checkpointed, and a resumed run only encodes what is missing. */
 static obfuscation *
-_obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
-           size_t *kappa, size_t nthreads, aes_randstate_t rng)
+__obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
+            size_t *kappa, size_t nthreads, aes_randstate_t rng, FILE *fp,
+            obf_journal *journal)
 {
     obfuscation *obf;
+    obf_index *index = NULL;
+    obf_stream *stream = NULL;
+    int ret = OK;
 
     const circ_params_t *cp = &op->cp;
     const size_t nconsts = cp->circ->consts.n;
@@ -195,8 +367,34 @@ _obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
     if (op->npowers == 0 || secparam == 0)
         return NULL;
 
-    obf = _alloc(mmap, op);
-    obf->sp = secret_params_new(obf->sp_vt, op, secparam, kappa, nthreads, rng);
+    if ((obf = _alloc(mmap, op)) == NULL)
+        return NULL;
+    if (journal && obf_journal_params(journal, mmap, cp, secparam, op->npowers) == ERR) {
+        _free(obf);
+        return NULL;
+    }
+    if (journal && obf_journal_resuming(journal)) {
+        FILE *const jfp = obf_journal_fp(journal);
+        size_t _kappa;
+        if (size_t_fread(&_kappa, jfp) == ERR) {
+            _free(obf);
+            return NULL;
+        }
+        if (kappa)
+            *kappa = _kappa;
+        obf->sp = secret_params_fread(obf->sp_vt, cp, jfp);
+    } else {
+        obf->sp = secret_params_new(obf->sp_vt, op, secparam, kappa, nthreads, rng);
+        if (obf->sp && journal) {
+            FILE *const jfp = obf_journal_fp(journal);
+            if (size_t_fwrite(kappa ? *kappa : 0, jfp) == ERR
+                || secret_params_fwrite(obf->sp_vt, obf->sp, jfp) == ERR) {
+                fprintf(stderr, "error: writing journal failed\n");
+                _free(obf);
+                return NULL;
+            }
+        }
+    }
     if (obf->sp == NULL) {
         _free(obf);
         return NULL;
@@ -207,30 +405,45 @@ _obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
         return NULL;
     }
 
-    for (size_t k = 0; k < ninputs; k++) {
-        for (size_t s = 0; s < cp->qs[k]; s++) {
-            for (size_t j = 0; j < cp->ds[k]; j++) {
-                obf->shat[k][s][j] = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-            }
-            for (size_t p = 0; p < op->npowers; p++) {
-                obf->uhat[k][s][p] = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-            }
-            for (size_t o = 0; o < noutputs; o++) {
-                obf->zhat[k][s][o] = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-                obf->what[k][s][o] = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
+    if (fp) {
+        index = obf_index_fwrite_begin(_nslices(obf, ninputs), fp);
+        if (index == NULL) {
+            _free(obf);
+            return NULL;
+        }
+        public_params_fwrite(obf->pp_vt, obf->pp, fp);
+        stream = obf_stream_new(obf->enc_vt, index, fp, 4 * nthreads);
+        if (stream == NULL) {
+            obf_index_free(index);
+            _free(obf);
+            return NULL;
+        }
+    } else {
+        for (size_t k = 0; k < ninputs; k++) {
+            for (size_t s = 0; s < cp->qs[k]; s++) {
+                for (size_t j = 0; j < cp->ds[k]; j++) {
+                    obf->shat[k][s][j] = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
+                }
+                for (size_t p = 0; p < op->npowers; p++) {
+                    obf->uhat[k][s][p] = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
+                }
+                for (size_t o = 0; o < noutputs; o++) {
+                    obf->zhat[k][s][o] = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
+                    obf->what[k][s][o] = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
+                }
             }
         }
+        for (size_t i = 0; i < nconsts; i++) {
+            obf->yhat[i] = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
+        }
+        for (size_t p = 0; p < op->npowers; p++) {
+            obf->vhat[p] = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
+        }
+        for (size_t i = 0; i < noutputs; i++) {
+            obf->Chatstar[i] = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
+        }
     }
-    for (size_t i = 0; i < nconsts; i++) {
-        obf->yhat[i] = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-    }
-    for (size_t p = 0; p < op->npowers; p++) {
-        obf->vhat[p] = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-    }
-    for (size_t i = 0; i < noutputs; i++) {
-        obf->Chatstar[i] = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-    }
-    
+
     acirc *const circ = cp->circ;
     mpz_t *const moduli =
         mpz_vect_create_of_fmpz(obf->mmap->sk->plaintext_fields(obf->sp->sk),
@@ -276,124 +489,123 @@ _obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
         mpz_init(beta[i]);
         mpz_randomm_inv(beta[i], rng, moduli[1]);
     }
+    if (journal) {
+        for (size_t k = 0; k < ninputs; k++)
+            for (size_t j = 0; j < cp->ds[k]; j++)
+                if (_journal_mpz(journal, alpha[k * cp->ds[k] + j]) == ERR)
+                    ret = ERR;
+        for (size_t k = 0; k < ninputs; k++)
+            for (size_t s = 0; s < cp->qs[k]; s++)
+                for (size_t o = 0; o < noutputs; o++)
+                    if (_journal_mpz(journal, gamma[k][s][o]) == ERR
+                        || _journal_mpz(journal, delta[k][s][o]) == ERR)
+                        ret = ERR;
+        for (size_t i = 0; i < nconsts; i++)
+            if (_journal_mpz(journal, beta[i]) == ERR)
+                ret = ERR;
+    }
 
     for (size_t o = 0; o < noutputs; o++) {
         mpz_init(Cstar[o]);
         acirc_eval_mpz_mod(Cstar[o], circ, circ->outputs.buf[o], alpha, beta, moduli[1]);
     }
 
-    unsigned long const_deg[noutputs];
-    unsigned long const_deg_max = 0;
-    unsigned long var_deg[ninputs][noutputs];
-    unsigned long var_deg_max[ninputs];
-    acirc_memo *memo;
+    out_degrees *const degs = _out_degrees_new(cp);
 
-    memset(const_deg, '\0', sizeof const_deg);
-    memset(var_deg, '\0', sizeof var_deg);
-    memset(var_deg_max, '\0', sizeof var_deg_max);
+    if (journal && ret == OK)
+        ret = obf_journal_commit(journal, total);
+    if (ret == ERR)
+        goto cleanup;
 
-    memo = acirc_memo_new(circ);
-    for (size_t o = 0; o < noutputs; o++) {
-        const_deg[o] = acirc_const_degree(circ, circ->outputs.buf[o], memo);
-        if (const_deg[o] > const_deg_max)
-            const_deg_max = const_deg[o];
+    if (g_verbose)
+        print_progress(count, total);
+
+    for (size_t i = 0; i < nconsts; i++) {
+        index_set_clear(ix);
+        ix_y_set(ix, cp, 1);
+        mpz_set_si(inps[0], circ->consts.buf[i]);
+        mpz_set   (inps[1], beta[i]);
+        __encode(pool, obf, stream, journal, obf->yhat[i], inps, index_set_copy(ix),
+                 &count_lock, &count, total);
+    }
+    for (size_t p = 0; p < op->npowers; p++) {
+        index_set_clear(ix);
+        ix_y_set(ix, cp, 1 << p);
+        mpz_set_ui(inps[0], 1);
+        mpz_set_ui(inps[1], 1);
+        __encode(pool, obf, stream, journal, obf->vhat[p], inps, index_set_copy(ix),
+                 &count_lock, &count, total);
     }
-    acirc_memo_free(memo, circ);
 
-    memo = acirc_memo_new(circ);
-    for (size_t k = 0; k < ninputs; k++) {
-        for (size_t o = 0; o < noutputs; o++) {
-            var_deg[k][o] = acirc_var_degree(circ, circ->outputs.buf[o], k, memo);
-            if (var_deg[k][o] > var_deg_max[k])
-                var_deg_max[k] = var_deg[k][o];
+    for (size_t i = 0; i < noutputs; i++) {
+        index_set_clear(ix);
+        ix_y_set(ix, cp, degs->const_deg_max);
+        for (size_t k = 0; k < ninputs; k++) {
+            for (size_t s = 0; s < cp->qs[k]; s++) {
+                ix_s_set(ix, cp, k, s, degs->var_deg_max[k]);
+            }
+            ix_z_set(ix, cp, k, 1);
         }
-    }
-    acirc_memo_free(memo, circ);
 
-    if (g_verbose)
-        print_progress(count, total);
+        mpz_set_ui(inps[0], 0);
+        mpz_set   (inps[1], Cstar[i]);
+
+        __encode(pool, obf, stream, journal, obf->Chatstar[i], inps,
+                 index_set_copy(ix), &count_lock, &count, total);
+    }
 
     for (size_t k = 0; k < ninputs; k++) {
         for (size_t s = 0; s < cp->qs[k]; s++) {
+            if (stream)
+                obf_stream_mark(stream, _slice(obf, k, s));
             for (size_t j = 0; j < cp->ds[k]; j++) {
                 mpz_set_ui(inps[0], op->sigma ? s == j : bit(s, j));
                 mpz_set   (inps[1], alpha[k * cp->ds[k] + j]);
                 index_set_clear(ix);
                 ix_s_set(ix, cp, k, s, 1);
-                __encode(pool, obf->enc_vt, obf->shat[k][s][j], inps,
-                         index_set_copy(ix), obf->sp, &count_lock, &count,
-                         total);
+                __encode(pool, obf, stream, journal, obf->shat[k][s][j], inps,
+                         index_set_copy(ix), &count_lock, &count, total);
             }
             mpz_set_ui(inps[0], 1);
             mpz_set_ui(inps[1], 1);
             index_set_clear(ix);
             for (size_t p = 0; p < op->npowers; p++) {
                 ix_s_set(ix, cp, k, s, 1 << p);
-                __encode(pool, obf->enc_vt, obf->uhat[k][s][p], inps,
-                         index_set_copy(ix), obf->sp, &count_lock, &count,
-                         total);
+                __encode(pool, obf, stream, journal, obf->uhat[k][s][p], inps,
+                         index_set_copy(ix), &count_lock, &count, total);
             }
             for (size_t o = 0; o < noutputs; o++) {
-                index_set_clear(ix);
-                if (k == 0)
-                    ix_y_set(ix, cp, const_deg_max - const_deg[o]);
-                for (size_t r = 0; r < cp->qs[k]; r++)
-                    ix_s_set(ix, cp, k, r, r == s ? var_deg_max[k] - var_deg[k][o] : var_deg_max[k]);
-                ix_z_set(ix, cp, k, 1);
-                ix_w_set(ix, cp, k, 1);
+                _zhat_ix(ix, cp, degs, k, s, o);
                 mpz_set(inps[0], delta[k][s][o]);
                 mpz_set(inps[1], gamma[k][s][o]);
-                __encode(pool, obf->enc_vt, obf->zhat[k][s][o], inps,
-                         index_set_copy(ix), obf->sp, &count_lock, &count,
-                         total);
+                __encode(pool, obf, stream, journal, obf->zhat[k][s][o], inps,
+                         index_set_copy(ix), &count_lock, &count, total);
 
                 index_set_clear(ix);
                 ix_w_set(ix, cp, k, 1);
                 mpz_set_ui(inps[0], 0);
                 mpz_set   (inps[1], gamma[k][s][o]);
-                __encode(pool, obf->enc_vt, obf->what[k][s][o], inps,
-                         index_set_copy(ix), obf->sp, &count_lock, &count,
-                         total);
-            }
-        }
-    }
-
-    for (size_t i = 0; i < nconsts; i++) {
-        index_set_clear(ix);
-        ix_y_set(ix, cp, 1);
-        mpz_set_si(inps[0], circ->consts.buf[i]);
-        mpz_set   (inps[1], beta[i]);
-        __encode(pool, obf->enc_vt, obf->yhat[i], inps, index_set_copy(ix),
-                 obf->sp, &count_lock, &count, total);
-    }
-    for (size_t p = 0; p < op->npowers; p++) {
-        index_set_clear(ix);
-        ix_y_set(ix, cp, 1 << p);
-        mpz_set_ui(inps[0], 1);
-        mpz_set_ui(inps[1], 1);
-        __encode(pool, obf->enc_vt, obf->vhat[p], inps, index_set_copy(ix),
-                 obf->sp, &count_lock, &count, total);
-    }
-
-    for (size_t i = 0; i < noutputs; i++) {
-        index_set_clear(ix);
-        ix_y_set(ix, cp, const_deg_max);
-        for (size_t k = 0; k < ninputs; k++) {
-            for (size_t s = 0; s < cp->qs[k]; s++) {
-                ix_s_set(ix, cp, k, s, var_deg_max[k]);
+                __encode(pool, obf, stream, journal, obf->what[k][s][o], inps,
+                         index_set_copy(ix), &count_lock, &count, total);
             }
-            ix_z_set(ix, cp, k, 1);
         }
-
-        mpz_set_ui(inps[0], 0);
-        mpz_set   (inps[1], Cstar[i]);
-
-        __encode(pool, obf->enc_vt, obf->Chatstar[i], inps,
-                 index_set_copy(ix), obf->sp, &count_lock, &count, total);
     }
 
+cleanup:
     threadpool_destroy(pool);
     pthread_mutex_destroy(&count_lock);
+    if (journal && obf_journal_failed(journal))
+        ret = ERR;
+    _out_degrees_free(degs);
+    if (stream) {
+        if (obf_stream_finish(stream) == ERR)
+            ret = ERR;
+        /* Without the index the partial output can't be mistaken for an
+         * obfuscation */
+        if (ret == OK && obf_index_fwrite_end(index, fp) == ERR)
+            ret = ERR;
+        obf_index_free(index);
+    }
 
     index_set_free(ix);
     mpz_vect_clear(inps, 2);
@@ -418,9 +630,97 @@ _obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
 
     mpz_vect_free(moduli, obf->mmap->sk->nslots(obf->sp->sk));
 
+    if (ret == ERR) {
+        _free(obf);
+        return NULL;
+    }
     return obf;
 }
 
+static obfuscation *
+_obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
+           size_t *kappa, size_t nthreads, aes_randstate_t rng)
+{
+    return __obfuscate(mmap, op, secparam, kappa, nthreads, rng, NULL, NULL);
+}
+
+static int
+_obfuscate_fwrite(const mmap_vtable *mmap, const obf_params_t *op,
+                  size_t secparam, size_t *kappa, size_t nthreads,
+                  aes_randstate_t rng, FILE *fp, obf_journal *journal)
+{
+    obfuscation *obf;
+
+    obf = __obfuscate(mmap, op, secparam, kappa, nthreads, rng, fp, journal);
+    if (obf == NULL)
+        return ERR;
+    _free(obf);
+    return OK;
+}
+
+static void
+_fwrite_slice(const obfuscation *obf, size_t k, size_t s, FILE *fp)
+{
+    const obf_params_t *const op = obf->op;
+    const circ_params_t *cp = &op->cp;
+
+    for (size_t j = 0; j < cp->ds[k]; j++)
+        encoding_fwrite(obf->enc_vt, obf->shat[k][s][j], fp);
+    for (size_t p = 0; p < op->npowers; p++)
+        encoding_fwrite(obf->enc_vt, obf->uhat[k][s][p], fp);
+    for (size_t o = 0; o < cp->m; o++) {
+        encoding_fwrite(obf->enc_vt, obf->zhat[k][s][o], fp);
+        encoding_fwrite(obf->enc_vt, obf->what[k][s][o], fp);
+    }
+}
+
+static void
+_clear_slice(const obfuscation *obf, size_t k, size_t s)
+{
+    const obf_params_t *const op = obf->op;
+    const circ_params_t *cp = &op->cp;
+
+    for (size_t j = 0; j < cp->ds[k]; j++) {
+        encoding_free(obf->enc_vt, obf->shat[k][s][j]);
+        obf->shat[k][s][j] = NULL;
+    }
+    for (size_t p = 0; p < op->npowers; p++) {
+        encoding_free(obf->enc_vt, obf->uhat[k][s][p]);
+        obf->uhat[k][s][p] = NULL;
+    }
+    for (size_t o = 0; o < cp->m; o++) {
+        encoding_free(obf->enc_vt, obf->zhat[k][s][o]);
+        encoding_free(obf->enc_vt, obf->what[k][s][o]);
+        obf->zhat[k][s][o] = obf->what[k][s][o] = NULL;
+    }
+}
+
+static int
+_fread_slice(const obfuscation *obf, size_t k, size_t s, FILE *fp)
+{
+    const obf_params_t *const op = obf->op;
+    const circ_params_t *cp = &op->cp;
+
+    for (size_t j = 0; j < cp->ds[k]; j++)
+        if ((obf->shat[k][s][j] = encoding_fread(obf->enc_vt, fp)) == NULL)
+            goto error;
+    for (size_t p = 0; p < op->npowers; p++)
+        if ((obf->uhat[k][s][p] = encoding_fread(obf->enc_vt, fp)) == NULL)
+            goto error;
+    for (size_t o = 0; o < cp->m; o++) {
+        if ((obf->zhat[k][s][o] = encoding_fread(obf->enc_vt, fp)) == NULL)
+            goto error;
+        if ((obf->what[k][s][o] = encoding_fread(obf->enc_vt, fp)) == NULL)
+            goto error;
+    }
+    return OK;
+error:
+    fprintf(stderr, "error: reading encodings of input %lu, symbol %lu failed\n",
+            k, s);
+    _clear_slice(obf, k, s);
+    return ERR;
+}
+
 static int
 _fwrite(const obfuscation *const obf, FILE *const fp)
 {
@@ -431,33 +731,88 @@ _fwrite(const obfuscation *const obf, FILE *const fp)
     const size_t has_consts = nconsts ? 1 : 0;
     const size_t ninputs = cp->n - has_consts;
     const size_t noutputs = cp->m;
+    obf_index *index;
+    int ret;
 
+    if ((index = obf_index_fwrite_begin(_nslices(obf, ninputs), fp)) == NULL)
+        return ERR;
     public_params_fwrite(obf->pp_vt, obf->pp, fp);
-    for (size_t k = 0; k < ninputs; k++) {
-        for (size_t s = 0; s < cp->qs[k]; s++) {
-            for (size_t j = 0; j < cp->ds[k]; j++)
-                encoding_fwrite(obf->enc_vt, obf->shat[k][s][j], fp);
-            for (size_t p = 0; p < op->npowers; p++)
-                encoding_fwrite(obf->enc_vt, obf->uhat[k][s][p], fp);
-            for (size_t o = 0; o < noutputs; o++) {
-                encoding_fwrite(obf->enc_vt, obf->zhat[k][s][o], fp);
-                encoding_fwrite(obf->enc_vt, obf->what[k][s][o], fp);
-            }
-        }
-    }
     for (size_t j = 0; j < nconsts; j++)
         encoding_fwrite(obf->enc_vt, obf->yhat[j], fp);
     for (size_t p = 0; p < op->npowers; p++)
         encoding_fwrite(obf->enc_vt, obf->vhat[p], fp);
     for (size_t k = 0; k < noutputs; k++)
         encoding_fwrite(obf->enc_vt, obf->Chatstar[k], fp);
-    return OK;
+    for (size_t k = 0; k < ninputs; k++) {
+        for (size_t s = 0; s < cp->qs[k]; s++) {
+            obf_index_mark(index, _slice(obf, k, s), fp);
+            _fwrite_slice(obf, k, s, fp);
+        }
+    }
+    ret = obf_index_fwrite_end(index, fp);
+    obf_index_free(index);
+    return ret;
+}
+
+static int
+_load_slice(size_t slice, FILE *fp, const void *vargs)
+{
+    const obfuscation *const obf = vargs;
+    const circ_params_t *cp = &obf->op->cp;
+    const size_t k = _slice_input(obf, slice, cp->n - (cp->circ->consts.n ? 1 : 0));
+
+    return _fread_slice(obf, k, slice - obf->slices[k], fp);
+}
+
+/* Materializes the encodings for the chosen symbol of each input */
+static int
+_load_inputs(const obfuscation *obf, const int *syms, size_t ninputs,
+             size_t nthreads)
+{
+    size_t slices[ninputs];
+
+    if (obf->index == NULL)
+        return OK;
+    for (size_t k = 0; k < ninputs; k++)
+        slices[k] = _slice(obf, k, syms[k]);
+    return obf_index_load_many(obf->index, slices, ninputs, _load_slice, obf,
+                               nthreads);
+}
+
+/* Raising tables for each (k, s) symbol, followed by one for the constants.
+ * The (k, s) tables point at uhat[k][s], so they work before the slices are
+ * loaded. */
+static raise_table *
+_raise_table(const obfuscation *obf)
+{
+    const circ_params_t *cp = &obf->op->cp;
+    const size_t ninputs = cp->n - (cp->circ->consts.n ? 1 : 0);
+    const size_t nsyms = _nslices(obf, ninputs);
+    const index_set *const toplevel = obf->pp_vt->toplevel(obf->pp);
+    raise_table *t;
+
+    /* Never keep more products than the powers they are built from */
+    t = raise_table_new(obf->enc_vt, obf->pp_vt, obf->pp, nsyms + 1,
+                        obf->op->npowers, (nsyms + 1) * obf->op->npowers);
+    for (size_t k = 0, sym = 0; k < ninputs; k++) {
+        for (size_t s = 0; s < cp->qs[k]; s++)
+            raise_table_set(t, sym++, obf->uhat[k][s],
+                            ix_s_get(toplevel, cp, k, s));
+    }
+    raise_table_set(t, nsyms, obf->vhat, ix_y_get(toplevel, cp));
+    return t;
 }
 
 static obfuscation *
-_fread(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp)
+_fread(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp,
+       const eval_ctx *ctx)
 {
     obfuscation *obf;
+    bool legacy;
+
+    /* The bulk of the encodings are loaded lazily, in parallel, by
+     * _load_inputs */
+    (void) ctx;
 
     const circ_params_t *cp = &op->cp;
     const size_t nconsts = cp->circ->consts.n;
@@ -468,96 +823,118 @@ _fread(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp)
     if ((obf = _alloc(mmap, op)) == NULL)
         return NULL;
 
-    obf->pp = public_params_fread(obf->pp_vt, op, fp);
-    for (size_t k = 0; k < ninputs; k++) {
-        for (size_t s = 0; s < cp->qs[k]; s++) {
-            for (size_t j = 0; j < cp->ds[k]; j++)
-                obf->shat[k][s][j] = encoding_fread(obf->enc_vt, fp);
-            for (size_t p = 0; p < op->npowers; p++)
-                obf->uhat[k][s][p] = encoding_fread(obf->enc_vt, fp);
-            for (size_t o = 0; o < noutputs; o++) {
-                obf->zhat[k][s][o] = encoding_fread(obf->enc_vt, fp);
-                obf->what[k][s][o] = encoding_fread(obf->enc_vt, fp);
-            }
-        }
+    obf->index = obf_index_fread(_nslices(obf, ninputs), fp, &legacy);
+    if (obf->index == NULL && !legacy)
+        goto error;
+    if ((obf->pp = public_params_fread(obf->pp_vt, op, fp)) == NULL)
+        goto error;
+    if (legacy) {
+        for (size_t k = 0; k < ninputs; k++)
+            for (size_t s = 0; s < cp->qs[k]; s++)
+                if (_fread_slice(obf, k, s, fp) == ERR)
+                    goto error;
     }
     for (size_t i = 0; i < nconsts; i++)
-        obf->yhat[i] = encoding_fread(obf->enc_vt, fp);
+        if ((obf->yhat[i] = encoding_fread(obf->enc_vt, fp)) == NULL)
+            goto error;
     for (size_t p = 0; p < op->npowers; p++)
-        obf->vhat[p] = encoding_fread(obf->enc_vt, fp);
+        if ((obf->vhat[p] = encoding_fread(obf->enc_vt, fp)) == NULL)
+            goto error;
     for (size_t i = 0; i < noutputs; i++)
-        obf->Chatstar[i] = encoding_fread(obf->enc_vt, fp);
+        if ((obf->Chatstar[i] = encoding_fread(obf->enc_vt, fp)) == NULL)
+            goto error;
+    obf->raise = _raise_table(obf);
     return obf;
+error:
+    fprintf(stderr, "error: reading obfuscation failed\n");
+    _free(obf);
+    return NULL;
 }
 
-static size_t g_max_npowers = 0;
-
-static void _raise_encoding(const obfuscation *obf, encoding *x, encoding **ys, size_t diff)
-{
-    while (diff > 0) {
-        // want to find the largest power we obfuscated to multiply by
-        size_t p = 0;
-        while (((size_t) 1 << (p+1)) <= diff && (p+1) < obf->op->npowers)
-            p++;
-        if (g_max_npowers < p + 1)
-            g_max_npowers = p + 1;
-        encoding_mul(obf->enc_vt, obf->pp_vt, x, x, ys[p], obf->pp);
-        diff -= (1 << p);
-    }
-}
-
-static void raise_encoding(const obfuscation *obf, encoding *x, const index_set *target)
+static int
+raise_encoding(const obfuscation *obf, raise_eval *raise, encoding *x,
+               const index_set *target)
 {
     const circ_params_t *cp = &obf->op->cp;
     const size_t ninputs = cp->n - (cp->circ->consts.n ? 1 : 0);
+    index_set_buf buf;
+    index_set *const ix = index_set_init(&buf, target->nzs);
+    size_t sym = 0;
+    int ret = ERR;
 
-    index_set *const ix =
-        index_set_difference(target, obf->enc_vt->mmap_set(x));
-    size_t diff;
+    if (index_set_sub(ix, target, obf->enc_vt->mmap_set(x)) == ERR)
+        goto cleanup;
     for (size_t k = 0; k < ninputs; k++) {
-        for (size_t s = 0; s < cp->qs[k]; s++) {
-            diff = ix_s_get(ix, cp, k, s);
-            _raise_encoding(obf, x, obf->uhat[k][s], diff);
-        }
+        for (size_t s = 0; s < cp->qs[k]; s++)
+            if (raise_eval_raise(raise, x, sym++, ix_s_get(ix, cp, k, s)) == ERR)
+                goto cleanup;
     }
-    diff = ix_y_get(ix, cp);
-    _raise_encoding(obf, x, obf->vhat, diff);
-    index_set_free(ix);
+    if (raise_eval_raise(raise, x, sym, ix_y_get(ix, cp)) == ERR)
+        goto cleanup;
+    ret = OK;
+cleanup:
+    index_set_release(&buf);
+    return ret;
 }
 
-static void
-raise_encodings(const obfuscation *obf, encoding *x, encoding *y)
+/* Raises x and y to their union.  Only an operand that is actually below the
+ * union gets cloned (into tmp_x / tmp_y, to be freed by the caller); the other
+ * is used as is.  Returns the number of clones made, or -1 on error. */
+static int
+raise_encodings(const obfuscation *obf, raise_eval *raise, const encoding **x,
+                const encoding **y, encoding **tmp_x, encoding **tmp_y)
 {
-    index_set *const ix = index_set_union(obf->enc_vt->mmap_set(x),
-                                          obf->enc_vt->mmap_set(y));
-    raise_encoding(obf, x, ix);
-    raise_encoding(obf, y, ix);
-    index_set_free(ix);
+    const index_set *const xs = obf->enc_vt->mmap_set(*x);
+    const index_set *const ys = obf->enc_vt->mmap_set(*y);
+    index_set_buf buf;
+    index_set *ix;
+    int ret = ERR;
+
+    *tmp_x = *tmp_y = NULL;
+    if (index_set_eq(xs, ys))
+        return 0;
+    ix = index_set_init(&buf, xs->nzs);
+    index_set_max(ix, xs, ys);
+    if (!index_set_eq(ix, xs)) {
+        *tmp_x = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
+        encoding_set(obf->enc_vt, *tmp_x, *x);
+        if (raise_encoding(obf, raise, *tmp_x, ix) == ERR)
+            goto cleanup;
+        *x = *tmp_x;
+    }
+    if (!index_set_eq(ix, ys)) {
+        *tmp_y = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
+        encoding_set(obf->enc_vt, *tmp_y, *y);
+        if (raise_encoding(obf, raise, *tmp_y, ix) == ERR)
+            goto cleanup;
+        *y = *tmp_y;
+    }
+    ret = (*tmp_x ? 1 : 0) + (*tmp_y ? 1 : 0);
+cleanup:
+    index_set_release(&buf);
+    return ret;
 }
 
-static void eval_worker(void *vargs)
+/* Evaluates gate ref into cache[ref], or returns NULL and leaves cache[ref] and
+ * mine[ref] untouched if it or one of its arguments failed */
+static encoding *
+_eval_gate(work_args *wargs, acircref ref)
 {
-    work_args *const wargs = vargs;
-    const acircref ref = wargs->ref;
     const acirc *const c = wargs->c;
     const int *const inputs = wargs->inputs;
     const obfuscation *const obf = wargs->obf;
     bool *const mine = wargs->mine;
-    int *const ready = wargs->ready;
     encoding **cache = wargs->cache;
-    ref_list *const deps = wargs->deps;
-    threadpool *const pool = wargs->pool;
-    unsigned int *const kappas = wargs->kappas;
-    int *const rop = wargs->rop;
 
     const acirc_operation op = c->gates.gates[ref].op;
     const acircref *const args = c->gates.gates[ref].args;
     encoding *res;
+    bool own;
+    int ret = OK;
 
     const circ_params_t *cp = &obf->op->cp;
     const size_t has_consts = cp->circ->consts.n ? 1 : 0;
     const size_t ninputs = cp->n - has_consts;
-    const size_t noutputs = cp->m;
 
     switch (op) {
     case OP_INPUT: {
@@ -567,37 +944,39 @@ static void eval_worker(void *vargs)
         const size_t s = inputs[k];
         const size_t j = sym.bit_number;
         res = obf->shat[k][s][j];
-        mine[ref] = false;
+        own = false;
         break;
     }
     case OP_CONST: {
         const size_t i = args[0];
         res = obf->yhat[i];
-        mine[ref] = false;
+        own = false;
         break;
     }
     case OP_ADD: case OP_SUB: case OP_MUL: {
         assert(c->gates.gates[ref].nargs == 2);
-        res = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-        mine[ref] = true;
+        const encoding *x = cache[args[0]];
+        const encoding *y = cache[args[1]];
 
-        const encoding *const x = cache[args[0]];
-        const encoding *const y = cache[args[1]];
+        if (x == NULL || y == NULL)
+            return NULL;
+        res = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
+        own = true;
+        circ_count(wargs->allocs, op, 1);
 
         if (op == OP_MUL) {
-            encoding_mul(obf->enc_vt, obf->pp_vt, res, x, y, obf->pp);
+            ret = encoding_mul(obf->enc_vt, obf->pp_vt, res, x, y, obf->pp);
         } else {
             encoding *tmp_x, *tmp_y;
-            tmp_x = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-            tmp_y = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-            encoding_set(obf->enc_vt, tmp_x, x);
-            encoding_set(obf->enc_vt, tmp_y, y);
-            if (!index_set_eq(obf->enc_vt->mmap_set(tmp_x), obf->enc_vt->mmap_set(tmp_y)))
-                raise_encodings(obf, tmp_x, tmp_y);
-            if (op == OP_ADD) {
-                encoding_add(obf->enc_vt, obf->pp_vt, res, tmp_x, tmp_y, obf->pp);
+            const int n = raise_encodings(obf, wargs->raise, &x, &y, &tmp_x, &tmp_y);
+            if (n != ERR)
+                circ_count(wargs->allocs, op, n);
+            if (n == ERR) {
+                ret = ERR;
+            } else if (op == OP_ADD) {
+                ret = encoding_add(obf->enc_vt, obf->pp_vt, res, x, y, obf->pp);
             } else if (op == OP_SUB) {
-                encoding_sub(obf->enc_vt, obf->pp_vt, res, tmp_x, tmp_y, obf->pp);
+                ret = encoding_sub(obf->enc_vt, obf->pp_vt, res, x, y, obf->pp);
             } else {
                 abort();
             }
@@ -607,95 +986,199 @@ static void eval_worker(void *vargs)
         break;
     }
     case OP_SET:
+        if (cache[args[0]] == NULL)
+            return NULL;
         res = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-        mine[ref] = true;
-        encoding_set(obf->enc_vt, res, cache[args[0]]);
+        own = true;
+        circ_count(wargs->allocs, op, 1);
+        ret = encoding_set(obf->enc_vt, res, cache[args[0]]);
         break;
     default:
         fprintf(stderr, "fatal: op not supported\n");
         abort();
     }        
 
+    if (ret == ERR) {
+        encoding_free(obf->enc_vt, res);
+        return NULL;
+    }
+    mine[ref] = own;
     cache[ref] = res;
+    return res;
+}
 
-    ref_list_node *node = &deps->refs[ref];
-    for (size_t i = 0; i < node->cur; ++i) {
-        const int num = __sync_add_and_fetch(&ready[node->refs[i]], 1);
-        if (num == 2) {
-            work_args *newargs = my_calloc(1, sizeof newargs[0]);
-            memcpy(newargs, wargs, sizeof newargs[0]);
-            newargs->ref = node->refs[i];
-            threadpool_add_job(pool, eval_worker, newargs);
-        }
-    }
+static int
+eval_gate(acircref ref, void *vargs)
+{
+    return _eval_gate(vargs, ref) ? OK : ERR;
+}
 
-    free(wargs);
+/* Zero-tests output o given its gate, zprod = Π_k \hat z_{k,s_k,o} (NULL with
+ * no inputs) and rhs = \hat C*_o Π_k \hat w_{k,s_k,o} */
+static void
+zero_test(const obfuscation *obf, raise_eval *raise, const encoding *res,
+          const encoding *zprod, const encoding *rhs, int *rop,
+          unsigned int *kappa)
+{
+    const index_set *const toplevel = obf->pp_vt->toplevel(obf->pp);
+    encoding *out, *lhs;
 
-    // addendum: is this ref an output bit? if so, we should zero test it.
-    ssize_t output = -1;
-    for (size_t i = 0; i < noutputs; i++) {
-        if (ref == c->outputs.buf[i]) {
-            output = i;
-            break;
-        }
+    out = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
+    lhs = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
+
+    /* Compute LHS */
+    if (zprod)
+        encoding_mul(obf->enc_vt, obf->pp_vt, lhs, res, zprod, obf->pp);
+    else
+        encoding_set(obf->enc_vt, lhs, res);
+    if (raise_encoding(obf, raise, lhs, toplevel) == ERR) {
+        fprintf(stderr, "error: raising lhs to toplevel failed\n");
+        *rop = 1;
+        goto cleanup;
+    }
+    if (!index_set_eq(obf->enc_vt->mmap_set(lhs), toplevel)) {
+        fprintf(stderr, "lhs != toplevel\n");
+        index_set_print(obf->enc_vt->mmap_set(lhs));
+        index_set_print(toplevel);
+        *rop = 1;
+        goto cleanup;
+    }
+    if (!index_set_eq(obf->enc_vt->mmap_set(rhs), toplevel)) {
+        fprintf(stderr, "rhs != toplevel\n");
+        index_set_print(obf->enc_vt->mmap_set(rhs));
+        index_set_print(toplevel);
+        *rop = 1;
+        goto cleanup;
     }
+    encoding_sub(obf->enc_vt, obf->pp_vt, out, lhs, rhs, obf->pp);
+    *rop = !encoding_is_zero(obf->enc_vt, obf->pp_vt, out, obf->pp);
+    if (kappa)
+        *kappa = encoding_get_degree(obf->enc_vt, out);
+
+cleanup:
+    encoding_free(obf->enc_vt, out);
+    encoding_free(obf->enc_vt, lhs);
+}
 
-    if (output != -1) {
-        encoding *out, *lhs, *rhs, *tmp;
-        const index_set *const toplevel = obf->pp_vt->toplevel(obf->pp);
+/* Trees for the zero-test products of output o, which only depend on the
+ * input and so can be computed alongside the circuit */
+static void
+output_trees(const obfuscation *obf, size_t o, prodtree **zprod,
+             prodtree **wprod)
+{
+    const circ_params_t *cp = &obf->op->cp;
+    const size_t ninputs = cp->n - (cp->circ->consts.n ? 1 : 0);
 
-        out = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-        lhs = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-        rhs = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-        tmp = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
+    *zprod = prodtree_new(obf->enc_vt, obf->pp_vt, obf->pp, ninputs);
+    *wprod = prodtree_new(obf->enc_vt, obf->pp_vt, obf->pp, ninputs + 1);
+    prodtree_set(*wprod, ninputs, obf->Chatstar[o]);
+}
 
-        /* Compute LHS */
-        encoding_set(obf->enc_vt, lhs, res);
-        for (size_t k = 0; k < ninputs; k++) {
-            encoding_set(obf->enc_vt, tmp, lhs);
-            encoding_mul(obf->enc_vt, obf->pp_vt, lhs, tmp,
-                         obf->zhat[k][inputs[k]][output], obf->pp);
-        }
-        raise_encoding(obf, lhs, toplevel);
-        if (!index_set_eq(obf->enc_vt->mmap_set(lhs), toplevel)) {
-            fprintf(stderr, "lhs != toplevel\n");
-            index_set_print(obf->enc_vt->mmap_set(lhs));
-            index_set_print(toplevel);
-            rop[output] = 1;
-            goto cleanup;
-        }
+static void
+output_trees_set(const obfuscation *obf, prodtree *zprod, prodtree *wprod,
+                 size_t o, size_t k, size_t s)
+{
+    prodtree_set(zprod, k, obf->zhat[k][s][o]);
+    prodtree_set(wprod, k, obf->what[k][s][o]);
+}
 
-        /* Compute RHS */
-        encoding_set(obf->enc_vt, rhs, obf->Chatstar[output]);
-        for (size_t k = 0; k < ninputs; k++) {
-            encoding_set(obf->enc_vt, tmp, rhs);
-            encoding_mul(obf->enc_vt, obf->pp_vt, rhs, tmp,
-                         obf->what[k][inputs[k]][output], obf->pp);
-        }
-        if (!index_set_eq(obf->enc_vt->mmap_set(rhs), toplevel)) {
-            fprintf(stderr, "rhs != toplevel\n");
-            index_set_print(obf->enc_vt->mmap_set(rhs));
-            index_set_print(toplevel);
-            rop[output] = 1;
-            goto cleanup;
-        }
-        encoding_sub(obf->enc_vt, obf->pp_vt, out, lhs, rhs, obf->pp);
-        rop[output] = !encoding_is_zero(obf->enc_vt, obf->pp_vt, out, obf->pp);
-        if (kappas)
-            kappas[output] = encoding_get_degree(obf->enc_vt, out);
+/* Starts updating the zero-test products of the outputs that have trees, as
+ * jobs when there are threads to run them */
+static void
+output_trees_start(sched_jobs *jobs, prodtree **zprods, prodtree **wprods,
+                   size_t m)
+{
+    if (jobs->pool == NULL)
+        return;
+    for (size_t o = 0; o < m; ++o) {
+        if (zprods[o] == NULL)
+            continue;
+        prodtree_update_async(zprods[o], jobs);
+        prodtree_update_async(wprods[o], jobs);
+    }
+}
 
-    cleanup:
-        encoding_free(obf->enc_vt, out);
-        encoding_free(obf->enc_vt, lhs);
-        encoding_free(obf->enc_vt, rhs);
-        encoding_free(obf->enc_vt, tmp);
+static void
+output_trees_finish(sched_jobs *jobs, prodtree **zprods, prodtree **wprods,
+                    size_t m)
+{
+    if (jobs->pool) {
+        sched_jobs_wait(jobs);
+        return;
     }
+    for (size_t o = 0; o < m; ++o) {
+        if (zprods[o] == NULL)
+            continue;
+        prodtree_update(zprods[o]);
+        prodtree_update(wprods[o]);
+    }
+}
+
+typedef struct {
+    const obfuscation *obf;
+    raise_eval *raise;
+    const encoding *res;
+    const prodtree *zprod;
+    const prodtree *wprod;
+    int *rop;
+    unsigned int *kappa;
+} zero_test_args;
+
+static void
+zero_test_worker(void *vargs)
+{
+    zero_test_args *const args = vargs;
+    zero_test(args->obf, args->raise, args->res, prodtree_root(args->zprod),
+              prodtree_root(args->wprod), args->rop, args->kappa);
+    free(args);
 }
 
+/* Zero-tests every output that was evaluated, in parallel */
+static void
+zero_tests(const obfuscation *obf, raise_eval *raise, encoding **cache,
+           prodtree **zprods, prodtree **wprods, int *rop,
+           unsigned int *kappas, const eval_ctx *ctx)
+{
+    const circ_params_t *cp = &obf->op->cp;
+    sched_jobs jobs;
+
+    sched_jobs_init(&jobs, cp->m > 1 ? ctx : NULL);
+    for (size_t o = 0; o < cp->m; ++o) {
+        zero_test_args *args;
+        if (cache[cp->circ->outputs.buf[o]] == NULL)
+            continue;           /* pruned from the schedule */
+        args = my_calloc(1, sizeof args[0]);
+        args->obf = obf;
+        args->raise = raise;
+        args->res = cache[cp->circ->outputs.buf[o]];
+        args->zprod = zprods[o];
+        args->wprod = wprods[o];
+        args->rop = &rop[o];
+        args->kappa = kappas ? &kappas[o] : NULL;
+        sched_jobs_add(&jobs, zero_test_worker, args);
+    }
+    sched_jobs_clear(&jobs);
+}
+
+static void
+release_gate(acircref ref, void *vargs)
+{
+    work_args *const wargs = vargs;
+    encoding **cache = wargs->cache;
+
+    /* Outputs are zero-tested once the circuit is done */
+    if (wargs->obf->op->cp.sched->output[ref] != -1)
+        return;
+    if (wargs->mine[ref]) {
+        encoding_free(wargs->obf->enc_vt, cache[ref]);
+        cache[ref] = NULL;
+        wargs->mine[ref] = false;
+    }
+}
 
 static int
 _evaluate(const obfuscation *obf, int *outputs, size_t noutputs,
-          const int *inputs, size_t ninputs, size_t nthreads,
+          const int *inputs, size_t ninputs, const eval_ctx *ctx,
           size_t *kappa, size_t *npowers)
 {
     const circ_params_t *cp = &obf->op->cp;
@@ -715,41 +1198,53 @@ _evaluate(const obfuscation *obf, int *outputs, size_t noutputs,
 
     encoding **cache = my_calloc(acirc_nrefs(c), sizeof cache[0]);
     bool *mine = my_calloc(acirc_nrefs(c), sizeof mine[0]);
-    int *ready = my_calloc(acirc_nrefs(c), sizeof ready[0]);
     unsigned int *kappas = my_calloc(c->outputs.n, sizeof kappas[0]);
     int *input_syms = get_input_syms(inputs, c->ninputs, obf->op->rchunker,
                                      cp->n - has_consts, ell, q, obf->op->sigma);
-    ref_list *deps = ref_list_new(c);
-    threadpool *pool = threadpool_create(nthreads);
-    g_max_npowers = 0;
-
-    if (input_syms == NULL)
+    raise_table *const raise = obf->raise ? obf->raise : _raise_table(obf);
+    raise_eval reval;
+    prodtree **zprods = my_calloc(cp->m, sizeof zprods[0]);
+    prodtree **wprods = my_calloc(cp->m, sizeof wprods[0]);
+    sched_jobs trees;
+    work_args args;
+
+    raise_eval_init(&reval, raise);
+    sched_jobs_init(&trees, ctx);
+    if (input_syms == NULL || cp->sched == NULL)
+        goto finish;
+    if (_load_inputs(obf, input_syms, cp->n - has_consts, ctx->nthreads) == ERR)
         goto finish;
 
-    for (size_t ref = 0; ref < acirc_nrefs(c); ref++) {
-        acirc_operation op = c->gates.gates[ref].op;
-        if (!(op == OP_INPUT || op == OP_CONST))
-            continue;
-        work_args *args = calloc(1, sizeof args[0]);
-        args->mmap   = obf->mmap;
-        args->ref    = ref;
-        args->c      = c;
-        args->inputs = input_syms;
-        args->obf    = obf;
-        args->mine   = mine;
-        args->ready  = ready;
-        args->cache  = cache;
-        args->deps   = deps;
-        args->pool   = pool;
-        args->rop    = outputs;
-        args->kappas = kappas;
-        threadpool_add_job(pool, eval_worker, args);
+    for (size_t o = 0; o < cp->m; ++o) {
+        if (cp->sched->output[c->outputs.buf[o]] == -1)
+            continue;           /* pruned from the schedule */
+        output_trees(obf, o, &zprods[o], &wprods[o]);
+        for (size_t k = 0; k < cp->n - has_consts; ++k)
+            output_trees_set(obf, zprods[o], wprods[o], o, k, input_syms[k]);
     }
-    ret = OK;
+    /* The zero-test products don't need the circuit, so start on them now */
+    output_trees_start(&trees, zprods, wprods, cp->m);
+
+    args.mmap   = obf->mmap;
+    args.c      = c;
+    args.inputs = input_syms;
+    args.obf    = obf;
+    args.raise  = &reval;
+    args.mine   = mine;
+    args.cache  = cache;
+    args.rop    = outputs;
+    args.kappas = kappas;
+    args.state  = NULL;
+    memset(args.allocs, '\0', sizeof args.allocs);
+    ret = sched_run_ctx(cp->sched, eval_gate, release_gate, &args, ctx);
+    output_trees_finish(&trees, zprods, wprods, cp->m);
+    if (ret == OK)
+        zero_tests(obf, &reval, cache, zprods, wprods, outputs, kappas, ctx);
+    if (g_verbose)
+        circ_counts_print("allocs:", args.allocs);
 
 finish:
-    threadpool_destroy(pool);
-
+    sched_jobs_clear(&trees);
     if (kappa) {
         unsigned int maxkappa = 0;
         for (size_t i = 0; i < noutputs; i++) {
@@ -759,20 +1254,433 @@ finish:
         *kappa = maxkappa;
     }
     if (npowers)
-        *npowers = g_max_npowers;
+        *npowers = reval.maxpower;
+    if (g_verbose)
+        fprintf(stderr, "raise mults:     %lu\n", reval.nmuls);
 
     for (size_t i = 0; i < acirc_nrefs(c); i++) {
         if (mine[i]) {
             encoding_free(obf->enc_vt, cache[i]);
         }
     }
-    ref_list_free(deps, c);
+    for (size_t o = 0; o < cp->m; ++o) {
+        prodtree_free(zprods[o]);
+        prodtree_free(wprods[o]);
+    }
+    free(zprods);
+    free(wprods);
     free(cache);
     free(mine);
-    free(ready);
     free(kappas);
     free(input_syms);
+    if (raise != obf->raise)
+        raise_table_free(raise);
+
+    return ret;
+}
+
+struct obf_state {
+    const obfuscation *obf;
+    bool first;                 // nothing evaluated yet
+    int *syms;                  // [ninputs], symbols of the previous input
+    size_t nwords;
+    uint64_t *deps;             // [nrefs][nwords], symbols each gate's cone reads
+    uint64_t *changed;          // [nwords], symbols that differ from the previous input
+    encoding **cache;           // [nrefs], every gate of the previous input
+    bool *mine;                 // [nrefs]
+    raise_table *raise;
+    raise_eval reval;           // counts across every input, as gates are reused
+    prodtree **zprods;          // [m], Π_k \hat z_{k,s_k,o}
+    prodtree **wprods;          // [m], \hat C*_o Π_k \hat w_{k,s_k,o}
+    int *rop;                   // [m], outputs of the previous input
+    unsigned int *kappas;       // [m]
+    size_t nevals;              // gates recomputed by the last evaluation
+};
 
+static void
+_free_state(obf_state *st)
+{
+    if (st == NULL)
+        return;
+    const obfuscation *const obf = st->obf;
+    const circ_params_t *cp = &obf->op->cp;
+
+    for (size_t ref = 0; ref < acirc_nrefs(cp->circ); ++ref) {
+        if (st->mine[ref])
+            encoding_free(obf->enc_vt, st->cache[ref]);
+    }
+    for (size_t o = 0; o < cp->m; ++o) {
+        prodtree_free(st->zprods[o]);
+        prodtree_free(st->wprods[o]);
+    }
+    if (st->raise != obf->raise)
+        raise_table_free(st->raise);
+    free(st->syms);
+    free(st->deps);
+    free(st->changed);
+    free(st->cache);
+    free(st->mine);
+    free(st->zprods);
+    free(st->wprods);
+    free(st->rop);
+    free(st->kappas);
+    free(st);
+}
+
+static obf_state *
+_state_new(const obfuscation *obf)
+{
+    const circ_params_t *cp = &obf->op->cp;
+    const acirc *const c = cp->circ;
+    const size_t ninputs = cp->n - (c->consts.n ? 1 : 0);
+    const size_t nrefs = acirc_nrefs(c);
+    obf_state *st;
+
+    st = my_calloc(1, sizeof st[0]);
+    st->obf = obf;
+    st->first = true;
+    st->syms = my_calloc(ninputs, sizeof st->syms[0]);
+    st->nwords = (ninputs + 63) / 64;
+    st->deps = my_calloc(nrefs * st->nwords, sizeof st->deps[0]);
+    st->changed = my_calloc(st->nwords, sizeof st->changed[0]);
+    st->cache = my_calloc(nrefs, sizeof st->cache[0]);
+    st->mine = my_calloc(nrefs, sizeof st->mine[0]);
+    st->raise = obf->raise ? obf->raise : _raise_table(obf);
+    raise_eval_init(&st->reval, st->raise);
+    st->zprods = my_calloc(cp->m, sizeof st->zprods[0]);
+    st->wprods = my_calloc(cp->m, sizeof st->wprods[0]);
+    for (size_t o = 0; o < cp->m; ++o) {
+        if (cp->sched->output[c->outputs.buf[o]] != -1)
+            output_trees(obf, o, &st->zprods[o], &st->wprods[o]);
+    }
+    st->rop = my_calloc(cp->m, sizeof st->rop[0]);
+    st->kappas = my_calloc(cp->m, sizeof st->kappas[0]);
+
+    /* The refs are in topological order, so arguments come first */
+    for (size_t i = 0; i < cp->sched->nsched; ++i) {
+        const acircref ref = cp->sched->refs[i];
+        const acirc_gate_t *const gate = &c->gates.gates[ref];
+        uint64_t *const deps = &st->deps[ref * st->nwords];
+        if (gate->op == OP_INPUT) {
+            const sym_id sym = obf->op->chunker(gate->args[0], c->ninputs, ninputs);
+            deps[sym.sym_number / 64] |= (uint64_t) 1 << (sym.sym_number % 64);
+        } else if (gate->op != OP_CONST) {
+            for (size_t a = 0; a < gate->nargs; ++a)
+                for (size_t w = 0; w < st->nwords; ++w)
+                    deps[w] |= st->deps[gate->args[a] * st->nwords + w];
+        }
+    }
+    return st;
+}
+
+static bool
+_stale(const obf_state *st, acircref ref)
+{
+    if (st->first)
+        return true;
+    for (size_t w = 0; w < st->nwords; ++w)
+        if (st->deps[ref * st->nwords + w] & st->changed[w])
+            return true;
+    return false;
+}
+
+static int
+incr_gate(acircref ref, void *vargs)
+{
+    work_args *const wargs = vargs;
+    obf_state *const st = wargs->state;
+    encoding *old;
+
+    if (!_stale(st, ref))
+        return OK;
+    old = st->mine[ref] ? st->cache[ref] : NULL;
+    if (_eval_gate(wargs, ref) == NULL)
+        return ERR;
+    encoding_free(wargs->obf->enc_vt, old);
+    __sync_fetch_and_add(&st->nevals, 1);
+    return OK;
+}
+
+static int
+_evaluate_incremental(const obfuscation *obf, obf_state **state, int *outputs,
+                      size_t noutputs, const int *inputs, size_t ninputs,
+                      const eval_ctx *ctx, size_t *kappa, size_t *npowers)
+{
+    const circ_params_t *cp = &obf->op->cp;
+    const acirc *const c = cp->circ;
+    const size_t has_consts = cp->circ->consts.n ? 1 : 0;
+    const size_t nsyms = cp->n - has_consts;
+    const size_t ell = array_max(cp->ds, nsyms);
+    const size_t q = array_max(cp->qs, nsyms);
+    int *input_syms = NULL;
+    bool changed = false;
+    obf_state *st;
+    int ret = ERR;
+
+    if (ninputs != c->ninputs) {
+        fprintf(stderr, "error: obf evaluate: invalid number of inputs\n");
+        return ERR;
+    } else if (noutputs != cp->m) {
+        fprintf(stderr, "error: obf evaluate: invalid number of outputs\n");
+        return ERR;
+    } else if (cp->sched == NULL) {
+        return ERR;
+    }
+    input_syms = get_input_syms(inputs, c->ninputs, obf->op->rchunker, nsyms,
+                                ell, q, obf->op->sigma);
+    if (input_syms == NULL)
+        return ERR;
+    if (_load_inputs(obf, input_syms, nsyms, ctx->nthreads) == ERR)
+        goto cleanup;
+    if (*state == NULL)
+        *state = _state_new(obf);
+    st = *state;
+
+    memset(st->changed, '\0', st->nwords * sizeof st->changed[0]);
+    for (size_t k = 0; k < nsyms; ++k) {
+        const size_t s = input_syms[k];
+        if (!st->first && st->syms[k] == input_syms[k])
+            continue;
+        st->changed[k / 64] |= (uint64_t) 1 << (k % 64);
+        st->syms[k] = input_syms[k];
+        changed = true;
+        for (size_t o = 0; o < cp->m; ++o) {
+            if (st->zprods[o])
+                output_trees_set(obf, st->zprods[o], st->wprods[o], o, k, s);
+        }
+    }
+
+    st->nevals = 0;
+    if (st->first || changed) {
+        /* Any changed symbol changes every output's \hat z and \hat w */
+        const size_t nmuls = st->reval.nmuls;
+        sched_jobs trees;
+        work_args args;
+        int res;
+
+        sched_jobs_init(&trees, ctx);
+        output_trees_start(&trees, st->zprods, st->wprods, cp->m);
+        args.mmap   = obf->mmap;
+        args.c      = c;
+        args.inputs = input_syms;
+        args.obf    = obf;
+        args.raise  = &st->reval;
+        args.mine   = st->mine;
+        args.cache  = st->cache;
+        args.rop    = NULL;
+        args.kappas = NULL;
+        args.state  = st;
+        memset(args.allocs, '\0', sizeof args.allocs);
+        /* Every gate is kept for the next input, so nothing is released */
+        res = sched_run_ctx(cp->sched, incr_gate, NULL, &args, ctx);
+        output_trees_finish(&trees, st->zprods, st->wprods, cp->m);
+        sched_jobs_clear(&trees);
+        if (res == ERR)
+            goto cleanup;
+        zero_tests(obf, &st->reval, st->cache, st->zprods, st->wprods, st->rop,
+                   st->kappas, ctx);
+        if (g_verbose) {
+            circ_counts_print("allocs:", args.allocs);
+            fprintf(stderr, "raise mults:     %lu\n", st->reval.nmuls - nmuls);
+        }
+    }
+    st->first = false;
+    if (g_verbose)
+        fprintf(stderr, "recomputed:      %lu of %lu gates\n", st->nevals,
+                cp->sched->nsched);
+
+    memcpy(outputs, st->rop, cp->m * sizeof outputs[0]);
+    if (kappa) {
+        unsigned int maxkappa = 0;
+        for (size_t o = 0; o < cp->m; o++) {
+            if (st->kappas[o] > maxkappa)
+                maxkappa = st->kappas[o];
+        }
+        *kappa = maxkappa;
+    }
+    if (npowers)
+        *npowers = st->reval.maxpower;
+    ret = OK;
+cleanup:
+    if (ret == ERR && *state) {
+        /* The state may be half updated, so start over next time */
+        _free_state(*state);
+        *state = NULL;
+    }
+    free(input_syms);
+    return ret;
+}
+
+/* Symbolic evaluation for _kappa: the index set and degree of each gate */
+typedef struct {
+    const obf_params_t *op;
+    index_set **ixs;            // [nrefs]
+    size_t *degs;               // [nrefs]
+    size_t maxpower;
+} kappa_args;
+
+/* Raises ix to target like raise_encoding, returning the degree it adds */
+static size_t
+kappa_raise(kappa_args *kargs, index_set *ix, const index_set *target)
+{
+    const circ_params_t *cp = &kargs->op->cp;
+    const size_t ninputs = cp->n - (cp->circ->consts.n ? 1 : 0);
+    const size_t npowers = kargs->op->npowers;
+    index_set_buf buf;
+    index_set *const diff = index_set_init(&buf, target->nzs);
+    size_t deg = 0;
+
+    if (index_set_sub(diff, target, ix) == ERR)
+        goto cleanup;
+    for (size_t k = 0; k < ninputs; k++) {
+        for (size_t s = 0; s < cp->qs[k]; s++) {
+            deg += raise_degree(npowers, ix_s_get(diff, cp, k, s),
+                                &kargs->maxpower);
+            ix_s_set(ix, cp, k, s, ix_s_get(target, cp, k, s));
+        }
+    }
+    deg += raise_degree(npowers, ix_y_get(diff, cp), &kargs->maxpower);
+    ix_y_set(ix, cp, ix_y_get(target, cp));
+cleanup:
+    index_set_release(&buf);
+    return deg;
+}
+
+static int
+kappa_gate(acircref ref, void *vargs)
+{
+    kappa_args *const kargs = vargs;
+    const obf_params_t *const op = kargs->op;
+    const circ_params_t *cp = &op->cp;
+    const acirc *const c = cp->circ;
+    const size_t ninputs = cp->n - (c->consts.n ? 1 : 0);
+    const acircref *const args = c->gates.gates[ref].args;
+    index_set *const ix = index_set_new(obf_params_nzs(cp));
+    size_t deg = 1;
+
+    switch (c->gates.gates[ref].op) {
+    case OP_INPUT: {
+        /* Every symbol's \hat s sits at the same place, so take s = 0 */
+        const sym_id sym = op->chunker(args[0], c->ninputs, ninputs);
+        ix_s_set(ix, cp, sym.sym_number, 0, 1);
+        break;
+    }
+    case OP_CONST:
+        ix_y_set(ix, cp, 1);
+        break;
+    case OP_MUL:
+        index_set_add(ix, kargs->ixs[args[0]], kargs->ixs[args[1]]);
+        deg = kargs->degs[args[0]] + kargs->degs[args[1]];
+        break;
+    case OP_ADD: case OP_SUB: {
+        const index_set *const xs = kargs->ixs[args[0]];
+        const index_set *const ys = kargs->ixs[args[1]];
+        size_t xdeg = kargs->degs[args[0]], ydeg = kargs->degs[args[1]];
+        index_set_buf buf;
+        index_set *const tmp = index_set_init(&buf, ix->nzs);
+
+        index_set_max(ix, xs, ys);
+        if (!index_set_eq(ix, xs)) {
+            index_set_set(tmp, xs);
+            xdeg += kappa_raise(kargs, tmp, ix);
+        }
+        if (!index_set_eq(ix, ys)) {
+            index_set_set(tmp, ys);
+            ydeg += kappa_raise(kargs, tmp, ix);
+        }
+        index_set_release(&buf);
+        deg = xdeg > ydeg ? xdeg : ydeg;
+        break;
+    }
+    case OP_SET:
+        index_set_set(ix, kargs->ixs[args[0]]);
+        deg = kargs->degs[args[0]];
+        break;
+    default:
+        fprintf(stderr, "fatal: op not supported\n");
+        abort();
+    }
+    kargs->ixs[ref] = ix;
+    kargs->degs[ref] = deg;
+    return OK;
+}
+
+static void
+kappa_release(acircref ref, void *vargs)
+{
+    kappa_args *const kargs = vargs;
+
+    if (kargs->op->cp.sched->output[ref] != -1)
+        return;
+    index_set_free(kargs->ixs[ref]);
+    kargs->ixs[ref] = NULL;
+}
+
+static int
+_kappa(const obf_params_t *op, size_t *kappa, size_t *npowers)
+{
+    const circ_params_t *cp = &op->cp;
+    const acirc *const c = cp->circ;
+    const size_t ninputs = cp->n - (c->consts.n ? 1 : 0);
+    const size_t nzs = obf_params_nzs(cp);
+    index_set *const toplevel = obf_params_new_toplevel(cp, nzs);
+    index_set *const lhs = index_set_new(nzs);
+    index_set *const zhat = index_set_new(nzs);
+    out_degrees *degs = NULL;
+    kappa_args args;
+    size_t maxkappa = 0;
+    int ret = ERR;
+
+    args.op = op;
+    args.ixs = my_calloc(acirc_nrefs(c), sizeof args.ixs[0]);
+    args.degs = my_calloc(acirc_nrefs(c), sizeof args.degs[0]);
+    args.maxpower = 0;
+    if (cp->sched == NULL)
+        goto cleanup;
+    if (sched_run(cp->sched, kappa_gate, kappa_release, &args, 1) == ERR)
+        goto cleanup;
+
+    /* Mirrors zero_test, with the \hat z of symbol 0 for every input */
+    degs = _out_degrees_new(cp);
+    for (size_t o = 0; o < cp->m; o++) {
+        const acircref ref = c->outputs.buf[o];
+        size_t deg;
+
+        if (cp->sched->output[ref] == -1)
+            continue;           /* pruned from the schedule */
+        index_set_set(lhs, args.ixs[ref]);
+        for (size_t k = 0; k < ninputs; k++) {
+            _zhat_ix(zhat, cp, degs, k, 0, o);
+            index_set_add(lhs, lhs, zhat);
+        }
+        deg = args.degs[ref] + ninputs + kappa_raise(&args, lhs, toplevel);
+        if (!index_set_eq(lhs, toplevel)) {
+            fprintf(stderr, "lhs != toplevel\n");
+            index_set_print(lhs);
+            index_set_print(toplevel);
+            goto cleanup;
+        }
+        /* The RHS is \hat C*_o times one \hat w per input */
+        if (deg < ninputs + 1)
+            deg = ninputs + 1;
+        if (deg > maxkappa)
+            maxkappa = deg;
+    }
+    if (kappa)
+        *kappa = maxkappa;
+    if (npowers)
+        *npowers = args.maxpower;
+    ret = OK;
+cleanup:
+    for (size_t i = 0; i < acirc_nrefs(c); i++)
+        index_set_free(args.ixs[i]);
+    free(args.ixs);
+    free(args.degs);
+    if (degs)
+        _out_degrees_free(degs);
+    index_set_free(zhat);
+    index_set_free(lhs);
+    index_set_free(toplevel);
     return ret;
 }
 
@@ -782,4 +1690,8 @@ obfuscator_vtable lz_obfuscator_vtable = {
     .evaluate = _evaluate,
     .fwrite = _fwrite,
     .fread = _fread,
+    .obfuscate_fwrite = _obfuscate_fwrite,
+    .evaluate_incremental = _evaluate_incremental,
+    .free_state = _free_state,
+    .kappa = _kappa,
 };
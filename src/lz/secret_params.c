@@ -41,6 +41,23 @@ _sp_init(secret_params *sp, mmap_params_t *params, const obf_params_t *op,
     return OK;
 }
 
+static int
+_sp_fwrite(const secret_params *sp, FILE *fp)
+{
+    (void) sp; (void) fp;
+    return OK;
+}
+
+static int
+_sp_fread(secret_params *sp, const circ_params_t *cp, FILE *fp)
+{
+    (void) fp;
+    spinfo(sp) = my_calloc(1, sizeof spinfo(sp)[0]);
+    spinfo(sp)->toplevel = obf_params_new_toplevel(cp, obf_params_nzs(cp));
+    spinfo(sp)->cp = cp;
+    return OK;
+}
+
 static void
 _sp_clear(secret_params *sp)
 {
@@ -63,6 +80,8 @@ _sp_params(const secret_params *sp)
 static sp_vtable _sp_vtable = {
     .mmap = NULL,
     .init = _sp_init,
+    .fwrite = _sp_fwrite,
+    .fread = _sp_fread,
     .clear = _sp_clear,
     .toplevel = _sp_toplevel,
     .params = _sp_params,
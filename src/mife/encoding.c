@@ -28,6 +28,12 @@ _encoding_free(encoding *enc)
     }
 }
 
+static void
+_encoding_reset(encoding *enc)
+{
+    index_set_clear(my(enc)->index);
+}
+
 static int
 _encoding_print(const encoding *enc)
 {
@@ -123,6 +129,7 @@ static encoding_vtable _encoding_vtable =
     .mmap = NULL,
     .new = _encoding_new,
     .free = _encoding_free,
+    .reset = _encoding_reset,
     .print = _encoding_print,
     .encode = _encode,
     .set = _encoding_set,
@@ -3,7 +3,9 @@
 #include "circ.h"
 #include "index_set.h"
 #include "mife_params.h"
-#include "reflist.h"
+#include "prodtree.h"
+#include "raise.h"
+#include "sched.h"
 #include "vtables.h"
 #include "util.h"
 
@@ -37,6 +39,7 @@ typedef struct mife_sk_t {
     public_params *pp;
     mpz_t *const_betas;
     size_t *deg_max;            /* [n] */
+    mpz_t *moduli;              /* [nslots], plaintext moduli of sp */
     bool local;
 } mife_sk_t;
 
@@ -51,9 +54,20 @@ typedef struct mife_ek_t {
     encoding **zhat;            /* [m] */
     encoding ***uhat;           /* [n][npowers] */
     mife_ciphertext_t *constants;
+    raise_table *raise;         /* shared by every decryption */
     bool local;
 } mife_ek_t;
 
+struct mife_partial_t {
+    const mife_ek_t *ek;
+    bool *pinned;               /* [n], slots whose ciphertext is fixed */
+    bool *fixed;                /* [nrefs], gates depending only on pinned slots */
+    bool *keep;                 /* [nrefs], fixed gates the residual cone reads */
+    encoding **encs;            /* [nrefs], set where keep is */
+    encoding **lhs;             /* [m], LHS of fixed outputs, else NULL */
+    encoding **rhs;             /* [m], pinned part of the RHS, or NULL */
+};
+
 typedef struct mife_ciphertext_t {
     const encoding_vtable *enc_vt;
     size_t slot;
@@ -61,6 +75,15 @@ typedef struct mife_ciphertext_t {
     encoding **what;             /* [m] */
 } mife_ciphertext_t;
 
+typedef struct mife_shell_t {
+    const encoding_vtable *enc_vt;
+    size_t slot;
+    mpz_t *betas;               /* [d_i] */
+    encoding **what;            /* [m] */
+    size_t nvals;               /* 0 unless xhat is pre-encoded */
+    encoding **xhat;            /* [nvals * d_i], xhat[v * d_i + j] encodes v */
+} mife_shell_t;
+
 typedef struct {
     const encoding_vtable *vt;
     encoding *enc;
@@ -71,21 +94,24 @@ typedef struct {
     pthread_mutex_t *lock;
     size_t *count;
     size_t total;
+    pthread_cond_t *done;       /* signaled once count reaches total */
 } encode_args_t;
 
 typedef struct {
     const mmap_vtable *mmap;
-    acircref ref;
     const acirc *c;
     mife_ciphertext_t **cts;
     const mife_ek_t *ek;
+    const mife_partial_t *partial; /* residual decryption, or NULL */
+    mife_partial_t *build;      /* partial decryption being built, or NULL */
+    raise_eval *raise;
     bool *mine;
-    int *ready;
     void *cache;
-    ref_list *deps;
-    threadpool *pool;
     int *rop;
     size_t *kappas;
+    encoding **lhs;             /* [m], zero-test LHS of each evaluated output */
+    prodtree **rhs;             /* [m], zero-test RHS of each output */
+    size_t allocs[CIRC_NOPS];
 } decrypt_args_t;
 
 static mife_ciphertext_t *
@@ -152,7 +178,7 @@ eval_circ(const circ_params_t *cp, size_t slot, mpz_t *outputs, mpz_t *inputs,
         refs = _refs;
     } else
         refs = my_calloc(nrefs, sizeof refs[0]);
-    circ_eval(cp->circ, inputs, consts, moduli[1 + slot], refs, nthreads);
+    circ_eval(cp->sched, inputs, consts, moduli[1 + slot], refs, nthreads);
     for (size_t o = 0; o < cp->m; ++o) {
         mpz_set(outputs[o], refs[cp->circ->outputs.buf[o]]);
     }
@@ -170,9 +196,14 @@ encode_worker(void *wargs)
     encode_args_t *const args = wargs;
 
     encode(args->vt, args->enc, args->inps, args->nslots, args->ix, args->sp);
-    if (g_verbose) {
+    if (g_verbose || args->done) {
         pthread_mutex_lock(args->lock);
-        print_progress(++*args->count, args->total);
+        ++*args->count;
+        /* Resident encryptions are reported per request instead */
+        if (g_verbose && args->done == NULL)
+            print_progress(*args->count, args->total);
+        if (args->done && *args->count == args->total)
+            pthread_cond_signal(args->done);
         pthread_mutex_unlock(args->lock);
     }
     mpz_vect_free(args->inps, args->nslots);
@@ -180,10 +211,13 @@ encode_worker(void *wargs)
     free(args);
 }
 
+/* Takes ownership of ix.  done, if not NULL, is signaled once count reaches
+ * total. */
 static void
 __encode(threadpool *pool, const encoding_vtable *vt, encoding *enc, mpz_t *inps,
          size_t nslots, index_set *ix, const secret_params *sp,
-         pthread_mutex_t *lock, size_t *count, size_t total)
+         pthread_mutex_t *lock, size_t *count, size_t total,
+         pthread_cond_t *done)
 {
     encode_args_t *args = my_calloc(1, sizeof args[0]);
     args->vt = vt;
@@ -198,6 +232,7 @@ __encode(threadpool *pool, const encoding_vtable *vt, encoding *enc, mpz_t *inps
     args->lock = lock;
     args->count = count;
     args->total = total;
+    args->done = done;
     threadpool_add_job(pool, encode_worker, args);
 }
 
@@ -314,7 +349,7 @@ mife_setup(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
         }
         IX_Z(ix) = 1;
         __encode(pool, mife->enc_vt, mife->zhat[o], inps, 1 + cp->n,
-                 index_set_copy(ix), mife->sp, &lock, &count, total);
+                 index_set_copy(ix), mife->sp, &lock, &count, total, NULL);
         mpz_clear(delta);
     }
 
@@ -328,7 +363,7 @@ mife_setup(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
             IX_X(ix, cp, i) = 1 << p;
             /* Encode \hat u_p = [1, ..., 1] */
             __encode(pool, mife->enc_vt, mife->uhat[i][p], inps, 1 + cp->n,
-                     index_set_copy(ix), mife->sp, &lock, &count, total);
+                     index_set_copy(ix), mife->sp, &lock, &count, total, NULL);
         }
     }
     if (has_consts) {
@@ -354,7 +389,7 @@ mife_setup(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
         }
         IX_Z(ix) = 1;
         __encode(pool, mife->enc_vt, mife->Chatstar, inps, 1 + cp->n,
-                 index_set_copy(ix), mife->sp, &lock, &count, total);
+                 index_set_copy(ix), mife->sp, &lock, &count, total, NULL);
     }
 
     result = OK;
@@ -389,6 +424,8 @@ mife_sk(const mife_t *mife)
     sk->pp = mife->pp;
     sk->const_betas = mife->const_betas;
     sk->deg_max = mife->deg_max;
+    sk->moduli = mpz_vect_create_of_fmpz(sk->mmap->sk->plaintext_fields(sk->sp->sk),
+                                         sk->mmap->sk->nslots(sk->sp->sk));
     sk->local = false;
     return sk;
 }
@@ -398,6 +435,8 @@ mife_sk_free(mife_sk_t *sk)
 {
     if (sk == NULL)
         return;
+    if (sk->moduli)
+        mpz_vect_free(sk->moduli, sk->mmap->sk->nslots(sk->sp->sk));
     if (sk->local) {
         if (sk->pp)
             public_params_free(sk->pp_vt, sk->pp);
@@ -455,6 +494,8 @@ mife_sk_fread(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp)
     end = current_time();
     if (g_verbose)
         fprintf(stderr, "  Reading sp from disk: %.2fs\n", end - start);
+    sk->moduli = mpz_vect_create_of_fmpz(mmap->sk->plaintext_fields(sk->sp->sk),
+                                         mmap->sk->nslots(sk->sp->sk));
     if (sk->cp->c) {
         sk->const_betas = my_calloc(sk->cp->c, sizeof sk->const_betas[0]);
         for (size_t o = 0; o < sk->cp->c; ++o)
@@ -472,6 +513,21 @@ error:
     return NULL;
 }
 
+static raise_table *
+_raise_table(const mife_ek_t *ek)
+{
+    const circ_params_t *const cp = ek->cp;
+    const index_set *const toplevel = ek->pp_vt->toplevel(ek->pp);
+    raise_table *t;
+
+    /* Never keep more products than the powers they are built from */
+    t = raise_table_new(ek->enc_vt, ek->pp_vt, ek->pp, cp->n, ek->npowers,
+                        cp->n * ek->npowers);
+    for (size_t i = 0; i < cp->n; i++)
+        raise_table_set(t, i, ek->uhat[i], IX_X(toplevel, cp, i));
+    return t;
+}
+
 mife_ek_t *
 mife_ek(const mife_t *mife)
 {
@@ -488,6 +544,7 @@ mife_ek(const mife_t *mife)
     ek->uhat = mife->uhat;
     ek->constants = mife->constants;
     ek->local = false;
+    ek->raise = _raise_table(ek);
     return ek;
 }
 
@@ -496,6 +553,7 @@ mife_ek_free(mife_ek_t *ek)
 {
     if (ek == NULL)
         return;
+    raise_table_free(ek->raise);
     if (ek->local) {
         if (ek->pp)
             public_params_free(ek->pp_vt, ek->pp);
@@ -531,17 +589,27 @@ mife_ek_fwrite(const mife_ek_t *ek, FILE *fp)
         bool_fwrite(false, fp);
         encoding_fwrite(ek->enc_vt, ek->Chatstar, fp);
     }
-    for (size_t o = 0; o < ek->cp->m; ++o)
-        encoding_fwrite(ek->enc_vt, ek->zhat[o], fp);
-    size_t_fwrite(ek->npowers, fp);
-    for (size_t i = 0; i < ek->cp->n; ++i)
-        for (size_t p = 0; p < ek->npowers; ++p)
-            encoding_fwrite(ek->enc_vt, ek->uhat[i][p], fp);
+    if (encodings_fwrite(ek->enc_vt, ek->zhat, ek->cp->m, fp) == ERR)
+        return ERR;
+    if (size_t_fwrite(ek->npowers, fp) == ERR)
+        return ERR;
+    {
+        encoding **uhat = my_calloc(ek->cp->n * ek->npowers, sizeof uhat[0]);
+        int ret;
+        for (size_t i = 0; i < ek->cp->n; ++i)
+            for (size_t p = 0; p < ek->npowers; ++p)
+                uhat[i * ek->npowers + p] = ek->uhat[i][p];
+        ret = encodings_fwrite(ek->enc_vt, uhat, ek->cp->n * ek->npowers, fp);
+        free(uhat);
+        if (ret == ERR)
+            return ERR;
+    }
     return OK;
 }
 
 mife_ek_t *
-mife_ek_fread(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp)
+mife_ek_fread(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp,
+              size_t nthreads)
 {
     const circ_params_t *cp = &op->cp;
     mife_ek_t *ek;
@@ -553,25 +621,44 @@ mife_ek_fread(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp)
     ek->cp = cp;
     ek->enc_vt = get_encoding_vtable(mmap);
     ek->pp_vt = get_pp_vtable(mmap);
-    ek->pp = public_params_fread(ek->pp_vt, op, fp);
-    bool_fread(&has_consts, fp);
+    if ((ek->pp = public_params_fread(ek->pp_vt, op, fp)) == NULL)
+        goto error;
+    if (bool_fread(&has_consts, fp) == ERR)
+        goto error;
     if (has_consts) {
-        if ((ek->constants = mife_ciphertext_fread(ek->mmap, ek->cp, fp)) == NULL)
+        if ((ek->constants = mife_ciphertext_fread(ek->mmap, ek->cp, fp, nthreads)) == NULL)
             goto error;
     } else {
         if ((ek->Chatstar = encoding_fread(ek->enc_vt, fp)) == NULL)
             goto error;
     }
     ek->zhat = my_calloc(cp->m, sizeof ek->zhat[0]);
-    for (size_t o = 0; o < cp->m; ++o)
-        ek->zhat[o] = encoding_fread(ek->enc_vt, fp);
-    size_t_fread(&ek->npowers, fp);
+    if (encodings_fread(ek->enc_vt, ek->zhat, cp->m, fp, nthreads) == ERR)
+        goto error;
+    if (size_t_fread(&ek->npowers, fp) == ERR)
+        goto error;
+    /* uhat[i][p] encodes û^(2^p), so more powers than bits in a size_t is a
+     * corrupt file */
+    if (ek->npowers > 8 * sizeof(size_t)) {
+        fprintf(stderr, "error: evaluation key has %lu powers\n", ek->npowers);
+        ek->npowers = 0;
+        goto error;
+    }
     ek->uhat = my_calloc(ek->cp->n, sizeof ek->uhat[0]);
-    for (size_t i = 0; i < ek->cp->n; ++i) {
+    for (size_t i = 0; i < ek->cp->n; ++i)
         ek->uhat[i] = my_calloc(ek->npowers, sizeof ek->uhat[i][0]);
-        for (size_t p = 0; p < ek->npowers; ++p)
-            ek->uhat[i][p] = encoding_fread(ek->enc_vt, fp);
+    {
+        encoding **uhat = my_calloc(ek->cp->n * ek->npowers, sizeof uhat[0]);
+        const int ret = encodings_fread(ek->enc_vt, uhat, ek->cp->n * ek->npowers,
+                                        fp, nthreads);
+        for (size_t i = 0; i < ek->cp->n; ++i)
+            for (size_t p = 0; p < ek->npowers; ++p)
+                ek->uhat[i][p] = uhat[i * ek->npowers + p];
+        free(uhat);
+        if (ret == ERR)
+            goto error;
     }
+    ek->raise = _raise_table(ek);
     return ek;
 error:
     mife_ek_free(ek);
@@ -598,19 +685,20 @@ mife_ciphertext_fwrite(const mife_ciphertext_t *ct, const circ_params_t *cp,
                        FILE *fp)
 {
     const size_t ninputs = cp->ds[ct->slot];
+    encoding *encs[ninputs + cp->m];
+
     if (size_t_fwrite(ct->slot, fp) == ERR)
         return ERR;
     for (size_t j = 0; j < ninputs; ++j)
-        if (encoding_fwrite(ct->enc_vt, ct->xhat[j], fp) == ERR)
-            return ERR;
+        encs[j] = ct->xhat[j];
     for (size_t o = 0; o < cp->m; ++o)
-        if (encoding_fwrite(ct->enc_vt, ct->what[o], fp) == ERR)
-            return ERR;
-    return OK;
+        encs[ninputs + o] = ct->what[o];
+    return encodings_fwrite(ct->enc_vt, encs, ninputs + cp->m, fp);
 }
 
 mife_ciphertext_t *
-mife_ciphertext_fread(const mmap_vtable *mmap, const circ_params_t *cp, FILE *fp)
+mife_ciphertext_fread(const mmap_vtable *mmap, const circ_params_t *cp, FILE *fp,
+                      size_t nthreads)
 {
     mife_ciphertext_t *ct;
     size_t ninputs;
@@ -625,21 +713,139 @@ mife_ciphertext_fread(const mmap_vtable *mmap, const circ_params_t *cp, FILE *fp
     }
     ninputs = cp->ds[ct->slot];
     ct->xhat = my_calloc(ninputs, sizeof ct->xhat[0]);
-    for (size_t j = 0; j < ninputs; ++j) {
-        if ((ct->xhat[j] = encoding_fread(ct->enc_vt, fp)) == NULL)
-            goto error;
-    }
     ct->what = my_calloc(cp->m, sizeof ct->what[0]);
-    for (size_t o = 0; o < cp->m; ++o)
-        if ((ct->what[o] = encoding_fread(ct->enc_vt, fp)) == NULL)
+    {
+        encoding *encs[ninputs + cp->m];
+        const int ret = encodings_fread(ct->enc_vt, encs, ninputs + cp->m, fp,
+                                        nthreads);
+        for (size_t j = 0; j < ninputs; ++j)
+            ct->xhat[j] = encs[j];
+        for (size_t o = 0; o < cp->m; ++o)
+            ct->what[o] = encs[ninputs + o];
+        if (ret == ERR)
             goto error;
+    }
     return ct;
 error:
     fprintf(stderr, "error: reading ciphertext failed\n");
-    free(ct);
+    if (ct->xhat)
+        mife_ciphertext_free(ct, cp);
+    else
+        free(ct);
     return NULL;
 }
 
+/* Sets up cache for a standalone encryption of total encodings */
+static void
+_encrypt_begin(mife_encrypt_cache_t *cache, size_t nthreads, size_t total)
+{
+    cache->pool = threadpool_create(nthreads);
+    cache->lock = my_calloc(1, sizeof cache->lock[0]);
+    pthread_mutex_init(cache->lock, NULL);
+    cache->count = my_calloc(1, sizeof cache->count[0]);
+    cache->total = total;
+    cache->done = NULL;
+    cache->refs = NULL;
+    if (g_verbose)
+        print_progress(*cache->count, cache->total);
+}
+
+static void
+_encrypt_end(mife_encrypt_cache_t *cache)
+{
+    threadpool_destroy(cache->pool);
+    pthread_mutex_destroy(cache->lock);
+    free(cache->lock);
+    free(cache->count);
+}
+
+/* Encodes \hat xⱼ := [xⱼ, 1, ..., 1, βⱼ, 1, ..., 1] into xhat[j] */
+static void
+_encrypt_xhat(const mife_sk_t *sk, size_t slot, encoding **xhat,
+              const int *inputs, mpz_t *betas, mife_encrypt_cache_t *cache)
+{
+    const circ_params_t *cp = sk->cp;
+    const size_t ninputs = cp->ds[slot];
+    const size_t nslots = 1 + cp->n;
+    index_set *const ix = index_set_new(mife_params_nzs(cp));
+    mpz_t slots[nslots];
+
+    mpz_vect_init(slots, nslots);
+    IX_X(ix, cp, slot) = 1;
+    for (size_t i = 0; i < cp->n; ++i)
+        mpz_set_ui(slots[1 + i], 1);
+    for (size_t j = 0; j < ninputs; ++j) {
+        mpz_set_ui(slots[0], inputs[j]);
+        mpz_set(slots[1 + slot], betas[j]);
+        __encode(cache->pool, sk->enc_vt, xhat[j], slots, nslots,
+                 index_set_copy(ix), sk->sp, cache->lock, cache->count,
+                 cache->total, cache->done);
+    }
+    index_set_free(ix);
+    mpz_vect_clear(slots, nslots);
+}
+
+/* Encodes \hat wₒ = [0, 1, ..., 1, C†ₒ, 1, ..., 1] into what[o] */
+static void
+_encrypt_what(const mife_sk_t *sk, size_t slot, encoding **what,
+              mpz_t *betas, const mpz_t *moduli, size_t nthreads,
+              mife_encrypt_cache_t *cache, bool parallelize_circ_eval)
+{
+    const circ_params_t *cp = sk->cp;
+    const size_t nconsts = cp->circ->consts.n;
+    const size_t has_consts = nconsts ? 1 : 0;
+    const size_t noutputs = cp->m;
+    const size_t nslots = 1 + cp->n;
+    index_set *const ix = index_set_new(mife_params_nzs(cp));
+    mpz_t slots[nslots];
+    mpz_t cs[noutputs];
+    mpz_t const_cs[noutputs];
+    mpz_t circ_inputs[circ_params_ninputs(cp)];
+    mpz_t consts[nconsts];
+    size_t _nthreads = parallelize_circ_eval ? nthreads : 0;
+
+    mpz_vect_init(cs, noutputs);
+    mpz_vect_init(const_cs, noutputs);
+    mpz_vect_init(circ_inputs, circ_params_ninputs(cp));
+    mpz_vect_init(consts, nconsts);
+
+    populate_circ_input(cp, slot, circ_inputs, consts, betas);
+    eval_circ(cp, slot, cs, circ_inputs, consts, moduli, cache->refs, _nthreads);
+    if (slot == 0 && has_consts) {
+        populate_circ_input(cp, cp->n - 1, circ_inputs, consts, sk->const_betas);
+        eval_circ(cp, cp->n - 1, const_cs, circ_inputs, consts, moduli,
+                  cache->refs, _nthreads);
+    }
+
+    IX_W(ix, cp, slot) = 1;
+    if (slot == 0 && has_consts) {
+        for (size_t i = 0; i < cp->n; ++i)
+            IX_X(ix, cp, i) = sk->deg_max[i];
+        IX_W(ix, cp, cp->n - 1) = 1;
+        IX_Z(ix) = 1;
+    }
+    mpz_vect_init(slots, nslots);
+    for (size_t i = 0; i < cp->n; ++i)
+        mpz_set_ui(slots[1 + i], 1);
+    mpz_set_ui(slots[0], 0);
+    for (size_t o = 0; o < noutputs; ++o) {
+        mpz_set(slots[1 + slot], cs[o]);
+        if (slot == 0 && has_consts) {
+            mpz_set(slots[cp->n], const_cs[o]);
+        }
+        __encode(cache->pool, sk->enc_vt, what[o], slots, nslots,
+                 index_set_copy(ix), sk->sp, cache->lock, cache->count,
+                 cache->total, cache->done);
+    }
+    index_set_free(ix);
+
+    mpz_vect_clear(circ_inputs, circ_params_ninputs(cp));
+    mpz_vect_clear(consts, nconsts);
+    mpz_vect_clear(cs, noutputs);
+    mpz_vect_clear(const_cs, noutputs);
+    mpz_vect_clear(slots, nslots);
+}
+
 static mife_ciphertext_t *
 _mife_encrypt(const mife_sk_t *sk, const size_t slot, const int *inputs,
               size_t nthreads, aes_randstate_t rng, mife_encrypt_cache_t *cache,
@@ -648,7 +854,7 @@ _mife_encrypt(const mife_sk_t *sk, const size_t slot, const int *inputs,
     mife_ciphertext_t *ct;
     double start, end, _start, _end;
     const circ_params_t *cp = sk->cp;
-    mpz_t *refs = cache ? cache->refs : NULL;
+    mife_encrypt_cache_t local;
 
     if (g_verbose && !cache)
         fprintf(stderr, "  Encrypting...\n");
@@ -657,14 +863,8 @@ _mife_encrypt(const mife_sk_t *sk, const size_t slot, const int *inputs,
     _start = current_time();
 
     const size_t ninputs = cp->ds[slot];
-    const size_t nconsts = cp->circ->consts.n;
-    const size_t has_consts = nconsts ? 1 : 0;
     const size_t noutputs = cp->m;
-    mpz_t *const moduli =
-        mpz_vect_create_of_fmpz(sk->mmap->sk->plaintext_fields(sk->sp->sk),
-                                sk->mmap->sk->nslots(sk->sp->sk));
-    index_set *const ix = index_set_new(mife_params_nzs(cp));
-    mpz_t slots[1 + cp->n];
+    const mpz_t *const moduli = sk->moduli;
     mpz_t *betas;
 
     ct = my_calloc(1, sizeof ct[0]);
@@ -677,7 +877,6 @@ _mife_encrypt(const mife_sk_t *sk, const size_t slot, const int *inputs,
     for (size_t o = 0; o < noutputs; ++o)
         ct->what[o] = encoding_new(sk->enc_vt, sk->pp_vt, sk->pp);
 
-    mpz_vect_init(slots, 1 + cp->n);
     betas = _betas ? _betas : mpz_vect_new(ninputs);
     for (size_t j = 0; j < ninputs; ++j)
         mpz_randomm_inv(betas[j], rng, moduli[1 + slot]);
@@ -686,101 +885,22 @@ _mife_encrypt(const mife_sk_t *sk, const size_t slot, const int *inputs,
     if (g_verbose && !cache)
         fprintf(stderr, "    Initialize: %.2fs\n", _end - _start);
 
-    threadpool *pool;
-    pthread_mutex_t *lock;
-    size_t *count, total;
-    
-    if (cache) {
-        pool = cache->pool;
-        lock = cache->lock;
-        count = cache->count;
-        total = cache->total;
-    } else {
-        pool = threadpool_create(nthreads);
-        lock = my_calloc(1, sizeof lock[0]);
-        pthread_mutex_init(lock, NULL);
-        count = my_calloc(1, sizeof count[0]);
-        total = mife_num_encodings_encrypt(cp, slot);
-    }
-
     _start = current_time();
-
-    if (g_verbose && !cache)
-        print_progress(*count, total);
-    
-    /* Encode \hat xⱼ */
-    index_set_clear(ix);
-    IX_X(ix, cp, slot) = 1;
-    for (size_t i = 0; i < cp->n; ++i)
-        mpz_set_ui(slots[1 + i], 1);
-    for (size_t j = 0; j < ninputs; ++j) {
-        mpz_set_ui(slots[0], inputs[j]);
-        mpz_set(slots[1 + slot], betas[j]);
-        /* Encode \hat xⱼ := [xⱼ, 1, ..., 1, βⱼ, 1, ..., 1] */
-        __encode(pool, sk->enc_vt, ct->xhat[j], slots, 1 + cp->n,
-                 index_set_copy(ix), sk->sp, lock, count, total);
-    }
-    /* Encode \hat wₒ */
+    if (cache == NULL)
+        _encrypt_begin(&local, nthreads, mife_num_encodings_encrypt(cp, slot));
+    _encrypt_xhat(sk, slot, ct->xhat, inputs, betas, cache ? cache : &local);
     if (!_betas) {
-        mpz_t cs[noutputs];
-        mpz_t const_cs[noutputs];
-        mpz_t circ_inputs[circ_params_ninputs(cp)];
-        mpz_t consts[nconsts];
-        size_t _nthreads = parallelize_circ_eval ? nthreads : 0;
-
-        mpz_vect_init(cs, noutputs);
-        mpz_vect_init(const_cs, noutputs);
-        mpz_vect_init(circ_inputs, circ_params_ninputs(cp));
-        mpz_vect_init(consts, nconsts);
-
-        populate_circ_input(cp, slot, circ_inputs, consts, betas);
-        eval_circ(cp, slot, cs, circ_inputs, consts, moduli, refs, _nthreads);
-        if (slot == 0 && has_consts) {
-            populate_circ_input(cp, cp->n - 1, circ_inputs, consts, sk->const_betas);
-            eval_circ(cp, cp->n - 1, const_cs, circ_inputs, consts, moduli, refs, _nthreads);
-        }
-
-        index_set_clear(ix);
-        IX_W(ix, cp, slot) = 1;
-        if (slot == 0 && has_consts) {
-            for (size_t i = 0; i < cp->n; ++i)
-                IX_X(ix, cp, i) = sk->deg_max[i];
-            IX_W(ix, cp, cp->n - 1) = 1;
-            IX_Z(ix) = 1;
-        }
-        mpz_set_ui(slots[0], 0);
-        for (size_t o = 0; o < noutputs; ++o) {
-            mpz_set(slots[1 + slot], cs[o]);
-            if (slot == 0 && has_consts) {
-                mpz_set(slots[cp->n], const_cs[o]);
-            }
-            /* Encode \hat wₒ = [0, 1, ..., 1, C†ₒ, 1, ..., 1] */
-            __encode(pool, sk->enc_vt, ct->what[o], slots, 1 + cp->n,
-                     index_set_copy(ix), sk->sp, lock, count, total);
-        }
-
-        mpz_vect_clear(circ_inputs, circ_params_ninputs(cp));
-        mpz_vect_clear(consts, nconsts);
+        _encrypt_what(sk, slot, ct->what, betas, moduli, nthreads,
+                      cache ? cache : &local, parallelize_circ_eval);
         mpz_vect_free(betas, ninputs);
-        mpz_vect_clear(cs, noutputs);
-        mpz_vect_clear(const_cs, noutputs);
-    }
-
-    if (!cache) {
-        threadpool_destroy(pool);
-        pthread_mutex_destroy(lock);
-        free(lock);
-        free(count);
     }
+    if (cache == NULL)
+        _encrypt_end(&local);
 
     _end = current_time();
     if (g_verbose && !cache)
         fprintf(stderr, "    Encode: %.2fs\n", _end - _start);
 
-    index_set_free(ix);
-    mpz_vect_clear(slots, 1 + cp->n);
-    mpz_vect_free(moduli, sk->mmap->sk->nslots(sk->sp->sk));
-
     end = current_time();
     if (g_verbose && !cache)
         fprintf(stderr, "    Total: %.2fs\n", end - start);
@@ -801,77 +921,337 @@ mife_encrypt(const mife_sk_t *sk, const size_t slot, const int *inputs,
                          parallelize_circ_eval);
 }
 
-static void
-_raise_encoding(const mife_ek_t *ek, encoding *x, encoding **us, size_t diff)
+struct mife_encrypter_t {
+    const mife_sk_t *sk;
+    size_t nthreads;
+    mife_encrypt_cache_t cache;
+    pthread_cond_t done;
+};
+
+mife_encrypter_t *
+mife_encrypter_new(const mife_sk_t *sk, size_t nthreads)
+{
+    mife_encrypter_t *e;
+
+    if (sk == NULL)
+        return NULL;
+    e = my_calloc(1, sizeof e[0]);
+    e->sk = sk;
+    e->nthreads = nthreads;
+    e->cache.pool = threadpool_create(nthreads);
+    e->cache.lock = my_calloc(1, sizeof e->cache.lock[0]);
+    pthread_mutex_init(e->cache.lock, NULL);
+    e->cache.count = my_calloc(1, sizeof e->cache.count[0]);
+    pthread_cond_init(&e->done, NULL);
+    e->cache.done = &e->done;
+    e->cache.refs = mpz_vect_new(acirc_nrefs(sk->cp->circ));
+    return e;
+}
+
+mife_ciphertext_t *
+mife_encrypter_encrypt(mife_encrypter_t *e, size_t slot, const int *inputs,
+                       aes_randstate_t rng)
 {
-    while (diff > 0) {
-        size_t p = 0;
-        while (((size_t) 1 << (p+1)) <= diff && (p+1) < ek->npowers)
-            p++;
-        encoding_mul(ek->enc_vt, ek->pp_vt, x, x, us[p], ek->pp);
-        diff -= (1 << p);
+    mife_ciphertext_t *ct;
+
+    if (e == NULL || slot >= e->sk->cp->n || inputs == NULL) {
+        fprintf(stderr, "error: mife encrypt: invalid input\n");
+        return NULL;
     }
+    *e->cache.count = 0;
+    e->cache.total = mife_num_encodings_encrypt(e->sk->cp, slot);
+    ct = _mife_encrypt(e->sk, slot, inputs, e->nthreads, rng, &e->cache, NULL,
+                       true);
+    /* The pool outlives this call, so wait for its jobs instead */
+    pthread_mutex_lock(e->cache.lock);
+    while (*e->cache.count < e->cache.total)
+        pthread_cond_wait(&e->done, e->cache.lock);
+    pthread_mutex_unlock(e->cache.lock);
+    return ct;
 }
 
-static int
-raise_encoding(const mife_ek_t *ek, encoding *x, const index_set *target)
+void
+mife_encrypter_free(mife_encrypter_t *e)
 {
-    const circ_params_t *const cp = ek->cp;
-    const size_t has_consts = cp->c ? 1 : 0;
-    index_set *ix;
-    size_t diff;
+    if (e == NULL)
+        return;
+    _encrypt_end(&e->cache);
+    pthread_cond_destroy(&e->done);
+    mpz_vect_free(e->cache.refs, acirc_nrefs(e->sk->cp->circ));
+    free(e);
+}
+
+mife_shell_t *
+mife_encrypt_offline(const mife_sk_t *sk, size_t slot, size_t nvals,
+                     size_t nthreads, aes_randstate_t rng)
+{
+    mife_shell_t *shell;
+    mife_encrypt_cache_t cache;
+    double start, end;
+
+    if (sk == NULL || slot >= sk->cp->n) {
+        fprintf(stderr, "error: mife encrypt: invalid input\n");
+        return NULL;
+    }
+    const circ_params_t *cp = sk->cp;
+    const size_t ninputs = cp->ds[slot];
+    const mpz_t *const moduli = sk->moduli;
+
+    start = current_time();
+    shell = my_calloc(1, sizeof shell[0]);
+    shell->enc_vt = sk->enc_vt;
+    shell->slot = slot;
+    shell->betas = mpz_vect_new(ninputs);
+    for (size_t j = 0; j < ninputs; ++j)
+        mpz_randomm_inv(shell->betas[j], rng, moduli[1 + slot]);
+    shell->what = my_calloc(cp->m, sizeof shell->what[0]);
+    for (size_t o = 0; o < cp->m; ++o)
+        shell->what[o] = encoding_new(sk->enc_vt, sk->pp_vt, sk->pp);
+    if (nvals) {
+        shell->nvals = nvals;
+        shell->xhat = my_calloc(shell->nvals * ninputs, sizeof shell->xhat[0]);
+        for (size_t i = 0; i < shell->nvals * ninputs; ++i)
+            shell->xhat[i] = encoding_new(sk->enc_vt, sk->pp_vt, sk->pp);
+    }
+
+    _encrypt_begin(&cache, nthreads, mife_num_encodings_offline(cp, slot, nvals));
+    _encrypt_what(sk, slot, shell->what, shell->betas, moduli, nthreads, &cache,
+                  true);
+    for (size_t v = 0; v < shell->nvals; ++v) {
+        int inputs[ninputs];
+        for (size_t j = 0; j < ninputs; ++j)
+            inputs[j] = v;
+        _encrypt_xhat(sk, slot, &shell->xhat[v * ninputs], inputs, shell->betas,
+                      &cache);
+    }
+    _encrypt_end(&cache);
+    end = current_time();
+    if (g_verbose)
+        fprintf(stderr, "    Encode: %.2fs\n", end - start);
+    return shell;
+}
+
+mife_ciphertext_t *
+mife_encrypt_online(const mife_sk_t *sk, const circ_params_t *cp,
+                    mife_shell_t *shell, const int *inputs, size_t nthreads)
+{
+    mife_ciphertext_t *ct;
+    double start, end;
+
+    if (shell == NULL || shell->what == NULL || inputs == NULL
+        || (sk == NULL && shell->nvals == 0)) {
+        fprintf(stderr, "error: mife encrypt: invalid input\n");
+        return NULL;
+    }
+    const size_t ninputs = cp->ds[shell->slot];
+    for (size_t j = 0; shell->nvals && j < ninputs; ++j) {
+        if (inputs[j] < 0 || (size_t) inputs[j] >= shell->nvals) {
+            fprintf(stderr, "error: mife encrypt: input %d out of range\n",
+                    inputs[j]);
+            return NULL;
+        }
+    }
+
+    start = current_time();
+    ct = my_calloc(1, sizeof ct[0]);
+    ct->enc_vt = shell->enc_vt;
+    ct->slot = shell->slot;
+    ct->xhat = my_calloc(ninputs, sizeof ct->xhat[0]);
+    if (shell->nvals) {
+        /* Every value is already encoded, so just take each input's xhat */
+        for (size_t j = 0; j < ninputs; ++j) {
+            ct->xhat[j] = shell->xhat[inputs[j] * ninputs + j];
+            shell->xhat[inputs[j] * ninputs + j] = NULL;
+        }
+    } else {
+        mife_encrypt_cache_t cache;
+        for (size_t j = 0; j < ninputs; ++j)
+            ct->xhat[j] = encoding_new(sk->enc_vt, sk->pp_vt, sk->pp);
+        _encrypt_begin(&cache, nthreads, ninputs);
+        _encrypt_xhat(sk, shell->slot, ct->xhat, inputs, shell->betas, &cache);
+        _encrypt_end(&cache);
+    }
+    ct->what = shell->what;
+    shell->what = NULL;
+    end = current_time();
+    if (g_verbose)
+        fprintf(stderr, "    Encode: %.2fs\n", end - start);
+    return ct;
+}
+
+void
+mife_shell_free(mife_shell_t *shell, const circ_params_t *cp)
+{
+    if (shell == NULL)
+        return;
+    const size_t ninputs = cp->ds[shell->slot];
+    if (shell->betas)
+        mpz_vect_free(shell->betas, ninputs);
+    if (shell->what) {
+        for (size_t o = 0; o < cp->m; ++o)
+            encoding_free(shell->enc_vt, shell->what[o]);
+        free(shell->what);
+    }
+    if (shell->xhat) {
+        for (size_t i = 0; i < shell->nvals * ninputs; ++i)
+            encoding_free(shell->enc_vt, shell->xhat[i]);
+        free(shell->xhat);
+    }
+    free(shell);
+}
+
+int
+mife_shell_fwrite(const mife_shell_t *shell, const circ_params_t *cp, FILE *fp)
+{
+    const size_t ninputs = cp->ds[shell->slot];
+    const size_t n = cp->m + shell->nvals * ninputs;
+    encoding *encs[n];
 
-    ix = index_set_difference(target, ek->enc_vt->mmap_set(x));
-    if (ix == NULL)
+    if (shell->what == NULL) {
+        fprintf(stderr, "error: ciphertext shell was already used\n");
         return ERR;
-    for (size_t i = 0; i < cp->n - has_consts; i++) {
-        diff = IX_X(ix, cp, i);
-        if (diff > 0)
-            _raise_encoding(ek, x, ek->uhat[i], diff);
     }
-    if (has_consts) {
-        diff = IX_X(ix, cp, cp->n - 1);
-        if (diff > 0)
-            _raise_encoding(ek, x, ek->uhat[cp->n - 1], diff);
+    if (size_t_fwrite(shell->slot, fp) == ERR)
+        return ERR;
+    if (size_t_fwrite(shell->nvals, fp) == ERR)
+        return ERR;
+    for (size_t j = 0; j < ninputs; ++j)
+        if (mpz_fwrite(shell->betas[j], fp) == ERR)
+            return ERR;
+    for (size_t o = 0; o < cp->m; ++o)
+        encs[o] = shell->what[o];
+    for (size_t i = 0; i < shell->nvals * ninputs; ++i)
+        encs[cp->m + i] = shell->xhat[i];
+    return encodings_fwrite(shell->enc_vt, encs, n, fp);
+}
+
+mife_shell_t *
+mife_shell_fread(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp,
+                 size_t nthreads)
+{
+    const circ_params_t *const cp = &op->cp;
+    mife_shell_t *shell;
+    size_t ninputs;
+
+    shell = my_calloc(1, sizeof shell[0]);
+    shell->enc_vt = get_encoding_vtable(mmap);
+    if (size_t_fread(&shell->slot, fp) == ERR)
+        goto error;
+    if (shell->slot >= cp->n) {
+        fprintf(stderr, "error: slot number > number of slots\n");
+        free(shell);
+        return NULL;
     }
-    index_set_free(ix);
-    return OK;
+    if (size_t_fread(&shell->nvals, fp) == ERR)
+        goto error;
+    if (shell->nvals && shell->nvals != mife_params_nvals(op, shell->slot)) {
+        fprintf(stderr, "error: ciphertext shell does not match circuit\n");
+        goto error;
+    }
+    ninputs = cp->ds[shell->slot];
+    shell->betas = mpz_vect_new(ninputs);
+    for (size_t j = 0; j < ninputs; ++j)
+        if (mpz_fread(&shell->betas[j], fp) == ERR)
+            goto error;
+    shell->what = my_calloc(cp->m, sizeof shell->what[0]);
+    if (shell->nvals)
+        shell->xhat = my_calloc(shell->nvals * ninputs, sizeof shell->xhat[0]);
+    {
+        const size_t n = cp->m + shell->nvals * ninputs;
+        encoding *encs[n];
+        const int ret = encodings_fread(shell->enc_vt, encs, n, fp, nthreads);
+        for (size_t o = 0; o < cp->m; ++o)
+            shell->what[o] = encs[o];
+        for (size_t i = 0; i < shell->nvals * ninputs; ++i)
+            shell->xhat[i] = encs[cp->m + i];
+        if (ret == ERR)
+            goto error;
+    }
+    return shell;
+error:
+    fprintf(stderr, "error: reading ciphertext shell failed\n");
+    mife_shell_free(shell, cp);
+    return NULL;
+}
+
+size_t
+mife_shell_slot(const mife_shell_t *shell)
+{
+    return shell->slot;
+}
+
+bool
+mife_shell_has_xhat(const mife_shell_t *shell)
+{
+    return shell->nvals > 0;
 }
 
 static int
-raise_encodings(const mife_ek_t *ek, encoding *x, encoding *y)
+raise_encoding(const mife_ek_t *ek, raise_eval *raise, encoding *x,
+               const index_set *target)
 {
-    index_set *ix;
+    const circ_params_t *const cp = ek->cp;
+    index_set_buf buf;
+    index_set *const ix = index_set_init(&buf, target->nzs);
     int ret = ERR;
-    ix = index_set_union(ek->enc_vt->mmap_set(x), ek->enc_vt->mmap_set(y));
-    if (ix == NULL)
-        goto cleanup;
-    if (raise_encoding(ek, x, ix) == ERR)
-        goto cleanup;
-    if (raise_encoding(ek, y, ix) == ERR)
+
+    if (index_set_sub(ix, target, ek->enc_vt->mmap_set(x)) == ERR)
         goto cleanup;
+    for (size_t i = 0; i < cp->n; i++)
+        if (raise_eval_raise(raise, x, i, IX_X(ix, cp, i)) == ERR)
+            goto cleanup;
     ret = OK;
 cleanup:
-    if (ix)
-        index_set_free(ix);
+    index_set_release(&buf);
     return ret;
 }
 
-static void
-decrypt_worker(void *vargs)
+/* Raises x and y to their union, cloning only an operand that is actually
+ * below it (into tmp_x / tmp_y, to be freed by the caller).  Returns the
+ * number of clones made, or -1 on error. */
+static int
+raise_encodings(const mife_ek_t *ek, raise_eval *raise, const encoding **x,
+                const encoding **y, encoding **tmp_x, encoding **tmp_y)
+{
+    const index_set *const xs = ek->enc_vt->mmap_set(*x);
+    const index_set *const ys = ek->enc_vt->mmap_set(*y);
+    index_set_buf buf;
+    index_set *ix;
+    int ret = ERR;
+
+    *tmp_x = *tmp_y = NULL;
+    if (index_set_eq(xs, ys))
+        return 0;
+    ix = index_set_init(&buf, xs->nzs);
+    index_set_max(ix, xs, ys);
+    if (!index_set_eq(ix, xs)) {
+        *tmp_x = encoding_new(ek->enc_vt, ek->pp_vt, ek->pp);
+        encoding_set(ek->enc_vt, *tmp_x, *x);
+        if (raise_encoding(ek, raise, *tmp_x, ix) == ERR)
+            goto cleanup;
+        *x = *tmp_x;
+    }
+    if (!index_set_eq(ix, ys)) {
+        *tmp_y = encoding_new(ek->enc_vt, ek->pp_vt, ek->pp);
+        encoding_set(ek->enc_vt, *tmp_y, *y);
+        if (raise_encoding(ek, raise, *tmp_y, ix) == ERR)
+            goto cleanup;
+        *y = *tmp_y;
+    }
+    ret = (*tmp_x ? 1 : 0) + (*tmp_y ? 1 : 0);
+cleanup:
+    index_set_release(&buf);
+    return ret;
+}
+
+static encoding *
+eval_gate(decrypt_args_t *dargs, acircref ref)
 {
-    decrypt_args_t *const dargs = vargs;
-    const acircref ref = dargs->ref;
     const acirc *const c = dargs->c;
     mife_ciphertext_t **cts = dargs->cts;
     const mife_ek_t *const ek = dargs->ek;
     bool *const mine = dargs->mine;
-    int *const ready = dargs->ready;
     encoding **cache = dargs->cache;
-    ref_list *const deps = dargs->deps;
-    threadpool *const pool = dargs->pool;
-    int *const rop = dargs->rop;
-    size_t *const kappas = dargs->kappas;
 
     const circ_params_t *const cp = ek->cp;
     const acirc_operation op = c->gates.gates[ref].op;
@@ -897,24 +1277,27 @@ decrypt_worker(void *vargs)
     case OP_ADD: case OP_SUB: case OP_MUL: {
         res = encoding_new(ek->enc_vt, ek->pp_vt, ek->pp);
         mine[ref] = true;
+        circ_count(dargs->allocs, op, 1);
 
-        const encoding *const x = cache[args[0]];
-        const encoding *const y = cache[args[1]];
+        const encoding *x = cache[args[0]];
+        const encoding *y = cache[args[1]];
 
         if (op == OP_MUL) {
             encoding_mul(ek->enc_vt, ek->pp_vt, res, x, y, ek->pp);
         } else {
             encoding *tmp_x, *tmp_y;
-            tmp_x = encoding_new(ek->enc_vt, ek->pp_vt, ek->pp);
-            tmp_y = encoding_new(ek->enc_vt, ek->pp_vt, ek->pp);
-            encoding_set(ek->enc_vt, tmp_x, x);
-            encoding_set(ek->enc_vt, tmp_y, y);
-            if (!index_set_eq(ek->enc_vt->mmap_set(tmp_x), ek->enc_vt->mmap_set(tmp_y)))
-                raise_encodings(ek, tmp_x, tmp_y);
+            const int n = raise_encodings(ek, dargs->raise, &x, &y, &tmp_x, &tmp_y);
+            if (n == ERR) {
+                encoding_free(ek->enc_vt, tmp_x);
+                encoding_free(ek->enc_vt, tmp_y);
+                cache[ref] = res;
+                return NULL;
+            }
+            circ_count(dargs->allocs, op, n);
             if (op == OP_ADD) {
-                encoding_add(ek->enc_vt, ek->pp_vt, res, tmp_x, tmp_y, ek->pp);
+                encoding_add(ek->enc_vt, ek->pp_vt, res, x, y, ek->pp);
             } else {
-                encoding_sub(ek->enc_vt, ek->pp_vt, res, tmp_x, tmp_y, ek->pp);
+                encoding_sub(ek->enc_vt, ek->pp_vt, res, x, y, ek->pp);
             }
             encoding_free(ek->enc_vt, tmp_x);
             encoding_free(ek->enc_vt, tmp_y);
@@ -927,123 +1310,262 @@ decrypt_worker(void *vargs)
     }
 
     cache[ref] = res;
+    return res;
+}
 
-    ref_list_node *node = &deps->refs[ref];
-    for (size_t i = 0; i < node->cur; ++i) {
-        const int num = __sync_add_and_fetch(&ready[node->refs[i]], 1);
-        if (num == 2) {
-            decrypt_args_t *newargs = my_calloc(1, sizeof newargs[0]);
-            memcpy(newargs, dargs, sizeof newargs[0]);
-            newargs->ref = node->refs[i];
-            threadpool_add_job(pool, decrypt_worker, newargs);
-        }
+static ssize_t
+output_index(const circ_params_t *cp, acircref ref)
+{
+    return cp->sched->output[ref];
+}
+
+/* Sets lhs to res * \hat zₒ, raised to the top level */
+static int
+output_lhs(const mife_ek_t *ek, raise_eval *raise, encoding *lhs,
+           const encoding *res, size_t o)
+{
+    const index_set *const toplevel = ek->pp_vt->toplevel(ek->pp);
+
+    encoding_mul(ek->enc_vt, ek->pp_vt, lhs, res, ek->zhat[o], ek->pp);
+    if (raise_encoding(ek, raise, lhs, toplevel) == ERR)
+        return ERR;
+    if (!index_set_eq(ek->enc_vt->mmap_set(lhs), toplevel)) {
+        fprintf(stderr, "error: lhs != toplevel\n");
+        index_set_print(ek->enc_vt->mmap_set(lhs));
+        index_set_print(toplevel);
+        return ERR;
     }
+    return OK;
+}
 
-    free(dargs);
+/* Product tree for start times \hat wₒ of every RHS slot with pinned[i] ==
+ * which (every slot when pinned is NULL).  Its root is NULL if empty. */
+static prodtree *
+output_rhs(const mife_ek_t *ek, const encoding *start, mife_ciphertext_t **cts,
+           const bool *pinned, bool which, size_t o)
+{
+    const circ_params_t *const cp = ek->cp;
+    /* With constants, slot n - 1's \hat w is already folded into slot 0's */
+    const size_t nslots = ek->Chatstar ? cp->n : cp->n - 1;
+    size_t n = start ? 1 : 0;
+    prodtree *rhs;
+
+    for (size_t i = 0; i < nslots; ++i)
+        if ((pinned ? pinned[i] : false) == which)
+            n++;
+    rhs = prodtree_new(ek->enc_vt, ek->pp_vt, ek->pp, n);
+    n = 0;
+    if (start)
+        prodtree_set(rhs, n++, start);
+    for (size_t i = 0; i < nslots; ++i)
+        if ((pinned ? pinned[i] : false) == which)
+            prodtree_set(rhs, n++, cts[i]->what[o]);
+    return rhs;
+}
 
-    ssize_t output = -1;
-    for (size_t i = 0; i < cp->m; i++) {
-        if (ref == c->outputs.buf[i]) {
-            output = i;
-            break;
-        }
+/* Zero-tests an output once both its LHS and RHS are done */
+static void
+decrypt_output(decrypt_args_t *dargs, size_t output)
+{
+    const mife_ek_t *const ek = dargs->ek;
+    const index_set *const toplevel = ek->pp_vt->toplevel(ek->pp);
+    const encoding *const rhs = prodtree_root(dargs->rhs[output]);
+    encoding *out;
+    int result;
+
+    if (rhs == NULL || !index_set_eq(ek->enc_vt->mmap_set(rhs), toplevel)) {
+        fprintf(stderr, "error: rhs != toplevel\n");
+        if (rhs)
+            index_set_print(ek->enc_vt->mmap_set(rhs));
+        index_set_print(toplevel);
+        if (dargs->rop)
+            dargs->rop[output] = 1;
+        return;
     }
+    out = encoding_new(ek->enc_vt, ek->pp_vt, ek->pp);
+    encoding_sub(ek->enc_vt, ek->pp_vt, out, dargs->lhs[output], rhs, ek->pp);
+    result = !encoding_is_zero(ek->enc_vt, ek->pp_vt, out, ek->pp);
+    if (dargs->rop)
+        dargs->rop[output] = result;
+    if (dargs->kappas)
+        dargs->kappas[output] = encoding_get_degree(ek->enc_vt, out);
+    encoding_free(ek->enc_vt, out);
+}
 
-    if (output != -1) {
-        encoding *out, *lhs, *rhs;
-        const index_set *const toplevel = ek->pp_vt->toplevel(ek->pp);
-        int result;
+typedef struct {
+    decrypt_args_t *dargs;
+    size_t output;
+} decrypt_output_args;
 
-        out = encoding_new(ek->enc_vt, ek->pp_vt, ek->pp);
-        lhs = encoding_new(ek->enc_vt, ek->pp_vt, ek->pp);
-        rhs = encoding_new(ek->enc_vt, ek->pp_vt, ek->pp);
+static void
+decrypt_output_worker(void *vargs)
+{
+    decrypt_output_args *const args = vargs;
+    decrypt_output(args->dargs, args->output);
+    free(args);
+}
 
-        /* Compute LHS */
-        encoding_mul(ek->enc_vt, ek->pp_vt, lhs, res, ek->zhat[output], ek->pp);
-        raise_encoding(ek, lhs, toplevel);
-        if (!index_set_eq(ek->enc_vt->mmap_set(lhs), toplevel)) {
-            fprintf(stderr, "error: lhs != toplevel\n");
-            index_set_print(ek->enc_vt->mmap_set(lhs));
-            index_set_print(toplevel);
-            if (rop)
-                rop[output] = 1;
-            goto cleanup;
-        }
-        /* Compute RHS */
-        if (ek->Chatstar) {
-            encoding_set(ek->enc_vt, rhs, ek->Chatstar);
-            for (size_t i = 0; i < cp->n; ++i)
-                encoding_mul(ek->enc_vt, ek->pp_vt, rhs, rhs, cts[i]->what[output], ek->pp);
+/* Computes the LHS of an output; the rest of its zero test waits for the RHS */
+static void
+output_gate(decrypt_args_t *dargs, const encoding *res, size_t output)
+{
+    const mife_ek_t *const ek = dargs->ek;
+    const mife_partial_t *const partial = dargs->partial;
+    encoding *lhs;
+
+    lhs = encoding_new(ek->enc_vt, ek->pp_vt, ek->pp);
+    if (partial && partial->lhs[output]) {
+        encoding_set(ek->enc_vt, lhs, partial->lhs[output]);
+    } else if (output_lhs(ek, dargs->raise, lhs, res, output) == ERR) {
+        if (dargs->rop)
+            dargs->rop[output] = 1;
+        encoding_free(ek->enc_vt, lhs);
+        return;
+    }
+    dargs->lhs[output] = lhs;
+}
+
+static int
+decrypt_gate(acircref ref, void *vargs)
+{
+    decrypt_args_t *const dargs = vargs;
+    const mife_partial_t *const partial = dargs->partial;
+    encoding **cache = dargs->cache;
+    encoding *res;
+    ssize_t output;
+
+    if (partial && partial->fixed[ref]) {
+        /* Precomputed; NULL unless the residual cone needs it */
+        res = cache[ref] = partial->encs[ref];
+        dargs->mine[ref] = false;
+    } else if ((res = eval_gate(dargs, ref)) == NULL) {
+        return ERR;
+    }
+    if ((output = output_index(dargs->ek->cp, ref)) != -1)
+        output_gate(dargs, res, output);
+    return OK;
+}
+
+/* Evaluates the gates that depend only on pinned slots, keeping those the
+ * residual cone needs */
+static int
+partial_gate(acircref ref, void *vargs)
+{
+    decrypt_args_t *const dargs = vargs;
+    mife_partial_t *const partial = dargs->build;
+    const mife_ek_t *const ek = dargs->ek;
+    encoding *res;
+    ssize_t output;
+
+    if (!partial->fixed[ref])
+        return OK;
+    if ((res = eval_gate(dargs, ref)) == NULL)
+        return ERR;
+    if ((output = output_index(ek->cp, ref)) != -1) {
+        partial->lhs[output] = encoding_new(ek->enc_vt, ek->pp_vt, ek->pp);
+        if (output_lhs(ek, dargs->raise, partial->lhs[output], res, output) == ERR)
+            return ERR;
+    }
+    if (partial->keep[ref]) {
+        if (dargs->mine[ref]) {
+            dargs->mine[ref] = false;
+            partial->encs[ref] = res;
         } else {
-            encoding_set(ek->enc_vt, rhs, cts[0]->what[output]);
-            for (size_t i = 1; i < cp->n - 1; ++i)
-                encoding_mul(ek->enc_vt, ek->pp_vt, rhs, rhs, cts[i]->what[output], ek->pp);
-        }
-        if (!index_set_eq(ek->enc_vt->mmap_set(rhs), toplevel)) {
-            fprintf(stderr, "error: rhs != toplevel\n");
-            index_set_print(ek->enc_vt->mmap_set(rhs));
-            index_set_print(toplevel);
-            if (rop)
-                rop[output] = 1;
-            goto cleanup;
+            partial->encs[ref] = encoding_new(ek->enc_vt, ek->pp_vt, ek->pp);
+            encoding_set(ek->enc_vt, partial->encs[ref], res);
         }
-        encoding_sub(ek->enc_vt, ek->pp_vt, out, lhs, rhs, ek->pp);
-        result = !encoding_is_zero(ek->enc_vt, ek->pp_vt, out, ek->pp);
-        if (rop)
-            rop[output] = result;
-        if (kappas)
-            kappas[output] = encoding_get_degree(ek->enc_vt, out);
-
-    cleanup:
-        encoding_free(ek->enc_vt, out);
-        encoding_free(ek->enc_vt, lhs);
-        encoding_free(ek->enc_vt, rhs);
     }
+    return OK;
 }
 
-int
-mife_decrypt(const mife_ek_t *ek, int *rop, mife_ciphertext_t **cts,
-             size_t nthreads, size_t *kappa)
+static void
+release_gate(acircref ref, void *vargs)
+{
+    decrypt_args_t *const dargs = vargs;
+    encoding **cache = dargs->cache;
+
+    if (dargs->mine[ref]) {
+        encoding_free(dargs->ek->enc_vt, cache[ref]);
+        cache[ref] = NULL;
+        dargs->mine[ref] = false;
+    }
+}
+
+static int
+_decrypt(const mife_ek_t *ek, const mife_partial_t *partial, int *rop,
+         mife_ciphertext_t **cts, const eval_ctx *ctx, size_t *kappa)
 {
     const circ_params_t *cp = ek->cp;
     const acirc *const circ = cp->circ;
     int ret = ERR;
 
-    if (ek == NULL || cts == NULL)
-        return ERR;
-
     encoding **cache = my_calloc(acirc_nrefs(circ), sizeof cache[0]);
     bool *mine = my_calloc(acirc_nrefs(circ), sizeof mine[0]);
-    int *ready = my_calloc(acirc_nrefs(circ), sizeof ready[0]);
     size_t *kappas = NULL;
-    ref_list *deps = ref_list_new(circ);
-    threadpool *pool = threadpool_create(nthreads);
+    raise_eval raise;
+    decrypt_args_t args;
 
+    raise_eval_init(&raise, ek->raise);
     if (kappa)
         kappas = my_calloc(cp->m, sizeof kappas[0]);
 
-    for (size_t ref = 0; ref < acirc_nrefs(circ); ++ref) {
-        acirc_operation op = circ->gates.gates[ref].op;
-        if (op != OP_INPUT && op != OP_CONST)
-            continue;
-        decrypt_args_t *args = calloc(1, sizeof args[0]);
-        args->mmap   = ek->mmap;
-        args->ref    = ref;
-        args->c      = circ;
-        args->cts    = cts;
-        args->ek     = ek;
-        args->mine   = mine;
-        args->ready  = ready;
-        args->cache  = cache;
-        args->deps   = deps;
-        args->pool   = pool;
-        args->rop    = rop;
-        args->kappas = kappas;
-        threadpool_add_job(pool, decrypt_worker, args);
-    }
-    ret = OK;
+    if (cp->sched) {
+        sched_jobs jobs;
+
+        args.mmap    = ek->mmap;
+        args.c       = circ;
+        args.cts     = cts;
+        args.ek      = ek;
+        args.partial = partial;
+        args.build   = NULL;
+        args.raise   = &raise;
+        args.mine    = mine;
+        args.cache   = cache;
+        args.rop     = rop;
+        args.kappas  = kappas;
+        args.lhs     = my_calloc(cp->m, sizeof args.lhs[0]);
+        args.rhs     = my_calloc(cp->m, sizeof args.rhs[0]);
+        memset(args.allocs, '\0', sizeof args.allocs);
+
+        /* The RHS products don't need the circuit, so start on them now */
+        sched_jobs_init(&jobs, ctx);
+        for (size_t o = 0; o < cp->m; ++o) {
+            if (output_index(cp, circ->outputs.buf[o]) != (ssize_t) o)
+                continue;
+            args.rhs[o] = output_rhs(ek, partial ? partial->rhs[o] : ek->Chatstar,
+                                     cts, partial ? partial->pinned : NULL,
+                                     false, o);
+            if (jobs.pool)
+                prodtree_update_async(args.rhs[o], &jobs);
+        }
+        ret = sched_run_ctx(cp->sched, decrypt_gate, release_gate, &args, ctx);
+        if (jobs.pool) {
+            sched_jobs_wait(&jobs);
+        } else {
+            for (size_t o = 0; o < cp->m; ++o)
+                if (args.rhs[o])
+                    prodtree_update(args.rhs[o]);
+        }
 
-    threadpool_destroy(pool);
+        for (size_t o = 0; o < cp->m; ++o) {
+            if (ret == OK && args.lhs[o]) {
+                decrypt_output_args *oargs = my_calloc(1, sizeof oargs[0]);
+                oargs->dargs = &args;
+                oargs->output = o;
+                sched_jobs_add(&jobs, decrypt_output_worker, oargs);
+            }
+        }
+        sched_jobs_clear(&jobs);
+        for (size_t o = 0; o < cp->m; ++o) {
+            if (args.lhs[o])
+                encoding_free(ek->enc_vt, args.lhs[o]);
+            prodtree_free(args.rhs[o]);
+        }
+        free(args.lhs);
+        free(args.rhs);
+        if (g_verbose)
+            circ_counts_print("allocs:", args.allocs);
+    }
 
     if (kappa) {
         size_t maxkappa = 0;
@@ -1060,10 +1582,339 @@ mife_decrypt(const mife_ek_t *ek, int *rop, mife_ciphertext_t **cts,
             encoding_free(ek->enc_vt, cache[i]);
         }
     }
-    ref_list_free(deps, circ);
     free(cache);
     free(mine);
-    free(ready);
+    if (g_verbose)
+        fprintf(stderr, "raise mults:     %lu\n", raise.nmuls);
+
+    return ret;
+}
+
+/* Symbolic decryption for mife_kappa: the index set and degree of each gate */
+typedef struct {
+    const circ_params_t *cp;
+    size_t npowers;
+    index_set **ixs;            // [nrefs]
+    size_t *degs;               // [nrefs]
+    size_t maxpower;
+} kappa_args;
+
+/* Raises ix to target like raise_encoding, returning the degree it adds */
+static size_t
+kappa_raise(kappa_args *kargs, index_set *ix, const index_set *target)
+{
+    const circ_params_t *const cp = kargs->cp;
+    index_set_buf buf;
+    index_set *const diff = index_set_init(&buf, target->nzs);
+    size_t deg = 0;
+
+    if (index_set_sub(diff, target, ix) == ERR)
+        goto cleanup;
+    for (size_t i = 0; i < cp->n; i++) {
+        deg += raise_degree(kargs->npowers, IX_X(diff, cp, i), &kargs->maxpower);
+        IX_X(ix, cp, i) = IX_X(target, cp, i);
+    }
+cleanup:
+    index_set_release(&buf);
+    return deg;
+}
+
+static int
+kappa_gate(acircref ref, void *vargs)
+{
+    kappa_args *const kargs = vargs;
+    const circ_params_t *const cp = kargs->cp;
+    const acirc *const c = cp->circ;
+    const acircref *const args = c->gates.gates[ref].args;
+    index_set *const ix = index_set_new(mife_params_nzs(cp));
+    size_t deg = 1;
+
+    switch (c->gates.gates[ref].op) {
+    case OP_CONST:
+        IX_X(ix, cp, circ_params_slot(cp, c->ninputs + args[0])) = 1;
+        break;
+    case OP_INPUT:
+        IX_X(ix, cp, circ_params_slot(cp, args[0])) = 1;
+        break;
+    case OP_MUL:
+        index_set_add(ix, kargs->ixs[args[0]], kargs->ixs[args[1]]);
+        deg = kargs->degs[args[0]] + kargs->degs[args[1]];
+        break;
+    case OP_ADD: case OP_SUB: {
+        const index_set *const xs = kargs->ixs[args[0]];
+        const index_set *const ys = kargs->ixs[args[1]];
+        size_t xdeg = kargs->degs[args[0]], ydeg = kargs->degs[args[1]];
+        index_set_buf buf;
+        index_set *const tmp = index_set_init(&buf, ix->nzs);
+
+        index_set_max(ix, xs, ys);
+        if (!index_set_eq(ix, xs)) {
+            index_set_set(tmp, xs);
+            xdeg += kappa_raise(kargs, tmp, ix);
+        }
+        if (!index_set_eq(ix, ys)) {
+            index_set_set(tmp, ys);
+            ydeg += kappa_raise(kargs, tmp, ix);
+        }
+        index_set_release(&buf);
+        deg = xdeg > ydeg ? xdeg : ydeg;
+        break;
+    }
+    default:
+        fprintf(stderr, "fatal: op not supported\n");
+        abort();
+    }
+    kargs->ixs[ref] = ix;
+    kargs->degs[ref] = deg;
+    return OK;
+}
+
+static void
+kappa_release(acircref ref, void *vargs)
+{
+    kappa_args *const kargs = vargs;
+
+    if (output_index(kargs->cp, ref) != -1)
+        return;
+    index_set_free(kargs->ixs[ref]);
+    kargs->ixs[ref] = NULL;
+}
 
+int
+mife_kappa(const obf_params_t *op, size_t npowers, size_t *kappa,
+           size_t *maxpower)
+{
+    const circ_params_t *const cp = &op->cp;
+    const acirc *const circ = cp->circ;
+    const size_t has_consts = cp->c ? 1 : 0;
+    const size_t nzs = mife_params_nzs(cp);
+    index_set *const toplevel = mife_params_new_toplevel(cp, nzs);
+    index_set *const lhs = index_set_new(nzs);
+    size_t **deg, *deg_max;
+    size_t maxkappa = 0;
+    kappa_args args;
+    int ret = ERR;
+
+    args.cp = cp;
+    args.npowers = npowers;
+    args.ixs = my_calloc(acirc_nrefs(circ), sizeof args.ixs[0]);
+    args.degs = my_calloc(acirc_nrefs(circ), sizeof args.degs[0]);
+    args.maxpower = 0;
+    deg = my_calloc(cp->n, sizeof deg[0]);
+    for (size_t i = 0; i < cp->n; ++i)
+        deg[i] = my_calloc(cp->m, sizeof deg[i][0]);
+    deg_max = my_calloc(cp->n, sizeof deg_max[0]);
+    populate_circ_degrees(cp, deg, deg_max);
+
+    if (cp->sched == NULL)
+        goto cleanup;
+    if (sched_run(cp->sched, kappa_gate, kappa_release, &args, 1) == ERR)
+        goto cleanup;
+    for (size_t o = 0; o < cp->m; ++o) {
+        const acircref ref = circ->outputs.buf[o];
+        size_t _kappa;
+
+        if (output_index(cp, ref) != (ssize_t) o)
+            continue;
+        /* LHS: times \hat zₒ (see mife_setup), raised to the top level */
+        index_set_set(lhs, args.ixs[ref]);
+        for (size_t i = 0; i < cp->n; ++i) {
+            IX_W(lhs, cp, i) += 1;
+            IX_X(lhs, cp, i) += deg_max[i] - deg[i][o];
+        }
+        IX_Z(lhs) += 1;
+        _kappa = args.degs[ref] + 1 + kappa_raise(&args, lhs, toplevel);
+        if (!index_set_eq(lhs, toplevel)) {
+            fprintf(stderr, "error: lhs != toplevel\n");
+            index_set_print(lhs);
+            index_set_print(toplevel);
+            goto cleanup;
+        }
+        /* RHS: one \hat wₒ per slot, with slot n - 1's folded into slot
+         * 0's when there are constants and \hat C* otherwise */
+        if (_kappa < (has_consts ? cp->n - 1 : cp->n + 1))
+            _kappa = has_consts ? cp->n - 1 : cp->n + 1;
+        if (_kappa > maxkappa)
+            maxkappa = _kappa;
+    }
+    if (kappa)
+        *kappa = maxkappa;
+    if (maxpower)
+        *maxpower = args.maxpower;
+    ret = OK;
+cleanup:
+    for (size_t i = 0; i < acirc_nrefs(circ); i++)
+        index_set_free(args.ixs[i]);
+    free(args.ixs);
+    free(args.degs);
+    for (size_t i = 0; i < cp->n; ++i)
+        free(deg[i]);
+    free(deg);
+    free(deg_max);
+    index_set_free(lhs);
+    index_set_free(toplevel);
     return ret;
 }
+
+int
+mife_decrypt(const mife_ek_t *ek, int *rop, mife_ciphertext_t **cts,
+             const eval_ctx *ctx, size_t *kappa)
+{
+    if (ek == NULL || cts == NULL)
+        return ERR;
+    return _decrypt(ek, NULL, rop, cts, ctx, kappa);
+}
+
+void
+mife_partial_free(mife_partial_t *partial)
+{
+    if (partial == NULL)
+        return;
+    const mife_ek_t *const ek = partial->ek;
+    for (size_t ref = 0; ref < acirc_nrefs(ek->cp->circ); ++ref)
+        if (partial->encs[ref])
+            encoding_free(ek->enc_vt, partial->encs[ref]);
+    for (size_t o = 0; o < ek->cp->m; ++o) {
+        if (partial->lhs[o])
+            encoding_free(ek->enc_vt, partial->lhs[o]);
+        if (partial->rhs[o])
+            encoding_free(ek->enc_vt, partial->rhs[o]);
+    }
+    free(partial->pinned);
+    free(partial->fixed);
+    free(partial->keep);
+    free(partial->encs);
+    free(partial->lhs);
+    free(partial->rhs);
+    free(partial);
+}
+
+mife_partial_t *
+mife_partial_new(const mife_ek_t *ek, mife_ciphertext_t **cts,
+                 const eval_ctx *ctx)
+{
+    mife_partial_t *partial;
+    decrypt_args_t args;
+    encoding **cache;
+    bool *mine;
+    raise_eval raise;
+    size_t nfixed = 0, nkeep = 0;
+    double start, end;
+    int ret = ERR;
+
+    if (ek == NULL || cts == NULL || ek->cp->sched == NULL)
+        return NULL;
+    const circ_params_t *const cp = ek->cp;
+    const acirc *const circ = cp->circ;
+    const sched_t *const sched = cp->sched;
+    const size_t nrefs = acirc_nrefs(circ);
+
+    start = current_time();
+    partial = my_calloc(1, sizeof partial[0]);
+    partial->ek = ek;
+    partial->pinned = my_calloc(cp->n, sizeof partial->pinned[0]);
+    for (size_t i = 0; i < cp->n; ++i)
+        partial->pinned[i] = cts[i] != NULL;
+    partial->fixed = my_calloc(nrefs, sizeof partial->fixed[0]);
+    partial->keep = my_calloc(nrefs, sizeof partial->keep[0]);
+    partial->encs = my_calloc(nrefs, sizeof partial->encs[0]);
+    partial->lhs = my_calloc(cp->m, sizeof partial->lhs[0]);
+    partial->rhs = my_calloc(cp->m, sizeof partial->rhs[0]);
+
+    /* A gate is fixed if all its inputs come from pinned slots or constants;
+     * refs are in topological order */
+    for (size_t i = 0; i < sched->nsched; ++i) {
+        const acircref ref = sched->refs[i];
+        const acirc_operation op = circ->gates.gates[ref].op;
+        const acircref *const gargs = circ->gates.gates[ref].args;
+        switch (op) {
+        case OP_CONST:
+            partial->fixed[ref] = true;
+            break;
+        case OP_INPUT:
+            partial->fixed[ref] = partial->pinned[circ_params_slot(cp, gargs[0])];
+            break;
+        default: {
+            /* Whatever its arity, as counted by the dependency graph */
+            const acircref *const deps = depgraph_args(sched->deps, ref);
+            partial->fixed[ref] = true;
+            for (int a = 0; a < sched->deps->nargs[ref]; ++a)
+                partial->fixed[ref] = partial->fixed[ref] && partial->fixed[deps[a]];
+            break;
+        }
+        }
+    }
+    /* Only keep fixed gates that some residual gate consumes */
+    for (size_t ref = 0; ref < nrefs; ++ref) {
+        const acircref *const succs = depgraph_succs(sched->deps, ref);
+        if (!partial->fixed[ref])
+            continue;
+        nfixed++;
+        for (size_t i = 0; i < depgraph_nsuccs(sched->deps, ref); ++i) {
+            if (!partial->fixed[succs[i]]) {
+                partial->keep[ref] = true;
+                nkeep++;
+                break;
+            }
+        }
+    }
+
+    raise_eval_init(&raise, ek->raise);
+    cache = my_calloc(nrefs, sizeof cache[0]);
+    mine = my_calloc(nrefs, sizeof mine[0]);
+    args.mmap    = ek->mmap;
+    args.c       = circ;
+    args.cts     = cts;
+    args.ek      = ek;
+    args.partial = NULL;
+    args.build   = partial;
+    args.raise   = &raise;
+    args.mine    = mine;
+    args.cache   = cache;
+    args.rop     = NULL;
+    args.kappas  = NULL;
+    args.lhs     = NULL;
+    args.rhs     = NULL;
+    memset(args.allocs, '\0', sizeof args.allocs);
+    if (sched_run_ctx(sched, partial_gate, release_gate, &args, ctx) == ERR)
+        goto cleanup;
+
+    /* Pre-multiply the pinned slots' \hat wₒ, along with \hat C* */
+    for (size_t o = 0; o < cp->m; ++o) {
+        prodtree *rhs = output_rhs(ek, ek->Chatstar, cts, partial->pinned, true, o);
+        prodtree_update(rhs);
+        if (prodtree_root(rhs)) {
+            partial->rhs[o] = encoding_new(ek->enc_vt, ek->pp_vt, ek->pp);
+            encoding_set(ek->enc_vt, partial->rhs[o], prodtree_root(rhs));
+        }
+        prodtree_free(rhs);
+    }
+    end = current_time();
+    if (g_verbose) {
+        fprintf(stderr, "  Fixed gates: %lu of %lu, %lu kept\n", nfixed, nrefs,
+                nkeep);
+        fprintf(stderr, "  Partial decryption: %.2fs\n", end - start);
+    }
+    ret = OK;
+cleanup:
+    for (size_t ref = 0; ref < nrefs; ++ref)
+        if (mine[ref])
+            encoding_free(ek->enc_vt, cache[ref]);
+    free(mine);
+    free(cache);
+    if (ret == ERR) {
+        mife_partial_free(partial);
+        return NULL;
+    }
+    return partial;
+}
+
+int
+mife_decrypt_partial(const mife_partial_t *partial, int *rop,
+                     mife_ciphertext_t **cts, const eval_ctx *ctx,
+                     size_t *kappa)
+{
+    if (partial == NULL || cts == NULL)
+        return ERR;
+    return _decrypt(partial->ek, partial, rop, cts, ctx, kappa);
+}
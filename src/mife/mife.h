@@ -1,6 +1,7 @@
 #pragma once
 
 #include "mmap.h"
+#include "sched.h"
 
 #include <threadpool.h>
 
@@ -8,6 +9,8 @@ typedef struct mife_t mife_t;
 typedef struct mife_sk_t mife_sk_t;
 typedef struct mife_ek_t mife_ek_t;
 typedef struct mife_ciphertext_t mife_ciphertext_t;
+typedef struct mife_shell_t mife_shell_t;
+typedef struct mife_partial_t mife_partial_t;
 
 typedef struct {
     bool sigma;
@@ -20,6 +23,7 @@ typedef struct {
     pthread_mutex_t *lock;
     size_t *count;
     size_t total;
+    pthread_cond_t *done;
     FILE *fp;
     mpz_t *refs;
 } mife_encrypt_cache_t;
@@ -40,11 +44,13 @@ mife_sk_t * mife_sk_fread(const mmap_vtable *mmap, const obf_params_t *op, FILE
 mife_ek_t * mife_ek(const mife_t *mife);
 void mife_ek_free(mife_ek_t *ek);
 int mife_ek_fwrite(const mife_ek_t *ek, FILE *fp);
-mife_ek_t * mife_ek_fread(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp);
+mife_ek_t * mife_ek_fread(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp,
+                          size_t nthreads);
 
 void mife_ciphertext_free(mife_ciphertext_t *ct, const circ_params_t *cp);
 int mife_ciphertext_fwrite(const mife_ciphertext_t *ct, const circ_params_t *cp, FILE *fp);
-mife_ciphertext_t * mife_ciphertext_fread(const mmap_vtable *mmap, const circ_params_t *cp, FILE *fp);
+mife_ciphertext_t * mife_ciphertext_fread(const mmap_vtable *mmap, const circ_params_t *cp, FILE *fp,
+                                          size_t nthreads);
 
 
 mife_ciphertext_t *
@@ -52,11 +58,74 @@ mife_encrypt(const mife_sk_t *sk, size_t slot, const int *inputs, size_t nthread
              mife_encrypt_cache_t *cache, aes_randstate_t rng,
              bool parallelize_circ_eval);
 
+/*
+ * Resident encryption state for serving many requests with one secret key:
+ * a warm thread pool and the circuit evaluation scratch space are kept
+ * across calls.  Calls must not overlap.
+ */
+typedef struct mife_encrypter_t mife_encrypter_t;
+mife_encrypter_t *
+mife_encrypter_new(const mife_sk_t *sk, size_t nthreads);
+mife_ciphertext_t *
+mife_encrypter_encrypt(mife_encrypter_t *e, size_t slot, const int *inputs,
+                       aes_randstate_t rng);
+void mife_encrypter_free(mife_encrypter_t *e);
+
+/*
+ * Offline/online encryption.  A shell holds everything of a slot's
+ * ciphertext that does not depend on the input: the betas, the what
+ * encodings and, optionally, xhat[j] encoded for every possible value.
+ * mife_encrypt_online finishes a ciphertext from a shell, taking its
+ * encodings; a shell must only ever be used once.
+ */
+/* nvals is the number of values to encode xhat for, see mife_params_nvals,
+ * or 0 to leave xhat to mife_encrypt_online */
+mife_shell_t *
+mife_encrypt_offline(const mife_sk_t *sk, size_t slot, size_t nvals,
+                     size_t nthreads, aes_randstate_t rng);
+/* sk may be NULL when the shell holds every xhat encoding */
+mife_ciphertext_t *
+mife_encrypt_online(const mife_sk_t *sk, const circ_params_t *cp,
+                    mife_shell_t *shell, const int *inputs, size_t nthreads);
+void mife_shell_free(mife_shell_t *shell, const circ_params_t *cp);
+int mife_shell_fwrite(const mife_shell_t *shell, const circ_params_t *cp, FILE *fp);
+mife_shell_t * mife_shell_fread(const mmap_vtable *mmap, const obf_params_t *op,
+                                FILE *fp, size_t nthreads);
+size_t mife_shell_slot(const mife_shell_t *shell);
+bool mife_shell_has_xhat(const mife_shell_t *shell);
+
+/* The κ and (in *maxpower) the number of powers decryption would use,
+ * following only index sets and degrees through the circuit */
+int
+mife_kappa(const obf_params_t *op, size_t npowers, size_t *kappa,
+           size_t *maxpower);
+
+/* Decrypts on the threads of ctx, so may share them with other decryptions
+ * running at once */
 int
 mife_decrypt(const mife_ek_t *ek, int *rop, mife_ciphertext_t **cts,
-             size_t nthreads, size_t *kappa);
+             const eval_ctx *ctx, size_t *kappa);
+
+/*
+ * Partial decryption.  mife_partial_new pins the slots whose entry in cts is
+ * non-NULL: it evaluates every gate that depends only on those slots (and
+ * constants), keeps the ones the rest of the circuit needs, and pre-multiplies
+ * the pinned slots' part of each RHS.  mife_decrypt_partial then only
+ * evaluates the residual cone; its pinned entries of cts are ignored.  The
+ * partial copies what it keeps, so only ek must outlive it.
+ */
+mife_partial_t *
+mife_partial_new(const mife_ek_t *ek, mife_ciphertext_t **cts,
+                 const eval_ctx *ctx);
+int
+mife_decrypt_partial(const mife_partial_t *partial, int *rop,
+                     mife_ciphertext_t **cts, const eval_ctx *ctx,
+                     size_t *kappa);
+void mife_partial_free(mife_partial_t *partial);
 
 size_t
 mife_num_encodings_setup(const circ_params_t *cp, size_t npowers);
 size_t
 mife_num_encodings_encrypt(const circ_params_t *cp, size_t slot);
+size_t
+mife_num_encodings_offline(const circ_params_t *cp, size_t slot, size_t nvals);
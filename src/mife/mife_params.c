@@ -41,6 +41,21 @@ mife_num_encodings_encrypt(const circ_params_t *cp, size_t slot)
     return cp->ds[slot] + cp->m;
 }
 
+size_t
+mife_num_encodings_offline(const circ_params_t *cp, size_t slot, size_t nvals)
+{
+    return cp->m + nvals * cp->ds[slot];
+}
+
+size_t
+mife_params_nvals(const obf_params_t *op, size_t slot)
+{
+    /* Σ-vector inputs are bits even though qs counts the symbols */
+    if (op->sigma)
+        return 2;
+    return op->cp.qs[slot] < 2 ? 2 : op->cp.qs[slot];
+}
+
 static obf_params_t *
 _new(acirc *circ, void *vparams)
 {
@@ -57,6 +72,7 @@ _new(acirc *circ, void *vparams)
         op->cp.ds[op->cp.n - 1] = circ->consts.n;
         op->cp.qs[op->cp.n - 1] = 1;
     }
+    op->sigma = params->sigma;
 
     if (g_verbose)
         circ_params_print(&op->cp);
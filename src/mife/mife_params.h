@@ -6,6 +6,7 @@
 
 struct obf_params_t {
     circ_params_t cp;
+    bool sigma;                 /* inputs are Σ-vectors of bits */
 };
 
 #define IX_Z(ix) (ix)->pows[0]
@@ -13,5 +14,7 @@ struct obf_params_t {
 #define IX_X(ix, cp, i) (ix)->pows[1 + (cp)->n + (i)]
 
 size_t mife_params_nzs(const circ_params_t *cp);
+/* Number of values an input symbol of slot can take */
+size_t mife_params_nvals(const obf_params_t *op, size_t slot);
 index_set * mife_params_new_toplevel(const circ_params_t *const cp, size_t nzs);
 
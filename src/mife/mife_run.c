@@ -1,9 +1,16 @@
 #include "mife_run.h"
 #include "mife_params.h"
+#include "estimate.h"
 #include "util.h"
 
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
 #include <string.h>
-#include <mmap/mmap_dummy.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 int
 mife_run_setup(const mmap_vtable *mmap, const char *circuit, obf_params_t *op,
@@ -65,17 +72,87 @@ cleanup:
     return ret;
 }
 
+static mife_sk_t *
+_read_sk(const mmap_vtable *mmap, const char *circuit, const obf_params_t *op)
+{
+    char skname[strlen(circuit) + sizeof ".sk\0"];
+    double start, end;
+    mife_sk_t *sk;
+    FILE *fp;
+
+    start = current_time();
+    snprintf(skname, sizeof skname, "%s.sk", circuit);
+    if ((fp = fopen(skname, "r")) == NULL) {
+        fprintf(stderr, "error: unable to open '%s' for reading\n", skname);
+        exit(EXIT_FAILURE);
+    }
+    sk = mife_sk_fread(mmap, op, fp);
+    fclose(fp);
+
+    end = current_time();
+    if (g_verbose)
+        fprintf(stderr, "  Reading sk from disk: %.2fs\n", end - start);
+    return sk;
+}
+
+/* Writes ct to a temporary file that is renamed to ctname once complete, so
+ * that ctname never holds a partial ciphertext */
+static int
+_write_ct_to(const char *ctname, const circ_params_t *cp,
+             const mife_ciphertext_t *ct)
+{
+    char tmpname[strlen(ctname) + sizeof ".tmp\0"];
+    double start, end;
+    FILE *fp;
+    int ret;
+
+    start = current_time();
+    snprintf(tmpname, sizeof tmpname, "%s.tmp", ctname);
+    if ((fp = fopen(tmpname, "w")) == NULL) {
+        fprintf(stderr, "error: unable to open '%s' for writing\n", tmpname);
+        return ERR;
+    }
+    ret = mife_ciphertext_fwrite(ct, cp, fp);
+    if (fclose(fp) != 0)
+        ret = ERR;
+    if (ret == OK && rename(tmpname, ctname) == -1) {
+        fprintf(stderr, "error: unable to write '%s'\n", ctname);
+        ret = ERR;
+    }
+    if (ret == ERR)
+        unlink(tmpname);
+    end = current_time();
+    if (g_verbose)
+        fprintf(stderr, "  Writing ct to disk: %.2fs\n", end - start);
+    return ret;
+}
+
+static void
+_write_ct(const char *circuit, const circ_params_t *cp, size_t slot,
+          const mife_ciphertext_t *ct)
+{
+    char ctname[strlen(circuit) + 10 + strlen("..ct\0")];
+
+    snprintf(ctname, sizeof ctname, "%s.%lu.ct", circuit, slot);
+    if (_write_ct_to(ctname, cp, ct) == ERR)
+        exit(EXIT_FAILURE);
+}
+
+static void
+_shell_name(char *name, size_t length, const char *circuit, size_t slot)
+{
+    snprintf(name, length, "%s.%lu.shell", circuit, slot);
+}
+
 int
 mife_run_encrypt(const mmap_vtable *mmap, const char *circuit, obf_params_t *op,
                  const int *input, size_t slot, size_t nthreads,
                  mife_sk_t *cached_sk, aes_randstate_t rng)
 {
     const circ_params_t *cp = &op->cp;
-    double start, end;
     mife_ciphertext_t *ct;
     mife_sk_t *sk;
     size_t ninputs;
-    FILE *fp;
 
     if (slot >= cp->n) {
         fprintf(stderr, "error: invalid MIFE slot %lu\n", slot);
@@ -96,53 +173,334 @@ mife_run_encrypt(const mmap_vtable *mmap, const char *circuit, obf_params_t *op,
                 mife_num_encodings_encrypt(cp, slot));
     }
 
-    if (cached_sk == NULL) {
-        char skname[strlen(circuit) + sizeof ".sk\0"];
-
-        start = current_time();
-        snprintf(skname, sizeof skname, "%s.sk", circuit);
-        if ((fp = fopen(skname, "r")) == NULL) {
-            fprintf(stderr, "error: unable to open '%s' for reading\n", skname);
-            exit(EXIT_FAILURE);
-        }
-        sk = mife_sk_fread(mmap, op, fp);
-        fclose(fp);
-
-        end = current_time();
-        if (g_verbose)
-            fprintf(stderr, "  Reading sk from disk: %.2fs\n", end - start);
-    } else {
-        sk = cached_sk;
-    }
-
+    sk = cached_sk ? cached_sk : _read_sk(mmap, circuit, op);
     ct = mife_encrypt(sk, slot, input, nthreads, NULL, rng, false);
     if (ct == NULL) {
         fprintf(stderr, "error: encryption failed\n");
         exit(EXIT_FAILURE);
     }
+    _write_ct(circuit, cp, slot, ct);
+    mife_ciphertext_free(ct, cp);
+    if (cached_sk == NULL)
+        mife_sk_free(sk);
 
-    start = current_time();
-    {
-        char ctname[strlen(circuit) + 10 + strlen("..ct\0")];
-        snprintf(ctname, sizeof ctname, "%s.%lu.ct", circuit, slot);
+    return OK;
+}
 
-        if ((fp = fopen(ctname, "w")) == NULL) {
-            fprintf(stderr, "error: unable to open '%s' for writing\n", ctname);
-            exit(EXIT_FAILURE);
-        }
-        mife_ciphertext_fwrite(ct, cp, fp);
+int
+mife_run_encrypt_offline(const mmap_vtable *mmap, const char *circuit,
+                         obf_params_t *op, size_t slot, bool xhat,
+                         size_t nthreads, aes_randstate_t rng)
+{
+    const circ_params_t *cp = &op->cp;
+    char shname[strlen(circuit) + 10 + strlen("..shell\0")];
+    mife_shell_t *shell = NULL;
+    mife_sk_t *sk = NULL;
+    FILE *fp = NULL;
+    size_t nvals;
+    int ret = ERR;
+
+    if (slot >= cp->n) {
+        fprintf(stderr, "error: invalid MIFE slot %lu\n", slot);
+        exit(EXIT_FAILURE);
+    }
+    nvals = xhat ? mife_params_nvals(op, slot) : 0;
+    if (g_verbose) {
+        fprintf(stderr, "MIFE offline encryption details:\n");
+        fprintf(stderr, "* circuit: ....... %s\n", circuit);
+        fprintf(stderr, "* slot: .......... %lu\n", slot);
+        fprintf(stderr, "* all inputs: .... %s\n", xhat ? "yes" : "no");
+        fprintf(stderr, "* # threads: ..... %lu\n", nthreads);
+        fprintf(stderr, "* # encodings: ... %lu\n",
+                mife_num_encodings_offline(cp, slot, nvals));
+    }
+
+    sk = _read_sk(mmap, circuit, op);
+    if ((shell = mife_encrypt_offline(sk, slot, nvals, nthreads, rng)) == NULL)
+        goto cleanup;
+    _shell_name(shname, sizeof shname, circuit, slot);
+    if ((fp = fopen(shname, "w")) == NULL) {
+        fprintf(stderr, "error: unable to open '%s' for writing\n", shname);
+        goto cleanup;
+    }
+    if (mife_shell_fwrite(shell, cp, fp) == ERR)
+        goto cleanup;
+    ret = OK;
+cleanup:
+    if (fp)
         fclose(fp);
+    mife_shell_free(shell, cp);
+    if (sk)
+        mife_sk_free(sk);
+    return ret;
+}
+
+int
+mife_run_encrypt_online(const mmap_vtable *mmap, const char *circuit,
+                        obf_params_t *op, const int *input, size_t slot,
+                        size_t nthreads)
+{
+    const circ_params_t *cp = &op->cp;
+    char shname[strlen(circuit) + 10 + strlen("..shell\0")];
+    char ctname[strlen(circuit) + 10 + strlen("..ct\0")];
+    mife_ciphertext_t *ct = NULL;
+    mife_shell_t *shell = NULL;
+    mife_sk_t *sk = NULL;
+    double start, end;
+    FILE *fp;
+    int ret = ERR;
+
+    if (slot >= cp->n) {
+        fprintf(stderr, "error: invalid MIFE slot %lu\n", slot);
+        exit(EXIT_FAILURE);
+    }
+
+    start = current_time();
+    _shell_name(shname, sizeof shname, circuit, slot);
+    if ((fp = fopen(shname, "r")) == NULL) {
+        fprintf(stderr, "error: unable to open '%s' for reading\n", shname);
+        return ERR;
+    }
+    shell = mife_shell_fread(mmap, op, fp, nthreads);
+    fclose(fp);
+    if (shell == NULL)
+        return ERR;
+    if (mife_shell_slot(shell) != slot) {
+        fprintf(stderr, "error: '%s' is for slot %lu\n", shname,
+                mife_shell_slot(shell));
+        goto cleanup;
     }
     end = current_time();
     if (g_verbose)
-        fprintf(stderr, "  Writing ct to disk: %.2fs\n", end - start);
+        fprintf(stderr, "  Reading shell from disk: %.2fs\n", end - start);
+
+    /* The secret key is only needed to encode inputs the shell lacks */
+    if (!mife_shell_has_xhat(shell))
+        sk = _read_sk(mmap, circuit, op);
+    if ((ct = mife_encrypt_online(sk, cp, shell, input, nthreads)) == NULL)
+        goto cleanup;
+    snprintf(ctname, sizeof ctname, "%s.%lu.ct", circuit, slot);
+    if (_write_ct_to(ctname, cp, ct) == ERR)
+        goto cleanup;
+    /* Reusing a shell would reuse its betas, so it is consumed here, and the
+     * ciphertext is withdrawn if that fails */
+    if (unlink(shname) == -1) {
+        fprintf(stderr, "error: unable to remove '%s'\n", shname);
+        unlink(ctname);
+        goto cleanup;
+    }
+    ret = OK;
+cleanup:
     mife_ciphertext_free(ct, cp);
-    if (cached_sk == NULL)
+    mife_shell_free(shell, cp);
+    if (sk)
         mife_sk_free(sk);
+    return ret;
+}
+
+/* Serves one "input slot [ciphertext]" request, replying on out.  A named
+ * ciphertext is written to outdir, so the name must be a plain file name. */
+static int
+_serve_request(mife_encrypter_t *e, const char *circuit, const char *outdir,
+               const circ_params_t *cp, char *line, FILE *out,
+               aes_randstate_t rng)
+{
+    char ctname[strlen(circuit) + 10 + strlen("..ct\0")];
+    char *save, *input_s, *slot_s, *ctname_s, *end;
+    mife_ciphertext_t *ct;
+    double start;
+    size_t slot;
+    int ret;
 
+    input_s = strtok_r(line, " \t", &save);
+    slot_s = strtok_r(NULL, " \t", &save);
+    ctname_s = strtok_r(NULL, " \t", &save);
+    if (input_s == NULL || slot_s == NULL || strtok_r(NULL, " \t", &save)) {
+        fprintf(out, "error expected 'input slot [ciphertext]'\n");
+        return ERR;
+    }
+    slot = strtoul(slot_s, &end, 10);
+    if (*end != '\0' || slot >= cp->n) {
+        fprintf(out, "error invalid slot '%s'\n", slot_s);
+        return ERR;
+    }
+    if (strlen(input_s) != cp->ds[slot]) {
+        fprintf(out, "error input has length %lu, expected %lu\n",
+                strlen(input_s), cp->ds[slot]);
+        return ERR;
+    }
+    int input[cp->ds[slot] + 1];
+    for (size_t i = 0; i < cp->ds[slot]; ++i) {
+        if ((input[i] = char_to_int(input_s[i])) < 0) {
+            fprintf(out, "error invalid input '%s'\n", input_s);
+            return ERR;
+        }
+    }
+    if (ctname_s && (outdir == NULL || strchr(ctname_s, '/')
+                     || !strcmp(ctname_s, ".") || !strcmp(ctname_s, ".."))) {
+        fprintf(out, "error invalid ciphertext name '%s'\n", ctname_s);
+        return ERR;
+    }
+    char path[(ctname_s ? strlen(outdir) + 1 + strlen(ctname_s) : 0) + 1];
+    if (ctname_s) {
+        snprintf(path, sizeof path, "%s/%s", outdir, ctname_s);
+        ctname_s = path;
+    } else {
+        snprintf(ctname, sizeof ctname, "%s.%lu.ct", circuit, slot);
+        ctname_s = ctname;
+    }
+
+    start = current_time();
+    if ((ct = mife_encrypter_encrypt(e, slot, input, rng)) == NULL) {
+        fprintf(out, "error encryption failed\n");
+        return ERR;
+    }
+    ret = _write_ct_to(ctname_s, cp, ct);
+    mife_ciphertext_free(ct, cp);
+    if (ret == ERR) {
+        fprintf(out, "error unable to write '%s'\n", ctname_s);
+        return ERR;
+    }
+    fprintf(out, "ok %s\n", ctname_s);
+    if (g_verbose)
+        fprintf(stderr, "  Encrypted slot %lu to '%s': %.2fs\n", slot, ctname_s,
+                current_time() - start);
     return OK;
 }
 
+/* Serves requests from in until EOF, returning true if asked to quit */
+static bool
+_serve_stream(mife_encrypter_t *e, const char *circuit, const char *outdir,
+              const circ_params_t *cp, FILE *in, FILE *out,
+              aes_randstate_t rng)
+{
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    bool quit = false;
+
+    while (!quit && (len = getline(&line, &cap, in)) != -1) {
+        while (len > 0 && isspace(line[len - 1]))
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        if (!strcmp(line, "quit"))
+            quit = true;
+        else
+            (void) _serve_request(e, circuit, outdir, cp, line, out, rng);
+        fflush(out);
+    }
+    free(line);
+    return quit;
+}
+
+static int
+_serve_socket(mife_encrypter_t *e, const char *circuit, const char *outdir,
+              const circ_params_t *cp, const char *sockname,
+              aes_randstate_t rng)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    bool quit = false, bound = false;
+    mode_t mask;
+    int fd, ret = ERR, res;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(sockname) >= sizeof addr.sun_path) {
+        fprintf(stderr, "error: socket name '%s' is too long\n", sockname);
+        return ERR;
+    }
+    strcpy(addr.sun_path, sockname);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        fprintf(stderr, "error: unable to create socket\n");
+        return ERR;
+    }
+    /* Only replace a stale socket, never whatever else the name points at */
+    if (lstat(sockname, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "error: '%s' exists and is not a socket\n", sockname);
+            goto cleanup;
+        }
+        (void) unlink(sockname);
+    }
+    /* Anyone who can connect encrypts under our key, so only we may */
+    mask = umask(0077);
+    res = bind(fd, (struct sockaddr *) &addr, sizeof addr);
+    umask(mask);
+    bound = res == 0;
+    if (res == -1 || listen(fd, 16) == -1) {
+        fprintf(stderr, "error: unable to listen on '%s'\n", sockname);
+        goto cleanup;
+    }
+    /* A client hanging up early must not take the server down with it */
+    signal(SIGPIPE, SIG_IGN);
+    if (g_verbose)
+        fprintf(stderr, "  Listening on '%s'\n", sockname);
+    /* Clients are served in turn; each encryption uses the whole pool */
+    while (!quit) {
+        FILE *in, *out;
+        int cfd;
+
+        if ((cfd = accept(fd, NULL, NULL)) == -1) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "error: accept failed\n");
+            goto cleanup;
+        }
+        in = fdopen(cfd, "r");
+        out = fdopen(dup(cfd), "w");
+        if (in && out)
+            quit = _serve_stream(e, circuit, outdir, cp, in, out, rng);
+        if (in)
+            fclose(in);
+        else
+            close(cfd);
+        if (out)
+            fclose(out);
+    }
+    ret = OK;
+cleanup:
+    close(fd);
+    if (bound)
+        (void) unlink(sockname);
+    return ret;
+}
+
+int
+mife_run_serve_encrypt(const mmap_vtable *mmap, const char *circuit,
+                       obf_params_t *op, const char *sockname,
+                       const char *outdir, size_t nthreads, aes_randstate_t rng)
+{
+    const circ_params_t *cp = &op->cp;
+    mife_encrypter_t *e = NULL;
+    mife_sk_t *sk;
+    int ret = ERR;
+
+    if (g_verbose) {
+        fprintf(stderr, "MIFE encryption server details:\n");
+        fprintf(stderr, "* circuit: ....... %s\n", circuit);
+        fprintf(stderr, "* requests: ...... %s\n", sockname ? sockname : "stdin");
+        fprintf(stderr, "* named cts: ..... %s\n", outdir ? outdir : "refused");
+        fprintf(stderr, "* # threads: ..... %lu\n", nthreads);
+    }
+
+    sk = _read_sk(mmap, circuit, op);
+    if ((e = mife_encrypter_new(sk, nthreads)) == NULL)
+        goto cleanup;
+    if (sockname) {
+        if (_serve_socket(e, circuit, outdir, cp, sockname, rng) == ERR)
+            goto cleanup;
+    } else {
+        (void) _serve_stream(e, circuit, outdir, cp, stdin, stdout, rng);
+    }
+    ret = OK;
+cleanup:
+    mife_encrypter_free(e);
+    mife_sk_free(sk);
+    return ret;
+}
+
 int
 mife_run_decrypt(const char *ek_s, char **cts_s, int *rop,
                  const mmap_vtable *mmap, obf_params_t *op, size_t *kappa,
@@ -152,6 +510,7 @@ mife_run_decrypt(const char *ek_s, char **cts_s, int *rop,
     const size_t has_consts = cp->circ->consts.n ? 1 : 0;
     mife_ciphertext_t *cts[cp->n];
     mife_ek_t *ek = NULL;
+    eval_ctx *ctx;
     FILE *fp;
     int ret = ERR;
 
@@ -170,7 +529,7 @@ mife_run_decrypt(const char *ek_s, char **cts_s, int *rop,
         fprintf(stderr, "error: unable to open '%s' for reading\n", ek_s);
         goto cleanup;
     }
-    ek = mife_ek_fread(mmap, op, fp);
+    ek = mife_ek_fread(mmap, op, fp, nthreads);
     fclose(fp);
     if (ek == NULL) {
         fprintf(stderr, "error: unable to read evaluation key\n");
@@ -181,18 +540,27 @@ mife_run_decrypt(const char *ek_s, char **cts_s, int *rop,
             fprintf(stderr, "error: unable to open '%s' for reading\n", cts_s[i]);
             goto cleanup;
         }
-        cts[i] = mife_ciphertext_fread(mmap, cp, fp);
+        cts[i] = mife_ciphertext_fread(mmap, cp, fp, nthreads);
         fclose(fp);
         if (cts[i] == NULL) {
             fprintf(stderr, "error: unable to read ciphertext for slot %lu\n", i);
             goto cleanup;
         }
     }
-    ret = mife_decrypt(ek, rop, cts, nthreads, kappa);
+    ctx = eval_ctx_new(nthreads);
+    ret = mife_decrypt(ek, rop, cts, ctx, kappa);
+    eval_ctx_free(ctx);
     if (ret == ERR) {
         fprintf(stderr, "error: decryption failed\n");
         goto cleanup;
     }
+    if (g_verbose) {
+        unsigned long size, resident, peak;
+        if (memory(&size, &resident) == OK)
+            fprintf(stderr, "memory:          %luM\n", resident);
+        if (memory_peak(&peak) == OK)
+            fprintf(stderr, "peak memory:     %luM\n", peak);
+    }
     ret = OK;
 cleanup:
     if (ek)
@@ -307,35 +675,148 @@ mife_run_test(const mmap_vtable *mmap, const char *circuit, obf_params_t *op,
 }
 
 size_t
-mife_run_smart_kappa(const char *circuit, obf_params_t *op, size_t npowers,
-                     size_t nthreads, aes_randstate_t rng)
+mife_run_smart_kappa(obf_params_t *op, size_t npowers, size_t *maxpower)
 {
-    const circ_params_t *cp = &op->cp;
-    const size_t has_consts = cp->circ->consts.n ? 1 : 0;
-    int *inps[cp->n - has_consts];
-    size_t kappa = 1;
-    bool verbosity = g_verbose;
+    size_t kappa = 0, _maxpower = 0;
+    double start, end;
 
     if (g_verbose)
         fprintf(stderr, "Choosing κ smartly...\n");
+    start = current_time();
+    if (mife_kappa(op, npowers, &kappa, &_maxpower) == ERR) {
+        fprintf(stderr, "error: unable to determine κ smartly\n");
+        return 0;
+    }
+    end = current_time();
+    if (g_verbose)
+        fprintf(stderr, "smart κ:         %.3fs (κ = %lu, %lu powers used)\n",
+                end - start, kappa, _maxpower);
+    if (maxpower)
+        *maxpower = _maxpower;
+    return kappa;
+}
+
+int
+mife_run_estimate(const mmap_vtable *mmap, obf_params_t *op, size_t secparam,
+                  size_t kappa, size_t npowers, size_t nthreads,
+                  aes_randstate_t rng)
+{
+    static const char *const names[] = { "setup", "encrypt", "decrypt" };
+    const circ_params_t *const cp = &op->cp;
+    const size_t has_consts = cp->circ->consts.n ? 1 : 0;
+    const mmap_vtable *const dry = estimate_begin();
+    mife_ciphertext_t *cts[cp->n];
+    estimate_ops ops[3];
+    estimate_costs costs;
+    mife_t *mife = NULL;
+    mife_sk_t *sk = NULL;
+    mife_ek_t *ek = NULL;
+    FILE *skfp = NULL, *ekfp = NULL, *ctfp = NULL;
+    bool verbosity = g_verbose;
+    eval_ctx *ctx;
+    double start;
+    int rop[cp->m];
+    int res, ret = ERR;
 
+    memset(cts, '\0', sizeof cts);
+    if ((skfp = tmpfile()) == NULL || (ekfp = tmpfile()) == NULL
+        || (ctfp = tmpfile()) == NULL) {
+        fprintf(stderr, "error: unable to create temporary file\n");
+        goto cleanup;
+    }
+    if (g_verbose)
+        fprintf(stderr, "Dry run with the dummy mmap...\n");
+    start = current_time();
     g_verbose = false;
-    if (mife_run_setup(&dummy_vtable, circuit, op, 8, &kappa, npowers, nthreads, rng) == ERR) {
+    /* Set up, encrypt all zeros in every slot and decrypt, going through the
+     * disk between each like the real commands do */
+    if ((mife = mife_setup(dry, op, secparam, &kappa, npowers, nthreads, rng)) == NULL) {
         fprintf(stderr, "error: mife setup failed\n");
         goto cleanup;
     }
+    sk = mife_sk(mife);
+    ek = mife_ek(mife);
+    if (mife_sk_fwrite(sk, skfp) == ERR || mife_ek_fwrite(ek, ekfp) == ERR)
+        goto cleanup;
+    mife_sk_free(sk);
+    mife_ek_free(ek);
+    mife_free(mife);
+    sk = NULL;
+    ek = NULL;
+    mife = NULL;
+    estimate_phase(&ops[0], ftell(skfp) + ftell(ekfp));
+
+    rewind(skfp);
+    if ((sk = mife_sk_fread(dry, op, skfp)) == NULL)
+        goto cleanup;
+    for (size_t i = 0; i < cp->n - has_consts; ++i) {
+        int input[cp->ds[i]];
+        mife_ciphertext_t *ct;
+
+        memset(input, '\0', sizeof input);
+        if ((ct = mife_encrypt(sk, i, input, nthreads, NULL, rng, false)) == NULL) {
+            fprintf(stderr, "error: encryption failed\n");
+            goto cleanup;
+        }
+        if (mife_ciphertext_fwrite(ct, cp, ctfp) == ERR) {
+            mife_ciphertext_free(ct, cp);
+            goto cleanup;
+        }
+        mife_ciphertext_free(ct, cp);
+    }
+    mife_sk_free(sk);
+    sk = NULL;
+    estimate_phase(&ops[1], ftell(ctfp));
 
+    rewind(ekfp);
+    rewind(ctfp);
+    if ((ek = mife_ek_fread(dry, op, ekfp, nthreads)) == NULL)
+        goto cleanup;
     for (size_t i = 0; i < cp->n - has_consts; ++i) {
-        inps[i] = my_calloc(cp->ds[i], sizeof inps[i][0]);
+        if ((cts[i] = mife_ciphertext_fread(dry, cp, ctfp, nthreads)) == NULL)
+            goto cleanup;
     }
-    if (mife_run_all(&dummy_vtable, circuit, op, inps, NULL, &kappa, nthreads, rng) == ERR) {
-        fprintf(stderr, "error: unable to determine κ smartly\n");
-        kappa = 0;
+    ctx = eval_ctx_new(nthreads);
+    res = mife_decrypt(ek, rop, cts, ctx, NULL);
+    eval_ctx_free(ctx);
+    if (res == ERR) {
+        fprintf(stderr, "error: decryption failed\n");
+        goto cleanup;
     }
-    for (size_t i = 0; i < cp->n - has_consts; ++i) {
-        free(inps[i]);
+    mife_ek_free(ek);
+    ek = NULL;
+    for (size_t i = 0; i < cp->n; ++i) {
+        if (cts[i])
+            mife_ciphertext_free(cts[i], cp);
+        cts[i] = NULL;
     }
+    estimate_phase(&ops[2], 0);
+    g_verbose = verbosity;
+    if (g_verbose)
+        fprintf(stderr, "dry run:         %.2fs\n", current_time() - start);
+
+    if (estimate_calibrate(mmap, secparam, nthreads, rng, &costs) == ERR)
+        goto cleanup;
+    estimate_fprint(stdout, "MIFE", secparam, nthreads, &costs, names, ops, 3);
+    ret = OK;
 cleanup:
     g_verbose = verbosity;
-    return kappa;
+    for (size_t i = 0; i < cp->n; ++i) {
+        if (cts[i])
+            mife_ciphertext_free(cts[i], cp);
+    }
+    if (sk)
+        mife_sk_free(sk);
+    if (ek)
+        mife_ek_free(ek);
+    if (mife)
+        mife_free(mife);
+    if (skfp)
+        fclose(skfp);
+    if (ekfp)
+        fclose(ekfp);
+    if (ctfp)
+        fclose(ctfp);
+    estimate_end();
+    return ret;
 }
@@ -15,6 +15,29 @@ int
 mife_run_encrypt(const mmap_vtable *mmap, const char *circuit, obf_params_t *op,
                  const int *input, size_t slot, size_t nthreads,
                  mife_sk_t *cached_sk, aes_randstate_t rng);
+/* Writes a ciphertext shell for slot to circuit.slot.shell */
+int
+mife_run_encrypt_offline(const mmap_vtable *mmap, const char *circuit,
+                         obf_params_t *op, size_t slot, bool xhat,
+                         size_t nthreads, aes_randstate_t rng);
+/* Finishes a ciphertext from circuit.slot.shell, removing the shell */
+int
+mife_run_encrypt_online(const mmap_vtable *mmap, const char *circuit,
+                        obf_params_t *op, const int *input, size_t slot,
+                        size_t nthreads);
+
+/*
+ * Keeps the secret key and a thread pool resident and encrypts each request
+ * line "input slot [ciphertext]", read from the Unix socket sockname or, if
+ * that is NULL, from stdin.  A named ciphertext must be a plain file name and
+ * is written to outdir; names are refused when outdir is NULL.  Each request
+ * is answered with "ok <ciphertext>" or "error <reason>"; a "quit" line stops
+ * the server.
+ */
+int
+mife_run_serve_encrypt(const mmap_vtable *mmap, const char *circuit,
+                       obf_params_t *op, const char *sockname,
+                       const char *outdir, size_t nthreads, aes_randstate_t rng);
 
 int
 mife_run_decrypt(const char *ek_s, char **cts_s, int *rop,
@@ -26,6 +49,15 @@ mife_run_test(const mmap_vtable *mmap, const char *circuit, obf_params_t *op,
               size_t secparam, size_t *kappa, size_t npowers, size_t nthreads,
               aes_randstate_t rng);
 
+/* κ for op, and in *maxpower (unless NULL) the number of powers decryption
+ * actually uses; 0 on error */
 size_t
-mife_run_smart_kappa(const char *circuit, obf_params_t *op, size_t npowers,
-                     size_t nthreads, aes_randstate_t rng);
+mife_run_smart_kappa(obf_params_t *op, size_t npowers, size_t *maxpower);
+
+/* Predicts the time, peak memory and disk space of setup, encrypting every
+ * slot and decrypting with mmap at secparam and kappa (0 for the default),
+ * printing them as JSON on stdout */
+int
+mife_run_estimate(const mmap_vtable *mmap, obf_params_t *op, size_t secparam,
+                  size_t kappa, size_t npowers, size_t nthreads,
+                  aes_randstate_t rng);
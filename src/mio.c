@@ -9,6 +9,7 @@
 #include "lz/obfuscator.h"
 #include "mobf/obfuscator.h"
 #include "obf_run.h"
+#include "sched.h"
 
 #include <aesrand.h>
 #include <acirc.h>
@@ -16,6 +17,7 @@
 #include <mmap/mmap_dummy.h>
 
 #include <assert.h>
+#include <ctype.h>
 #include <err.h>
 #include <getopt.h>
 #include <math.h>
@@ -90,6 +92,7 @@ args_usage(void)
 "    --symlen N         set Σ-vector length to N bits (default: %lu)\n"
 "    --base B           set base to B (default: %lu)\n"
 "    --nthreads N       set the number of threads to N (default: %lu)\n"
+"    --sched S          set gate scheduler to S (options: LEVEL, GATE | default: LEVEL)\n"
 "    --verbose          be verbose\n"
 "    --help             print this message and exit\n",
 mmap, defaults.sigma ? "yes" : "no", defaults.symlen, defaults.base, defaults.nthreads);
@@ -106,6 +109,60 @@ args_get_size_t(size_t *result, int *argc, char ***argv)
     return OK;
 }
 
+/* Parses a list of output indices such as "0,3,8-15", each below noutputs */
+static int
+outputs_parse(size_t **outputs, size_t *n, const char *list, size_t noutputs)
+{
+    const char *str = list;
+    char *end;
+
+    free(*outputs);
+    *outputs = NULL;
+    *n = 0;
+    while (*str) {
+        size_t lo, hi;
+        lo = hi = strtoul(str, &end, 10);
+        if (end == str)
+            goto error;
+        if (*end == '-') {
+            str = end + 1;
+            hi = strtoul(str, &end, 10);
+            if (end == str || hi < lo)
+                goto error;
+        }
+        if (hi >= noutputs) {
+            fprintf(stderr, "error: output %lu out of range, the circuit has %lu outputs\n",
+                    hi, noutputs);
+            goto cleanup;
+        }
+        *outputs = my_realloc(*outputs, (*n + hi - lo + 1) * sizeof (*outputs)[0]);
+        for (size_t o = lo; o <= hi; ++o)
+            (*outputs)[(*n)++] = o;
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            goto error;
+        str = end;
+    }
+    if (*n == 0)
+        goto error;
+    return OK;
+error:
+    fprintf(stderr, "error: invalid output list '%s'\n", list);
+cleanup:
+    free(*outputs);
+    *outputs = NULL;
+    *n = 0;
+    return ERR;
+}
+
+/* Output i of rop, counting only the --outputs list when one was given */
+static int
+get_output(const int *rop, const size_t *outputs, size_t n, size_t i)
+{
+    return rop[n ? outputs[i] : i];
+}
+
 typedef struct mife_setup_args_t {
     size_t secparam;
     size_t npowers;
@@ -151,12 +208,13 @@ mife_setup_handle_options(int *argc, char ***argv, void *vargs)
 }
 
 typedef struct {
+    bool shell;
 } mife_encrypt_args_t;
 
 static void
 mife_encrypt_args_init(mife_encrypt_args_t *args)
 {
-    (void) args;
+    args->shell = false;
 }
 
 static void
@@ -165,6 +223,8 @@ mife_encrypt_usage(bool longform, int ret)
     printf("usage: %s mife encrypt [<args>] circuit input slot\n", progname);
     if (longform) {
         printf("\nAvailable arguments:\n\n");
+        printf("    --shell            finish the ciphertext from the shell made by\n"
+               "                       'mife precompute', consuming it\n");
         args_usage();
         printf("\n");
     }
@@ -174,17 +234,119 @@ mife_encrypt_usage(bool longform, int ret)
 static int
 mife_encrypt_handle_options(int *argc, char ***argv, void *vargs)
 {
-    (void) argc; (void) argv; (void) vargs;
-    return ERR;
+    mife_encrypt_args_t *args = vargs;
+    const char *cmd = (*argv)[0];
+    (void) argc;
+    if (!strcmp(cmd, "--shell")) {
+        args->shell = true;
+    } else {
+        return ERR;
+    }
+    return OK;
+}
+
+typedef struct {
+    bool xhat;
+} mife_precompute_args_t;
+
+static void
+mife_precompute_args_init(mife_precompute_args_t *args)
+{
+    args->xhat = false;
+}
+
+static void
+mife_precompute_usage(bool longform, int ret)
+{
+    printf("usage: %s mife precompute [<args>] circuit slot\n", progname);
+    if (longform) {
+        printf("\nAvailable arguments:\n\n");
+        printf("    --all-inputs       also encode every possible input, so that\n"
+               "                       'mife encrypt --shell' needs no encoding\n");
+        args_usage();
+        printf("\n");
+    }
+    exit(ret);
+}
+
+static int
+mife_precompute_handle_options(int *argc, char ***argv, void *vargs)
+{
+    mife_precompute_args_t *args = vargs;
+    const char *cmd = (*argv)[0];
+    (void) argc;
+    if (!strcmp(cmd, "--all-inputs")) {
+        args->xhat = true;
+    } else {
+        return ERR;
+    }
+    return OK;
+}
+
+typedef struct {
+    const char *socket;
+    const char *outdir;
+} mife_serve_encrypt_args_t;
+
+static void
+mife_serve_encrypt_args_init(mife_serve_encrypt_args_t *args)
+{
+    args->socket = NULL;
+    args->outdir = NULL;
+}
+
+static void
+mife_serve_encrypt_usage(bool longform, int ret)
+{
+    printf("usage: %s mife serve-encrypt [<args>] circuit\n", progname);
+    if (longform) {
+        printf("\nReads requests 'input slot [ciphertext]', one per line, and\n"
+               "answers each with 'ok <ciphertext>' or 'error <reason>'.  A 'quit'\n"
+               "line stops the server.\n");
+        printf("\nAvailable arguments:\n\n");
+        printf("    --socket PATH      serve requests on the Unix socket PATH\n"
+               "                       instead of stdin\n");
+        printf("    --outdir DIR       write named ciphertexts to DIR; without it\n"
+               "                       requests may not name their ciphertext\n");
+        args_usage();
+        printf("\n");
+    }
+    exit(ret);
+}
+
+static int
+mife_serve_encrypt_handle_options(int *argc, char ***argv, void *vargs)
+{
+    mife_serve_encrypt_args_t *args = vargs;
+    const char *cmd = (*argv)[0];
+    if (!strcmp(cmd, "--socket")) {
+        if (*argc <= 1)
+            return ERR;
+        args->socket = (*argv)[1];
+        (*argv)++; (*argc)--;
+    } else if (!strcmp(cmd, "--outdir")) {
+        if (*argc <= 1)
+            return ERR;
+        args->outdir = (*argv)[1];
+        (*argv)++; (*argc)--;
+    } else {
+        return ERR;
+    }
+    return OK;
 }
 
 typedef struct {
+    const char *outputs_list;   /* parsed into outputs once the circuit is known */
+    size_t *outputs;
+    size_t noutputs;
 } mife_decrypt_args_t;
 
 static void
 mife_decrypt_args_init(mife_decrypt_args_t *args)
 {
-    (void) args;
+    args->outputs_list = NULL;
+    args->outputs = NULL;
+    args->noutputs = 0;
 }
 
 static void
@@ -193,6 +355,7 @@ mife_decrypt_usage(bool longform, int ret)
     printf("usage: %s mife decrypt [<args>] circuit\n", progname);
     if (longform) {
         printf("\nAvailable arguments:\n\n");
+        printf("    --outputs LIST     only decrypt the listed outputs (e.g., 0,3,8-15)\n");
         args_usage();
         printf("\n");
     }
@@ -202,8 +365,17 @@ mife_decrypt_usage(bool longform, int ret)
 static int
 mife_decrypt_handle_options(int *argc, char ***argv, void *vargs)
 {
-    (void) argc; (void) argv; (void) vargs;
-    return ERR;
+    mife_decrypt_args_t *args = vargs;
+    const char *cmd = (*argv)[0];
+    if (!strcmp(cmd, "--outputs")) {
+        if (*argc <= 1)
+            return ERR;
+        args->outputs_list = (*argv)[1];
+        (*argv)++; (*argc)--;
+    } else {
+        return ERR;
+    }
+    return OK;
 }
 
 typedef struct {
@@ -290,11 +462,31 @@ mife_get_kappa_handle_options(int *argc, char ***argv, void *vargs)
     return OK;
 }
 
+typedef mife_test_args_t mife_estimate_args_t;
+#define mife_estimate_args_init mife_test_args_init
+static void
+mife_estimate_usage(bool longform, int ret)
+{
+    printf("usage: %s mife estimate [<args>] circuit\n", progname);
+    if (longform) {
+        printf("\nAvailable arguments:\n\n");
+        printf("    --secparam λ       set security parameter to λ (default: %d)\n"
+               "    --npowers N        set the number of powers to N (default: %d)\n",
+               SECPARAM_DEFAULT, NPOWERS_DEFAULT);
+        args_usage();
+        printf("\n");
+    }
+    exit(ret);
+}
+#define mife_estimate_handle_options mife_test_handle_options
+
 typedef struct {
     size_t secparam;
     size_t npowers;
     size_t kappa;
     enum scheme_e scheme;
+    bool stream;
+    bool resume;
 } obf_obfuscate_args_t;
 
 static void
@@ -304,6 +496,8 @@ obf_obfuscate_args_init(obf_obfuscate_args_t *args)
     args->npowers = NPOWERS_DEFAULT;
     args->scheme = SCHEME_MIFE;
     args->kappa = 0;
+    args->stream = false;
+    args->resume = false;
 }
 
 static void
@@ -316,7 +510,10 @@ obf_obfuscate_or_test_usage(bool longform, int ret, const char *cmd)
             "    --kappa Κ          set kappa to Κ\n"
             "    --scheme S         set obfuscation scheme to S (options: LIN, LZ, MIFE | default: MIFE)\n"
             "    --secparam λ       set security parameter to λ (default: %d)\n"
-            "    --npowers N        set the number of powers to N (default: %d)\n",
+            "    --npowers N        set the number of powers to N (default: %d)\n"
+            "    --stream           write encodings to disk as they are produced (LZ only)\n"
+            "    --resume           checkpoint to <circuit>.obf.journal, resuming from it\n"
+            "                       if it exists (LZ only)\n",
             SECPARAM_DEFAULT, NPOWERS_DEFAULT);
         args_usage();
         printf("\n");
@@ -371,6 +568,10 @@ obf_obfuscate_handle_options(int *argc, char ***argv, void *vargs)
             return ERR;
         }
         (*argv)++; (*argc)--;
+    } else if (!strcmp(cmd, "--stream")) {
+        args->stream = true;
+    } else if (!strcmp(cmd, "--resume")) {
+        args->resume = true;
     } else {
         return ERR;
     }
@@ -380,6 +581,11 @@ obf_obfuscate_handle_options(int *argc, char ***argv, void *vargs)
 typedef struct {
     size_t npowers;
     enum scheme_e scheme;
+    bool batch;
+    bool incremental;
+    const char *outputs_list;   /* parsed into outputs once the circuit is known */
+    size_t *outputs;
+    size_t noutputs;
 } obf_evaluate_args_t;
 
 static void
@@ -387,6 +593,11 @@ obf_evaluate_args_init(obf_evaluate_args_t *args)
 {
     args->npowers = NPOWERS_DEFAULT;
     args->scheme = SCHEME_MIFE;
+    args->batch = false;
+    args->incremental = false;
+    args->outputs_list = NULL;
+    args->outputs = NULL;
+    args->noutputs = 0;
 }
 
 static void
@@ -396,7 +607,11 @@ obf_evaluate_usage(bool longform, int ret)
     if (longform) {
         printf("\nAvailable arguments:\n\n");
         printf("    --scheme S         set obfuscation scheme to S (options: LZ, MIFE | default: MIFE)\n"
-               "    --npowers N        set the number of powers to N (default: %d)\n",
+               "    --npowers N        set the number of powers to N (default: %d)\n"
+               "    --batch            treat input as a file of inputs, one per line ('-' for stdin)\n"
+               "    --incremental      with --batch, only re-evaluate the gates that depend on\n"
+               "                       input symbols that changed since the previous line\n"
+               "    --outputs LIST     only evaluate the listed outputs (e.g., 0,3,8-15)\n",
                NPOWERS_DEFAULT);
         args_usage();
         printf("\n");
@@ -427,6 +642,15 @@ obf_evaluate_handle_options(int *argc, char ***argv, void *vargs)
             return ERR;
         }
         (*argv)++; (*argc)--;
+    } else if (!strcmp(cmd, "--batch")) {
+        args->batch = true;
+    } else if (!strcmp(cmd, "--incremental")) {
+        args->incremental = true;
+    } else if (!strcmp(cmd, "--outputs")) {
+        if (*argc <= 1)
+            return ERR;
+        args->outputs_list = (*argv)[1];
+        (*argv)++; (*argc)--;
     } else {
         return ERR;
     }
@@ -459,6 +683,27 @@ obf_get_kappa_usage(bool longform, int ret)
 }
 #define obf_get_kappa_handle_options obf_evaluate_handle_options
 
+typedef obf_obfuscate_args_t obf_estimate_args_t;
+#define obf_estimate_args_init obf_obfuscate_args_init
+static void
+obf_estimate_usage(bool longform, int ret)
+{
+    printf("usage: %s obf estimate [<args>] circuit\n", progname);
+    if (longform) {
+        printf("\nAvailable arguments:\n\n");
+        printf(
+            "    --kappa Κ          set kappa to Κ\n"
+            "    --scheme S         set obfuscation scheme to S (options: LIN, LZ, MIFE | default: MIFE)\n"
+            "    --secparam λ       set security parameter to λ (default: %d)\n"
+            "    --npowers N        set the number of powers to N (default: %d)\n",
+            SECPARAM_DEFAULT, NPOWERS_DEFAULT);
+        args_usage();
+        printf("\n");
+    }
+    exit(ret);
+}
+#define obf_estimate_handle_options obf_obfuscate_handle_options
+
 static void
 handle_options(int *argc, char ***argv, int left, args_t *args, void *others,
                int (*other)(int *, char ***, void *),
@@ -490,6 +735,19 @@ handle_options(int *argc, char ***argv, int left, args_t *args, void *others,
         } else if (!strcmp(cmd, "--nthreads")) {
             if (args_get_size_t(&args->nthreads, argc, argv) == ERR)
                 f(false, EXIT_FAILURE);
+        } else if (!strcmp(cmd, "--sched")) {
+            if (*argc <= 1)
+                f(false, EXIT_FAILURE);
+            const char *sched = (*argv)[1];
+            if (!strcmp(sched, "LEVEL")) {
+                g_sched = SCHED_LEVEL;
+            } else if (!strcmp(sched, "GATE")) {
+                g_sched = SCHED_GATE;
+            } else {
+                fprintf(stderr, "error: unknown scheduler \"%s\"\n", sched);
+                f(true, EXIT_FAILURE);
+            }
+            (*argv)++; (*argc)--;
         } else if (!strcmp(cmd, "--sigma")) {
             args->sigma = true;
         } else if (!strcmp(cmd, "--symlen")) {
@@ -605,8 +863,63 @@ cmd_mife_encrypt(int argc, char **argv, args_t *args)
     int slot = atoi(argv[1]);
     if (mife_select_scheme(&args->circ, args->sigma, args->symlen, args->base, &op_vt, &op) == ERR)
         goto cleanup;
-    if (mife_run_encrypt(args->vt, args->circuit, op, input, slot,
-                         args->nthreads, NULL, args->rng) == ERR)
+    if (args_.shell) {
+        if (mife_run_encrypt_online(args->vt, args->circuit, op, input, slot,
+                                    args->nthreads) == ERR)
+            goto cleanup;
+    } else {
+        if (mife_run_encrypt(args->vt, args->circuit, op, input, slot,
+                             args->nthreads, NULL, args->rng) == ERR)
+            goto cleanup;
+    }
+    ret = OK;
+cleanup:
+    if (op)
+        op_vt->free(op);
+    return ret;
+}
+
+static int
+cmd_mife_precompute(int argc, char **argv, args_t *args)
+{
+    mife_precompute_args_t args_;
+    op_vtable *op_vt = NULL;
+    obf_params_t *op = NULL;
+    int ret = ERR;
+
+    argv++; argc--;
+    mife_precompute_args_init(&args_);
+    handle_options(&argc, &argv, 1, args, &args_, mife_precompute_handle_options,
+                   mife_precompute_usage);
+    int slot = atoi(argv[0]);
+    if (mife_select_scheme(&args->circ, args->sigma, args->symlen, args->base, &op_vt, &op) == ERR)
+        goto cleanup;
+    if (mife_run_encrypt_offline(args->vt, args->circuit, op, slot, args_.xhat,
+                                 args->nthreads, args->rng) == ERR)
+        goto cleanup;
+    ret = OK;
+cleanup:
+    if (op)
+        op_vt->free(op);
+    return ret;
+}
+
+static int
+cmd_mife_serve_encrypt(int argc, char **argv, args_t *args)
+{
+    mife_serve_encrypt_args_t args_;
+    op_vtable *op_vt = NULL;
+    obf_params_t *op = NULL;
+    int ret = ERR;
+
+    argv++; argc--;
+    mife_serve_encrypt_args_init(&args_);
+    handle_options(&argc, &argv, 0, args, &args_,
+                   mife_serve_encrypt_handle_options, mife_serve_encrypt_usage);
+    if (mife_select_scheme(&args->circ, args->sigma, args->symlen, args->base, &op_vt, &op) == ERR)
+        goto cleanup;
+    if (mife_run_serve_encrypt(args->vt, args->circuit, op, args_.socket,
+                               args_.outdir, args->nthreads, args->rng) == ERR)
         goto cleanup;
     ret = OK;
 cleanup:
@@ -632,6 +945,11 @@ cmd_mife_decrypt(int argc, char **argv, args_t *args)
     handle_options(&argc, &argv, 0, args, &args_, mife_decrypt_handle_options, mife_decrypt_usage);
     if (mife_select_scheme(&args->circ, args->sigma, args->symlen, args->base, &op_vt, &op) == ERR)
         goto cleanup;
+    if (args_.outputs_list
+        && (outputs_parse(&args_.outputs, &args_.noutputs, args_.outputs_list,
+                          op->cp.m) == ERR
+            || circ_params_prune(&op->cp, args_.outputs, args_.noutputs) == ERR))
+        goto cleanup;
     nslots = op->cp.n;
 
     length = snprintf(NULL, 0, "%s.ek\n", args->circuit);
@@ -649,12 +967,13 @@ cmd_mife_decrypt(int argc, char **argv, args_t *args)
         goto cleanup;
     }
     printf("result: ");
-    for (size_t o = 0; o < op->cp.m; ++o) {
-        printf("%d", rop[o]);
+    for (size_t o = 0; o < (args_.noutputs ? args_.noutputs : op->cp.m); ++o) {
+        printf("%d", get_output(rop, args_.outputs, args_.noutputs, o));
     }
     printf("\n");
     ret = OK;
 cleanup:
+    free(args_.outputs);
     if (ek)
         free(ek);
     if (cts) {
@@ -684,7 +1003,7 @@ cmd_mife_test(int argc, char **argv, args_t *args)
     if (mife_select_scheme(&args->circ, args->sigma, args->symlen, args->base, &op_vt, &op) == ERR)
         goto cleanup;
     if (args->smart) {
-        kappa = mife_run_smart_kappa(args->circuit, op, args_.npowers, args->nthreads, args->rng);
+        kappa = mife_run_smart_kappa(op, args_.npowers, NULL);
         if (kappa == 0)
             goto cleanup;
     }
@@ -707,7 +1026,7 @@ cmd_mife_get_kappa(int argc, char **argv, args_t *args)
     const mmap_vtable *vt = &dummy_vtable;
     op_vtable *op_vt = NULL;
     obf_params_t *op = NULL;
-    size_t kappa = 0;
+    size_t kappa = 0, npowers = 0;
     int ret = ERR;
 
     argv++, argc--;
@@ -716,7 +1035,7 @@ cmd_mife_get_kappa(int argc, char **argv, args_t *args)
     if (mife_select_scheme(&args->circ, args->sigma, args->symlen, args->base, &op_vt, &op) == ERR)
         goto cleanup;
     if (args->smart) {
-        kappa = mife_run_smart_kappa(args->circuit, op, args_.npowers, args->nthreads, args->rng);
+        kappa = mife_run_smart_kappa(op, args_.npowers, &npowers);
         if (kappa == 0)
             goto cleanup;
     } else {
@@ -727,6 +1046,38 @@ cmd_mife_get_kappa(int argc, char **argv, args_t *args)
         }
     }
     printf("κ = %lu\n", kappa);
+    if (args->smart)
+        printf("npowers used = %lu\n", npowers);
+    ret = OK;
+cleanup:
+    if (op)
+        op_vt->free(op);
+    return ret;
+}
+
+static int
+cmd_mife_estimate(int argc, char **argv, args_t *args)
+{
+    mife_estimate_args_t args_;
+    op_vtable *op_vt = NULL;
+    obf_params_t *op = NULL;
+    size_t kappa = 0;
+    int ret = ERR;
+
+    argv++, argc--;
+    mife_estimate_args_init(&args_);
+    handle_options(&argc, &argv, 0, args, &args_, mife_estimate_handle_options,
+                   mife_estimate_usage);
+    if (mife_select_scheme(&args->circ, args->sigma, args->symlen, args->base, &op_vt, &op) == ERR)
+        goto cleanup;
+    if (args->smart) {
+        kappa = mife_run_smart_kappa(op, args_.npowers, NULL);
+        if (kappa == 0)
+            goto cleanup;
+    }
+    if (mife_run_estimate(args->vt, op, args->secparam, kappa, args_.npowers,
+                          args->nthreads, args->rng) == ERR)
+        goto cleanup;
     ret = OK;
 cleanup:
     if (op)
@@ -742,9 +1093,12 @@ mife_usage(bool longform, int ret)
         printf("\nAvailable commands:\n\n"
                "   setup         run MIFE setup routine\n"
                "   encrypt       run MIFE encryption routine\n"
+               "   precompute    generate a ciphertext shell ahead of encryption\n"
+               "   serve-encrypt keep the secret key loaded and serve encryptions\n"
                "   decrypt       run MIFE decryption routine\n"
                "   test          run test suite\n"
                "   get-kappa     get κ value\n"
+               "   estimate      predict the cost of setup, encryption and decryption\n"
                "   help          print this message and exit\n\n");
     }
     exit(ret);
@@ -767,12 +1121,18 @@ cmd_mife(int argc, char **argv)
         ret = cmd_mife_setup(argc, argv, &args);
     } else if (!strcmp(cmd, "encrypt")) {
         ret = cmd_mife_encrypt(argc, argv, &args);
+    } else if (!strcmp(cmd, "precompute")) {
+        ret = cmd_mife_precompute(argc, argv, &args);
+    } else if (!strcmp(cmd, "serve-encrypt")) {
+        ret = cmd_mife_serve_encrypt(argc, argv, &args);
     } else if (!strcmp(cmd, "decrypt")) {
         ret = cmd_mife_decrypt(argc, argv, &args);
     } else if (!strcmp(cmd, "test")) {
         ret = cmd_mife_test(argc, argv, &args);
     } else if (!strcmp(cmd, "get-kappa")) {
         ret = cmd_mife_get_kappa(argc, argv, &args);
+    } else if (!strcmp(cmd, "estimate")) {
+        ret = cmd_mife_estimate(argc, argv, &args);
     } else if (!strcmp(cmd, "help")
                || !strcmp(cmd, "--help")
                || !strcmp(cmd, "-h")) {
@@ -856,7 +1216,7 @@ cmd_obf_obfuscate(int argc, char **argv, args_t *args)
                           args->symlen, args->base, &vt, &op_vt, &op) == ERR)
         goto cleanup;
     if (args->smart) {
-        kappa = obf_run_smart_kappa(vt, &args->circ, op, args->nthreads, args->rng);
+        kappa = obf_run_smart_kappa(vt, &args->circ, op, args->nthreads, args->rng, NULL);
         if (kappa == 0)
             goto cleanup;
     }
@@ -867,7 +1227,8 @@ cmd_obf_obfuscate(int argc, char **argv, args_t *args)
     fname = my_calloc(length, sizeof fname[0]);
     snprintf(fname, length, "%s.obf", args->circuit);
     if (obf_run_obfuscate(args->vt, vt, fname, op, args->secparam, &kappa,
-                          args->nthreads, args->rng) == ERR)
+                          args->nthreads, args->rng, args_.stream,
+                          args_.resume) == ERR)
         goto cleanup;
 
     ret = OK;
@@ -879,6 +1240,97 @@ cleanup:
     return ret;
 }
     
+static int
+obf_read_inputs(const char *fname, size_t ninputs, int ***inputs, size_t *n)
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t cap = 0, max = 0;
+    ssize_t len;
+    int ret = ERR;
+
+    if (!strcmp(fname, "-"))
+        fp = stdin;
+    else if ((fp = fopen(fname, "r")) == NULL) {
+        fprintf(stderr, "error: unable to open '%s' for reading\n", fname);
+        return ERR;
+    }
+    *inputs = NULL;
+    *n = 0;
+    while ((len = getline(&line, &cap, fp)) != -1) {
+        while (len > 0 && isspace(line[len - 1]))
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        if ((size_t) len != ninputs) {
+            fprintf(stderr, "error: input #%lu has length %ld, expected %lu\n",
+                    *n + 1, len, ninputs);
+            goto cleanup;
+        }
+        if (*n == max) {
+            max = max ? 2 * max : 64;
+            *inputs = my_realloc(*inputs, max * sizeof (*inputs)[0]);
+        }
+        (*inputs)[*n] = my_calloc(ninputs, sizeof (*inputs)[*n][0]);
+        (*n)++;
+        for (size_t i = 0; i < ninputs; ++i) {
+            if (((*inputs)[*n - 1][i] = char_to_int(line[i])) < 0)
+                goto cleanup;
+        }
+    }
+    ret = OK;
+cleanup:
+    if (ret == ERR) {
+        for (size_t i = 0; i < *n; ++i)
+            free((*inputs)[i]);
+        free(*inputs);
+        *inputs = NULL;
+        *n = 0;
+    }
+    free(line);
+    if (fp != stdin)
+        fclose(fp);
+    return ret;
+}
+
+static int
+cmd_obf_evaluate_batch(const char *inputs_fname, args_t *args,
+                       const obfuscator_vtable *vt, obf_params_t *op,
+                       const char *fname, bool incremental,
+                       const size_t *which, size_t nwhich)
+{
+    int **inputs = NULL, **outputs = NULL;
+    size_t n = 0;
+    int ret = ERR;
+
+    if (obf_read_inputs(inputs_fname, args->circ.ninputs, &inputs, &n) == ERR)
+        return ERR;
+    outputs = my_calloc(n, sizeof outputs[0]);
+    for (size_t i = 0; i < n; ++i)
+        outputs[i] = my_calloc(op->cp.m, sizeof outputs[i][0]);
+    if (obf_run_evaluate_batch(args->vt, vt, fname, op, inputs, args->circ.ninputs,
+                               outputs, op->cp.m, n, args->nthreads, NULL, NULL,
+                               incremental) == ERR)
+        goto cleanup;
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < args->circ.ninputs; ++j)
+            printf("%c", int_to_char(inputs[i][j]));
+        printf(" ");
+        for (size_t o = 0; o < (nwhich ? nwhich : op->cp.m); ++o)
+            printf("%c", int_to_char(get_output(outputs[i], which, nwhich, o)));
+        printf("\n");
+    }
+    ret = OK;
+cleanup:
+    for (size_t i = 0; i < n; ++i) {
+        free(inputs[i]);
+        free(outputs[i]);
+    }
+    free(inputs);
+    free(outputs);
+    return ret;
+}
+
 static int
 cmd_obf_evaluate(int argc, char **argv, args_t *args)
 {
@@ -894,16 +1346,32 @@ cmd_obf_evaluate(int argc, char **argv, args_t *args)
     argv++; argc--;
     obf_evaluate_args_init(&args_);
     handle_options(&argc, &argv, 1, args, &args_, obf_evaluate_handle_options, obf_evaluate_usage);
+    if (args_.incremental && !args_.batch) {
+        fprintf(stderr, "error: --incremental requires --batch\n");
+        goto cleanup;
+    }
     if (obf_select_scheme(args_.scheme, &args->circ, args_.npowers, args->sigma,
                           args->symlen, args->base, &vt, &op_vt, &op) == ERR)
         goto cleanup;
+    if (args_.outputs_list
+        && (outputs_parse(&args_.outputs, &args_.noutputs, args_.outputs_list,
+                          op->cp.m) == ERR
+            || circ_params_prune(&op->cp, args_.outputs, args_.noutputs) == ERR))
+        goto cleanup;
 
-    input = my_calloc(strlen(argv[0]), sizeof input[0]);
-    output = my_calloc(op->cp.m, sizeof output[0]);
     length = snprintf(NULL, 0, "%s.obf\n", args->circuit);
     fname = my_calloc(length, sizeof fname[0]);
     snprintf(fname, length, "%s.obf", args->circuit);
-    
+
+    if (args_.batch) {
+        ret = cmd_obf_evaluate_batch(argv[0], args, vt, op, fname,
+                                     args_.incremental, args_.outputs,
+                                     args_.noutputs);
+        goto cleanup;
+    }
+
+    input = my_calloc(strlen(argv[0]), sizeof input[0]);
+    output = my_calloc(op->cp.m, sizeof output[0]);
     for (size_t i = 0; i < strlen(argv[0]); ++i) {
         if ((input[i] = char_to_int(argv[0][i])) < 0)
             goto cleanup;
@@ -913,12 +1381,13 @@ cmd_obf_evaluate(int argc, char **argv, args_t *args)
         goto cleanup;
 
     printf("result: ");
-    for (size_t i = 0; i < op->cp.m; ++i)
-        printf("%c", int_to_char(output[i]));
+    for (size_t i = 0; i < (args_.noutputs ? args_.noutputs : op->cp.m); ++i)
+        printf("%c", int_to_char(get_output(output, args_.outputs, args_.noutputs, i)));
     printf("\n");
 
     ret = OK;
 cleanup:
+    free(args_.outputs);
     if (input)
         free(input);
     if (output)
@@ -938,6 +1407,7 @@ cmd_obf_test(int argc, char **argv, args_t *args)
     op_vtable *op_vt = NULL;
     obf_params_t *op = NULL;
     char *fname = NULL;
+    int **outps = NULL;
     size_t length, kappa = 0;
     bool passed = true;
     int ret = ERR;
@@ -949,7 +1419,7 @@ cmd_obf_test(int argc, char **argv, args_t *args)
                           args->symlen, args->base, &vt, &op_vt, &op) == ERR)
         goto cleanup;
     if (args->smart) {
-        kappa = obf_run_smart_kappa(vt, &args->circ, op, args->nthreads, args->rng);
+        kappa = obf_run_smart_kappa(vt, &args->circ, op, args->nthreads, args->rng, NULL);
         if (kappa == 0)
             goto cleanup;
     }
@@ -961,23 +1431,32 @@ cmd_obf_test(int argc, char **argv, args_t *args)
     fname = my_calloc(length, sizeof fname[0]);
     snprintf(fname, length, "%s.obf", args->circuit);
     if (obf_run_obfuscate(args->vt, vt, fname, op, args->secparam, &kappa,
-                          args->nthreads, args->rng) == ERR)
+                          args->nthreads, args->rng, args_.stream,
+                          args_.resume) == ERR)
         goto cleanup;
 
+    outps = my_calloc(args->circ.tests.n, sizeof outps[0]);
+    for (size_t t = 0; t < args->circ.tests.n; ++t)
+        outps[t] = my_calloc(op->cp.m, sizeof outps[t][0]);
+    if (obf_run_evaluate_batch(args->vt, vt, fname, op, args->circ.tests.inps,
+                               args->circ.ninputs, outps, args->circ.outputs.n,
+                               args->circ.tests.n, args->nthreads, &kappa, NULL,
+                               false) == ERR)
+        goto cleanup;
     for (size_t t = 0; t < args->circ.tests.n; ++t) {
-        int outp[op->cp.m];
-        if (obf_run_evaluate(args->vt, vt, fname, op, args->circ.tests.inps[t],
-                             args->circ.ninputs, outp, args->circ.outputs.n,
-                             args->nthreads, &kappa, NULL) == ERR)
-            goto cleanup;
         if (!print_test_output(t + 1, args->circ.tests.inps[t], args->circ.ninputs,
-                               args->circ.tests.outs[t], outp, args->circ.outputs.n,
+                               args->circ.tests.outs[t], outps[t], args->circ.outputs.n,
                                args_.scheme == SCHEME_LIN))
             passed = false;
     }
     if (passed)
         ret = OK;
 cleanup:
+    if (outps) {
+        for (size_t t = 0; t < args->circ.tests.n; ++t)
+            free(outps[t]);
+        free(outps);
+    }
     if (fname)
         free(fname);
     if (op)
@@ -992,7 +1471,7 @@ cmd_obf_get_kappa(int argc, char **argv, args_t *args)
     obfuscator_vtable *vt = NULL;
     op_vtable *op_vt = NULL;
     obf_params_t *op = NULL;
-    size_t kappa = 0;
+    size_t kappa = 0, npowers = 0;
     int ret = ERR;
 
     argv++, argc--;
@@ -1003,15 +1482,56 @@ cmd_obf_get_kappa(int argc, char **argv, args_t *args)
         goto cleanup;
 
     if (args->smart) {
-        kappa = obf_run_smart_kappa(vt, &args->circ, op, args->nthreads, args->rng);
+        kappa = obf_run_smart_kappa(vt, &args->circ, op, args->nthreads, args->rng, &npowers);
         if (kappa == 0)
             goto cleanup;
     } else {
         if (obf_run_obfuscate(args->vt, vt, NULL, op, args->secparam, &kappa,
-                              args->nthreads, args->rng) == ERR)
+                              args->nthreads, args->rng, false, false) == ERR)
             goto cleanup;
     }
     printf("κ = %lu\n", kappa);
+    if (args->smart)
+        printf("npowers used = %lu\n", npowers);
+    ret = OK;
+cleanup:
+    if (op)
+        op_vt->free(op);
+    return ret;
+}
+
+static int
+cmd_obf_estimate(int argc, char **argv, args_t *args)
+{
+    static const char *const schemes[] = {
+        [SCHEME_LIN] = "LIN",
+        [SCHEME_LZ] = "LZ",
+        [SCHEME_MIFE] = "MIFE",
+    };
+    obf_estimate_args_t args_;
+    obfuscator_vtable *vt = NULL;
+    op_vtable *op_vt = NULL;
+    obf_params_t *op = NULL;
+    size_t kappa = 0;
+    int ret = ERR;
+
+    argv++, argc--;
+    obf_estimate_args_init(&args_);
+    handle_options(&argc, &argv, 0, args, &args_, obf_estimate_handle_options,
+                   obf_estimate_usage);
+    if (obf_select_scheme(args_.scheme, &args->circ, args_.npowers, args->sigma,
+                          args->symlen, args->base, &vt, &op_vt, &op) == ERR)
+        goto cleanup;
+    if (args->smart) {
+        kappa = obf_run_smart_kappa(vt, &args->circ, op, args->nthreads, args->rng, NULL);
+        if (kappa == 0)
+            goto cleanup;
+    }
+    if (args_.kappa)
+        kappa = args_.kappa;
+    if (obf_run_estimate(args->vt, vt, schemes[args_.scheme], &args->circ, op,
+                         args->secparam, kappa, args->nthreads, args->rng) == ERR)
+        goto cleanup;
     ret = OK;
 cleanup:
     if (op)
@@ -1029,6 +1549,7 @@ obf_usage(bool longform, int ret)
                "   evaluate     run circuit evaluation\n"
                "   test         run test suite\n"
                "   get-kappa    get κ value\n"
+               "   estimate     predict the cost of obfuscation and evaluation\n"
                "   help         print this message and exit\n\n");
     }
     exit(ret);
@@ -1055,6 +1576,8 @@ cmd_obf(int argc, char **argv)
         ret = cmd_obf_test(argc, argv, &args);
     } else if (!strcmp(cmd, "get-kappa")) {
         ret = cmd_obf_get_kappa(argc, argv, &args);
+    } else if (!strcmp(cmd, "estimate")) {
+        ret = cmd_obf_estimate(argc, argv, &args);
     } else if (!strcmp(cmd, "help")
                || !strcmp(cmd, "--help")
                || !strcmp(cmd, "-h")) {
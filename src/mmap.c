@@ -2,8 +2,11 @@
 #include "util.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
 #include <clt13.h>
+#include <threadpool.h>
 
 static void
 mmap_params_fprint(FILE *fp, const mmap_params_t *params)
@@ -98,25 +101,241 @@ public_params_fwrite(const pp_vtable *vt, const public_params *pp, FILE *fp)
     return OK;
 }
 
+/* Public parameters read from disk are only used for evaluation, so give them
+ * a pool to recycle the intermediate encodings */
 public_params *
 public_params_fread(const pp_vtable *vt, const obf_params_t *op, FILE *fp)
 {
     public_params *pp = my_calloc(1, sizeof pp[0]);
-    vt->fread(pp, op, fp);
+    if (vt->fread(pp, op, fp) == ERR) {
+        free(pp);
+        return NULL;
+    }
     pp->pp = my_calloc(1, vt->mmap->pp->size);
-    vt->mmap->pp->fread(pp->pp, fp);
+    if (vt->mmap->pp->fread(pp->pp, fp)) {
+        fprintf(stderr, "error: reading public parameters failed\n");
+        vt->clear(pp);
+        free(pp->pp);
+        free(pp);
+        return NULL;
+    }
+    pp->pool = encoding_pool_new();
     return pp;
 }
 
 void
 public_params_free(const pp_vtable *vt, public_params *pp)
 {
+    encoding_pool_free(pp->pool);
     vt->clear(pp);
     vt->mmap->pp->clear(pp->pp);
     free(pp->pp);
     free(pp);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// encoding pool
+//
+// Freed encodings are kept, fully allocated, in a small per-thread cache so
+// that workers can reuse them without going through malloc.  Caches spill to
+// and refill from a shared depot in batches, and hand everything back to the
+// depot when their thread exits.
+
+#define POOL_CACHE_SIZE 64
+
+typedef struct pool_cache {
+    encoding_pool *pool;        /* NULL once the pool is freed */
+    const encoding_vtable *vt;
+    size_t n;
+    encoding *encs[POOL_CACHE_SIZE];
+    struct pool_cache *prev, *next; /* caches of the same pool */
+    struct pool_cache *tnext;   /* caches of the same thread */
+} pool_cache;
+
+struct encoding_pool {
+    const encoding_vtable *vt;
+    pthread_mutex_t lock;
+    encoding **depot;
+    size_t ndepot, cap;
+    pool_cache *caches;         /* caches of live threads */
+};
+
+/* A single key for all pools, holding the list of the thread's caches, one
+ * per pool it has used.  A cache belongs to its thread: freeing the pool
+ * empties it and clears cache->pool, and the thread frees it later.
+ * caches_lock orders that against a thread handing its caches back. */
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+static int pool_key_ret = ERR;
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+_encoding_destroy(const encoding_vtable *vt, encoding *enc)
+{
+    vt->mmap->enc->clear(enc->enc);
+    free(enc->enc);
+    vt->free(enc);
+    free(enc);
+}
+
+/* Moves n encodings from the top of cache into the depot; lock must be held */
+static void
+_pool_spill(encoding_pool *pool, pool_cache *cache, size_t n)
+{
+    if (n == 0)
+        return;
+    pool->vt = cache->vt;
+    if (pool->ndepot + n > pool->cap) {
+        pool->cap = 2 * (pool->ndepot + n);
+        pool->depot = my_realloc(pool->depot, pool->cap * sizeof pool->depot[0]);
+    }
+    cache->n -= n;
+    memcpy(&pool->depot[pool->ndepot], &cache->encs[cache->n], n * sizeof cache->encs[0]);
+    pool->ndepot += n;
+}
+
+static void
+_pool_cache_unlink(encoding_pool *pool, pool_cache *cache)
+{
+    if (cache->prev)
+        cache->prev->next = cache->next;
+    else
+        pool->caches = cache->next;
+    if (cache->next)
+        cache->next->prev = cache->prev;
+}
+
+static void
+_pool_thread_exit(void *vhead)
+{
+    pool_cache *cache, *next;
+
+    pthread_mutex_lock(&caches_lock);
+    for (cache = vhead; cache; cache = next) {
+        encoding_pool *const pool = cache->pool;
+        next = cache->tnext;
+        if (pool) {
+            pthread_mutex_lock(&pool->lock);
+            _pool_spill(pool, cache, cache->n);
+            _pool_cache_unlink(pool, cache);
+            pthread_mutex_unlock(&pool->lock);
+        }
+        free(cache);
+    }
+    pthread_mutex_unlock(&caches_lock);
+}
+
+static void
+_pool_key_init(void)
+{
+    if (pthread_key_create(&pool_key, _pool_thread_exit) == 0)
+        pool_key_ret = OK;
+}
+
+/* The calling thread's cache for pool, or NULL for pool == NULL.  Drops the
+ * thread's caches of pools freed since. */
+static pool_cache *
+_pool_cache(encoding_pool *pool)
+{
+    pool_cache *const old = pthread_getspecific(pool_key);
+    pool_cache *head = old, **p = &head, *cache;
+
+    while ((cache = *p) != NULL) {
+        encoding_pool *const owner = __atomic_load_n(&cache->pool, __ATOMIC_ACQUIRE);
+        if (owner == pool && pool)
+            break;
+        if (owner == NULL) {
+            *p = cache->tnext;
+            free(cache);
+        } else {
+            p = &cache->tnext;
+        }
+    }
+    if (cache == NULL && pool) {
+        cache = my_calloc(1, sizeof cache[0]);
+        cache->pool = pool;
+        pthread_mutex_lock(&pool->lock);
+        cache->next = pool->caches;
+        if (pool->caches)
+            pool->caches->prev = cache;
+        pool->caches = cache;
+        pthread_mutex_unlock(&pool->lock);
+        cache->tnext = head;
+        head = cache;
+    }
+    if (head != old)
+        pthread_setspecific(pool_key, head);
+    return cache;
+}
+
+encoding_pool *
+encoding_pool_new(void)
+{
+    encoding_pool *pool;
+
+    (void) pthread_once(&pool_key_once, _pool_key_init);
+    if (pool_key_ret == ERR)
+        return NULL;
+    pool = my_calloc(1, sizeof pool[0]);
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+void
+encoding_pool_free(encoding_pool *pool)
+{
+    pool_cache *cache, *next;
+
+    if (pool == NULL)
+        return;
+    /* Nothing uses the pool any more, but threads that did may still be
+     * alive, holding on to their caches */
+    pthread_mutex_lock(&caches_lock);
+    for (cache = pool->caches; cache; cache = next) {
+        next = cache->next;
+        for (size_t i = 0; i < cache->n; ++i)
+            _encoding_destroy(cache->vt, cache->encs[i]);
+        cache->n = 0;
+        __atomic_store_n(&cache->pool, NULL, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&caches_lock);
+    (void) _pool_cache(NULL);
+    for (size_t i = 0; i < pool->ndepot; ++i)
+        _encoding_destroy(pool->vt, pool->depot[i]);
+    free(pool->depot);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+static encoding *
+_pool_get(encoding_pool *pool)
+{
+    pool_cache *const cache = _pool_cache(pool);
+
+    if (cache->n == 0) {
+        pthread_mutex_lock(&pool->lock);
+        while (cache->n < POOL_CACHE_SIZE / 2 && pool->ndepot)
+            cache->encs[cache->n++] = pool->depot[--pool->ndepot];
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return cache->n ? cache->encs[--cache->n] : NULL;
+}
+
+static void
+_pool_put(encoding_pool *pool, const encoding_vtable *vt, encoding *enc)
+{
+    pool_cache *const cache = _pool_cache(pool);
+
+    vt->reset(enc);
+    cache->vt = vt;
+    if (cache->n == POOL_CACHE_SIZE) {
+        pthread_mutex_lock(&pool->lock);
+        _pool_spill(pool, cache, POOL_CACHE_SIZE / 2);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    cache->encs[cache->n++] = enc;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // encodings
 
@@ -124,22 +343,27 @@ encoding *
 encoding_new(const encoding_vtable *vt, const pp_vtable *pp_vt,
              const public_params *pp)
 {
-    encoding *enc = calloc(1, sizeof enc[0]);
+    encoding *enc;
+
+    if (pp->pool && (enc = _pool_get(pp->pool)) != NULL)
+        return enc;
+    enc = calloc(1, sizeof enc[0]);
     (void) vt->new(pp_vt, enc, pp);
     enc->enc = calloc(1, vt->mmap->enc->size);
     vt->mmap->enc->init(enc->enc, pp->pp);
+    enc->pool = pp->pool;
     return enc;
 }
 
 void
 encoding_free(const encoding_vtable *vt, encoding *enc)
 {
-    if (enc) {
-        vt->mmap->enc->clear(enc->enc);
-        free(enc->enc);
-        vt->free(enc);
-        free(enc);
-    }
+    if (enc == NULL)
+        return;
+    if (enc->pool && vt->reset)
+        _pool_put(enc->pool, vt, enc);
+    else
+        _encoding_destroy(vt, enc);
 }
 
 int
@@ -229,9 +453,17 @@ encoding *
 encoding_fread(const encoding_vtable *vt, FILE *fp)
 {
     encoding *const x = my_calloc(1, sizeof x[0]);
-    vt->fread(x, fp);
-    x->enc = calloc(1, vt->mmap->enc->size);
-    vt->mmap->enc->fread(x->enc, fp);
+    if (vt->fread(x, fp) == ERR) {
+        free(x);
+        return NULL;
+    }
+    x->enc = my_calloc(1, vt->mmap->enc->size);
+    if (vt->mmap->enc->fread(x->enc, fp)) {
+        free(x->enc);
+        vt->free(x);
+        free(x);
+        return NULL;
+    }
     return x;
 }
 
@@ -242,3 +474,142 @@ encoding_fwrite(const encoding_vtable *vt, const encoding *x, FILE *fp)
     vt->mmap->enc->fwrite(x->enc, fp);
     return OK;
 }
+
+/* Blocks of encodings are prefixed with their lengths so they can be parsed
+ * concurrently:
+ *
+ *   magic | n | lens[n] | encoding 0 | encoding 1 | ...
+ */
+static const char encodings_magic[8] = "MIOENC01";
+
+int
+encodings_fwrite(const encoding_vtable *vt, encoding **encs, size_t n, FILE *fp)
+{
+    size_t *lens = NULL;
+    long start, pos, end;
+    int ret = ERR;
+
+    if (fwrite(encodings_magic, sizeof encodings_magic, 1, fp) != 1
+        || size_t_fwrite(n, fp) == ERR)
+        goto cleanup;
+    /* Reserve the length table, filled in once the encodings are written */
+    lens = my_calloc(n, sizeof lens[0]);
+    start = ftell(fp);
+    for (size_t i = 0; i < n; ++i)
+        if (size_t_fwrite(0, fp) == ERR)
+            goto cleanup;
+    for (size_t i = 0; i < n; ++i) {
+        pos = ftell(fp);
+        if (encoding_fwrite(vt, encs[i], fp) == ERR)
+            goto cleanup;
+        lens[i] = ftell(fp) - pos;
+    }
+    end = ftell(fp);
+    if (fseek(fp, start, SEEK_SET) == -1)
+        goto cleanup;
+    for (size_t i = 0; i < n; ++i)
+        if (size_t_fwrite(lens[i], fp) == ERR)
+            goto cleanup;
+    if (fseek(fp, end, SEEK_SET) == -1)
+        goto cleanup;
+    ret = OK;
+cleanup:
+    free(lens);
+    return ret;
+}
+
+typedef struct {
+    const encoding_vtable *vt;
+    encoding **rop;
+    char *buf;
+    size_t len;
+    int *ret;
+} fread_args;
+
+static void
+_fread_worker(void *vargs)
+{
+    fread_args *const args = vargs;
+    FILE *fp;
+
+    if ((fp = fmemopen(args->buf, args->len, "r")) == NULL) {
+        (void) __sync_lock_test_and_set(args->ret, ERR);
+    } else {
+        if ((*args->rop = encoding_fread(args->vt, fp)) == NULL)
+            (void) __sync_lock_test_and_set(args->ret, ERR);
+        fclose(fp);
+    }
+    free(args->buf);
+    free(args);
+}
+
+int
+encodings_fread(const encoding_vtable *vt, encoding **encs, size_t n, FILE *fp,
+                size_t nthreads)
+{
+    const long pos = ftell(fp);
+    char magic[sizeof encodings_magic];
+    threadpool *pool = NULL;
+    size_t *lens = NULL;
+    size_t count;
+    int ret = OK;
+
+    memset(encs, '\0', n * sizeof encs[0]);
+    if (fread(magic, sizeof magic, 1, fp) != 1
+        || memcmp(magic, encodings_magic, sizeof magic) != 0) {
+        /* Written before blocks were length-prefixed, so read sequentially */
+        if (fseek(fp, pos, SEEK_SET) == -1)
+            return ERR;
+        for (size_t i = 0; i < n; ++i)
+            if ((encs[i] = encoding_fread(vt, fp)) == NULL) {
+                fprintf(stderr, "error: reading encoding failed\n");
+                ret = ERR;
+                goto cleanup;
+            }
+        return OK;
+    }
+    if (size_t_fread(&count, fp) == ERR)
+        return ERR;
+    if (count != n) {
+        fprintf(stderr, "error: expected %lu encodings, found %lu\n", n, count);
+        return ERR;
+    }
+    lens = my_calloc(n, sizeof lens[0]);
+    for (size_t i = 0; i < n; ++i)
+        if (size_t_fread(&lens[i], fp) == ERR) {
+            ret = ERR;
+            goto cleanup;
+        }
+    if (nthreads > 1 && n > 1)
+        pool = threadpool_create(nthreads < n ? nthreads : n);
+    /* Reading stays sequential, parsing is spread over the pool */
+    for (size_t i = 0; i < n; ++i) {
+        fread_args *args = my_calloc(1, sizeof args[0]);
+        args->vt = vt;
+        args->rop = &encs[i];
+        args->buf = my_calloc(lens[i], sizeof args->buf[0]);
+        args->len = lens[i];
+        args->ret = &ret;
+        if (fread(args->buf, lens[i], 1, fp) != 1) {
+            fprintf(stderr, "error: reading encoding failed\n");
+            free(args->buf);
+            free(args);
+            (void) __sync_lock_test_and_set(&ret, ERR);
+            break;
+        }
+        if (pool)
+            threadpool_add_job(pool, _fread_worker, args);
+        else
+            _fread_worker(args);
+    }
+    if (pool)
+        threadpool_destroy(pool);
+cleanup:
+    if (ret == ERR)
+        for (size_t i = 0; i < n; ++i) {
+            encoding_free(vt, encs[i]);
+            encs[i] = NULL;
+        }
+    free(lens);
+    return ret;
+}
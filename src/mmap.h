@@ -39,10 +39,13 @@ typedef struct {
     const void * (*params)(const secret_params *);
 } sp_vtable;
 
+typedef struct encoding_pool encoding_pool;
+
 typedef struct pp_info pp_info;
 typedef struct public_params {
     pp_info *info;
     mmap_pp *pp;
+    encoding_pool *pool;        /* recycles evaluation encodings, may be NULL */
 } public_params;
 
 typedef struct {
@@ -59,12 +62,16 @@ typedef struct encoding_info encoding_info;
 typedef struct {
     mmap_enc *enc;
     encoding_info *info;
+    encoding_pool *pool;        /* pool to return to when freed, or NULL */
 } encoding;
 
 typedef struct {
     const mmap_vtable *mmap;
     int (*new)(const pp_vtable *, encoding *, const public_params *);
     void (*free)(encoding *);
+    /* Optional: resets the scheme's part of an encoding to that of a new one,
+     * so that a pool can hand the encoding out again */
+    void (*reset)(encoding *);
     int (*print)(const encoding *);
     int * (*encode)(encoding *, const void *);
     int (*set)(encoding *, const encoding *);
@@ -100,6 +107,14 @@ public_params_fread(const pp_vtable *vt, const obf_params_t *op, FILE *fp);
 void
 public_params_free(const pp_vtable *vt, public_params *p);
 
+encoding_pool *
+encoding_pool_new(void);
+void
+encoding_pool_free(encoding_pool *pool);
+
+/* With a pool, the mmap value of the new encoding is left over from an
+ * earlier one, so callers must overwrite it (set, encode, add, sub or mul)
+ * before reading it; the scheme's part is reset either way */
 encoding *
 encoding_new(const encoding_vtable *enc_vt, const pp_vtable *pp_vt,
              const public_params *pp);
@@ -130,3 +145,10 @@ encoding *
 encoding_fread(const encoding_vtable *vt, FILE *fp);
 int
 encoding_fwrite(const encoding_vtable *vt, const encoding *x, FILE *fp);
+int
+encodings_fwrite(const encoding_vtable *vt, encoding **encs, size_t n, FILE *fp);
+/* Parses the encodings in parallel when nthreads > 1.  On error every encs[i]
+ * is NULL. */
+int
+encodings_fread(const encoding_vtable *vt, encoding **encs, size_t n, FILE *fp,
+                size_t nthreads);
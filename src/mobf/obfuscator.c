@@ -2,15 +2,20 @@
 #include "obf_params.h"
 #include "input_chunker.h"
 #include "../mife/mife.h"
+#include "obf_index.h"
 #include "util.h"
 
 #include <string.h>
 
 typedef struct obfuscation {
+    const mmap_vtable *mmap;
     const obf_params_t *op;
     mife_t *mife;
     mife_ek_t *ek;
     mife_ciphertext_t ***cts;   /* [n][Σ] */
+    obf_index *index;           /* NULL unless lazily loading from disk */
+    size_t *slices;             /* [n + 1], first slice of each input, then the total */
+    mife_partial_t *consts;     /* gates fed only by constants, or NULL */
 } obfuscation;
 
 static void
@@ -22,6 +27,7 @@ _free(obfuscation *obf)
     const circ_params_t *const cp = &obf->op->cp;
     const size_t ninputs = cp->n;
 
+    mife_partial_free(obf->consts);
     if (obf->ek)
         mife_ek_free(obf->ek);
     if (obf->cts) {
@@ -35,9 +41,20 @@ _free(obfuscation *obf)
     }
     if (obf->mife)
         mife_free(obf->mife);
+    obf_index_free(obf->index);
+    free(obf->slices);
     free(obf);
 }
 
+static size_t *
+_slices_new(const circ_params_t *cp)
+{
+    size_t *slices = my_calloc(cp->n + 1, sizeof slices[0]);
+    for (size_t i = 0; i < cp->n; ++i)
+        slices[i + 1] = slices[i] + cp->qs[i];
+    return slices;
+}
+
 static obfuscation *
 _obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
            size_t *kappa, size_t nthreads, aes_randstate_t rng)
@@ -59,7 +76,9 @@ _obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
     start = _start = current_time();
 
     obf = my_calloc(1, sizeof obf[0]);
+    obf->mmap = mmap;
     obf->op = op;
+    obf->slices = _slices_new(cp);
     obf->mife = mife_setup(mmap, op, secparam, kappa, op->npowers, nthreads, rng);
     obf->ek = mife_ek(obf->mife);
     sk = mife_sk(obf->mife);
@@ -79,6 +98,7 @@ _obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
     cache.lock = &lock;
     cache.count = &count;
     cache.total = mobf_num_encodings(op);
+    cache.done = NULL;
     cache.refs = my_calloc(nrefs, sizeof cache.refs[0]);
     for (size_t ref = 0; ref < nrefs; ++ref)
         mpz_init(cache.refs[ref]);
@@ -125,10 +145,64 @@ cleanup:
     }
 }
 
+/* Each (i, j) ciphertext is stored as its own slice so it can be loaded lazily */
+static size_t
+_slice(const obfuscation *obf, size_t i, size_t j)
+{
+    return obf->slices[i] + j;
+}
+
+/* The input whose slices include slice */
+static size_t
+_slice_input(const obfuscation *obf, size_t slice)
+{
+    size_t lo = 0, hi = obf->op->cp.n;
+
+    while (hi - lo > 1) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (obf->slices[mid] <= slice)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int
+_load_slice(size_t slice, FILE *fp, const void *vargs)
+{
+    const obfuscation *const obf = vargs;
+    const circ_params_t *cp = &obf->op->cp;
+    const size_t i = _slice_input(obf, slice);
+    const size_t j = slice - obf->slices[i];
+
+    /* Slices are already loaded in parallel, so parse each one serially */
+    obf->cts[i][j] = mife_ciphertext_fread(obf->mmap, cp, fp, 1);
+    return obf->cts[i][j] ? OK : ERR;
+}
+
+/* Materializes the ciphertexts for the chosen symbol of each input */
+static int
+_load_inputs(const obfuscation *obf, const int *syms, size_t nthreads)
+{
+    const circ_params_t *cp = &obf->op->cp;
+    const size_t has_consts = cp->c ? 1 : 0;
+    size_t slices[cp->n];
+
+    if (obf->index == NULL)
+        return OK;
+    for (size_t i = 0; i < cp->n; ++i) {
+        const size_t j = i < cp->n - has_consts ? (size_t) syms[i] : 0;
+        slices[i] = _slice(obf, i, j);
+    }
+    return obf_index_load_many(obf->index, slices, cp->n, _load_slice, obf,
+                               nthreads);
+}
+
 static int
 _evaluate(const obfuscation *obf, int *outputs, size_t noutputs,
-          const int *inputs, size_t ninputs, size_t nthreads, size_t *kappa,
-          size_t *npowers)
+          const int *inputs, size_t ninputs, const eval_ctx *ctx,
+          size_t *kappa, size_t *npowers)
 {
     (void) npowers;
     const circ_params_t *cp = &obf->op->cp;
@@ -152,14 +226,20 @@ _evaluate(const obfuscation *obf, int *outputs, size_t noutputs,
                                 cp->n - has_consts, ell, q, obf->op->sigma);
     if (input_syms == NULL)
         goto cleanup;
+    if (_load_inputs(obf, input_syms, ctx->nthreads) == ERR)
+        goto cleanup;
     cts = my_calloc(cp->n, sizeof cts[0]);
     for (size_t i = 0; i < cp->n - has_consts; ++i) {
         cts[i] = obf->cts[i][input_syms[i]];
     }
     if (has_consts)
         cts[cp->n - 1] = obf->cts[cp->n - 1][0];
-    if (mife_decrypt(obf->ek, outputs, cts, nthreads, kappa) == ERR)
+    if (obf->consts) {
+        if (mife_decrypt_partial(obf->consts, outputs, cts, ctx, kappa) == ERR)
+            goto cleanup;
+    } else if (mife_decrypt(obf->ek, outputs, cts, ctx, kappa) == ERR) {
         goto cleanup;
+    }
 
     ret = OK;
 cleanup:
@@ -175,31 +255,57 @@ _fwrite(const obfuscation *const obf, FILE *const fp)
 {
     const circ_params_t *cp = &obf->op->cp;
     const size_t ninputs = cp->n;
+    obf_index *index;
+    int ret;
+
+    if ((index = obf_index_fwrite_begin(obf->slices[ninputs], fp)) == NULL)
+        return ERR;
     mife_ek_fwrite(obf->ek, fp);
     for (size_t i = 0; i < ninputs; ++i) {
         for (size_t j = 0; j < cp->qs[i]; ++j) {
+            obf_index_mark(index, _slice(obf, i, j), fp);
             mife_ciphertext_fwrite(obf->cts[i][j], cp, fp);
         }
     }
-    return OK;
+    ret = obf_index_fwrite_end(index, fp);
+    obf_index_free(index);
+    return ret;
 }
 
 static obfuscation *
-_fread(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp)
+_fread(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp,
+       const eval_ctx *ctx)
 {
     obfuscation *obf;
     const circ_params_t *cp = &op->cp;
     const size_t ninputs = cp->n;
+    bool legacy;
+
     obf = my_calloc(1, sizeof obf[0]);
+    obf->mmap = mmap;
     obf->op = op;
-    if ((obf->ek = mife_ek_fread(mmap, op, fp)) == NULL)
+    obf->slices = _slices_new(cp);
+    obf->index = obf_index_fread(obf->slices[ninputs], fp, &legacy);
+    if (obf->index == NULL && !legacy)
         goto error;
+    if ((obf->ek = mife_ek_fread(mmap, op, fp, ctx->nthreads)) == NULL)
+        goto error;
+    if (cp->c) {
+        /* The constants are the same for every input, so evaluate their cone
+         * once up front */
+        mife_ciphertext_t *pinned[cp->n];
+        memset(pinned, '\0', sizeof pinned);
+        if ((obf->consts = mife_partial_new(obf->ek, pinned, ctx)) == NULL)
+            goto error;
+    }
     obf->mife = NULL;
     obf->cts = my_calloc(ninputs, sizeof obf->cts[0]);
     for (size_t i = 0; i < ninputs; ++i) {
         obf->cts[i] = my_calloc(cp->qs[i], sizeof obf->cts[i][0]);
+        if (!legacy)
+            continue;
         for (size_t j = 0; j < cp->qs[i]; ++j) {
-            if ((obf->cts[i][j] = mife_ciphertext_fread(mmap, cp, fp)) == NULL)
+            if ((obf->cts[i][j] = mife_ciphertext_fread(mmap, cp, fp, ctx->nthreads)) == NULL)
                 goto error;
         }
     }
@@ -209,10 +315,17 @@ error:
     return NULL;
 }
 
+static int
+_kappa(const obf_params_t *op, size_t *kappa, size_t *npowers)
+{
+    return mife_kappa(op, op->npowers, kappa, npowers);
+}
+
 obfuscator_vtable mobf_obfuscator_vtable = {
     .free = _free,
     .obfuscate = _obfuscate,
     .evaluate = _evaluate,
     .fwrite = _fwrite,
     .fread = _fread,
+    .kappa = _kappa,
 };
@@ -0,0 +1,235 @@
+#include "obf_index.h"
+#include "util.h"
+
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char obf_index_magic[8] = "MIOIDX01";
+
+static obf_index *
+_obf_index_new(size_t nslices)
+{
+    obf_index *index = my_calloc(1, sizeof index[0]);
+    index->nslices = nslices;
+    index->offsets = my_calloc(nslices + 1, sizeof index->offsets[0]);
+    index->loaded = my_calloc(nslices, sizeof index->loaded[0]);
+    index->locks = my_calloc(nslices, sizeof index->locks[0]);
+    for (size_t i = 0; i < nslices; ++i)
+        pthread_mutex_init(&index->locks[i], NULL);
+    pthread_mutex_init(&index->pool_lock, NULL);
+    return index;
+}
+
+obf_index *
+obf_index_fwrite_begin(size_t nslices, FILE *fp)
+{
+    obf_index *index = _obf_index_new(nslices);
+
+    if (fwrite(obf_index_magic, sizeof obf_index_magic, 1, fp) != 1)
+        goto error;
+    if (size_t_fwrite(nslices, fp) == ERR)
+        goto error;
+    /* Reserve the offset table, filled in by obf_index_fwrite_end */
+    index->start = ftell(fp);
+    for (size_t i = 0; i < nslices + 1; ++i)
+        if (size_t_fwrite(0, fp) == ERR)
+            goto error;
+    return index;
+error:
+    fprintf(stderr, "error: writing obfuscation index failed\n");
+    obf_index_free(index);
+    return NULL;
+}
+
+void
+obf_index_mark(obf_index *index, size_t slice, FILE *fp)
+{
+    index->offsets[slice] = ftell(fp);
+}
+
+int
+obf_index_fwrite_end(obf_index *index, FILE *fp)
+{
+    const long end = ftell(fp);
+
+    index->offsets[index->nslices] = end;
+    if (fseek(fp, index->start, SEEK_SET) == -1)
+        goto error;
+    for (size_t i = 0; i < index->nslices + 1; ++i)
+        if (size_t_fwrite(index->offsets[i], fp) == ERR)
+            goto error;
+    if (fseek(fp, end, SEEK_SET) == -1)
+        goto error;
+    return OK;
+error:
+    fprintf(stderr, "error: writing obfuscation index failed\n");
+    return ERR;
+}
+
+obf_index *
+obf_index_fread(size_t nslices, FILE *fp, bool *legacy)
+{
+    obf_index *index = NULL;
+    const long pos = ftell(fp);
+    char magic[sizeof obf_index_magic];
+    struct stat st;
+    size_t n;
+
+    *legacy = false;
+    if (fread(magic, sizeof magic, 1, fp) != 1
+        || memcmp(magic, obf_index_magic, sizeof magic) != 0) {
+        /* Not indexed, so rewind and let the caller read it eagerly */
+        *legacy = true;
+        fseek(fp, pos, SEEK_SET);
+        return NULL;
+    }
+    if (size_t_fread(&n, fp) == ERR)
+        return NULL;
+    if (n != nslices) {
+        fprintf(stderr, "error: obfuscation index has %lu slices, expected %lu\n",
+                n, nslices);
+        return NULL;
+    }
+    if (fstat(fileno(fp), &st) == -1) {
+        fprintf(stderr, "error: unable to stat obfuscation file\n");
+        return NULL;
+    }
+    index = _obf_index_new(nslices);
+    /* Slices are loaded straight from these, so they must stay in the file */
+    for (size_t i = 0; i < nslices + 1; ++i) {
+        if (size_t_fread(&index->offsets[i], fp) == ERR)
+            goto error;
+        if ((i > 0 && index->offsets[i] < index->offsets[i - 1])
+            || index->offsets[i] > (size_t) st.st_size) {
+            fprintf(stderr, "error: obfuscation file is truncated or corrupt\n");
+            goto error;
+        }
+    }
+    index->size = st.st_size;
+    index->base = mmap(NULL, index->size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (index->base == MAP_FAILED) {
+        fprintf(stderr, "error: unable to mmap obfuscation file\n");
+        index->base = NULL;
+        goto error;
+    }
+    return index;
+error:
+    obf_index_free(index);
+    return NULL;
+}
+
+int
+obf_index_load(obf_index *index, size_t slice, obf_index_load_f load,
+               const void *vargs)
+{
+    int ret = OK;
+    FILE *fp;
+
+    pthread_mutex_lock(&index->locks[slice]);
+    if (index->loaded[slice])
+        goto cleanup;
+    fp = fmemopen((char *) index->base + index->offsets[slice],
+                  index->offsets[slice + 1] - index->offsets[slice], "r");
+    if (fp == NULL) {
+        fprintf(stderr, "error: unable to open obfuscation slice %lu\n", slice);
+        ret = ERR;
+        goto cleanup;
+    }
+    ret = load(slice, fp, vargs);
+    fclose(fp);
+    if (ret == OK)
+        index->loaded[slice] = true;
+cleanup:
+    pthread_mutex_unlock(&index->locks[slice]);
+    return ret;
+}
+
+/* One obf_index_load_many call, finished once pending drops to zero */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    size_t pending;
+    int ret;
+} load_batch;
+
+typedef struct {
+    obf_index *index;
+    size_t slice;
+    obf_index_load_f load;
+    const void *vargs;
+    load_batch *batch;
+} load_args;
+
+static void
+_load_worker(void *vargs)
+{
+    load_args *const args = vargs;
+    load_batch *const batch = args->batch;
+    const int ret = obf_index_load(args->index, args->slice, args->load, args->vargs);
+
+    pthread_mutex_lock(&batch->lock);
+    if (ret == ERR)
+        batch->ret = ERR;
+    if (--batch->pending == 0)
+        pthread_cond_signal(&batch->done);
+    pthread_mutex_unlock(&batch->lock);
+    free(args);
+}
+
+int
+obf_index_load_many(obf_index *index, const size_t *slices, size_t n,
+                    obf_index_load_f load, const void *vargs, size_t nthreads)
+{
+    load_batch batch;
+
+    if (nthreads <= 1 || n <= 1) {
+        for (size_t i = 0; i < n; ++i)
+            if (obf_index_load(index, slices[i], load, vargs) == ERR)
+                return ERR;
+        return OK;
+    }
+    pthread_mutex_lock(&index->pool_lock);
+    if (index->pool == NULL)
+        index->pool = threadpool_create(nthreads);
+    pthread_mutex_unlock(&index->pool_lock);
+
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.done, NULL);
+    batch.pending = n;
+    batch.ret = OK;
+    for (size_t i = 0; i < n; ++i) {
+        load_args *args = my_calloc(1, sizeof args[0]);
+        args->index = index;
+        args->slice = slices[i];
+        args->load = load;
+        args->vargs = vargs;
+        args->batch = &batch;
+        threadpool_add_job(index->pool, _load_worker, args);
+    }
+    pthread_mutex_lock(&batch.lock);
+    while (batch.pending)
+        pthread_cond_wait(&batch.done, &batch.lock);
+    pthread_mutex_unlock(&batch.lock);
+    pthread_cond_destroy(&batch.done);
+    pthread_mutex_destroy(&batch.lock);
+    return batch.ret;
+}
+
+void
+obf_index_free(obf_index *index)
+{
+    if (index == NULL)
+        return;
+    if (index->pool)
+        threadpool_destroy(index->pool);
+    pthread_mutex_destroy(&index->pool_lock);
+    if (index->base)
+        munmap(index->base, index->size);
+    for (size_t i = 0; i < index->nslices; ++i)
+        pthread_mutex_destroy(&index->locks[i]);
+    free(index->locks);
+    free(index->offsets);
+    free(index->loaded);
+    free(index);
+}
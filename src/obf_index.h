@@ -0,0 +1,52 @@
+#pragma once
+
+/*
+ * Indexed on-disk layout for obfuscations.
+ *
+ *   magic | nslices | offsets[nslices + 1] | eager data | slice 0 | slice 1 | ...
+ *
+ * The eager data (public parameters and anything needed by every evaluation)
+ * is read as usual.  The file is then mmap'ed and each slice (typically the
+ * encodings for one input symbol) is only deserialized the first time an
+ * evaluation asks for it.  Distinct slices can be loaded concurrently.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <threadpool.h>
+
+typedef struct obf_index {
+    size_t nslices;
+    size_t *offsets;            /* [nslices + 1], file offsets of each slice */
+    long start;                 /* position of the offset table */
+    void *base;                 /* mmap'ed file, NULL when writing */
+    size_t size;
+    bool *loaded;               /* [nslices] */
+    pthread_mutex_t *locks;     /* [nslices] */
+    threadpool *pool;           /* for obf_index_load_many, created on first use */
+    pthread_mutex_t pool_lock;
+} obf_index;
+
+/* Loads the encodings of one slice from fp */
+typedef int (*obf_index_load_f)(size_t slice, FILE *fp, const void *vargs);
+
+obf_index *
+obf_index_fwrite_begin(size_t nslices, FILE *fp);
+void
+obf_index_mark(obf_index *index, size_t slice, FILE *fp);
+int
+obf_index_fwrite_end(obf_index *index, FILE *fp);
+
+obf_index *
+obf_index_fread(size_t nslices, FILE *fp, bool *legacy);
+int
+obf_index_load(obf_index *index, size_t slice, obf_index_load_f load,
+               const void *vargs);
+/* Loads several slices, in parallel when nthreads > 1.  The threads are
+ * started by the first such call and reused until obf_index_free. */
+int
+obf_index_load_many(obf_index *index, const size_t *slices, size_t n,
+                    obf_index_load_f load, const void *vargs, size_t nthreads);
+void
+obf_index_free(obf_index *index);
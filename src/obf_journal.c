@@ -0,0 +1,334 @@
+#include "obf_journal.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <mmap/mmap_clt.h>
+#include <mmap/mmap_dummy.h>
+
+static const char obf_journal_magic[8] = "MIOJNL01";
+
+struct obf_journal {
+    char *fname;
+    char *tmpname;              /* holds the header until it is committed */
+    FILE *fp;
+    bool resuming;
+    size_t n;
+    long *offsets;              /* [n], position of each encoding, or -1 */
+    size_t ndone;
+    bool failed;
+    pthread_mutex_t lock;
+};
+
+obf_journal *
+obf_journal_open(const char *fname)
+{
+    obf_journal *j = my_calloc(1, sizeof j[0]);
+    char magic[sizeof obf_journal_magic];
+
+    j->fname = strdup(fname);
+    j->tmpname = my_calloc(strlen(fname) + sizeof ".tmp", sizeof j->tmpname[0]);
+    sprintf(j->tmpname, "%s.tmp", fname);
+    pthread_mutex_init(&j->lock, NULL);
+    if ((j->fp = fopen(fname, "r+")) != NULL) {
+        j->resuming = true;
+        if (fread(magic, sizeof magic, 1, j->fp) != 1
+            || memcmp(magic, obf_journal_magic, sizeof magic) != 0) {
+            fprintf(stderr, "error: '%s' is not an obfuscation journal\n", fname);
+            goto error;
+        }
+    } else {
+        int fd;
+        /* The header holds secret parameters, so keep it to ourselves.  A
+         * header left by a crash was never committed and can go. */
+        (void) unlink(j->tmpname);
+        if ((fd = open(j->tmpname, O_CREAT | O_EXCL | O_RDWR, 0600)) == -1
+            || (j->fp = fdopen(fd, "w+")) == NULL) {
+            fprintf(stderr, "error: unable to open journal '%s'\n", j->tmpname);
+            if (fd != -1)
+                close(fd);
+            goto error;
+        }
+        if (fwrite(obf_journal_magic, sizeof obf_journal_magic, 1, j->fp) != 1)
+            goto error;
+    }
+    return j;
+error:
+    obf_journal_close(j, false);
+    return NULL;
+}
+
+void
+obf_journal_close(obf_journal *j, bool remove)
+{
+    if (j == NULL)
+        return;
+    if (j->fp)
+        fclose(j->fp);
+    if (remove)
+        unlink(j->fname);
+    /* Left behind if the header was never committed */
+    unlink(j->tmpname);
+    pthread_mutex_destroy(&j->lock);
+    free(j->offsets);
+    free(j->tmpname);
+    free(j->fname);
+    free(j);
+}
+
+bool
+obf_journal_resuming(const obf_journal *j)
+{
+    return j->resuming;
+}
+
+/* FNV-1a over everything that determines the encodings of cp */
+static uint64_t
+_fnv(uint64_t h, size_t x)
+{
+    for (size_t i = 0; i < sizeof x; ++i) {
+        h ^= (x >> (8 * i)) & 0xff;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint64_t
+_circ_hash(const circ_params_t *cp)
+{
+    const acirc *const circ = cp->circ;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    h = _fnv(h, cp->n);
+    h = _fnv(h, cp->c);
+    h = _fnv(h, cp->m);
+    for (size_t k = 0; k < cp->n; ++k) {
+        h = _fnv(h, cp->ds[k]);
+        h = _fnv(h, cp->qs[k]);
+    }
+    h = _fnv(h, circ->ninputs);
+    h = _fnv(h, circ->gates.n);
+    for (size_t i = 0; i < circ->gates.n; ++i) {
+        const acirc_gate_t *const gate = &circ->gates.gates[i];
+        h = _fnv(h, gate->op);
+        h = _fnv(h, gate->nargs);
+        for (size_t a = 0; a < gate->nargs; ++a)
+            h = _fnv(h, gate->args[a]);
+    }
+    h = _fnv(h, circ->outputs.n);
+    for (size_t o = 0; o < circ->outputs.n; ++o)
+        h = _fnv(h, circ->outputs.buf[o]);
+    h = _fnv(h, circ->consts.n);
+    for (size_t i = 0; i < circ->consts.n; ++i)
+        h = _fnv(h, (size_t) circ->consts.buf[i]);
+    return h;
+}
+
+static const char *const mmap_names[] = { "unknown", "DUMMY", "CLT" };
+
+static size_t
+_mmap_id(const mmap_vtable *mmap)
+{
+    if (mmap == &dummy_vtable)
+        return 1;
+    if (mmap == &clt_vtable)
+        return 2;
+    return 0;
+}
+
+int
+obf_journal_params(obf_journal *j, const mmap_vtable *mmap,
+                   const circ_params_t *cp, size_t secparam, size_t npowers)
+{
+    const size_t params[4] = { _mmap_id(mmap), _circ_hash(cp), secparam, npowers };
+    size_t saved[4];
+
+    if (!j->resuming) {
+        if (fwrite(params, sizeof params, 1, j->fp) != 1) {
+            fprintf(stderr, "error: writing journal '%s' failed\n", j->fname);
+            return ERR;
+        }
+        return OK;
+    }
+    if (fread(saved, sizeof saved, 1, j->fp) != 1) {
+        fprintf(stderr, "error: journal '%s' is incomplete, remove it and start over\n",
+                j->fname);
+        return ERR;
+    }
+    /* The secret parameters in the header are only readable by their mmap */
+    if (saved[0] != params[0]) {
+        fprintf(stderr, "error: journal '%s' was started with the %s mmap, not %s\n",
+                j->fname,
+                mmap_names[saved[0] < 3 ? saved[0] : 0], mmap_names[params[0]]);
+        return ERR;
+    }
+    if (saved[1] != params[1]) {
+        fprintf(stderr, "error: journal '%s' was started for another circuit\n",
+                j->fname);
+        return ERR;
+    }
+    if (saved[2] != secparam || saved[3] != npowers) {
+        fprintf(stderr, "error: journal '%s' was started with secparam %lu and "
+                "npowers %lu, not %lu and %lu\n", j->fname, saved[2], saved[3],
+                secparam, npowers);
+        return ERR;
+    }
+    return OK;
+}
+
+FILE *
+obf_journal_fp(obf_journal *j)
+{
+    return j->fp;
+}
+
+/* Records everything up to the first incomplete record */
+static int
+_scan(obf_journal *j)
+{
+    struct stat st;
+    long pos;
+    size_t seq, len;
+
+    if (fstat(fileno(j->fp), &st) == -1)
+        return ERR;
+    while (true) {
+        pos = ftell(j->fp);
+        if (fread(&seq, sizeof seq, 1, j->fp) != 1
+            || fread(&len, sizeof len, 1, j->fp) != 1
+            || len == 0 || seq >= j->n
+            || pos + 2 * sizeof(size_t) + len > (size_t) st.st_size)
+            break;
+        if (j->offsets[seq] == -1)
+            j->ndone++;
+        j->offsets[seq] = pos + 2 * sizeof(size_t);
+        if (fseek(j->fp, len, SEEK_CUR) == -1)
+            break;
+    }
+    /* Drop whatever a crash left behind so new records append cleanly */
+    if (ftruncate(fileno(j->fp), pos) == -1 || fseek(j->fp, pos, SEEK_SET) == -1)
+        return ERR;
+    return OK;
+}
+
+int
+obf_journal_commit(obf_journal *j, size_t nencodings)
+{
+    char magic[sizeof obf_journal_magic];
+    size_t n;
+
+    j->n = nencodings;
+    j->offsets = my_calloc(nencodings, sizeof j->offsets[0]);
+    for (size_t i = 0; i < nencodings; ++i)
+        j->offsets[i] = -1;
+    if (!j->resuming) {
+        /* Only a journal with a complete header is ever resumed from */
+        if (size_t_fwrite(nencodings, j->fp) == ERR
+            || fwrite(obf_journal_magic, sizeof magic, 1, j->fp) != 1
+            || fflush(j->fp) != 0
+            || rename(j->tmpname, j->fname) == -1)
+            goto error;
+        return OK;
+    }
+    if (size_t_fread(&n, j->fp) == ERR
+        || fread(magic, sizeof magic, 1, j->fp) != 1
+        || memcmp(magic, obf_journal_magic, sizeof magic) != 0) {
+        fprintf(stderr, "error: journal '%s' is incomplete, remove it and start over\n",
+                j->fname);
+        return ERR;
+    }
+    if (n != nencodings) {
+        fprintf(stderr, "error: journal '%s' has %lu encodings, expected %lu\n",
+                j->fname, n, nencodings);
+        return ERR;
+    }
+    if (_scan(j) == ERR)
+        goto error;
+    if (g_verbose)
+        fprintf(stderr, "resumed:         %lu of %lu encodings\n", j->ndone, j->n);
+    return OK;
+error:
+    fprintf(stderr, "error: writing journal '%s' failed\n", j->fname);
+    return ERR;
+}
+
+bool
+obf_journal_done(const obf_journal *j, size_t seq)
+{
+    return j->offsets[seq] != -1;
+}
+
+size_t
+obf_journal_ndone(const obf_journal *j)
+{
+    return j->ndone;
+}
+
+bool
+obf_journal_failed(obf_journal *j)
+{
+    bool failed;
+
+    pthread_mutex_lock(&j->lock);
+    failed = j->failed;
+    pthread_mutex_unlock(&j->lock);
+    return failed;
+}
+
+encoding *
+obf_journal_fread(obf_journal *j, const encoding_vtable *vt, size_t seq)
+{
+    encoding *enc = NULL;
+    long end;
+
+    pthread_mutex_lock(&j->lock);
+    end = ftell(j->fp);
+    if (fseek(j->fp, j->offsets[seq], SEEK_SET) == 0)
+        enc = encoding_fread(vt, j->fp);
+    if (fseek(j->fp, end, SEEK_SET) == -1 && enc) {
+        encoding_free(vt, enc);
+        enc = NULL;
+    }
+    if (enc == NULL)
+        j->failed = true;
+    pthread_mutex_unlock(&j->lock);
+    if (enc == NULL)
+        fprintf(stderr, "error: reading journal '%s' failed\n", j->fname);
+    return enc;
+}
+
+int
+obf_journal_fwrite(obf_journal *j, const encoding_vtable *vt, size_t seq,
+                   const encoding *enc)
+{
+    long pos, end;
+    size_t len = 0;
+    int ret = OK;
+
+    pthread_mutex_lock(&j->lock);
+    pos = ftell(j->fp);
+    /* The length goes in last, so a record is only valid once complete */
+    if (size_t_fwrite(seq, j->fp) == ERR || size_t_fwrite(len, j->fp) == ERR
+        || encoding_fwrite(vt, enc, j->fp) == ERR) {
+        ret = ERR;
+        goto cleanup;
+    }
+    end = ftell(j->fp);
+    len = end - pos - 2 * sizeof(size_t);
+    if (fseek(j->fp, pos + sizeof(size_t), SEEK_SET) == -1
+        || size_t_fwrite(len, j->fp) == ERR
+        || fseek(j->fp, end, SEEK_SET) == -1
+        || fflush(j->fp) != 0)
+        ret = ERR;
+cleanup:
+    if (ret == ERR)
+        j->failed = true;
+    pthread_mutex_unlock(&j->lock);
+    if (ret == ERR)
+        fprintf(stderr, "error: writing journal '%s' failed\n", j->fname);
+    return ret;
+}
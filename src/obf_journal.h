@@ -0,0 +1,57 @@
+#pragma once
+
+/*
+ * Checkpoint journal for long-running obfuscations.
+ *
+ *   magic | params | header | nencodings | magic | record | record | ...
+ *
+ * The params pin down the mmap, circuit, security parameter and number of
+ * powers the journal was started with, so that it is never resumed for
+ * another obfuscation.  The journal is only readable by its owner.  The header is scheme-specific and holds whatever is needed to reproduce the
+ * obfuscation's randomness (secret parameters, random scalars).  Each record
+ * is `seq | len | encoding` for one finished encoding, where seq is the order
+ * in which the scheme produces encodings.  On resume the header is read back
+ * and the records are scanned, so only the missing encodings are recomputed;
+ * a record cut short by a crash is dropped.
+ */
+
+#include "circ_params.h"
+#include "mmap.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+typedef struct obf_journal obf_journal;
+
+/* Opens fname, resuming from it if it already exists */
+obf_journal *
+obf_journal_open(const char *fname);
+void
+obf_journal_close(obf_journal *j, bool remove);
+
+bool
+obf_journal_resuming(const obf_journal *j);
+/* Writes the params of a new journal, or checks those of a resumed one */
+int
+obf_journal_params(obf_journal *j, const mmap_vtable *mmap,
+                   const circ_params_t *cp, size_t secparam, size_t npowers);
+/* Stream for the scheme-specific header */
+FILE *
+obf_journal_fp(obf_journal *j);
+/* Ends a new header, or checks a resumed one and scans its records */
+int
+obf_journal_commit(obf_journal *j, size_t nencodings);
+
+bool
+obf_journal_done(const obf_journal *j, size_t seq);
+size_t
+obf_journal_ndone(const obf_journal *j);
+/* Set once a record fails to be read or written, after which the
+ * obfuscation is to be abandoned */
+bool
+obf_journal_failed(obf_journal *j);
+encoding *
+obf_journal_fread(obf_journal *j, const encoding_vtable *vt, size_t seq);
+int
+obf_journal_fwrite(obf_journal *j, const encoding_vtable *vt, size_t seq,
+                   const encoding *enc);
@@ -1,19 +1,80 @@
 #include "obf_run.h"
+#include "estimate.h"
 #include "util.h"
 
+#include <pthread.h>
 #include <string.h>
+#include <threadpool.h>
+#include <unistd.h>
 #include <mmap/mmap_dummy.h>
 
+/* Writes go to <fname>.tmp, renamed over fname only once complete, so that a
+ * failed run never leaves a file that looks like an obfuscation */
+static FILE *
+_fopen_tmp(const char *fname, char *tmpname, size_t length)
+{
+    FILE *fp;
+
+    snprintf(tmpname, length, "%s.tmp", fname);
+    if ((fp = fopen(tmpname, "w")) == NULL)
+        fprintf(stderr, "error: unable to open '%s' for writing\n", tmpname);
+    return fp;
+}
+
+static int
+_fclose_tmp(FILE *fp, const char *fname, const char *tmpname, int ret)
+{
+    if (fclose(fp) != 0)
+        ret = ERR;
+    if (ret == OK && rename(tmpname, fname) == -1) {
+        fprintf(stderr, "error: unable to write '%s'\n", fname);
+        ret = ERR;
+    }
+    if (ret == ERR)
+        unlink(tmpname);
+    return ret;
+}
+
 int
 obf_run_obfuscate(const mmap_vtable *mmap, const obfuscator_vtable *vt,
                   const char *fname, obf_params_t *op, size_t secparam,
-                  size_t *kappa, size_t nthreads, aes_randstate_t rng)
+                  size_t *kappa, size_t nthreads, aes_randstate_t rng,
+                  bool stream, bool resume)
 {
-    obfuscation *obf;
+    obfuscation *obf = NULL;
+    obf_journal *journal = NULL;
     double start, end, _start, _end;
     int ret = ERR;
 
     start = current_time();
+    if (resume && (fname == NULL || vt->obfuscate_fwrite == NULL)) {
+        fprintf(stderr, "error: checkpointing is not supported by this scheme\n");
+        return ERR;
+    }
+    if ((stream || resume) && fname && vt->obfuscate_fwrite) {
+        char tmpname[strlen(fname) + sizeof ".tmp"];
+        FILE *fp;
+        int res;
+        if (resume) {
+            const size_t length = snprintf(NULL, 0, "%s.journal", fname) + 1;
+            char jname[length];
+            snprintf(jname, length, "%s.journal", fname);
+            if ((journal = obf_journal_open(jname)) == NULL)
+                return ERR;
+        }
+        if ((fp = _fopen_tmp(fname, tmpname, sizeof tmpname)) == NULL)
+            exit(EXIT_FAILURE);
+        res = vt->obfuscate_fwrite(mmap, op, secparam, kappa, nthreads, rng, fp,
+                                   journal);
+        if (_fclose_tmp(fp, fname, tmpname, res) == ERR) {
+            fprintf(stderr, "error: obfuscation failed\n");
+            obf_journal_close(journal, false);
+            goto cleanup;
+        }
+        /* The obfuscation is complete, so the checkpoints are no longer needed */
+        obf_journal_close(journal, true);
+        goto done;
+    }
     _start = current_time();
     obf = vt->obfuscate(mmap, op, secparam, kappa, nthreads, rng);
     if (obf == NULL) {
@@ -24,29 +85,29 @@ obf_run_obfuscate(const mmap_vtable *mmap, const obfuscator_vtable *vt,
     if (g_verbose)
         fprintf(stderr, "obfuscate:       %.2fs\n", _end - _start);
     if (fname) {
+        char tmpname[strlen(fname) + sizeof ".tmp"];
         FILE *fp;
-        if ((fp = fopen(fname, "w")) == NULL) {
-            fprintf(stderr, "error: unable to open '%s' for writing\n", fname);
+        if ((fp = _fopen_tmp(fname, tmpname, sizeof tmpname)) == NULL)
             exit(EXIT_FAILURE);
-        }
         _start = current_time();
-        if (vt->fwrite(obf, fp) == ERR) {
+        if (_fclose_tmp(fp, fname, tmpname, vt->fwrite(obf, fp)) == ERR) {
             fprintf(stderr, "error: writing obfuscation to disk failed\n");
-            fclose(fp);
             goto cleanup;
         }
-        fclose(fp);
         _end = current_time();
         if (g_verbose)
             fprintf(stderr, "write to disk:   %.2fs\n", _end - _start);
     }
+done:
     end = current_time();
     if (g_verbose)
         fprintf(stderr, "obfuscate total: %.2fs\n", end - start);
     if (g_verbose) {
-        unsigned long size, resident;
+        unsigned long size, resident, peak;
         if (memory(&size, &resident) == OK)
             fprintf(stderr, "memory:          %luM\n", resident);
+        if (memory_peak(&peak) == OK)
+            fprintf(stderr, "peak memory:     %luM\n", peak);
     }
     ret = OK;
 cleanup:
@@ -54,6 +115,28 @@ cleanup:
     return ret;
 }
 
+static obfuscation *
+_obf_run_fread(const mmap_vtable *mmap, const obfuscator_vtable *vt,
+               const char *fname, obf_params_t *op, const eval_ctx *ctx)
+{
+    double start, end;
+    obfuscation *obf;
+    FILE *fp;
+
+    if ((fp = fopen(fname, "r")) == NULL) {
+        fprintf(stderr, "error: unable to open '%s' for reading\n", fname);
+        return NULL;
+    }
+    start = current_time();
+    if ((obf = vt->fread(mmap, op, fp, ctx)) == NULL)
+        fprintf(stderr, "error: reading obfuscator failed\n");
+    end = current_time();
+    fclose(fp);
+    if (obf && g_verbose)
+        fprintf(stderr, "read from disk: %.2fs\n", end - start);
+    return obf;
+}
+
 int
 obf_run_evaluate(const mmap_vtable *mmap, const obfuscator_vtable *vt, 
                  const char *fname, obf_params_t *op, const int *inputs,
@@ -62,26 +145,19 @@ obf_run_evaluate(const mmap_vtable *mmap, const obfuscator_vtable *vt,
 {
     double start, end, _start, _end;
     obfuscation *obf;
-    FILE *fp;
+    eval_ctx *ctx;
     int ret = ERR;
 
-    if ((fp = fopen(fname, "r")) == NULL) {
-        fprintf(stderr, "error: unable to open '%s' for reading\n", fname);
-        return ERR;
-    }
-
     start = current_time();
-    _start = current_time();
-    if ((obf = vt->fread(mmap, op, fp)) == NULL) {
-        fprintf(stderr, "error: reading obfuscator failed\n");
-        goto cleanup;
+    ctx = eval_ctx_new(nthreads);
+    if ((obf = _obf_run_fread(mmap, vt, fname, op, ctx)) == NULL) {
+        eval_ctx_free(ctx);
+        return ERR;
     }
-    _end = current_time();
-    if (g_verbose)
-        fprintf(stderr, "read from disk: %.2fs\n", _end - _start);
 
     _start = current_time();
-    if (vt->evaluate(obf, outputs, noutputs, inputs, ninputs, nthreads, kappa, npowers) == ERR)
+    ret = vt->evaluate(obf, outputs, noutputs, inputs, ninputs, ctx, kappa, npowers);
+    if (ret == ERR)
         goto cleanup;
     _end = current_time();
     if (g_verbose)
@@ -91,32 +167,218 @@ obf_run_evaluate(const mmap_vtable *mmap, const obfuscator_vtable *vt,
     if (g_verbose)
         fprintf(stderr, "evaluate total: %.2fs\n", end - start);
     if (g_verbose) {
-        unsigned long size, resident;
+        unsigned long size, resident, peak;
         if (memory(&size, &resident) == OK)
             fprintf(stderr, "memory:          %luM\n", resident);
+        if (memory_peak(&peak) == OK)
+            fprintf(stderr, "peak memory:     %luM\n", peak);
     }
     ret = OK;
 cleanup:
-    fclose(fp);
     vt->free(obf);
+    eval_ctx_free(ctx);
     return ret;
 }
 
+typedef struct {
+    const obfuscator_vtable *vt;
+    const obfuscation *obf;
+    int **inputs;
+    size_t ninputs;
+    int **outputs;
+    size_t noutputs;
+    size_t n;
+    const eval_ctx *ctx;        /* threads shared within the evaluations */
+    bool incremental;
+    size_t next;                /* next input to hand out */
+    size_t chunk;               /* inputs handed out at a time */
+    double *times;              /* [n] */
+    size_t *kappa;
+    size_t *npowers;
+    pthread_mutex_t lock;
+    int ret;
+} batch_args_t;
+
+static void
+batch_worker(void *vargs)
+{
+    batch_args_t *const args = vargs;
+    obf_state *state = NULL;
+    size_t i;
+
+    while (__sync_fetch_and_add(&args->ret, 0) == OK
+           && (i = __sync_fetch_and_add(&args->next, args->chunk)) < args->n) {
+        const size_t end = i + args->chunk < args->n ? i + args->chunk : args->n;
+        for (; i < end; ++i) {
+            size_t kappa = 0, npowers = 0;
+            double start;
+            int res;
+
+            start = current_time();
+            if (args->incremental)
+                res = args->vt->evaluate_incremental(
+                    args->obf, &state, args->outputs[i], args->noutputs,
+                    args->inputs[i], args->ninputs, args->ctx,
+                    args->kappa ? &kappa : NULL, args->npowers ? &npowers : NULL);
+            else
+                res = args->vt->evaluate(
+                    args->obf, args->outputs[i], args->noutputs, args->inputs[i],
+                    args->ninputs, args->ctx, args->kappa ? &kappa : NULL,
+                    args->npowers ? &npowers : NULL);
+            args->times[i] = current_time() - start;
+            if (res == ERR) {
+                fprintf(stderr, "error: evaluating input #%lu failed\n", i + 1);
+                __sync_lock_test_and_set(&args->ret, ERR);
+                break;
+            }
+            pthread_mutex_lock(&args->lock);
+            if (args->kappa && kappa > *args->kappa)
+                *args->kappa = kappa;
+            if (args->npowers && npowers > *args->npowers)
+                *args->npowers = npowers;
+            pthread_mutex_unlock(&args->lock);
+        }
+    }
+    if (state)
+        args->vt->free_state(state);
+}
+
+int
+obf_run_evaluate_batch(const mmap_vtable *mmap, const obfuscator_vtable *vt,
+                       const char *fname, obf_params_t *op, int **inputs,
+                       size_t ninputs, int **outputs, size_t noutputs,
+                       size_t n, size_t nthreads, size_t *kappa, size_t *npowers,
+                       bool incremental)
+{
+    double start, end, total = 0.0, min = 0.0, max = 0.0;
+    obfuscation *obf;
+    batch_args_t args;
+    eval_ctx *ctx;
+    size_t njobs;
+
+    if (incremental && vt->evaluate_incremental == NULL) {
+        if (g_verbose)
+            fprintf(stderr, "scheme has no incremental evaluation, evaluating each input in full\n");
+        incremental = false;
+    }
+
+    start = current_time();
+    ctx = eval_ctx_new(nthreads);
+    if ((obf = _obf_run_fread(mmap, vt, fname, op, ctx)) == NULL) {
+        eval_ctx_free(ctx);
+        return ERR;
+    }
+
+    /* Narrow circuits leave threads idle within one evaluation, so also run
+     * separate inputs side by side, their gates all sharing one pool */
+    njobs = nthreads < n ? nthreads : n;
+    if (njobs == 0)
+        njobs = 1;
+    args.vt = vt;
+    args.obf = obf;
+    args.inputs = inputs;
+    args.ninputs = ninputs;
+    args.outputs = outputs;
+    args.noutputs = noutputs;
+    args.n = n;
+    args.ctx = ctx;
+    args.incremental = incremental;
+    args.next = 0;
+    /* Incremental evaluation wants each worker to see consecutive inputs */
+    args.chunk = incremental ? (n + njobs - 1) / njobs : 1;
+    if (args.chunk == 0)
+        args.chunk = 1;
+    args.times = my_calloc(n, sizeof args.times[0]);
+    args.kappa = kappa;
+    args.npowers = npowers;
+    args.ret = OK;
+    if (kappa)
+        *kappa = 0;
+    if (npowers)
+        *npowers = 0;
+    pthread_mutex_init(&args.lock, NULL);
+    if (njobs == 1) {
+        batch_worker(&args);
+    } else {
+        threadpool *pool = threadpool_create(njobs);
+        for (size_t i = 0; i < njobs; ++i)
+            threadpool_add_job(pool, batch_worker, &args);
+        threadpool_destroy(pool);
+    }
+    pthread_mutex_destroy(&args.lock);
+    if (args.ret == ERR)
+        goto cleanup;
+
+    end = current_time();
+    for (size_t i = 0; i < n; ++i) {
+        if (g_verbose)
+            fprintf(stderr, "evaluate #%lu:    %.2fs\n", i + 1, args.times[i]);
+        total += args.times[i];
+        if (i == 0 || args.times[i] < min)
+            min = args.times[i];
+        if (i == 0 || args.times[i] > max)
+            max = args.times[i];
+    }
+    if (g_verbose && n) {
+        fprintf(stderr, "evaluate inputs: %lu\n", n);
+        if (njobs > 1)
+            fprintf(stderr, "evaluate jobs:   %lu on %lu threads\n", njobs,
+                    nthreads);
+        fprintf(stderr, "evaluate min:    %.2fs\n", min);
+        fprintf(stderr, "evaluate max:    %.2fs\n", max);
+        fprintf(stderr, "evaluate avg:    %.2fs\n", total / n);
+        fprintf(stderr, "evaluate sum:    %.2fs\n", total);
+    }
+    if (g_verbose)
+        fprintf(stderr, "evaluate total:  %.2fs\n", end - start);
+    if (g_verbose) {
+        unsigned long size, resident, peak;
+        if (memory(&size, &resident) == OK)
+            fprintf(stderr, "memory:          %luM\n", resident);
+        if (memory_peak(&peak) == OK)
+            fprintf(stderr, "peak memory:     %luM\n", peak);
+    }
+cleanup:
+    free(args.times);
+    vt->free(obf);
+    eval_ctx_free(ctx);
+    return args.ret;
+}
+
 size_t
 obf_run_smart_kappa(const obfuscator_vtable *vt, const acirc *circ,
-                    obf_params_t *op, size_t nthreads, aes_randstate_t rng)
+                    obf_params_t *op, size_t nthreads, aes_randstate_t rng,
+                    size_t *npowers)
 {
-    const char *fname = "/tmp/smart-kappa.obf";
+    char fname[] = "/tmp/smart-kappa.XXXXXX";
     int input[circ->ninputs];
     int output[circ->outputs.n];
     bool verbosity = g_verbose;
-    size_t kappa = 1;
+    size_t kappa = 1, _npowers = 0;
+    double start, end;
+    int fd;
 
     if (g_verbose)
         fprintf(stderr, "Choosing κ smartly...\n");
 
+    start = current_time();
+    if (vt->kappa) {
+        if (vt->kappa(op, &kappa, &_npowers) == ERR) {
+            fprintf(stderr, "error: unable to determine smart κ settings\n");
+            return 0;
+        }
+        goto done;
+    }
+
+    /* Otherwise obfuscate with the dummy mmap and evaluate the all-zeros
+     * input, in a file of our own so concurrent runs don't collide */
+    if ((fd = mkstemp(fname)) == -1) {
+        fprintf(stderr, "error: unable to create temporary file\n");
+        return 0;
+    }
+    close(fd);
     g_verbose = false;
-    if (obf_run_obfuscate(&dummy_vtable, vt, fname, op, 8, &kappa, nthreads, rng) == ERR) {
+    if (obf_run_obfuscate(&dummy_vtable, vt, fname, op, 8, &kappa, nthreads, rng, false, false) == ERR) {
         fprintf(stderr, "error: unable to obfuscate to determine smart κ settings\n");
         kappa = 0;
         goto cleanup;
@@ -125,12 +387,98 @@ obf_run_smart_kappa(const obfuscator_vtable *vt, const acirc *circ,
     memset(input, '\0', sizeof input);
     memset(output, '\0', sizeof output);
     if (obf_run_evaluate(&dummy_vtable, vt, fname, op, input, circ->ninputs,
-                         output, circ->outputs.n, nthreads, &kappa, NULL) == ERR) {
+                         output, circ->outputs.n, nthreads, &kappa, &_npowers) == ERR) {
         fprintf(stderr, "error: unable to evaluate to determine smart κ settings\n");
         kappa = 0;
     }
 
 cleanup:
+    unlink(fname);
     g_verbose = verbosity;
+    if (kappa == 0)
+        return 0;
+done:
+    end = current_time();
+    if (g_verbose)
+        fprintf(stderr, "smart κ:         %.3fs (κ = %lu, %lu powers used)\n",
+                end - start, kappa, _npowers);
+    if (npowers)
+        *npowers = _npowers;
     return kappa;
 }
+
+int
+obf_run_estimate(const mmap_vtable *mmap, const obfuscator_vtable *vt,
+                 const char *scheme, const acirc *circ, obf_params_t *op,
+                 size_t secparam, size_t kappa, size_t nthreads,
+                 aes_randstate_t rng)
+{
+    static const char *const names[] = { "obfuscate", "evaluate" };
+    const mmap_vtable *const dry = estimate_begin();
+    int input[circ->ninputs];
+    int output[circ->outputs.n];
+    estimate_ops ops[2];
+    estimate_costs costs;
+    obfuscation *obf = NULL;
+    bool verbosity = g_verbose;
+    eval_ctx *ctx;
+    double start;
+    FILE *fp;
+    int res, ret = ERR;
+
+    if ((fp = tmpfile()) == NULL) {
+        fprintf(stderr, "error: unable to create temporary file\n");
+        goto cleanup;
+    }
+    if (g_verbose)
+        fprintf(stderr, "Dry run with the dummy mmap...\n");
+    start = current_time();
+    g_verbose = false;
+    /* Obfuscate and evaluate the all-zeros input like the real thing would,
+     * going through the disk so reading is counted too */
+    if ((obf = vt->obfuscate(dry, op, secparam, &kappa, nthreads, rng)) == NULL) {
+        fprintf(stderr, "error: obfuscation failed\n");
+        goto cleanup;
+    }
+    if (vt->fwrite(obf, fp) == ERR) {
+        fprintf(stderr, "error: writing obfuscation failed\n");
+        goto cleanup;
+    }
+    vt->free(obf);
+    obf = NULL;
+    estimate_phase(&ops[0], ftell(fp));
+
+    rewind(fp);
+    ctx = eval_ctx_new(nthreads);
+    if ((obf = vt->fread(dry, op, fp, ctx)) == NULL) {
+        fprintf(stderr, "error: reading obfuscation failed\n");
+        eval_ctx_free(ctx);
+        goto cleanup;
+    }
+    memset(input, '\0', sizeof input);
+    res = vt->evaluate(obf, output, circ->outputs.n, input, circ->ninputs, ctx,
+                       NULL, NULL);
+    eval_ctx_free(ctx);
+    if (res == ERR) {
+        fprintf(stderr, "error: evaluation failed\n");
+        goto cleanup;
+    }
+    vt->free(obf);
+    obf = NULL;
+    estimate_phase(&ops[1], 0);
+    g_verbose = verbosity;
+    if (g_verbose)
+        fprintf(stderr, "dry run:         %.2fs\n", current_time() - start);
+
+    if (estimate_calibrate(mmap, secparam, nthreads, rng, &costs) == ERR)
+        goto cleanup;
+    estimate_fprint(stdout, scheme, secparam, nthreads, &costs, names, ops, 2);
+    ret = OK;
+cleanup:
+    g_verbose = verbosity;
+    vt->free(obf);
+    if (fp)
+        fclose(fp);
+    estimate_end();
+    return ret;
+}
@@ -5,7 +5,8 @@
 int
 obf_run_obfuscate(const mmap_vtable *mmap, const obfuscator_vtable *vt,
                   const char *fname, obf_params_t *op, size_t secparam,
-                  size_t *kappa, size_t nthreads, aes_randstate_t rng);
+                  size_t *kappa, size_t nthreads, aes_randstate_t rng,
+                  bool stream, bool resume);
 
 int
 obf_run_evaluate(const mmap_vtable *mmap, const obfuscator_vtable *vt, 
@@ -13,6 +14,27 @@ obf_run_evaluate(const mmap_vtable *mmap, const obfuscator_vtable *vt,
                  size_t ninputs, int *output, size_t noutputs, size_t nthreads,
                  size_t *kappa, size_t *npowers);
 
+/* Evaluates n inputs against one read of the obfuscation.  Up to nthreads
+ * inputs are evaluated at once, with the gates of all of them run on one
+ * shared pool of nthreads threads. */
+int
+obf_run_evaluate_batch(const mmap_vtable *mmap, const obfuscator_vtable *vt,
+                       const char *fname, obf_params_t *op, int **inputs,
+                       size_t ninputs, int **outputs, size_t noutputs,
+                       size_t n, size_t nthreads, size_t *kappa, size_t *npowers,
+                       bool incremental);
+
+/* κ for obfuscating op, and in *npowers (unless NULL) the number of powers
+ * evaluation actually uses; 0 on error */
 size_t
 obf_run_smart_kappa(const obfuscator_vtable *vt, const acirc *circ, obf_params_t *op, size_t nthreads,
-                    aes_randstate_t rng);
+                    aes_randstate_t rng, size_t *npowers);
+
+/* Predicts the time, peak memory and disk space of obfuscating op with mmap
+ * at secparam and kappa (0 for the scheme's default), and of evaluating the
+ * result, printing them as JSON on stdout */
+int
+obf_run_estimate(const mmap_vtable *mmap, const obfuscator_vtable *vt,
+                 const char *scheme, const acirc *circ, obf_params_t *op,
+                 size_t secparam, size_t kappa, size_t nthreads,
+                 aes_randstate_t rng);
@@ -0,0 +1,139 @@
+#include "obf_stream.h"
+#include "util.h"
+
+#include <pthread.h>
+
+#define NO_SLICE ((size_t) -1)
+
+typedef struct {
+    encoding *enc;
+    size_t slice;               /* NO_SLICE unless the encoding starts a slice */
+} stream_item;
+
+struct obf_stream {
+    const encoding_vtable *vt;
+    obf_index *index;
+    FILE *fp;
+    size_t window;
+    stream_item *items;         /* [window], item seq lives at seq % window */
+    size_t nreserved;
+    size_t nwritten;
+    size_t mark;
+    bool done;
+    int ret;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;       /* an item was put or the stream finished */
+    pthread_cond_t space;       /* an item was written */
+};
+
+static void *
+_writer(void *vargs)
+{
+    obf_stream *const s = vargs;
+
+    pthread_mutex_lock(&s->lock);
+    while (true) {
+        stream_item *const item = &s->items[s->nwritten % s->window];
+        if (s->nwritten == s->nreserved || item->enc == NULL) {
+            if (s->done && s->nwritten == s->nreserved)
+                break;
+            pthread_cond_wait(&s->ready, &s->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&s->lock);
+        if (item->slice != NO_SLICE)
+            obf_index_mark(s->index, item->slice, s->fp);
+        if (encoding_fwrite(s->vt, item->enc, s->fp) == ERR)
+            s->ret = ERR;
+        encoding_free(s->vt, item->enc);
+        pthread_mutex_lock(&s->lock);
+        item->enc = NULL;
+        item->slice = NO_SLICE;
+        s->nwritten++;
+        pthread_cond_signal(&s->space);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+obf_stream *
+obf_stream_new(const encoding_vtable *vt, obf_index *index, FILE *fp,
+               size_t window)
+{
+    obf_stream *s = my_calloc(1, sizeof s[0]);
+    s->vt = vt;
+    s->index = index;
+    s->fp = fp;
+    s->window = window ? window : 1;
+    s->items = my_calloc(s->window, sizeof s->items[0]);
+    for (size_t i = 0; i < s->window; ++i)
+        s->items[i].slice = NO_SLICE;
+    s->mark = NO_SLICE;
+    s->ret = OK;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->ready, NULL);
+    pthread_cond_init(&s->space, NULL);
+    if (pthread_create(&s->writer, NULL, _writer, s) != 0) {
+        fprintf(stderr, "error: unable to start obfuscation writer\n");
+        pthread_cond_destroy(&s->space);
+        pthread_cond_destroy(&s->ready);
+        pthread_mutex_destroy(&s->lock);
+        free(s->items);
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+void
+obf_stream_mark(obf_stream *s, size_t slice)
+{
+    s->mark = slice;
+}
+
+size_t
+obf_stream_reserve(obf_stream *s)
+{
+    size_t seq;
+
+    pthread_mutex_lock(&s->lock);
+    while (s->nreserved - s->nwritten >= s->window)
+        pthread_cond_wait(&s->space, &s->lock);
+    seq = s->nreserved++;
+    s->items[seq % s->window].slice = s->mark;
+    s->mark = NO_SLICE;
+    pthread_mutex_unlock(&s->lock);
+    return seq;
+}
+
+void
+obf_stream_put(obf_stream *s, size_t seq, encoding *enc)
+{
+    pthread_mutex_lock(&s->lock);
+    s->items[seq % s->window].enc = enc;
+    if (seq == s->nwritten)
+        pthread_cond_signal(&s->ready);
+    pthread_mutex_unlock(&s->lock);
+}
+
+int
+obf_stream_finish(obf_stream *s)
+{
+    int ret;
+
+    pthread_mutex_lock(&s->lock);
+    s->done = true;
+    pthread_cond_signal(&s->ready);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->writer, NULL);
+    ret = s->ret;
+    if (ferror(s->fp))
+        ret = ERR;
+    pthread_cond_destroy(&s->space);
+    pthread_cond_destroy(&s->ready);
+    pthread_mutex_destroy(&s->lock);
+    free(s->items);
+    free(s);
+    return ret;
+}
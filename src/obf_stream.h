@@ -0,0 +1,32 @@
+#pragma once
+
+/*
+ * Streams encodings to disk as they are produced.  Encodings are reserved in
+ * file order, filled in by the workers in whatever order they finish, and
+ * appended by a dedicated writer thread once every earlier encoding has been
+ * written.  Each encoding is freed as soon as it is on disk, and reserving
+ * blocks while `window` encodings are outstanding, so memory is bounded by the
+ * window rather than by the size of the obfuscation.
+ */
+
+#include "mmap.h"
+#include "obf_index.h"
+
+#include <stdio.h>
+
+typedef struct obf_stream obf_stream;
+
+obf_stream *
+obf_stream_new(const encoding_vtable *vt, obf_index *index, FILE *fp,
+               size_t window);
+/* Marks the next reserved encoding as the start of `slice` */
+void
+obf_stream_mark(obf_stream *s, size_t slice);
+size_t
+obf_stream_reserve(obf_stream *s);
+/* Hands over ownership of enc */
+void
+obf_stream_put(obf_stream *s, size_t seq, encoding *enc);
+/* Waits for everything reserved to be written and frees s */
+int
+obf_stream_finish(obf_stream *s);
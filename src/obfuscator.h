@@ -1,16 +1,42 @@
 #pragma once
 
 #include "mmap.h"
+#include "obf_journal.h"
+#include "sched.h"
 
 typedef struct obfuscation obfuscation;
+typedef struct obf_state obf_state;
 typedef struct {
     obfuscation * (*obfuscate)(const mmap_vtable *mmap, const obf_params_t *op,
                                size_t secparam, size_t *kappa, size_t nthreads,
                                aes_randstate_t rng);
     void (*free)(obfuscation *obf);
+    /* Keeps all its state per call, so may run concurrently on one obf,
+     * sharing the threads of ctx */
     int (*evaluate)(const obfuscation *obf, int *outputs, size_t noutputs,
-                    const int *inputs, size_t ninputs, size_t nthreads,
+                    const int *inputs, size_t ninputs, const eval_ctx *ctx,
                     size_t *kappa, size_t *npowers);
     int (*fwrite)(const obfuscation *obf, FILE *fp);
-    obfuscation * (*fread)(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp);
+    /* Any work done up front shares the threads of ctx, which the caller
+     * then evaluates with */
+    obfuscation * (*fread)(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp,
+                           const eval_ctx *ctx);
+    /* Optional: obfuscates straight to fp, freeing encodings once written,
+     * and checkpointing to journal unless it is NULL */
+    int (*obfuscate_fwrite)(const mmap_vtable *mmap, const obf_params_t *op,
+                            size_t secparam, size_t *kappa, size_t nthreads,
+                            aes_randstate_t rng, FILE *fp, obf_journal *journal);
+    /* Optional: like evaluate, but keeps every gate of the previous input in
+     * *state (NULL at first, then freed with free_state) and only recomputes
+     * the cones of the input symbols that changed.  Distinct states may be
+     * used concurrently. */
+    int (*evaluate_incremental)(const obfuscation *obf, obf_state **state,
+                                int *outputs, size_t noutputs, const int *inputs,
+                                size_t ninputs, const eval_ctx *ctx,
+                                size_t *kappa, size_t *npowers);
+    void (*free_state)(obf_state *state);
+    /* Optional: computes the κ and npowers evaluate would report on the
+     * all-zeros input by following only index sets (or levels) and degrees
+     * through the circuit, without any encodings */
+    int (*kappa)(const obf_params_t *op, size_t *kappa, size_t *npowers);
 } obfuscator_vtable;
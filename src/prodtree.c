@@ -0,0 +1,123 @@
+#include "prodtree.h"
+#include "util.h"
+
+#include <string.h>
+
+prodtree *
+prodtree_new(const encoding_vtable *enc_vt, const pp_vtable *pp_vt,
+             const public_params *pp, size_t n)
+{
+    prodtree *t = my_calloc(1, sizeof t[0]);
+    t->enc_vt = enc_vt;
+    t->pp_vt = pp_vt;
+    t->pp = pp;
+    t->n = n;
+    t->leaves = my_calloc(n, sizeof t->leaves[0]);
+    t->nodes = my_calloc(n, sizeof t->nodes[0]);
+    t->dirty = my_calloc(n, sizeof t->dirty[0]);
+    t->pending = my_calloc(n, sizeof t->pending[0]);
+    for (size_t i = 1; i < n; ++i)
+        t->nodes[i] = encoding_new(enc_vt, pp_vt, pp);
+    return t;
+}
+
+void
+prodtree_free(prodtree *t)
+{
+    if (t == NULL)
+        return;
+    for (size_t i = 1; i < t->n; ++i)
+        encoding_free(t->enc_vt, t->nodes[i]);
+    free(t->leaves);
+    free(t->nodes);
+    free(t->dirty);
+    free(t->pending);
+    free(t);
+}
+
+void
+prodtree_set(prodtree *t, size_t i, const encoding *x)
+{
+    if (t->leaves[i] == x)
+        return;
+    t->leaves[i] = x;
+    for (size_t j = (t->n + i) / 2; j >= 1 && !t->dirty[j]; j /= 2)
+        t->dirty[j] = true;
+}
+
+static const encoding *
+_node(const prodtree *t, size_t i)
+{
+    return i >= t->n ? t->leaves[i - t->n] : t->nodes[i];
+}
+
+void
+prodtree_update(prodtree *t)
+{
+    /* Children have larger indices than their parent */
+    for (size_t i = t->n - 1; i >= 1 && i < t->n; --i) {
+        if (!t->dirty[i])
+            continue;
+        encoding_mul(t->enc_vt, t->pp_vt, t->nodes[i], _node(t, 2 * i),
+                     _node(t, 2 * i + 1), t->pp);
+        t->dirty[i] = false;
+        t->nmuls++;
+    }
+}
+
+typedef struct {
+    prodtree *t;
+    size_t i;
+} node_job;
+
+static void
+node_worker(void *vargs)
+{
+    node_job *const job = vargs;
+    prodtree *const t = job->t;
+    size_t i = job->i;
+
+    /* Whichever child finishes last goes on to its parent */
+    do {
+        encoding_mul(t->enc_vt, t->pp_vt, t->nodes[i], _node(t, 2 * i),
+                     _node(t, 2 * i + 1), t->pp);
+        t->dirty[i] = false;
+        __sync_fetch_and_add(&t->nmuls, 1);
+        i /= 2;
+    } while (i >= 1 && __sync_sub_and_fetch(&t->pending[i], 1) == 0);
+    free(job);
+}
+
+void
+prodtree_update_async(prodtree *t, sched_jobs *jobs)
+{
+    size_t nready = 0;
+    size_t *ready;
+
+    if (t->n <= 1)
+        return;
+    /* Count first, since jobs may start as soon as they are added */
+    ready = my_calloc(t->n, sizeof ready[0]);
+    memset(t->pending, '\0', t->n * sizeof t->pending[0]);
+    for (size_t i = 2; i < t->n; ++i)
+        if (t->dirty[i])
+            t->pending[i / 2]++;
+    for (size_t i = 1; i < t->n; ++i)
+        if (t->dirty[i] && t->pending[i] == 0)
+            ready[nready++] = i;
+    for (size_t i = 0; i < nready; ++i) {
+        node_job *job = my_calloc(1, sizeof job[0]);
+        job->t = t;
+        job->i = ready[i];
+        sched_jobs_add(jobs, node_worker, job);
+    }
+    free(ready);
+}
+
+const encoding *
+prodtree_root(const prodtree *t)
+{
+    if (t->n == 0)
+        return NULL;
+    return t->n == 1 ? t->leaves[0] : t->nodes[1];
+}
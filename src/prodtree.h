@@ -0,0 +1,42 @@
+#pragma once
+
+/*
+ * Product of n encodings, kept as a binary tree so that changing a few
+ * factors only recomputes the products on their paths to the root.  Leaf i
+ * sits at index n + i and node i < n is the product of nodes 2i and 2i + 1,
+ * so the root is node 1 (or the only leaf when n == 1).  The leaves are
+ * borrowed; the internal products are owned by the tree.
+ */
+
+#include "mmap.h"
+#include "sched.h"
+
+typedef struct {
+    const encoding_vtable *enc_vt;
+    const pp_vtable *pp_vt;
+    const public_params *pp;
+    size_t n;
+    const encoding **leaves;    /* [n] */
+    encoding **nodes;           /* [n], nodes[0] unused */
+    bool *dirty;                /* [n] */
+    int *pending;               /* [n], dirty children left, when updating async */
+    size_t nmuls;               /* multiplications done by prodtree_update */
+} prodtree;
+
+prodtree *
+prodtree_new(const encoding_vtable *enc_vt, const pp_vtable *pp_vt,
+             const public_params *pp, size_t n);
+void
+prodtree_free(prodtree *t);
+/* Sets leaf i to x, marking the products above it stale */
+void
+prodtree_set(prodtree *t, size_t i, const encoding *x);
+/* Recomputes the stale products */
+void
+prodtree_update(prodtree *t);
+/* Recomputes the stale products as jobs, each as soon as its children are
+ * done.  The root is ready once the jobs have been waited for. */
+void
+prodtree_update_async(prodtree *t, sched_jobs *jobs);
+const encoding *
+prodtree_root(const prodtree *t);
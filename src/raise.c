@@ -0,0 +1,167 @@
+#include "raise.h"
+#include "util.h"
+
+raise_table *
+raise_table_new(const encoding_vtable *enc_vt, const pp_vtable *pp_vt,
+                const public_params *pp, size_t nsyms, size_t npowers,
+                size_t maxprods)
+{
+    raise_table *t = my_calloc(1, sizeof t[0]);
+    t->enc_vt = enc_vt;
+    t->pp_vt = pp_vt;
+    t->pp = pp;
+    t->nsyms = nsyms;
+    t->npowers = npowers;
+    t->maxprods = maxprods;
+    t->syms = my_calloc(nsyms, sizeof t->syms[0]);
+    pthread_mutex_init(&t->lock, NULL);
+    return t;
+}
+
+void
+raise_table_free(raise_table *t)
+{
+    if (t == NULL)
+        return;
+    for (size_t i = 0; i < t->nsyms; ++i) {
+        raise_sym *const rs = &t->syms[i];
+        for (size_t d = 0; rs->prods && d <= rs->maxdiff; ++d) {
+            if (rs->mine[d])
+                encoding_free(t->enc_vt, rs->prods[d]);
+        }
+        free(rs->prods);
+        free(rs->mine);
+    }
+    free(t->syms);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+}
+
+void
+raise_table_set(raise_table *t, size_t sym, encoding **powers, size_t maxdiff)
+{
+    raise_sym *const rs = &t->syms[sym];
+    rs->powers = powers;
+    rs->maxdiff = maxdiff;
+    rs->prods = my_calloc(maxdiff + 1, sizeof rs->prods[0]);
+    rs->mine = my_calloc(maxdiff + 1, sizeof rs->mine[0]);
+}
+
+/* Largest power we obfuscated that fits in diff */
+static size_t
+_power_of(size_t npowers, size_t diff)
+{
+    size_t p = 0;
+    while (((size_t) 1 << (p + 1)) <= diff && (p + 1) < npowers)
+        p++;
+    return p;
+}
+
+static size_t
+_power(raise_eval *r, size_t diff)
+{
+    const size_t p = _power_of(r->table->npowers, diff);
+    size_t cur;
+    while ((cur = r->maxpower) < p + 1)
+        __sync_bool_compare_and_swap(&r->maxpower, cur, p + 1);
+    return p;
+}
+
+/* Multiplies x by the powers in the decomposition of diff one at a time */
+static int
+_raise_direct(raise_eval *r, raise_sym *rs, encoding *x, size_t diff)
+{
+    raise_table *const t = r->table;
+
+    while (diff > 0) {
+        const size_t p = _power(r, diff);
+        if (encoding_mul(t->enc_vt, t->pp_vt, x, x, rs->powers[p], t->pp) == ERR)
+            return ERR;
+        __sync_fetch_and_add(&r->nmuls, 1);
+        diff -= (size_t) 1 << p;
+    }
+    return OK;
+}
+
+/* The memoized product of the decomposition of diff, or NULL if the table is
+ * full or a multiplication failed */
+static encoding *
+_product(raise_eval *r, raise_sym *rs, size_t diff)
+{
+    raise_table *const t = r->table;
+    const size_t p = _power(r, diff);
+    encoding *rest, *prod;
+    bool full;
+
+    if (diff == (size_t) 1 << p)
+        return rs->powers[p];
+    pthread_mutex_lock(&t->lock);
+    rest = rs->prods[diff];
+    full = t->nprods >= t->maxprods;
+    pthread_mutex_unlock(&t->lock);
+    if (rest)
+        return rest;
+    if (full)
+        return NULL;
+
+    if ((rest = _product(r, rs, diff - ((size_t) 1 << p))) == NULL)
+        return NULL;
+    prod = encoding_new(t->enc_vt, t->pp_vt, t->pp);
+    if (encoding_mul(t->enc_vt, t->pp_vt, prod, rest, rs->powers[p], t->pp) == ERR) {
+        encoding_free(t->enc_vt, prod);
+        return NULL;
+    }
+    __sync_fetch_and_add(&r->nmuls, 1);
+
+    /* Another thread may have built the same product in the meantime */
+    pthread_mutex_lock(&t->lock);
+    if (rs->prods[diff] == NULL && t->nprods < t->maxprods) {
+        rs->prods[diff] = prod;
+        rs->mine[diff] = true;
+        t->nprods++;
+        prod = NULL;
+    }
+    rest = rs->prods[diff];
+    pthread_mutex_unlock(&t->lock);
+    encoding_free(t->enc_vt, prod);
+    return rest;
+}
+
+void
+raise_eval_init(raise_eval *r, raise_table *t)
+{
+    r->table = t;
+    r->nmuls = 0;
+    r->maxpower = 0;
+}
+
+int
+raise_eval_raise(raise_eval *r, encoding *x, size_t sym, size_t diff)
+{
+    raise_table *const t = r->table;
+    raise_sym *const rs = &t->syms[sym];
+    const encoding *prod;
+
+    if (diff == 0)
+        return OK;
+    /* Out of the table's range, or not kept, so raise directly */
+    if (rs->prods == NULL || diff > rs->maxdiff
+        || (prod = _product(r, rs, diff)) == NULL)
+        return _raise_direct(r, rs, x, diff);
+    if (encoding_mul(t->enc_vt, t->pp_vt, x, x, prod, t->pp) == ERR)
+        return ERR;
+    __sync_fetch_and_add(&r->nmuls, 1);
+    return OK;
+}
+
+size_t
+raise_degree(size_t npowers, size_t diff, size_t *maxpower)
+{
+    size_t deg = 0;
+
+    if (diff > 0 && *maxpower < _power_of(npowers, diff) + 1)
+        *maxpower = _power_of(npowers, diff) + 1;
+    for (; diff > 0; deg++)
+        diff -= (size_t) 1 << _power_of(npowers, diff);
+    return deg;
+}
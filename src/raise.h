@@ -0,0 +1,61 @@
+#pragma once
+
+/*
+ * Per-evaluation cache of the products used to raise encodings to a larger
+ * index set.  Raising by `diff` in some symbol multiplies by the greedy
+ * power-of-two decomposition of `diff`; the product of that decomposition is
+ * computed once and reused, so each raise costs a single multiplication per
+ * symbol.
+ */
+
+#include "mmap.h"
+
+#include <pthread.h>
+
+typedef struct {
+    encoding **powers;          /* [npowers], powers[p] raises by 2^p */
+    encoding **prods;           /* [maxdiff + 1], memoized products */
+    bool *mine;                 /* [maxdiff + 1] */
+    size_t maxdiff;
+} raise_sym;
+
+typedef struct {
+    const encoding_vtable *enc_vt;
+    const pp_vtable *pp_vt;
+    const public_params *pp;
+    size_t nsyms;
+    size_t npowers;
+    raise_sym *syms;            /* [nsyms] */
+    size_t nprods;              /* memoized products held */
+    size_t maxprods;            /* beyond which products are no longer kept */
+    pthread_mutex_t lock;
+} raise_table;
+
+/* One evaluation's use of a table, which concurrent evaluations may share,
+ * counting only the work of that evaluation */
+typedef struct {
+    raise_table *table;
+    size_t nmuls;               /* number of raising multiplications */
+    size_t maxpower;            /* largest power used, plus one */
+} raise_eval;
+
+/* Keeps at most maxprods memoized products, so a table that lives as long as
+ * its obfuscation holds a bounded number of encodings */
+raise_table *
+raise_table_new(const encoding_vtable *enc_vt, const pp_vtable *pp_vt,
+                const public_params *pp, size_t nsyms, size_t npowers,
+                size_t maxprods);
+void
+raise_table_free(raise_table *t);
+void
+raise_table_set(raise_table *t, size_t sym, encoding **powers, size_t maxdiff);
+
+void
+raise_eval_init(raise_eval *r, raise_table *t);
+int
+raise_eval_raise(raise_eval *r, encoding *x, size_t sym, size_t diff);
+/* The degree raising by diff in one symbol adds, i.e. the number of powers
+ * in its decomposition, without touching any encoding.  Updates *maxpower
+ * like raise_eval_raise does for r->maxpower. */
+size_t
+raise_degree(size_t npowers, size_t diff, size_t *maxpower);
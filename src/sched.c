@@ -0,0 +1,426 @@
+#include "sched.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <threadpool.h>
+
+sched_e g_sched = SCHED_LEVEL;
+
+sched_t *
+sched_new(const acirc *c)
+{
+    const size_t nrefs = acirc_nrefs(c);
+    sched_t *s;
+    size_t *level, *order, *remaining;
+    size_t head = 0, tail = 0;
+
+    s = my_calloc(1, sizeof s[0]);
+    s->circ = c;
+    s->nrefs = nrefs;
+    s->nsched = nrefs;
+    s->deps = depgraph_new(c);
+    s->refs = my_calloc(nrefs, sizeof s->refs[0]);
+    s->output = my_calloc(nrefs, sizeof s->output[0]);
+    for (size_t ref = 0; ref < nrefs; ++ref)
+        s->output[ref] = -1;
+    for (size_t o = c->outputs.n; o-- > 0;)
+        s->output[c->outputs.buf[o]] = o;
+
+    /* Kahn's algorithm, tracking the level of each gate as we go */
+    level = my_calloc(nrefs, sizeof level[0]);
+    order = my_calloc(nrefs, sizeof order[0]);
+    remaining = my_calloc(nrefs, sizeof remaining[0]);
+    for (size_t ref = 0; ref < nrefs; ++ref) {
+        remaining[ref] = s->deps->nargs[ref];
+        if (remaining[ref] == 0)
+            order[tail++] = ref;
+    }
+    while (head < tail) {
+        const acircref ref = order[head++];
+        const acircref *succs = depgraph_succs(s->deps, ref);
+        const size_t nsuccs = depgraph_nsuccs(s->deps, ref);
+        if (level[ref] + 1 > s->nlevels)
+            s->nlevels = level[ref] + 1;
+        for (size_t i = 0; i < nsuccs; ++i) {
+            const acircref next = succs[i];
+            if (level[next] < level[ref] + 1)
+                level[next] = level[ref] + 1;
+            if (--remaining[next] == 0)
+                order[tail++] = next;
+        }
+    }
+    if (tail != nrefs) {
+        fprintf(stderr, "error: circuit contains a cycle\n");
+        free(level);
+        free(order);
+        free(remaining);
+        sched_free(s);
+        return NULL;
+    }
+
+    /* Bucket refs by level, keeping each level in increasing ref order */
+    s->levels = my_calloc(s->nlevels + 1, sizeof s->levels[0]);
+    for (size_t ref = 0; ref < nrefs; ++ref)
+        s->levels[level[ref] + 1]++;
+    for (size_t l = 0; l < s->nlevels; ++l)
+        s->levels[l + 1] += s->levels[l];
+    memcpy(remaining, s->levels, s->nlevels * sizeof remaining[0]);
+    for (size_t ref = 0; ref < nrefs; ++ref)
+        s->refs[remaining[level[ref]]++] = ref;
+
+    free(level);
+    free(order);
+    free(remaining);
+    return s;
+}
+
+sched_t *
+sched_prune(const sched_t *s, const size_t *outputs, size_t n)
+{
+    const acirc *const c = s->circ;
+    sched_t *p;
+    bool *keep;
+
+    keep = my_calloc(s->nrefs, sizeof keep[0]);
+    for (size_t i = 0; i < n; ++i) {
+        if (outputs[i] >= c->outputs.n) {
+            fprintf(stderr, "error: output %lu out of range (circuit has %lu)\n",
+                    outputs[i], c->outputs.n);
+            free(keep);
+            return NULL;
+        }
+        keep[c->outputs.buf[outputs[i]]] = true;
+    }
+    /* Walk refs backwards so each gate is marked before its arguments */
+    for (size_t i = s->nsched; i-- > 0;) {
+        const acircref ref = s->refs[i];
+        const acircref *args = depgraph_args(s->deps, ref);
+        if (!keep[ref])
+            continue;
+        for (int j = 0; j < s->deps->nargs[ref]; ++j)
+            keep[args[j]] = true;
+    }
+
+    p = my_calloc(1, sizeof p[0]);
+    p->circ = c;
+    p->nrefs = s->nrefs;
+    p->nlevels = s->nlevels;
+    p->deps = depgraph_restrict(s->deps, keep);
+    p->levels = my_calloc(s->nlevels + 1, sizeof p->levels[0]);
+    p->refs = my_calloc(s->nsched, sizeof p->refs[0]);
+    p->output = my_calloc(s->nrefs, sizeof p->output[0]);
+    for (size_t ref = 0; ref < s->nrefs; ++ref)
+        p->output[ref] = keep[ref] ? s->output[ref] : -1;
+    for (size_t l = 0; l < s->nlevels; ++l) {
+        for (size_t i = s->levels[l]; i < s->levels[l + 1]; ++i)
+            if (keep[s->refs[i]])
+                p->refs[p->nsched++] = s->refs[i];
+        p->levels[l + 1] = p->nsched;
+    }
+    free(keep);
+    return p;
+}
+
+void
+sched_free(sched_t *s)
+{
+    if (s == NULL)
+        return;
+    depgraph_free(s->deps);
+    free(s->levels);
+    free(s->refs);
+    free(s->output);
+    free(s);
+}
+
+/* Drops one use of each argument of ref, releasing those no longer needed */
+static void
+sched_release(const sched_t *s, acircref ref, int *uses,
+              sched_release_f release, void *vargs)
+{
+    const acircref *args = depgraph_args(s->deps, ref);
+
+    if (release == NULL)
+        return;
+    if (depgraph_nsuccs(s->deps, ref) == 0)
+        release(ref, vargs);
+    for (int i = 0; i < s->deps->nargs[ref]; ++i) {
+        if (__sync_sub_and_fetch(&uses[args[i]], 1) == 0)
+            release(args[i], vargs);
+    }
+}
+
+static int *
+sched_uses(const sched_t *s, sched_release_f release)
+{
+    int *uses;
+
+    if (release == NULL)
+        return NULL;
+    uses = my_calloc(s->nrefs, sizeof uses[0]);
+    for (size_t ref = 0; ref < s->nrefs; ++ref)
+        uses[ref] = depgraph_nsuccs(s->deps, ref);
+    return uses;
+}
+
+eval_ctx *
+eval_ctx_new(size_t nthreads)
+{
+    eval_ctx *ctx;
+
+    ctx = my_calloc(1, sizeof ctx[0]);
+    ctx->nthreads = nthreads ? nthreads : 1;
+    if (ctx->nthreads > 1)
+        ctx->pool = threadpool_create(ctx->nthreads);
+    return ctx;
+}
+
+void
+eval_ctx_free(eval_ctx *ctx)
+{
+    if (ctx == NULL)
+        return;
+    if (ctx->pool)
+        threadpool_destroy(ctx->pool);
+    free(ctx);
+}
+
+void
+sched_jobs_init(sched_jobs *jobs, const eval_ctx *ctx)
+{
+    jobs->pool = ctx ? ctx->pool : NULL;
+    jobs->pending = 0;
+    pthread_mutex_init(&jobs->lock, NULL);
+    pthread_cond_init(&jobs->cond, NULL);
+}
+
+typedef struct {
+    sched_jobs *jobs;
+    void (*f)(void *);
+    void *arg;
+} sched_job_t;
+
+static void
+sched_job_worker(void *vargs)
+{
+    sched_job_t *const job = vargs;
+    sched_jobs *const jobs = job->jobs;
+
+    job->f(job->arg);
+    free(job);
+    pthread_mutex_lock(&jobs->lock);
+    if (--jobs->pending == 0)
+        pthread_cond_broadcast(&jobs->cond);
+    pthread_mutex_unlock(&jobs->lock);
+}
+
+void
+sched_jobs_add(sched_jobs *jobs, void (*f)(void *), void *arg)
+{
+    sched_job_t *job;
+
+    if (jobs->pool == NULL) {
+        f(arg);
+        return;
+    }
+    job = my_calloc(1, sizeof job[0]);
+    job->jobs = jobs;
+    job->f = f;
+    job->arg = arg;
+    pthread_mutex_lock(&jobs->lock);
+    jobs->pending++;
+    pthread_mutex_unlock(&jobs->lock);
+    threadpool_add_job(jobs->pool, sched_job_worker, job);
+}
+
+void
+sched_jobs_wait(sched_jobs *jobs)
+{
+    pthread_mutex_lock(&jobs->lock);
+    while (jobs->pending)
+        pthread_cond_wait(&jobs->cond, &jobs->lock);
+    pthread_mutex_unlock(&jobs->lock);
+}
+
+void
+sched_jobs_clear(sched_jobs *jobs)
+{
+    sched_jobs_wait(jobs);
+    pthread_cond_destroy(&jobs->cond);
+    pthread_mutex_destroy(&jobs->lock);
+}
+
+typedef struct {
+    const sched_t *s;
+    sched_f f;
+    sched_release_f release;
+    void *vargs;
+    int *uses;
+    size_t next, end;
+    size_t chunk;
+    int ret;
+} level_args_t;
+
+static void
+level_worker(void *vargs)
+{
+    level_args_t *const args = vargs;
+    size_t i;
+
+    while ((i = __sync_fetch_and_add(&args->next, args->chunk)) < args->end) {
+        const size_t end = i + args->chunk < args->end ? i + args->chunk : args->end;
+        for (; i < end; ++i) {
+            const acircref ref = args->s->refs[i];
+            if (args->f(ref, args->vargs) == ERR)
+                __sync_lock_test_and_set(&args->ret, ERR);
+            sched_release(args->s, ref, args->uses, args->release, args->vargs);
+        }
+    }
+}
+
+static int
+sched_run_level(const sched_t *s, sched_f f, sched_release_f release,
+                void *vargs, const eval_ctx *ctx)
+{
+    const size_t nthreads = ctx->nthreads;
+    level_args_t args;
+    sched_jobs jobs;
+
+    args.s = s;
+    args.f = f;
+    args.release = release;
+    args.vargs = vargs;
+    args.uses = sched_uses(s, release);
+    args.ret = OK;
+    sched_jobs_init(&jobs, ctx);
+
+    for (size_t l = 0; l < s->nlevels && args.ret == OK; ++l) {
+        const size_t n = s->levels[l + 1] - s->levels[l];
+        size_t njobs;
+
+        /* Hand out a few chunks per thread so uneven gates balance out */
+        args.chunk = n / (4 * nthreads) ? n / (4 * nthreads) : 1;
+        args.next = s->levels[l];
+        args.end = s->levels[l + 1];
+        njobs = (n + args.chunk - 1) / args.chunk;
+        if (njobs > nthreads)
+            njobs = nthreads;
+        if (njobs == 1) {
+            level_worker(&args);
+            continue;
+        }
+        for (size_t i = 0; i < njobs; ++i)
+            sched_jobs_add(&jobs, level_worker, &args);
+        sched_jobs_wait(&jobs);
+    }
+
+    sched_jobs_clear(&jobs);
+    free(args.uses);
+    return args.ret;
+}
+
+typedef struct {
+    const sched_t *s;
+    sched_f f;
+    sched_release_f release;
+    void *vargs;
+    sched_jobs *jobs;
+    int *ready;
+    int *uses;
+    int ret;
+} gate_args_t;
+
+typedef struct {
+    gate_args_t *args;
+    acircref ref;
+} gate_job_t;
+
+static void
+gate_worker(void *vargs)
+{
+    gate_job_t *const job = vargs;
+    gate_args_t *const args = job->args;
+    const acircref *succs = depgraph_succs(args->s->deps, job->ref);
+    const size_t nsuccs = depgraph_nsuccs(args->s->deps, job->ref);
+
+    if (args->f(job->ref, args->vargs) == ERR)
+        __sync_lock_test_and_set(&args->ret, ERR);
+    sched_release(args->s, job->ref, args->uses, args->release, args->vargs);
+    for (size_t i = 0; i < nsuccs; ++i) {
+        const acircref ref = succs[i];
+        const int num = __sync_add_and_fetch(&args->ready[ref], 1);
+        if (num == args->s->deps->nargs[ref]) {
+            gate_job_t *newjob = my_calloc(1, sizeof newjob[0]);
+            newjob->args = args;
+            newjob->ref = ref;
+            sched_jobs_add(args->jobs, gate_worker, newjob);
+        }
+    }
+    free(job);
+}
+
+static int
+sched_run_gate(const sched_t *s, sched_f f, sched_release_f release,
+               void *vargs, const eval_ctx *ctx)
+{
+    gate_args_t args;
+    sched_jobs jobs;
+
+    sched_jobs_init(&jobs, ctx);
+    args.s = s;
+    args.f = f;
+    args.release = release;
+    args.vargs = vargs;
+    args.jobs = &jobs;
+    args.ready = my_calloc(s->nrefs, sizeof args.ready[0]);
+    args.uses = sched_uses(s, release);
+    args.ret = OK;
+    for (size_t i = s->levels[0]; i < s->levels[1]; ++i) {
+        gate_job_t *job = my_calloc(1, sizeof job[0]);
+        job->args = &args;
+        job->ref = s->refs[i];
+        sched_jobs_add(&jobs, gate_worker, job);
+    }
+    sched_jobs_clear(&jobs);
+    free(args.ready);
+    free(args.uses);
+    return args.ret;
+}
+
+int
+sched_run_ctx(const sched_t *s, sched_f f, sched_release_f release,
+              void *vargs, const eval_ctx *ctx)
+{
+    if (s->nlevels == 0)
+        return OK;
+    /* Without a pool, gate jobs would run recursively, so go in order */
+    if (ctx->pool && g_sched == SCHED_GATE)
+        return sched_run_gate(s, f, release, vargs, ctx);
+    if (ctx->pool == NULL) {
+        int *uses = sched_uses(s, release);
+        int ret = OK;
+        for (size_t i = 0; i < s->nsched && ret == OK; ++i) {
+            ret = f(s->refs[i], vargs);
+            sched_release(s, s->refs[i], uses, release, vargs);
+        }
+        free(uses);
+        return ret;
+    }
+    return sched_run_level(s, f, release, vargs, ctx);
+}
+
+int
+sched_run(const sched_t *s, sched_f f, sched_release_f release, void *vargs,
+          size_t nthreads)
+{
+    eval_ctx *ctx;
+    int ret;
+
+    if (s->nlevels == 0)
+        return OK;
+    ctx = eval_ctx_new(nthreads);
+    ret = sched_run_ctx(s, f, release, vargs, ctx);
+    eval_ctx_free(ctx);
+    return ret;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "depgraph.h"
+
+#include <acirc.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <threadpool.h>
+
+typedef enum sched_e {
+    SCHED_LEVEL,                /* dispatch one level of gates at a time */
+    SCHED_GATE,                 /* dispatch each gate once its inputs are ready */
+} sched_e;
+extern sched_e g_sched;
+
+typedef struct {
+    const acirc *circ;
+    size_t nrefs;
+    size_t nsched;              /* refs scheduled, nrefs unless pruned */
+    size_t nlevels;
+    size_t *levels;             /* [nlevels + 1], offsets into refs */
+    acircref *refs;             /* [nsched], sorted by level */
+    ssize_t *output;            /* [nrefs], first output at each ref, or -1 */
+    depgraph *deps;
+} sched_t;
+
+/* Threads shared by evaluations that may run at once, so that a batch starts
+ * them once rather than for every input and every stage of an evaluation.
+ * Evaluations only ever wait on the pool from outside it. */
+typedef struct {
+    threadpool *pool;           /* NULL when nthreads <= 1 */
+    size_t nthreads;
+} eval_ctx;
+
+/* Jobs one evaluation added to a shared pool, waited for apart from the jobs
+ * of other evaluations.  Jobs may add more jobs before they return. */
+typedef struct {
+    threadpool *pool;
+    size_t pending;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} sched_jobs;
+
+/* Evaluates a single gate, returning OK or ERR */
+typedef int (*sched_f)(acircref ref, void *vargs);
+/* Called once the last consumer of a gate has been evaluated */
+typedef void (*sched_release_f)(acircref ref, void *vargs);
+
+sched_t *
+sched_new(const acirc *c);
+/* Schedule of only the gates that outputs[0..n) of the circuit depend on */
+sched_t *
+sched_prune(const sched_t *s, const size_t *outputs, size_t n);
+void
+sched_free(sched_t *s);
+int
+sched_run(const sched_t *s, sched_f f, sched_release_f release, void *vargs,
+          size_t nthreads);
+/* Like sched_run, but on the threads of ctx */
+int
+sched_run_ctx(const sched_t *s, sched_f f, sched_release_f release,
+              void *vargs, const eval_ctx *ctx);
+
+eval_ctx *
+eval_ctx_new(size_t nthreads);
+void
+eval_ctx_free(eval_ctx *ctx);
+
+void
+sched_jobs_init(sched_jobs *jobs, const eval_ctx *ctx);
+/* Runs f(arg) as a job on the pool, or right away if ctx had none */
+void
+sched_jobs_add(sched_jobs *jobs, void (*f)(void *), void *arg);
+/* Waits for every job added so far, including those added by jobs */
+void
+sched_jobs_wait(sched_jobs *jobs);
+void
+sched_jobs_clear(sched_jobs *jobs);
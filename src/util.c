@@ -7,6 +7,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <err.h>
 
 #include <gmp.h>
@@ -182,6 +183,25 @@ mpz_randomm_inv(mpz_t rop, aes_randstate_t rng, const mpz_t modulus)
     mpz_clear(inv);
 }
 
+void
+randstate_split(aes_randstate_t rop, aes_randstate_t rng)
+{
+    unsigned char seed[32];
+    size_t len;
+    mpz_t x;
+
+    memset(seed, '\0', sizeof seed);
+    mpz_init(x);
+    mpz_urandomb_aes(x, rng, 8 * sizeof seed);
+    /* Right-aligned, so that leading zero bytes of x stay in the seed rather
+     * than shifting it */
+    len = (mpz_sizeinbase(x, 2) + 7) / 8;
+    if (mpz_sgn(x) != 0)
+        mpz_export(seed + sizeof seed - len, NULL, 1, 1, 0, 0, x);
+    mpz_clear(x);
+    aes_randinit_seedn(rop, (char *) seed, sizeof seed, NULL, 0);
+}
+
 size_t bit(size_t x, size_t i)
 {
     return (x & (1 << i)) > 0;
@@ -448,3 +468,23 @@ memory(unsigned long *size, unsigned long *resident)
     *resident = *resident * 4 / 1024;
     return OK;
 }
+
+int
+memory_peak(unsigned long *peak)
+{
+    FILE *fp;
+    char line[256];
+    int ret = ERR;
+
+    if ((fp = fopen("/proc/self/status", "r")) == NULL)
+        return ERR;
+    while (fgets(line, sizeof line, fp)) {
+        if (sscanf(line, "VmHWM: %lu kB", peak) == 1) {
+            *peak /= 1024;
+            ret = OK;
+            break;
+        }
+    }
+    fclose(fp);
+    return ret;
+}
@@ -37,6 +37,8 @@ double current_time(void);
 int max(int, int);
 
 void mpz_randomm_inv(mpz_t rop, aes_randstate_t rng, const mpz_t modulus);
+/* Seeds rop from rng, giving a job its own reproducible randomness */
+void randstate_split(aes_randstate_t rop, aes_randstate_t rng);
 
 mpz_t * mpz_vect_new(size_t n);
 void mpz_vect_init(mpz_t *vec, size_t n);
@@ -90,3 +92,5 @@ char
 int_to_char(int i);
 int
 memory(unsigned long *size, unsigned long *resident);
+int
+memory_peak(unsigned long *peak);